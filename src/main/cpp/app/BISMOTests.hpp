@@ -35,7 +35,14 @@
 #include <vector>
 using namespace std;
 #include "BitSerialMatMulAccelDriver.hpp"
+#include "BitSerialMatMulAutotuner.hpp"
+#include "BitSerialMatMulBenchmark.hpp"
 #include "BitSerialMatMulExecutor.hpp"
+#include "BitSerialMatMulMetrics.hpp"
+#include "BitSerialMatMulPacker.hpp"
+#include "BitSerialMatMulPerfModel.hpp"
+#include "BitSerialMatMulSession.hpp"
+#include "BitSerialMatMulTrace.hpp"
 #include "gemmbitserial/test/testhelpers.hpp"
 
 using namespace gemmbitserial;
@@ -46,7 +53,8 @@ bool test(
   string testName,
   WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc,
   size_t nrows_lhs, size_t nrows_rhs, size_t ncols, size_t nbits_lhs = 1,
-  size_t nbits_rhs = 1, bool sgn_lhs = false, bool sgn_rhs = false
+  size_t nbits_rhs = 1, bool sgn_lhs = false, bool sgn_rhs = false,
+  bool dram_cmds = false, BitSerialMatMulBufferPool * pool = 0
 ) {
   uint8_t * lhs = new uint8_t[nrows_lhs * ncols];
   uint8_t * rhs = new uint8_t[nrows_rhs * ncols];
@@ -61,8 +69,9 @@ bool test(
   int32_t * accel_res = new int32_t[nrows_lhs*nrows_rhs];
 
   BitSerialMatMulExecutor * runner = new BitSerialMatMulExecutor(
-    ctx, acc, platform
+    ctx, acc, platform, true, pool
   );
+  runner->setDRAMCommands(dram_cmds);
   runner->setLHS(ctx.lhs);
   runner->setRHS(ctx.rhs);
   runner->run();
@@ -182,4 +191,1273 @@ bool test_binary_offchip_widerows_multitile(
     }
   }
   return all_OK;
-}
\ No newline at end of file
+}
+bool test_multibit_onchip_multitile(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  vector<size_t> bits {2, 3};
+  vector<bool> sgn {false, true};
+  for(auto & lhs_bits : bits) {
+    for(auto & rhs_bits : bits) {
+      for(auto sgned : sgn) {
+        size_t ncols = acc->hwcfg().dpaDimCommon*acc->hwcfg().lhsEntriesPerMem / (4*lhs_bits*rhs_bits);
+        size_t nrows_lhs = 2*acc->hwcfg().dpaDimLHS;
+        size_t nrows_rhs = 2*acc->hwcfg().dpaDimRHS;
+        all_OK &= test(
+          "multibit_onchip_multitile_" +
+          to_string(nrows_lhs) + "x" + to_string(ncols) + "x"+ to_string(nrows_rhs) +
+          "_" + to_string(lhs_bits) + "b" + to_string(rhs_bits) + "b" + (sgned ? "s" : "u"),
+          platform, acc, nrows_lhs, nrows_rhs, ncols, lhs_bits, rhs_bits, sgned, sgned
+        );
+      }
+    }
+  }
+  return all_OK;
+}
+
+bool test_multibit_offchip_widerows_multitile(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  vector<size_t> lr_stripes {1, 2};
+  for(auto & lhs_stripe : lr_stripes) {
+    for(auto & rhs_stripe : lr_stripes) {
+      size_t ncols = acc->hwcfg().dpaDimCommon*acc->hwcfg().lhsEntriesPerMem*2;
+      size_t nrows_lhs = lhs_stripe*acc->hwcfg().dpaDimLHS;
+      size_t nrows_rhs = rhs_stripe*acc->hwcfg().dpaDimRHS;
+      all_OK &= test(
+        "multibit_offchip_widerows_multitile_" +
+        to_string(nrows_lhs) + "x" + to_string(ncols) + "x"+ to_string(nrows_rhs),
+        platform, acc, nrows_lhs, nrows_rhs, ncols, 2, 3, true, false
+      );
+    }
+  }
+  return all_OK;
+}
+
+bool test_ragged_multitile(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  // row counts that leave a partial L2 tile along LHS and RHS
+  vector<size_t> row_tiles {3, 17};
+  // column counts that fit on-chip, or leave a partial L1 tile along the
+  // common dimension
+  vector<size_t> col_counts {
+    acc->hwcfg().dpaDimCommon*4 - 3,
+    acc->hwcfg().dpaDimCommon*acc->hwcfg().lhsEntriesPerMem*3/8 - 3,
+    acc->hwcfg().dpaDimCommon*acc->hwcfg().lhsEntriesPerMem*5/8 - 3
+  };
+  for(auto & lr_tiles : row_tiles) {
+    for(auto & ncols : col_counts) {
+      size_t nrows_lhs = lr_tiles*acc->hwcfg().dpaDimLHS - 1;
+      size_t nrows_rhs = 3*acc->hwcfg().dpaDimRHS - 1;
+      all_OK &= test(
+        "ragged_multitile_" +
+        to_string(nrows_lhs) + "x" + to_string(ncols) + "x"+ to_string(nrows_rhs),
+        platform, acc, nrows_lhs, nrows_rhs, ncols, 2, 1, true, false
+      );
+    }
+  }
+  return all_OK;
+}
+
+bool test_plan_cache(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  BitSerialMatMulPlanCache & cache = BitSerialMatMulPlanCache::instance();
+  size_t nrows_lhs = 2*acc->hwcfg().dpaDimLHS;
+  size_t nrows_rhs = 3*acc->hwcfg().dpaDimRHS;
+  size_t ncols = acc->hwcfg().dpaDimCommon*acc->hwcfg().lhsEntriesPerMem;
+  // the first run of a shape builds its plan, the following runs reuse it
+  // with new buffers and new data
+  cache.clear();
+  uint64_t misses_before = cache.misses();
+  uint64_t hits_before = cache.hits();
+  for(int i = 0; i < 3; i++) {
+    all_OK &= test(
+      "plan_cache_run" + to_string(i), platform, acc,
+      nrows_lhs, nrows_rhs, ncols, 2, 2, true, false
+    );
+  }
+  all_OK &= (cache.misses() - misses_before == 1);
+  all_OK &= (cache.hits() - hits_before == 2);
+  all_OK &= (cache.size() == 1);
+  // beyond its capacity the cache drops the least recently used plans
+  const size_t capacity = cache.capacity();
+  cache.setCapacity(1);
+  GEMMContext other = acc->allocGEMMContext(
+    nrows_lhs, ncols, 2*nrows_rhs, 2, 2, true, false
+  );
+  misses_before = cache.misses();
+  std::shared_ptr<const BitSerialMatMulPlan> plan = cache.get(other, acc->hwcfg());
+  all_OK &= (cache.size() == 1) && (cache.get(other, acc->hwcfg()) == plan);
+  all_OK &= (cache.misses() - misses_before == 1);
+  cache.setCapacity(capacity);
+  deallocGEMMContext(other);
+  if(!all_OK) {
+    cout << "Plan cache test failed" << endl;
+  }
+  return all_OK;
+}
+
+bool test_plan_save_load(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  BitSerialMatMulPlanCache & cache = BitSerialMatMulPlanCache::instance();
+  size_t nrows_lhs = 3*acc->hwcfg().dpaDimLHS - 1;
+  size_t nrows_rhs = 2*acc->hwcfg().dpaDimRHS;
+  size_t ncols = acc->hwcfg().dpaDimCommon*acc->hwcfg().lhsEntriesPerMem - 3;
+  GEMMContext ctx = acc->allocGEMMContext(
+    nrows_lhs, ncols, nrows_rhs, 3, 2, false, true
+  );
+  const char * path = "bismo_test_plan.bin";
+  BitSerialMatMulPlan plan(ctx, acc->hwcfg());
+  all_OK &= plan.save(path);
+  // a loaded plan must encode to the same bytes
+  std::shared_ptr<const BitSerialMatMulPlan> loaded =
+    BitSerialMatMulPlan::load(path, acc->hwcfg());
+  all_OK &= (loaded != nullptr) && (loaded->serialize() == plan.serialize());
+  // corrupted files must be rejected
+  std::vector<uint8_t> bad = plan.serialize();
+  bad[bad.size() / 2] ^= 1;
+  all_OK &= (BitSerialMatMulPlan::deserialize(bad.data(), bad.size(), acc->hwcfg()) == nullptr);
+  // so must plans for another hardware config
+  HardwareCfg other = acc->hwcfg();
+  other.lhsEntriesPerMem *= 2;
+  bad = plan.serialize();
+  all_OK &= (BitSerialMatMulPlan::deserialize(bad.data(), bad.size(), other) == nullptr);
+  // and plans with invalid instructions, even with a matching checksum.
+  // the first fetch op follows the 179-byte header.
+  bad[179] = 3;
+  uint32_t sum = BitSerialMatMulPlan::checksum(bad.data(), bad.size() - 4);
+  for(int i = 0; i < 4; i++) {
+    bad[bad.size() - 4 + i] = (sum >> (8 * i)) & 0xff;
+  }
+  all_OK &= (BitSerialMatMulPlan::deserialize(bad.data(), bad.size(), acc->hwcfg()) == nullptr);
+  bad[179] = plan.serialize()[179];
+  sum = BitSerialMatMulPlan::checksum(bad.data(), bad.size() - 4);
+  for(int i = 0; i < 4; i++) {
+    bad[bad.size() - 4 + i] = (sum >> (8 * i)) & 0xff;
+  }
+  all_OK &= (BitSerialMatMulPlan::deserialize(bad.data(), bad.size(), acc->hwcfg()) != nullptr);
+  // run with the loaded plan instead of generating one
+  cache.clear();
+  all_OK &= cache.load(path, acc->hwcfg());
+  uint64_t misses_before = cache.misses();
+  all_OK &= test(
+    "plan_save_load", platform, acc, nrows_lhs, nrows_rhs, ncols, 3, 2, false, true
+  );
+  all_OK &= (cache.misses() == misses_before);
+  remove(path);
+  deallocGEMMContext(ctx);
+  if(!all_OK) {
+    cout << "Plan save/load test failed" << endl;
+  }
+  return all_OK;
+}
+
+bool test_dram_cmdqueues(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  // on-chip, off-chip and multibit shapes with commands read from DRAM
+  size_t ncols_onchip = acc->hwcfg().dpaDimCommon*acc->hwcfg().lhsEntriesPerMem/4;
+  size_t ncols_offchip = acc->hwcfg().dpaDimCommon*acc->hwcfg().lhsEntriesPerMem*2;
+  all_OK &= test(
+    "dram_cmdqueues_onchip", platform, acc,
+    2*acc->hwcfg().dpaDimLHS, 2*acc->hwcfg().dpaDimRHS, ncols_onchip,
+    1, 1, false, false, true
+  );
+  all_OK &= test(
+    "dram_cmdqueues_offchip", platform, acc,
+    4*acc->hwcfg().dpaDimLHS, 3*acc->hwcfg().dpaDimRHS, ncols_offchip,
+    1, 1, false, false, true
+  );
+  all_OK &= test(
+    "dram_cmdqueues_multibit", platform, acc,
+    3*acc->hwcfg().dpaDimLHS - 1, 2*acc->hwcfg().dpaDimRHS, ncols_onchip - 3,
+    2, 3, true, false, true
+  );
+  return all_OK;
+}
+
+bool test_async_run(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const size_t nrows_lhs = 2*acc->hwcfg().dpaDimLHS;
+  const size_t nrows_rhs = 3*acc->hwcfg().dpaDimRHS;
+  const size_t ncols = acc->hwcfg().dpaDimCommon*acc->hwcfg().lhsEntriesPerMem;
+  const size_t njobs = 3;
+  uint8_t * lhs = new uint8_t[nrows_lhs * ncols];
+  uint8_t * rhs = new uint8_t[nrows_rhs * ncols];
+  int32_t * accel_res = new int32_t[nrows_lhs*nrows_rhs];
+  vector<GEMMContext> ctx;
+  for(size_t i = 0; i < njobs; i++) {
+    ctx.push_back(acc->allocGEMMContext(
+      nrows_lhs, ncols, nrows_rhs, 2, 1, true, false
+    ));
+  }
+  BitSerialMatMulExecutor * runner = new BitSerialMatMulExecutor(
+    ctx[0], acc, platform
+  );
+  generateRandomVector(2, nrows_lhs*ncols, lhs);
+  generateRandomVector(1, nrows_rhs*ncols, rhs);
+  ctx[0].lhs.importRegular(lhs);
+  ctx[0].rhs.importRegular(rhs);
+  for(size_t i = 0; i < njobs; i++) {
+    runner->setLHS(ctx[i].lhs);
+    runner->setRHS(ctx[i].rhs);
+    BitSerialMatMulCompletion done = runner->runAsync();
+    if(i + 1 < njobs) {
+      // pack the inputs of the next job while the accelerator runs this one
+      generateRandomVector(2, nrows_lhs*ncols, lhs);
+      generateRandomVector(1, nrows_rhs*ncols, rhs);
+      ctx[i+1].lhs.importRegular(lhs);
+      ctx[i+1].rhs.importRegular(rhs);
+    }
+    gemmBitSerial(ctx[i]);
+    done.wait();
+    all_OK &= done.poll();
+    runner->getRes(accel_res);
+    int res = memcmp(ctx[i].res, accel_res, nrows_lhs*nrows_rhs*sizeof(ResultType));
+    all_OK &= (res == 0);
+  }
+  // two executors sharing the accelerator run one after the other
+  BitSerialMatMulExecutor * other = new BitSerialMatMulExecutor(
+    ctx[1], acc, platform, false
+  );
+  runner->setLHS(ctx[0].lhs);
+  runner->setRHS(ctx[0].rhs);
+  other->setLHS(ctx[1].lhs);
+  other->setRHS(ctx[1].rhs);
+  BitSerialMatMulCompletion done0 = runner->runAsync();
+  BitSerialMatMulCompletion done1 = other->runAsync();
+  done0.wait();
+  done1.wait();
+  runner->getRes(accel_res);
+  all_OK &= (memcmp(ctx[0].res, accel_res, nrows_lhs*nrows_rhs*sizeof(ResultType)) == 0);
+  other->getRes(accel_res);
+  all_OK &= (memcmp(ctx[1].res, accel_res, nrows_lhs*nrows_rhs*sizeof(ResultType)) == 0);
+  delete other;
+  if(all_OK) {
+    cout << "Test succeeded (async_run)" << endl;
+  } else {
+    cout << "Test failed (async_run)" << endl;
+  }
+  delete runner;
+  for(auto & c : ctx) {
+    deallocGEMMContext(c);
+  }
+  delete [] lhs;
+  delete [] rhs;
+  delete [] accel_res;
+  return all_OK;
+}
+
+bool test_session(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const HardwareCfg & hw = acc->hwcfg();
+  // shapes as (lhs rows, rhs rows, cols, lhs bits, rhs bits, lhs signed)
+  // repeated shapes reuse BRAM regions at the job boundary
+  vector<vector<size_t>> shapes {
+    {2*hw.dpaDimLHS, 2*hw.dpaDimRHS, hw.dpaDimCommon*hw.lhsEntriesPerMem/4, 1, 1, 0},
+    {2*hw.dpaDimLHS, 2*hw.dpaDimRHS, hw.dpaDimCommon*hw.lhsEntriesPerMem/4, 1, 1, 0},
+    {3*hw.dpaDimLHS - 1, 2*hw.dpaDimRHS, hw.dpaDimCommon*hw.lhsEntriesPerMem*2, 2, 1, 1},
+    {hw.dpaDimLHS, 3*hw.dpaDimRHS - 1, hw.dpaDimCommon*4 - 3, 3, 2, 1},
+    {2*hw.dpaDimLHS, 2*hw.dpaDimRHS, hw.dpaDimCommon*hw.lhsEntriesPerMem/4, 1, 1, 0}
+  };
+  vector<GEMMContext> ctx;
+  vector<BitSerialMatMulExecutor *> runners;
+  BitSerialMatMulSession * session = new BitSerialMatMulSession(acc);
+  vector<size_t> job_ids;
+  for(auto & s : shapes) {
+    uint8_t * lhs = new uint8_t[s[0] * s[2]];
+    uint8_t * rhs = new uint8_t[s[1] * s[2]];
+    generateRandomVector(s[3], s[0]*s[2], lhs);
+    generateRandomVector(s[4], s[1]*s[2], rhs);
+    GEMMContext c = acc->allocGEMMContext(s[0], s[2], s[1], s[3], s[4], s[5] != 0, false);
+    c.lhs.importRegular(lhs);
+    c.rhs.importRegular(rhs);
+    gemmBitSerial(c);
+    delete [] lhs;
+    delete [] rhs;
+    BitSerialMatMulExecutor * runner = new BitSerialMatMulExecutor(c, acc, platform, false);
+    runner->setLHS(c.lhs);
+    runner->setRHS(c.rhs);
+    // submit while the previous jobs are still running
+    job_ids.push_back(session->submit(*runner));
+    ctx.push_back(c);
+    runners.push_back(runner);
+  }
+  session->waitAll();
+  for(size_t i = 0; i < shapes.size(); i++) {
+    const size_t nres = shapes[i][0] * shapes[i][1];
+    int32_t * accel_res = new int32_t[nres];
+    runners[i]->getRes(accel_res);
+    bool job_OK = memcmp(ctx[i].res, accel_res, nres*sizeof(ResultType)) == 0;
+    cout << "Session job " << job_ids[i] << ": " << session->getJobCycles(job_ids[i]);
+    cout << " cycles, " << (job_OK ? "OK" : "failed") << endl;
+    all_OK &= job_OK;
+    delete [] accel_res;
+    delete runners[i];
+    deallocGEMMContext(ctx[i]);
+  }
+  delete session;
+  if(all_OK) {
+    cout << "Test succeeded (session)" << endl;
+  } else {
+    cout << "Test failed (session)" << endl;
+  }
+  return all_OK;
+}
+
+bool test_buffer_pool(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const HardwareCfg & hw = acc->hwcfg();
+  BitSerialMatMulBufferPool * pool = new BitSerialMatMulBufferPool(platform);
+  // size classes are aligned and waste less than half of each buffer
+  for(size_t bytes = 1; bytes < 1024*1024; bytes = bytes * 3 + 7) {
+    size_t cls = BitSerialMatMulBufferPool::sizeClass(bytes);
+    all_OK &= (cls >= bytes) && (cls % FETCH_ALIGN == 0);
+    all_OK &= (bytes <= FETCH_ALIGN) || (cls < 2 * bytes);
+  }
+  // a stream of varied shapes, seen twice: the second round must be served
+  // entirely from the pool
+  vector<vector<size_t>> shapes {
+    {2*hw.dpaDimLHS, 2*hw.dpaDimRHS, hw.dpaDimCommon*hw.lhsEntriesPerMem/4},
+    {3*hw.dpaDimLHS - 1, 2*hw.dpaDimRHS, hw.dpaDimCommon*hw.lhsEntriesPerMem*2},
+    {hw.dpaDimLHS, 3*hw.dpaDimRHS - 1, hw.dpaDimCommon*4 - 3}
+  };
+  for(int round = 0; round < 2; round++) {
+    uint64_t allocs_before = pool->getStats().platform_allocs;
+    for(auto & s : shapes) {
+      all_OK &= test(
+        "buffer_pool_round" + to_string(round), platform, acc,
+        s[0], s[1], s[2], 2, 1, true, false, false, pool
+      );
+    }
+    if(round == 1) {
+      all_OK &= (pool->getStats().platform_allocs == allocs_before);
+    }
+  }
+  BufferPoolStats stats = pool->getStats();
+  all_OK &= (stats.in_use_bytes == 0) && (stats.reserved_bytes == 0);
+  all_OK &= (stats.hits > 0) && (stats.peak_in_use_bytes <= stats.peak_held_bytes);
+  pool->printStats();
+  delete pool;
+  if(!all_OK) {
+    cout << "Buffer pool test failed" << endl;
+  }
+  return all_OK;
+}
+
+bool test_zero_copy_pack(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const size_t nrows_lhs = 2*acc->hwcfg().dpaDimLHS - 1;
+  const size_t nrows_rhs = 2*acc->hwcfg().dpaDimRHS + 1;
+  const size_t ncols = acc->hwcfg().dpaDimCommon*3 - 5;
+  uint8_t * lhs = new uint8_t[nrows_lhs * ncols];
+  uint8_t * rhs = new uint8_t[nrows_rhs * ncols];
+  int32_t * accel_res = new int32_t[nrows_lhs*nrows_rhs];
+  GEMMContext ctx = acc->allocGEMMContext(
+    nrows_lhs, ncols, nrows_rhs, 3, 2, true, false
+  );
+  BitSerialMatMulShapeMetrics * m = BitSerialMatMulMetrics::instance().get(
+    ctx, acc->hwcfg()
+  );
+  // through a host mapping, if the probe finds one for the platform, then
+  // through the staging buffers with the mapping turned off
+  const BitSerialMatMulAccelDriver::HostMapFxn prev = acc->hostMapping();
+  const BitSerialMatMulAccelDriver::HostMapFxn hostmap = acc->probeHostMapping();
+  cout << "Host mapping: " << (hostmap ? "yes" : "no") << endl;
+  for(int mapped = (hostmap ? 1 : 0); mapped >= 0; mapped--) {
+    acc->setHostMapping(mapped ? hostmap : 0);
+    BitSerialMatMulExecutor * runner = new BitSerialMatMulExecutor(
+      ctx, acc, platform
+    );
+    const uint64_t uploads = m->uploadNs.count();
+    // pack straight into the executor's targets, twice to check that the
+    // committed operands replace the previous ones
+    for(int i = 0; i < 2; i++) {
+      generateRandomVector(3, nrows_lhs*ncols, lhs);
+      generateRandomVector(2, nrows_rhs*ncols, rhs);
+      runner->lhsTarget().importRegular(lhs);
+      runner->rhsTarget().importRegular(rhs);
+      runner->commitLHS();
+      runner->commitRHS();
+      runner->run();
+      runner->getRes(accel_res);
+      ctx.lhs.importRegular(lhs);
+      ctx.rhs.importRegular(rhs);
+      gemmBitSerial(ctx);
+      int res = memcmp(ctx.res, accel_res, nrows_lhs*nrows_rhs*sizeof(ResultType));
+      all_OK &= (res == 0);
+    }
+    // only the staging buffers are uploaded
+    all_OK &= ((m->uploadNs.count() == uploads) == (mapped == 1));
+    delete runner;
+  }
+  acc->setHostMapping(prev);
+  if(all_OK) {
+    cout << "Test succeeded (zero_copy_pack)" << endl;
+  } else {
+    cout << "Test failed (zero_copy_pack)" << endl;
+  }
+  deallocGEMMContext(ctx);
+  delete [] lhs;
+  delete [] rhs;
+  delete [] accel_res;
+  return all_OK;
+}
+
+bool test_result_layouts(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  // ragged sizes to exercise the SIMD kernels and their scalar edges
+  vector<vector<size_t>> shapes {
+    {acc->hwcfg().dpaDimLHS, acc->hwcfg().dpaDimRHS, acc->hwcfg().dpaDimCommon},
+    {3*acc->hwcfg().dpaDimLHS - 1, 2*acc->hwcfg().dpaDimRHS + 3, acc->hwcfg().dpaDimCommon*2 - 1},
+    {acc->hwcfg().dpaDimLHS + 5, 9*acc->hwcfg().dpaDimRHS - 2, acc->hwcfg().dpaDimCommon}
+  };
+  for(auto & s : shapes) {
+    const size_t nrows_lhs = s[0], nrows_rhs = s[1], ncols = s[2];
+    uint8_t * lhs = new uint8_t[nrows_lhs * ncols];
+    uint8_t * rhs = new uint8_t[nrows_rhs * ncols];
+    generateRandomVector(2, nrows_lhs*ncols, lhs);
+    generateRandomVector(2, nrows_rhs*ncols, rhs);
+    GEMMContext ctx = acc->allocGEMMContext(
+      nrows_lhs, ncols, nrows_rhs, 2, 2, true, true
+    );
+    ctx.lhs.importRegular(lhs);
+    ctx.rhs.importRegular(rhs);
+    gemmBitSerial(ctx);
+    BitSerialMatMulExecutor * runner = new BitSerialMatMulExecutor(
+      ctx, acc, platform
+    );
+    runner->setLHS(ctx.lhs);
+    runner->setRHS(ctx.rhs);
+    runner->run();
+    const size_t nres = nrows_lhs * nrows_rhs;
+    const size_t lhs_a = ctx.lhs.nrows_a;
+    int32_t * row_res = new int32_t[nres];
+    int32_t * col_res = new int32_t[nres];
+    int32_t * pad_res = new int32_t[runner->resBytes() / sizeof(int32_t)];
+    runner->getRes(row_res, resRowMajor);
+    runner->getRes(col_res, resColMajor);
+    runner->getRes(pad_res, resPadded);
+    all_OK &= (memcmp(ctx.res, row_res, nres*sizeof(ResultType)) == 0);
+    for(size_t i = 0; i < nrows_rhs; i++) {
+      for(size_t j = 0; j < nrows_lhs; j++) {
+        all_OK &= (col_res[j * nrows_rhs + i] == ctx.res[i * nrows_lhs + j]);
+        all_OK &= (pad_res[i * lhs_a + j] == ctx.res[i * nrows_lhs + j]);
+      }
+    }
+    delete runner;
+    deallocGEMMContext(ctx);
+    delete [] lhs;
+    delete [] rhs;
+    delete [] row_res;
+    delete [] col_res;
+    delete [] pad_res;
+  }
+  if(all_OK) {
+    cout << "Test succeeded (result_layouts)" << endl;
+  } else {
+    cout << "Test failed (result_layouts)" << endl;
+  }
+  return all_OK;
+}
+
+bool test_epilogue(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const size_t nrows_lhs = 3*acc->hwcfg().dpaDimLHS + 1;
+  const size_t nrows_rhs = 40*acc->hwcfg().dpaDimRHS - 3;
+  const size_t ncols = acc->hwcfg().dpaDimCommon*2 + 7;
+  const size_t nres = nrows_lhs * nrows_rhs;
+  uint8_t * lhs = new uint8_t[nrows_lhs * ncols];
+  uint8_t * rhs = new uint8_t[nrows_rhs * ncols];
+  generateRandomVector(2, nrows_lhs*ncols, lhs);
+  generateRandomVector(3, nrows_rhs*ncols, rhs);
+  GEMMContext ctx = acc->allocGEMMContext(
+    nrows_lhs, ncols, nrows_rhs, 2, 3, true, false
+  );
+  ctx.lhs.importRegular(lhs);
+  ctx.rhs.importRegular(rhs);
+  gemmBitSerial(ctx);
+  BitSerialMatMulExecutor * runner = new BitSerialMatMulExecutor(
+    ctx, acc, platform
+  );
+  runner->setLHS(ctx.lhs);
+  runner->setRHS(ctx.rhs);
+  runner->run();
+  // per-channel parameters
+  vector<int32_t> bias(nrows_lhs);
+  vector<float> cscale(nrows_lhs);
+  for(size_t c = 0; c < nrows_lhs; c++) {
+    bias[c] = (int32_t)(c % 7) - 3;
+    cscale[c] = 0.05f + 0.01f * (c % 5);
+  }
+  int8_t * out = new int8_t[nres];
+  int8_t * expected = new int8_t[nres];
+  for(int sgn = 0; sgn < 2; sgn++) {
+    // bias, per-channel scale, ReLU and requantize to 4 bits
+    EpilogueCfg cfg = makeEpilogueCfg(4, sgn != 0);
+    cfg.bias = bias.data();
+    cfg.channelScale = cscale.data();
+    cfg.scale = 0.5f;
+    cfg.clampLo = 0.0f;
+    cfg.zeroPoint = sgn ? -2 : 1;
+    cfg.threads = 3;
+    const int32_t qmin = sgn ? -8 : 0, qmax = sgn ? 7 : 15;
+    for(size_t r = 0; r < nrows_rhs; r++) {
+      for(size_t c = 0; c < nrows_lhs; c++) {
+        float y = (float)(ctx.res[r * nrows_lhs + c] + bias[c]) * cscale[c] * cfg.scale;
+        y = y < 0.0f ? 0.0f : y;
+        int32_t q = (int32_t) lrintf(y) + cfg.zeroPoint;
+        q = q < qmin ? qmin : (q > qmax ? qmax : q);
+        expected[r * nrows_lhs + c] = (int8_t) q;
+      }
+    }
+    runner->getRes(out, cfg);
+    all_OK &= (memcmp(out, expected, nres) == 0);
+    // the same, packed into a bit-serial matrix
+    BitSerialMatrix bs = allocBitSerialMatrix(
+      nrows_rhs, nrows_lhs, 4, sgn != 0, 1, 64
+    );
+    BitSerialMatrix ref = allocBitSerialMatrix(
+      nrows_rhs, nrows_lhs, 4, sgn != 0, 1, 64
+    );
+    memset(bs.data, 0xff, bs.wordsPerBitplane() * bs.nbits * sizeof(uint64_t));
+    runner->getRes(bs, cfg);
+    ref.importRegular(expected);
+    all_OK &= (memcmp(bs.data, ref.data, ref.wordsPerBitplane() * ref.nbits * sizeof(uint64_t)) == 0);
+    deallocBitSerialMatrix(bs);
+    deallocBitSerialMatrix(ref);
+  }
+  // 2-bit thresholding
+  EpilogueCfg tcfg = makeEpilogueCfg(2, false);
+  vector<int32_t> thres(nrows_lhs * 3);
+  for(size_t c = 0; c < nrows_lhs; c++) {
+    thres[c * 3 + 0] = -(int32_t)(c % 4);
+    thres[c * 3 + 1] = 2;
+    thres[c * 3 + 2] = 5 + (int32_t)(c % 3);
+  }
+  tcfg.thresholds = thres.data();
+  for(size_t r = 0; r < nrows_rhs; r++) {
+    for(size_t c = 0; c < nrows_lhs; c++) {
+      int32_t v = ctx.res[r * nrows_lhs + c], q = 0;
+      for(size_t t = 0; t < 3; t++) {
+        q += (v >= thres[c * 3 + t]) ? 1 : 0;
+      }
+      expected[r * nrows_lhs + c] = (int8_t) q;
+    }
+  }
+  runner->getRes(out, tcfg);
+  all_OK &= (memcmp(out, expected, nres) == 0);
+  if(all_OK) {
+    cout << "Test succeeded (epilogue)" << endl;
+  } else {
+    cout << "Test failed (epilogue)" << endl;
+  }
+  delete runner;
+  deallocGEMMContext(ctx);
+  delete [] lhs;
+  delete [] rhs;
+  delete [] out;
+  delete [] expected;
+  return all_OK;
+}
+
+bool test_packer(
+  WrapperRegDriver *, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const HardwareCfg & hw = acc->hwcfg();
+  vector<vector<size_t>> shapes {
+    {hw.dpaDimLHS, hw.dpaDimCommon},
+    {3*hw.dpaDimLHS - 1, 64*3 + 17},
+    {2*hw.dpaDimLHS + 3, hw.dpaDimCommon*9 - 5}
+  };
+  for(auto & s : shapes) {
+    const size_t nrows = s[0], ncols = s[1];
+    int8_t * m = new int8_t[nrows * ncols];
+    for(size_t nbits = 1; nbits <= 8; nbits++) {
+      for(int sgn = 0; sgn < 2; sgn++) {
+        for(size_t i = 0; i < nrows * ncols; i++) {
+          int v = rand() % (1 << nbits);
+          m[i] = (int8_t)(sgn ? v - (1 << (nbits - 1)) : v);
+        }
+        GEMMContext ref = acc->allocGEMMContext(
+          nrows, ncols, 1, nbits, 1, sgn != 0, false
+        );
+        GEMMContext ctx = acc->allocGEMMContext(
+          nrows, ncols, 1, nbits, 1, sgn != 0, false
+        );
+        const size_t bytes = ref.lhs.wordsPerBitplane() * nbits * sizeof(uint64_t);
+        // garbage in the target to check that the padding is written
+        memset(ctx.lhs.data, 0xff, bytes);
+        ref.lhs.importRegular(m);
+        if(sgn) {
+          packBitSerial(m, ctx.lhs, 3);
+        } else {
+          packBitSerial((uint8_t *) m, ctx.lhs, 3);
+        }
+        all_OK &= (memcmp(ref.lhs.data, ctx.lhs.data, bytes) == 0);
+        deallocGEMMContext(ref);
+        deallocGEMMContext(ctx);
+      }
+    }
+    delete [] m;
+  }
+  if(all_OK) {
+    cout << "Test succeeded (packer)" << endl;
+  } else {
+    cout << "Test failed (packer)" << endl;
+  }
+  return all_OK;
+}
+
+bool test_quantize_pack(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const HardwareCfg & hw = acc->hwcfg();
+  const size_t nrows = 2*hw.dpaDimLHS + 1, ncols = hw.dpaDimCommon*3 - 7;
+  float * x = new float[nrows * ncols];
+  int8_t * q = new int8_t[nrows * ncols];
+  vector<float> scale(nrows);
+  vector<int32_t> zp(nrows);
+  for(size_t i = 0; i < nrows * ncols; i++) {
+    x[i] = (float)(rand() % 2001 - 1000) / 100.0f;
+  }
+  for(size_t r = 0; r < nrows; r++) {
+    scale[r] = 0.3f + 0.1f * (r % 4);
+    zp[r] = (int32_t)(r % 3) - 1;
+  }
+  for(size_t nbits = 1; nbits <= 8; nbits++) {
+    for(int sgn = 0; sgn < 2; sgn++) {
+      for(int perRow = 0; perRow < 2; perRow++) {
+        const int32_t qmin = sgn ? -(1 << (nbits - 1)) : 0;
+        const int32_t qmax = sgn ? (1 << (nbits - 1)) - 1 : (1 << nbits) - 1;
+        for(size_t r = 0; r < nrows; r++) {
+          const float s = scale[perRow ? r : 0];
+          const int32_t z = zp[perRow ? r : 0];
+          for(size_t c = 0; c < ncols; c++) {
+            int32_t v = (int32_t) lrintf(x[r * ncols + c] / s) + z;
+            v = v < qmin ? qmin : (v > qmax ? qmax : v);
+            q[r * ncols + c] = (int8_t) v;
+          }
+        }
+        GEMMContext ref = acc->allocGEMMContext(
+          nrows, ncols, 1, nbits, 1, sgn != 0, false
+        );
+        GEMMContext ctx = acc->allocGEMMContext(
+          nrows, ncols, 1, nbits, 1, sgn != 0, false
+        );
+        const size_t bytes = ref.lhs.wordsPerBitplane() * nbits * sizeof(uint64_t);
+        memset(ctx.lhs.data, 0xff, bytes);
+        ref.lhs.importRegular(q);
+        quantizePackBitSerial(x, ctx.lhs, scale.data(), zp.data(), perRow != 0, 2);
+        all_OK &= (memcmp(ref.lhs.data, ctx.lhs.data, bytes) == 0);
+        deallocGEMMContext(ref);
+        deallocGEMMContext(ctx);
+      }
+    }
+  }
+  // quantize straight into the executor's LHS
+  const size_t nrows_rhs = hw.dpaDimRHS + 3;
+  uint8_t * rhs = new uint8_t[nrows_rhs * ncols];
+  int32_t * accel_res = new int32_t[nrows * nrows_rhs];
+  generateRandomVector(2, nrows_rhs * ncols, rhs);
+  GEMMContext ctx = acc->allocGEMMContext(nrows, ncols, nrows_rhs, 3, 2, true, false);
+  BitSerialMatMulExecutor * runner = new BitSerialMatMulExecutor(ctx, acc, platform);
+  BitSerialMatrix lhsTarget = runner->lhsTarget();
+  quantizePackBitSerial(x, lhsTarget, scale.data(), zp.data(), true);
+  runner->commitLHS();
+  runner->rhsTarget().importRegular(rhs);
+  runner->commitRHS();
+  runner->run();
+  runner->getRes(accel_res);
+  quantizePackBitSerial(x, ctx.lhs, scale.data(), zp.data(), true);
+  ctx.rhs.importRegular(rhs);
+  gemmBitSerial(ctx);
+  all_OK &= (memcmp(ctx.res, accel_res, nrows*nrows_rhs*sizeof(ResultType)) == 0);
+  delete runner;
+  deallocGEMMContext(ctx);
+  if(all_OK) {
+    cout << "Test succeeded (quantize_pack)" << endl;
+  } else {
+    cout << "Test failed (quantize_pack)" << endl;
+  }
+  delete [] x;
+  delete [] q;
+  delete [] rhs;
+  delete [] accel_res;
+  return all_OK;
+}
+
+bool test_operand_store(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const HardwareCfg & hw = acc->hwcfg();
+  const size_t nrows_lhs = 2*hw.dpaDimLHS, nrows_rhs = hw.dpaDimRHS + 1;
+  const size_t ncols = hw.dpaDimCommon*4 - 3;
+  const size_t nweights = 3, nreqs = 3;
+  uint8_t * lhs = new uint8_t[nrows_lhs * ncols];
+  uint8_t * rhs = new uint8_t[nrows_rhs * ncols];
+  int32_t * accel_res = new int32_t[nrows_lhs * nrows_rhs];
+  vector<GEMMContext> w;
+  for(size_t i = 0; i < nweights; i++) {
+    w.push_back(acc->allocGEMMContext(nrows_lhs, ncols, nrows_rhs, 2, 2, true, false));
+    generateRandomVector(2, nrows_lhs * ncols, lhs);
+    w[i].lhs.importRegular(lhs);
+  }
+  const size_t wbytes = w[0].lhs.wordsPerBitplane() * w[0].lhs.nbits * sizeof(uint64_t);
+  // room for two weight matrices
+  BitSerialMatMulOperandStore store(platform, 2 * wbytes);
+  BitSerialMatMulOperandHandle w0 = store.put("w0", w[0].lhs);
+  all_OK &= (bool) store.put("w1", w[1].lhs);
+  // two executors share w0, only the activations are uploaded per request
+  BitSerialMatMulExecutor * runner[2];
+  for(size_t e = 0; e < 2; e++) {
+    runner[e] = new BitSerialMatMulExecutor(w[0], acc, platform);
+    runner[e]->bindLHS(w0);
+    for(size_t r = 0; r < nreqs; r++) {
+      generateRandomVector(2, nrows_rhs * ncols, rhs);
+      w[0].rhs.importRegular(rhs);
+      runner[e]->setRHS(w[0].rhs);
+      runner[e]->run();
+      runner[e]->getRes(accel_res);
+      gemmBitSerial(w[0]);
+      all_OK &= (memcmp(w[0].res, accel_res, nrows_lhs*nrows_rhs*sizeof(ResultType)) == 0);
+    }
+  }
+  all_OK &= (store.uploads() == 2) && (store.get("w0") == w0);
+  w0.reset();
+  // w0 is still bound to the executors, so w1 is evicted to make room
+  BitSerialMatMulOperandHandle w2 = store.put("w2", w[2].lhs);
+  all_OK &= (bool) w2 && !store.get("w1") && (bool) store.get("w0");
+  all_OK &= (store.evictions() == 1) && (store.residentBytes() == 2 * wbytes);
+  // everything is in use, nothing fits
+  all_OK &= !store.put("w1", w[1].lhs);
+  // unbinding makes w0 evictable again
+  delete runner[0];
+  delete runner[1];
+  all_OK &= (bool) store.put("w1", w[1].lhs) && !store.get("w0");
+  // binding a different operand to the same executor
+  runner[0] = new BitSerialMatMulExecutor(w[2], acc, platform);
+  runner[0]->bindLHS(w2);
+  runner[0]->setDRAMCommands(true);
+  runner[0]->setRHS(w[0].rhs);
+  runner[0]->run();
+  runner[0]->bindLHS(store.get("w1"));
+  runner[0]->run();
+  runner[0]->getRes(accel_res);
+  w[1].rhs.importRegular(rhs);
+  gemmBitSerial(w[1]);
+  all_OK &= (memcmp(w[1].res, accel_res, nrows_lhs*nrows_rhs*sizeof(ResultType)) == 0);
+  // removed operands still bound to an executor keep counting against the
+  // budget, and a put that does not fit keeps the operand it would replace
+  all_OK &= (store.residentBytes() == 2 * wbytes);
+  store.remove("w1");
+  all_OK &= (store.residentBytes() == 2 * wbytes) && !store.get("w1");
+  all_OK &= !store.put("w1", w[1].lhs) && (bool) store.get("w2");
+  // replacing an unused operand reuses its room
+  w2.reset();
+  all_OK &= (bool) store.put("w2", w[0].lhs) && (store.residentBytes() == 2 * wbytes);
+  delete runner[0];
+  all_OK &= (store.residentBytes() == wbytes);
+  // with a pool, operands count in size classes
+  BitSerialMatMulBufferPool pool(platform);
+  BitSerialMatMulOperandStore pooled(platform, 2 * wbytes, &pool);
+  all_OK &= (bool) pooled.put("w0", w[0].lhs);
+  all_OK &= (pooled.residentBytes() == BitSerialMatMulBufferPool::sizeClass(wbytes));
+  if(all_OK) {
+    cout << "Test succeeded (operand_store)" << endl;
+  } else {
+    cout << "Test failed (operand_store)" << endl;
+  }
+  for(auto & c : w) {
+    deallocGEMMContext(c);
+  }
+  delete [] lhs;
+  delete [] rhs;
+  delete [] accel_res;
+  return all_OK;
+}
+
+bool test_bram_residency(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const HardwareCfg & hw = acc->hwcfg();
+  // a small LHS that stays in BRAM while a stream of RHS goes through
+  const size_t nrows_lhs = hw.dpaDimLHS, nrows_rhs = 2*hw.dpaDimRHS;
+  const size_t ncols = hw.dpaDimCommon*4;
+  const size_t nreqs = 3;
+  uint8_t * lhs = new uint8_t[nrows_lhs * ncols];
+  uint8_t * rhs = new uint8_t[nrows_rhs * ncols];
+  int32_t * accel_res = new int32_t[nrows_lhs * nrows_rhs];
+  GEMMContext ctx = acc->allocGEMMContext(nrows_lhs, ncols, nrows_rhs, 2, 2, true, false);
+  generateRandomVector(2, nrows_lhs * ncols, lhs);
+  ctx.lhs.importRegular(lhs);
+  BitSerialMatMulExecutor * runner = new BitSerialMatMulExecutor(ctx, acc, platform);
+  BitSerialMatMulExecutor * other = new BitSerialMatMulExecutor(ctx, acc, platform);
+  const uint64_t cold = runner->getPlan()->bytesToFetch();
+  runner->setLHS(ctx.lhs);
+  other->setLHS(ctx.lhs);
+  other->setRHS(ctx.rhs);
+  vector<uint64_t> fetched;
+  for(size_t r = 0; r < nreqs + 3; r++) {
+    if(r == nreqs) {
+      // another executor overwrites BRAM in between
+      other->run();
+    } else if(r == nreqs + 2) {
+      // a new LHS must be fetched again
+      runner->setLHS(ctx.lhs);
+    }
+    // a new RHS each time, so results left by an earlier run do not match
+    generateRandomVector(2, nrows_rhs * ncols, rhs);
+    ctx.rhs.importRegular(rhs);
+    runner->setRHS(ctx.rhs);
+    const uint32_t res_bytes = acc->resultBytes();
+    runner->run();
+    fetched.push_back(runner->getLastRunFetchBytes());
+    // each run waits for its own result bytes on top of those of earlier runs
+    all_OK &= (acc->resultBytes() == (uint32_t) (res_bytes + runner->resBytes()));
+    runner->getRes(accel_res);
+    gemmBitSerial(ctx);
+    all_OK &= (memcmp(ctx.res, accel_res, nrows_lhs*nrows_rhs*sizeof(ResultType)) == 0);
+  }
+  // cold, then only the RHS is fetched until the LHS is lost or changed
+  const uint64_t warm = cold - ctx.lhs.wordsPerBitplane() *
+    ctx.lhs.nbits * sizeof(uint64_t);
+  all_OK &= (fetched[0] == cold) && (fetched[nreqs] == cold) && (fetched[nreqs + 2] == cold);
+  for(size_t r = 1; r < nreqs; r++) {
+    all_OK &= (fetched[r] == warm);
+  }
+  all_OK &= (fetched[nreqs + 1] == warm);
+  if(all_OK) {
+    cout << "Test succeeded (bram_residency)" << endl;
+  } else {
+    cout << "Test failed (bram_residency)" << endl;
+  }
+  delete runner;
+  delete other;
+  deallocGEMMContext(ctx);
+  delete [] lhs;
+  delete [] rhs;
+  delete [] accel_res;
+  return all_OK;
+}
+
+bool test_autotuner(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const HardwareCfg & hw = acc->hwcfg();
+  BitSerialMatMulPlanCache & cache = BitSerialMatMulPlanCache::instance();
+  BitSerialMatMulTuningDB & db = BitSerialMatMulTuningDB::instance();
+  // rows wider than the BRAM, so there are several L1 tile sizes to try
+  const size_t nrows_lhs = 2*hw.dpaDimLHS, nrows_rhs = 2*hw.dpaDimRHS;
+  const size_t ncols = hw.dpaDimCommon*hw.lhsEntriesPerMem;
+  GEMMContext ctx = acc->allocGEMMContext(nrows_lhs, ncols, nrows_rhs, 2, 1, true, false);
+  db.clear();
+  BitSerialMatMulAutotuner tuner(acc, platform, 1);
+  TuningEntry e = tuner.tune(ctx);
+  const vector<TuningResult> & res = tuner.lastResults();
+  all_OK &= (res.size() == BitSerialMatMulPlan(ctx, hw).candidateScheduleCfgs().size());
+  for(auto & r : res) {
+    all_OK &= r.ok && (r.cycles > 0) && (e.cycles <= r.cycles);
+  }
+  // the winner survives a round trip through the database file
+  const char * path = "bismo_test_tuning.db";
+  all_OK &= db.save(path);
+  db.clear();
+  all_OK &= db.load(path);
+  TuningEntry loaded;
+  all_OK &= db.lookup(ctx, hw, loaded) && (loaded.cycles == e.cycles);
+  all_OK &= (loaded.sc.order == e.sc.order) && (loaded.sc.l0_per_l1 == e.sc.l0_per_l1);
+  // malformed files are rejected
+  FILE * f = fopen(path, "w");
+  fprintf(f, "BISMOTUNE 1\n1 2 3\n");
+  fclose(f);
+  all_OK &= !db.load(path) && (db.size() == 1);
+  remove(path);
+  // newly built plans for the shape use the tuned schedule
+  cache.clear();
+  BitSerialMatMulExecutor * runner = new BitSerialMatMulExecutor(ctx, acc, platform);
+  all_OK &= (runner->getScheduleCfg().order == e.sc.order);
+  all_OK &= (runner->getScheduleCfg().l0_per_l1 == e.sc.l0_per_l1);
+  delete runner;
+  // a stored config that is not a candidate for the shape, as from a stale
+  // database, is ignored in favour of the cost model
+  TuningEntry stale = e;
+  for(auto & sc : BitSerialMatMulPlan::candidateScheduleCfgs(ctx, hw)) {
+    stale.sc.l0_per_l1 = max(stale.sc.l0_per_l1, sc.l0_per_l1 + 1);
+  }
+  db.put(ctx, hw, stale);
+  all_OK &= !db.lookup(ctx, hw, loaded);
+  cache.clear();
+  runner = new BitSerialMatMulExecutor(ctx, acc, platform);
+  const ScheduleCfg model = BitSerialMatMulPlan(ctx, hw).scheduleCfg();
+  all_OK &= (runner->getScheduleCfg().order == model.order);
+  all_OK &= (runner->getScheduleCfg().l0_per_l1 == model.l0_per_l1);
+  delete runner;
+  db.put(ctx, hw, e);
+  cache.clear();
+  all_OK &= test(
+    "autotuned", platform, acc, nrows_lhs, nrows_rhs, ncols, 2, 1, true, false
+  );
+  db.clear();
+  cache.clear();
+  deallocGEMMContext(ctx);
+  if(!all_OK) {
+    cout << "Autotuner test failed" << endl;
+  }
+  return all_OK;
+}
+
+bool test_perf_model(
+  WrapperRegDriver *, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const HardwareCfg & hw = acc->hwcfg();
+  PerfModelParams params = defaultPerfModelParams();
+  BitSerialMatMulPerfModel model(hw, params);
+  // shapes as (lhs rows, rhs rows, cols, lhs bits, rhs bits)
+  vector<vector<size_t>> shapes {
+    {hw.dpaDimLHS, hw.dpaDimRHS, hw.dpaDimCommon*4, 1, 1},
+    {2*hw.dpaDimLHS, 3*hw.dpaDimRHS, hw.dpaDimCommon*hw.lhsEntriesPerMem, 2, 2},
+    {4*hw.dpaDimLHS, 3*hw.dpaDimRHS, hw.dpaDimCommon*hw.lhsEntriesPerMem, 2, 2}
+  };
+  vector<uint64_t> predicted;
+  for(auto & s : shapes) {
+    GEMMShape g = {s[0], s[2], s[1], s[3], s[4], false, false};
+    BitSerialMatMulPlan plan(makeGEMMShape(g, hw), hw);
+    PerfPrediction p = model.predict(plan);
+    predicted.push_back(p.cycles);
+    // every stage accounts for the whole runtime
+    for(const uint64_t * cs : {p.fetch_cstate_cycles, p.exec_cstate_cycles, p.result_cstate_cycles}) {
+      all_OK &= (cs[csGetCmd] + cs[csRun] + cs[csSend] + cs[csReceive] == p.cycles);
+    }
+    uint64_t exec_run = 0;
+    for(auto & e : plan.execRunCfgs()) {
+      exec_run += e.numTiles + params.execRunCycles;
+    }
+    all_OK &= (p.exec_cstate_cycles[csRun] == exec_run);
+    // skipping resident fetches can only help
+    PerfPrediction warm = model.predict(*plan.residentVariant(true, false));
+    all_OK &= (warm.cycles <= p.cycles);
+  }
+  // more rows, more cycles
+  all_OK &= (predicted[1] < predicted[2]);
+  // larger overlays are faster on a compute-heavy workload
+  vector<GEMMShape> workload {
+    {8*hw.dpaDimLHS, hw.dpaDimCommon*hw.lhsEntriesPerMem, 8*hw.dpaDimRHS, 2, 2, false, false},
+    {4*hw.dpaDimLHS, hw.dpaDimCommon*64, 2*hw.dpaDimRHS, 1, 1, false, false}
+  };
+  vector<OverlayEstimate> ranking = exploreOverlays(
+    hw, {hw.dpaDimLHS, 2*hw.dpaDimLHS}, {hw.dpaDimCommon}, {hw.dpaDimRHS, 2*hw.dpaDimRHS}, workload
+  );
+  all_OK &= (ranking.size() == 4);
+  for(size_t i = 0; i < ranking.size(); i++) {
+    uint64_t sum = 0;
+    for(auto & c : ranking[i].shapeCycles) {
+      sum += c;
+    }
+    all_OK &= (ranking[i].shapeCycles.size() == workload.size()) && (sum == ranking[i].cycles);
+    all_OK &= (i == 0) || (ranking[i-1].cycles <= ranking[i].cycles);
+  }
+  all_OK &= (ranking.front().hwcfg.dpaDimLHS == 2*hw.dpaDimLHS);
+  all_OK &= (ranking.front().hwcfg.dpaDimRHS == 2*hw.dpaDimRHS);
+  // overlays narrower than the read channel are not supported
+  all_OK &= exploreOverlays(hw, {hw.dpaDimLHS}, {hw.readChanWidth / 2}, {hw.dpaDimRHS}, workload).empty();
+  if(!all_OK) {
+    cout << "Performance model test failed" << endl;
+  }
+  return all_OK;
+}
+
+bool test_perf_report(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const HardwareCfg & hw = acc->hwcfg();
+  GEMMContext ctx = acc->allocGEMMContext(
+    2*hw.dpaDimLHS, hw.dpaDimCommon*hw.lhsEntriesPerMem, 2*hw.dpaDimRHS, 2, 2, false, false
+  );
+  BitSerialMatMulExecutor * runner = new BitSerialMatMulExecutor(ctx, acc, platform);
+  runner->setLHS(ctx.lhs);
+  runner->setRHS(ctx.rhs);
+  runner->run();
+  PerfReport r = runner->getPerfReport();
+  all_OK &= (r.cycles == runner->getLastRuntimeCycles()) && (r.cycles > 0);
+  all_OK &= (r.bytesRead == runner->getPlan()->bytesToFetch());
+  all_OK &= (r.achievedGOPS > 0) && (r.achievedGOPS <= r.peakGOPS);
+  // JSON objects are balanced, CSV rows match the header
+  string json = perfReportJSON(r);
+  all_OK &= (count(json.begin(), json.end(), '{') == count(json.begin(), json.end(), '}'));
+  all_OK &= (count(json.begin(), json.end(), '"') % 2 == 0);
+  all_OK &= (json.find("\"bottleneck\": \"") != string::npos);
+  string hdr = perfReportCSVHeader(), row = perfReportCSVRow(r);
+  all_OK &= (count(hdr.begin(), hdr.end(), ',') == count(row.begin(), row.end(), ','));
+  // classification picks the busiest stage, or sync when none is busy
+  PerfReport c = r;
+  c.cycles = 1000;
+  c.fetchCycles[csRun] = 200;
+  c.execCycles[csRun] = 800;
+  c.resultCycles[csRun] = 100;
+  classifyPerfReport(c);
+  all_OK &= (c.bottleneck == boundExec) && (c.limitingRatio == 0.8f);
+  c.resultCycles[csRun] = 900;
+  classifyPerfReport(c);
+  all_OK &= (c.bottleneck == boundResult);
+  c.execCycles[csRun] = c.resultCycles[csRun] = 300;
+  classifyPerfReport(c);
+  all_OK &= (c.bottleneck == boundSync) && (c.limitingRatio == 0.7f);
+  delete runner;
+  deallocGEMMContext(ctx);
+  if(!all_OK) {
+    cout << "Performance report test failed" << endl;
+  }
+  return all_OK;
+}
+
+bool test_metrics(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const HardwareCfg & hw = acc->hwcfg();
+  // histogram values are exact up to the bucket resolution
+  BitSerialMatMulHistogram h;
+  for(uint64_t v = 1; v <= 1000; v++) {
+    h.record(v);
+  }
+  all_OK &= (h.count() == 1000) && (h.sum() == 500500);
+  all_OK &= (h.minValue() == 1) && (h.maxValue() == 1000);
+  all_OK &= (h.countAtMost(31) == 31) && (h.countAtMost(1023) == 1000);
+  const uint64_t p50 = h.quantile(0.5), p99 = h.quantile(0.99);
+  all_OK &= (p50 >= 500) && (p50 <= 500 + 500 / HIST_SUB_BUCKETS);
+  all_OK &= (p99 >= 990) && (p99 <= 1000);
+  // concurrent recording loses nothing
+  h.reset();
+  vector<thread> threads;
+  for(int t = 0; t < 4; t++) {
+    threads.push_back(thread([&h] {
+      for(uint64_t v = 0; v < 10000; v++) {
+        h.record(v);
+      }
+    }));
+  }
+  for(auto & t : threads) {
+    t.join();
+  }
+  all_OK &= (h.count() == 40000) && (h.countAtMost((1 << 14) - 1) == 40000);
+  // executors record per shape
+  BitSerialMatMulMetrics & metrics = BitSerialMatMulMetrics::instance();
+  metrics.reset();
+  const size_t nrows_lhs = hw.dpaDimLHS, nrows_rhs = 2*hw.dpaDimRHS;
+  const size_t ncols = hw.dpaDimCommon*4, nruns = 3;
+  GEMMContext ctx = acc->allocGEMMContext(nrows_lhs, ncols, nrows_rhs, 1, 1, false, false);
+  int32_t * accel_res = new int32_t[nrows_lhs * nrows_rhs];
+  BitSerialMatMulExecutor * runner = new BitSerialMatMulExecutor(ctx, acc, platform);
+  uint64_t fetched = 0, written = 0;
+  for(size_t i = 0; i < nruns; i++) {
+    runner->setLHS(ctx.lhs);
+    runner->setRHS(ctx.rhs);
+    runner->run();
+    runner->getRes(accel_res);
+    fetched += runner->getLastRunFetchBytes();
+    written += runner->getPlan()->bytesToWrite();
+  }
+  BitSerialMatMulShapeMetrics * m = metrics.get(ctx, hw);
+  all_OK &= (m->runs == nruns) && (m->bytesFetched == fetched) && (m->bytesWritten == written);
+  all_OK &= (m->cycles.count() == nruns) && (m->latencyNs.count() == nruns);
+  all_OK &= (m->uploadNs.count() == 2 * nruns) && (m->readbackNs.count() == nruns);
+  all_OK &= (m->cycles.maxValue() == runner->getLastRuntimeCycles());
+  const string labels = "{shape=\"" + m->shape + "\",bits=\"1x1\",signed=\"0x0\",hwcfg=\"" +
+    hwcfgString(hw) + "\"}";
+  const string prom = metrics.prometheusText();
+  all_OK &= (prom.find("bismo_gemm_runs_total" + labels + " " + to_string(nruns) + "\n") != string::npos);
+  all_OK &= (prom.find("# TYPE bismo_gemm_cycles histogram\n") != string::npos);
+  const string json = metrics.jsonSnapshot();
+  all_OK &= (json.find("\"shape\": \"" + m->shape + "\"") != string::npos);
+  all_OK &= (json.find("\"hwcfg\": \"" + hwcfgString(hw) + "\"") != string::npos);
+  // the same shape on another hardware config is a separate series
+  HardwareCfg hw2 = hw;
+  hw2.lhsEntriesPerMem *= 2;
+  metrics.get(ctx, hw2)->runs.fetch_add(1);
+  const string prom2 = metrics.prometheusText();
+  all_OK &= (prom2.find("hwcfg=\"" + hwcfgString(hw2) + "\"} 1\n") != string::npos);
+  all_OK &= (prom2.find("bismo_gemm_runs_total" + labels + " " + to_string(nruns) + "\n") != string::npos);
+  all_OK &= (count(json.begin(), json.end(), '{') == count(json.begin(), json.end(), '}'));
+  delete runner;
+  delete [] accel_res;
+  deallocGEMMContext(ctx);
+  if(!all_OK) {
+    cout << "Metrics test failed" << endl;
+  }
+  return all_OK;
+}
+
+bool test_trace(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const HardwareCfg & hw = acc->hwcfg();
+  // ring entries as (cycle, kind, stage, channel), see TraceBuffer.scala
+  auto entry = [](uint64_t c, uint64_t k, uint64_t s, uint64_t ch) {
+    return c | (k << 48) | (s << 51) | (ch << 53);
+  };
+  // a wrapped ring of 4 after 6 entries keeps the last 4, oldest first
+  uint64_t ring[4] = {
+    entry(40, traceRecvEnd, traceExec, 1), entry(50, traceRunStart, traceExec, 0),
+    entry(10, traceRunStart, traceFetch, 0), entry(30, traceRecvStart, traceExec, 1)
+  };
+  vector<TraceEvent> ev = decodeTraceRing(ring, 4, 6);
+  all_OK &= (ev.size() == 4) && (ev[0].cycle == 10) && (ev[3].cycle == 50);
+  all_OK &= (ev[1].kind == traceRecvStart) && (ev[1].stage == traceExec) && (ev[1].channel == 1);
+  // unmatched starts are left out of the JSON
+  string json = traceChromeJSON(ev, 100.0);
+  all_OK &= (json.find("\"name\": \"wait token\", \"ph\": \"X\", \"pid\": 0, \"tid\": 1, \"ts\": 0.3, \"dur\": 0.1") != string::npos);
+  all_OK &= (json.find("\"name\": \"run\"") == string::npos);
+  // trace a GEMM: every run and token op shows up, and the ring holds all
+  const size_t nrows_lhs = 2*hw.dpaDimLHS, nrows_rhs = 2*hw.dpaDimRHS;
+  const size_t ncols = hw.dpaDimCommon*4;
+  GEMMContext ctx = acc->allocGEMMContext(nrows_lhs, ncols, nrows_rhs, 2, 1, false, false);
+  int32_t * accel_res = new int32_t[nrows_lhs * nrows_rhs];
+  BitSerialMatMulExecutor * runner = new BitSerialMatMulExecutor(ctx, acc, platform);
+  runner->setLHS(ctx.lhs);
+  runner->setRHS(ctx.rhs);
+  BitSerialMatMulTracer tracer(platform, acc);
+  tracer.start();
+  runner->run();
+  ev = tracer.stop();
+  runner->getRes(accel_res);
+  all_OK &= (tracer.dropped() == 0) && (tracer.written() == ev.size());
+  size_t counts[N_TRACE_STAGES][traceRecvEnd + 1] = {{0}};
+  for(const TraceEvent & e : ev) {
+    counts[e.stage][e.kind]++;
+  }
+  for(int s = 0; s < N_TRACE_STAGES; s++) {
+    all_OK &= (counts[s][traceRunStart] > 0) && (counts[s][traceRunStart] == counts[s][traceRunEnd]);
+    all_OK &= (counts[s][traceRecvStart] == counts[s][traceRecvEnd]);
+  }
+  // each token sent to the next stage is received there
+  all_OK &= (counts[traceFetch][traceSend] == counts[traceExec][traceRecvEnd] - counts[traceResult][traceSend]);
+  json = traceChromeJSON(ev, acc->fclk_MHz());
+  all_OK &= (count(json.begin(), json.end(), '{') == count(json.begin(), json.end(), '}'));
+  delete runner;
+  delete [] accel_res;
+  deallocGEMMContext(ctx);
+  if(!all_OK) {
+    cout << "Trace test failed" << endl;
+  }
+  return all_OK;
+}
+
+bool test_fclk_cache(
+  WrapperRegDriver *, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const char * path = "bismo_test_fclk.cache";
+  remove(path);
+  float fclk = 0;
+  double err = 0;
+  const string key = acc->fclk_cache_key();
+  all_OK &= !BitSerialMatMulAccelDriver::load_fclk_cache(path, key, fclk, err);
+  // entries of other bitstreams are kept, the same key is replaced
+  all_OK &= BitSerialMatMulAccelDriver::save_fclk_cache(path, "other", 100.0, 0.01);
+  all_OK &= BitSerialMatMulAccelDriver::save_fclk_cache(path, key, 150.0, 0.01);
+  all_OK &= BitSerialMatMulAccelDriver::save_fclk_cache(path, key, 187.5, 0.0005);
+  all_OK &= BitSerialMatMulAccelDriver::load_fclk_cache(path, key, fclk, err);
+  all_OK &= (fclk == 187.5f) && (err == 0.0005);
+  all_OK &= BitSerialMatMulAccelDriver::load_fclk_cache(path, "other", fclk, err);
+  all_OK &= (fclk == 100.0f) && (err == 0.01);
+  // a disabled cache stores nothing
+  all_OK &= !BitSerialMatMulAccelDriver::save_fclk_cache("", key, 150.0, 0.01);
+  all_OK &= !BitSerialMatMulAccelDriver::load_fclk_cache("", key, fclk, err);
+  // a file of another format is not used
+  FILE * f = fopen(path, "w");
+  fprintf(f, "%s 187.5 0.0005\n", key.c_str());
+  fclose(f);
+  all_OK &= !BitSerialMatMulAccelDriver::load_fclk_cache(path, key, fclk, err);
+  remove(path);
+  // with the driver pointed at the test file: stopping the cycle counter
+  // only refines the estimate, the cache is written by save_fclk
+  const char * env = getenv(FCLK_CACHE_ENV);
+  const string prev = env ? env : "";
+  setenv(FCLK_CACHE_ENV, path, 1);
+  acc->perf_set_cc_enable(true);
+  acc->perf_set_cc_enable(false);
+  all_OK &= !BitSerialMatMulAccelDriver::load_fclk_cache(path, key, fclk, err);
+  all_OK &= acc->save_fclk();
+  if(env) {
+    setenv(FCLK_CACHE_ENV, prev.c_str(), 1);
+  } else {
+    unsetenv(FCLK_CACHE_ENV);
+  }
+  remove(path);
+  if(!all_OK) {
+    cout << "Clock calibration cache test failed" << endl;
+  }
+  return all_OK;
+}
+
+bool test_benchmark(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc
+) {
+  bool all_OK = true;
+  const HardwareCfg & hw = acc->hwcfg();
+  // sweeps are the cross product of the listed values
+  BenchmarkConfig cfg;
+  all_OK &= parseBenchmarkConfig("lhsrows 2 4 # rows\ndepth 256\nrhsrows 2\nrhsbits 1 2\nreps 3\n", cfg);
+  all_OK &= (cfg.shapes.size() == 4) && (cfg.reps == 3) && (cfg.warmup == BENCH_DEFAULT_WARMUP);
+  all_OK &= (benchmarkShapeName(cfg.shapes[3]) == "4x256x2:1b/2b");
+  all_OK &= !parseBenchmarkConfig("lhsrows 2\ndepth 256\n", cfg);
+  all_OK &= !parseBenchmarkConfig("lhsrows 2\ndepth 256\nrhsrows 2\ncolumns 4\n", cfg);
+  all_OK &= !parseBenchmarkConfig("lhsrows 2\ndepth 256x\nrhsrows 2\n", cfg);
+  BenchmarkStat st = benchmarkStat({5, 1, 4, 2, 3});
+  all_OK &= (st.median == 3) && (st.p99 == 5);
+  // time a small sweep and compare it against itself as the baseline
+  string text = "lhsrows " + to_string(hw.dpaDimLHS) + "\ndepth " + to_string(hw.dpaDimCommon * 2);
+  text += "\nrhsrows " + to_string(2 * hw.dpaDimRHS) + "\nlhsbits 1 2\nrhssigned 0 1\nreps 3\n";
+  all_OK &= parseBenchmarkConfig(text, cfg);
+  vector<BenchmarkResult> results = runBenchmarkSweep(platform, acc, cfg);
+  all_OK &= (results.size() == 4);
+  for(auto & r : results) {
+    all_OK &= r.ok && (r.reps == 3) && (r.cycles.median > 0) && (r.cycles.p99 >= r.cycles.median);
+  }
+  const char * path = "bismo_test_bench.csv";
+  all_OK &= writeBenchmarkFile(path, benchmarkCSV(results));
+  map<string, uint64_t> baseline;
+  all_OK &= loadBenchmarkBaseline(path, baseline) && (baseline.size() == results.size());
+  ostringstream report;
+  all_OK &= (compareBenchmarkBaseline(results, baseline, BENCH_DEFAULT_THRESHOLD, report) == 0);
+  // a faster baseline flags a regression
+  baseline[benchmarkShapeName(results[1].shape)] = results[1].cycles.median / 2;
+  all_OK &= (compareBenchmarkBaseline(results, baseline, BENCH_DEFAULT_THRESHOLD, report) == 1);
+  remove(path);
+  const string json = benchmarkJSON(results);
+  all_OK &= (count(json.begin(), json.end(), '{') == count(json.begin(), json.end(), '}'));
+  if(!all_OK) {
+    cout << "Benchmark test failed" << endl;
+  }
+  return all_OK;
+}
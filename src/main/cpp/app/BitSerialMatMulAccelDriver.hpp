@@ -34,10 +34,38 @@
 #define BitSerialMatMulAccelDriver_H
 
 #include <cassert>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include "platform.h"
 #include "BitSerialMatMulAccel.hpp"
 #include <iostream>
+// standard headers used by the executor, included before the min/max macros
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+// SIMD intrinsics for the result layout kernels
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 #include "gemmbitserial/gemmbitserial.hpp"
 
 #define CMDFIFO_CAP       16
@@ -47,6 +75,24 @@
 #define FETCH_ADDRALIGN   64
 #define FETCH_SIZEALIGN   8
 
+// fclk calibration cache, one entry per bitstream. BISMO_FCLK_CACHE overrides
+// the path, an empty value disables the cache.
+#define FCLK_CACHE_ENV          "BISMO_FCLK_CACHE"
+#define FCLK_CACHE_PATH         "/tmp/bismo_fclk.cache"
+#define FCLK_CACHE_MAGIC        "BISMOFCLK"
+#define FCLK_CACHE_VERSION      1
+// target relative error and time limits for calibrate_fclk
+#define FCLK_CAL_TOL            0.001
+#define FCLK_CAL_MIN_US         2000
+#define FCLK_CAL_MAX_US         50000
+#define FCLK_CAL_STEP_US        500
+// waiting for the accelerator: back-to-back polls first, then sleeps that
+// double up to POLL_MAX_SLEEP_US between polls
+#define POLL_SPIN_COUNT         64
+#define POLL_MAX_SLEEP_US       100
+// size of the buffer used to find out whether accel memory is host-visible
+#define HOSTMAP_PROBE_BYTES     64
+
 #define max(x,y) (x > y ? x : y)
 #define FETCH_ALIGN       max(FETCH_ADDRALIGN, FETCH_SIZEALIGN)
 
@@ -54,6 +100,13 @@ typedef enum {
   opRun = 0, opSendToken, opReceiveToken
 } OpCode;
 
+// command queues, in the order used by the hardware command fetcher
+typedef enum {
+  cmdqFetchOp = 0, cmdqExecOp, cmdqResultOp,
+  cmdqFetchRunCfg, cmdqExecRunCfg, cmdqResultRunCfg
+} CmdQueue;
+#define N_CMD_QUEUES      6
+
 typedef enum {
   csGetCmd = 0, csRun, csSend, csReceive
 } ControllerState;
@@ -109,35 +162,365 @@ typedef struct {
 typedef uint64_t PackedBitGroupType;
 typedef int32_t ResultType;
 
+// hardware config as "<dpaDimLHS>x<dpaDimCommon>x<dpaDimRHS>" followed by the
+// other fields, so that different configs give different strings
+static inline std::string hwcfgString(const HardwareCfg & cfg) {
+  std::ostringstream k;
+  k << cfg.dpaDimLHS << "x" << cfg.dpaDimCommon << "x" << cfg.dpaDimRHS;
+  k << "-" << cfg.lhsEntriesPerMem << "-" << cfg.rhsEntriesPerMem;
+  k << "-" << cfg.accWidth << "-" << cfg.maxShiftSteps << "-" << cfg.cmdQueueEntries;
+  k << "-" << cfg.readChanWidth << "-" << cfg.writeChanWidth;
+  return k.str();
+}
+
+// the platform drivers are not thread-safe, so every call into a
+// WrapperRegDriver, including register I/O through the accelerator driver, is
+// made under this lock when more than one thread may use the platform (async
+// runs, sessions). it is recursive so that guarded code can call guarded code.
+inline std::recursive_mutex & bismo_platform_lock() {
+  static std::recursive_mutex lock;
+  return lock;
+}
+
+typedef std::lock_guard<std::recursive_mutex> BitSerialMatMulPlatformGuard;
+
+// pacing for polling the accelerator: polls go back to back at first for
+// low latency, then the host sleeps between polls, doubling the sleep up to
+// POLL_MAX_SLEEP_US, so that long waits leave the core free
+class BitSerialMatMulBackoff {
+public:
+  BitSerialMatMulBackoff() {
+    reset();
+  }
+
+  // call after a poll that made progress
+  void reset() {
+    m_polls = 0;
+    m_us = 1;
+  }
+
+  // microseconds to wait before the next poll, 0 while still spinning
+  unsigned step() {
+    if(m_polls < POLL_SPIN_COUNT) {
+      m_polls++;
+      return 0;
+    }
+    const unsigned us = m_us;
+    m_us = (2 * m_us < POLL_MAX_SLEEP_US) ? 2 * m_us : POLL_MAX_SLEEP_US;
+    return us;
+  }
+
+  // call after a poll that made no progress
+  void pause() {
+    const unsigned us = step();
+    if(us) {
+      usleep(us);
+    }
+  }
+
+protected:
+  unsigned m_polls, m_us;
+};
+
 class BitSerialMatMulAccelDriver {
 public:
   BitSerialMatMulAccelDriver(WrapperRegDriver * platform) {
     m_platform = platform;
     m_accel = new BitSerialMatMulAccel(m_platform);
     m_fclk = 200.0;
+    m_fclk_err = 1.0;
+    m_fclk_cache_err = 1.0;
+    m_calibrate = (m_platform->platformID() != "EmuDriver");
+    m_calibrating = false;
+    m_cc_on = false;
+    m_fclk_dirty = false;
+    m_bram_owner = 0;
+    m_result_bytes = 0;
+    m_feeder_stop = false;
+    // accel memory is not assumed to be host-visible, see setHostMapping
+    m_hostmap = 0;
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
     update_hw_cfg();
-    measure_fclk();
+    init_fclk();
   }
   ~BitSerialMatMulAccelDriver() {
+    save_fclk();
+    if(m_feeder.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(m_feeder_lock);
+        m_feeder_stop = true;
+      }
+      m_feeder_wake.notify_all();
+      m_feeder.join();
+    }
+  }
+
+  // held while a GEMM is using the instruction queues and tokens, so that
+  // GEMMs from different executors never interleave
+  std::mutex & run_lock() {
+    return m_run_lock;
+  }
+
+  // run fn on the feeder thread of this accelerator, after everything queued
+  // before it and under run_lock(). the thread is started on first use and
+  // sleeps while there is nothing queued. the returned future becomes ready
+  // when fn has returned.
+  std::shared_future<void> run_async(std::function<void()> fn) {
+    std::shared_ptr<std::packaged_task<void()>> task(
+      new std::packaged_task<void()>(fn)
+    );
+    std::shared_future<void> ret = task->get_future().share();
+    std::lock_guard<std::mutex> lock(m_feeder_lock);
+    if(!m_feeder.joinable()) {
+      m_feeder = std::thread([this] { feed(); });
+    }
+    m_feeder_queue.push_back(task);
+    m_feeder_wake.notify_all();
+    return ret;
   }
 
+  // calibrate fclk and update the cache entry for this bitstream. the
+  // calibration restarts the cycle counter, so this holds the run lock and
+  // waits for running GEMMs and sessions to finish. do not call it from a
+  // thread that owns a live BitSerialMatMulSession.
   void measure_fclk() {
-    if(m_platform->platformID() != "EmuDriver") {
-      uint32_t cc_start = perf_get_cc();
-      perf_set_cc_enable(true);
-      // sleep for one second of CPU time
-      usleep(1000000);
-      perf_set_cc_enable(false);
-      uint32_t cc_end = perf_get_cc();
-      // million ticks per second = fclk in MHz
-      m_fclk = (float)(cc_end - cc_start) / 1000000.0;
+    std::lock_guard<std::mutex> lock(m_run_lock);
+    if(m_calibrate) {
+      calibrate_fclk();
+      m_fclk_dirty = true;
+      save_fclk();
+    }
+  }
+
+  // write the fclk estimate to the cache if runs have refined it enough
+  // since the last write, see refine_fclk. called on destruction, call it
+  // earlier to keep the refinement if the process may not exit cleanly.
+  // runs never write the cache themselves. returns false on I/O errors.
+  bool save_fclk() {
+    float fclk;
+    double err;
+    {
+      std::lock_guard<std::mutex> lock(m_fclk_lock);
+      if(!m_fclk_dirty) {
+        return true;
+      }
+      m_fclk_dirty = false;
+      fclk = m_fclk;
+      err = m_fclk_err;
+    }
+    if(!save_fclk_cache(fclk_cache_path(), fclk_cache_key(), fclk, err)) {
+      return false;
     }
+    m_fclk_cache_err = err;
+    return true;
   }
 
   float fclk_MHz() const {
     return m_fclk;
   }
 
+  // bound on the relative error of fclk_MHz
+  double fclk_error() const {
+    return m_fclk_err;
+  }
+
+  // look up the cached fclk for key, false if there is none
+  static bool load_fclk_cache(
+    const std::string & path, const std::string & key, float & fclk, double & err
+  ) {
+    FILE * f = path.empty() ? 0 : fopen(path.c_str(), "r");
+    if(!f) {
+      return false;
+    }
+    unsigned int version = 0;
+    bool found = false;
+    bool ok = fscanf(f, FCLK_CACHE_MAGIC " %u", &version) == 1;
+    ok &= (version == FCLK_CACHE_VERSION);
+    char k[256];
+    float kf;
+    double ke;
+    while(ok && !found && fscanf(f, "%255s %f %lf", k, &kf, &ke) == 3) {
+      if(key == k && kf > 0) {
+        fclk = kf;
+        err = ke;
+        found = true;
+      }
+    }
+    fclose(f);
+    return found;
+  }
+
+  // add or replace the cached fclk for key
+  static bool save_fclk_cache(
+    const std::string & path, const std::string & key, float fclk, double err
+  ) {
+    if(path.empty()) {
+      return false;
+    }
+    // keep the entries of other bitstreams
+    std::map<std::string, std::pair<float, double>> entries;
+    FILE * f = fopen(path.c_str(), "r");
+    if(f) {
+      unsigned int version = 0;
+      if(fscanf(f, FCLK_CACHE_MAGIC " %u", &version) == 1 && version == FCLK_CACHE_VERSION) {
+        char k[256];
+        float kf;
+        double ke;
+        while(fscanf(f, "%255s %f %lf", k, &kf, &ke) == 3) {
+          entries[k] = std::make_pair(kf, ke);
+        }
+      }
+      fclose(f);
+    }
+    entries[key] = std::make_pair(fclk, err);
+    // write to a temporary file first, so concurrent readers never see a
+    // partial cache
+    const std::string tmp = path + "." + std::to_string(getpid());
+    f = fopen(tmp.c_str(), "w");
+    if(!f) {
+      return false;
+    }
+    bool ok = fprintf(f, FCLK_CACHE_MAGIC " %u\n", FCLK_CACHE_VERSION) > 0;
+    for(auto & e : entries) {
+      ok &= fprintf(f, "%s %.6f %.9f\n", e.first.c_str(), e.second.first, e.second.second) > 0;
+    }
+    ok &= fclose(f) == 0;
+    ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+    return ok;
+  }
+
+  // cache path from the environment, or the default
+  static std::string fclk_cache_path() {
+    const char * env = getenv(FCLK_CACHE_ENV);
+    return env ? std::string(env) : std::string(FCLK_CACHE_PATH);
+  }
+
+  // identifies the bitstream: platform, accelerator signature and the
+  // instantiated hardware config
+  std::string fclk_cache_key() const {
+    std::ostringstream k;
+    k << m_platform->platformID() << "-" << std::hex << m_signature << std::dec;
+    k << "-" << hwcfgString(m_cfg);
+    return k.str();
+  }
+
+  // translates the first bytes of an accel buffer into a host pointer, for
+  // platforms where accel memory is mapped into the host address space.
+  // returns 0 if the buffer cannot be mapped.
+  typedef void * (*HostMapFxn)(
+    WrapperRegDriver * platform, void * accelBuf, size_t bytes
+  );
+
+  // install the translation, or 0 if accel memory is not host-visible,
+  // which is the default. the mapping must be non-cacheable or kept coherent
+  // by the platform, since the host writes to it without
+  // copyBufferHostToAccel.
+  void setHostMapping(HostMapFxn f) {
+    m_hostmap = f;
+  }
+
+  // opt-in alternative to setHostMapping: install the first of
+  // identityHostMap and devmemHostMap under which the host sees what
+  // copyBufferHostToAccel wrote, and copyBufferAccelToHost returns what the
+  // host wrote. this allocates a probe buffer and may open /dev/mem, which
+  // is why the driver does not do it by itself. candidates are only read
+  // through a pipe, which fails rather than faulting on unmapped addresses,
+  // and only written once they have shown the buffer contents. returns the
+  // installed mapping, or 0 if none works.
+  HostMapFxn probeHostMapping() {
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    const HostMapFxn candidates[2] = {identityHostMap, devmemHostMap};
+    uint8_t pattern[HOSTMAP_PROBE_BYTES], seen[HOSTMAP_PROBE_BYTES];
+    for(size_t i = 0; i < HOSTMAP_PROBE_BYTES; i++) {
+      pattern[i] = (uint8_t)(0x5a ^ (i * 37));
+    }
+    void * buf = m_platform->allocAccelBuffer(HOSTMAP_PROBE_BYTES);
+    m_platform->copyBufferHostToAccel(pattern, buf, HOSTMAP_PROBE_BYTES);
+    m_hostmap = 0;
+    for(auto c : candidates) {
+      uint8_t * p = (uint8_t *) c(m_platform, buf, HOSTMAP_PROBE_BYTES);
+      if(!p || !read_via_pipe(p, seen, HOSTMAP_PROBE_BYTES) ||
+        memcmp(seen, pattern, HOSTMAP_PROBE_BYTES) != 0) {
+        continue;
+      }
+      for(size_t i = 0; i < HOSTMAP_PROBE_BYTES; i++) {
+        p[i] = ~pattern[i];
+      }
+      m_platform->copyBufferAccelToHost(buf, seen, HOSTMAP_PROBE_BYTES);
+      bool ok = true;
+      for(size_t i = 0; i < HOSTMAP_PROBE_BYTES; i++) {
+        ok &= (seen[i] == (uint8_t) ~pattern[i]);
+      }
+      if(ok) {
+        m_hostmap = c;
+        break;
+      }
+    }
+    m_platform->deallocAccelBuffer(buf);
+    return m_hostmap;
+  }
+
+  HostMapFxn hostMapping() const {
+    return m_hostmap;
+  }
+
+  // host pointer for an accel buffer, or 0 if accel memory is not mapped
+  void * hostPtr(void * accelBuf, size_t bytes) const {
+    return m_hostmap ? m_hostmap(m_platform, accelBuf, bytes) : 0;
+  }
+
+  // accel buffer addresses are host addresses, e.g. in emulation with the
+  // accelerator memory in the host process
+  static void * identityHostMap(WrapperRegDriver *, void * accelBuf, size_t) {
+    return accelBuf;
+  }
+
+  // accel buffer addresses are physical DDR addresses, as on Zynq: uncached
+  // views through /dev/mem, kept for reuse since pool buffers come back. a
+  // larger view of an address replaces and unmaps the previous one, so a
+  // host pointer stays valid until its buffer is freed or mapped larger.
+  static void * devmemHostMap(
+    WrapperRegDriver *, void * accelBuf, size_t bytes
+  ) {
+#if defined(__arm__) || defined(__aarch64__)
+    static std::mutex lock;
+    static int fd = -2;
+    static std::map<uint64_t, std::pair<uint8_t *, size_t>> views;
+    std::lock_guard<std::mutex> guard(lock);
+    if(fd == -2) {
+      fd = open("/dev/mem", O_RDWR | O_SYNC);
+    }
+    if(fd < 0 || bytes == 0) {
+      return 0;
+    }
+    const uint64_t addr = (uint64_t) accelBuf;
+    auto it = views.find(addr);
+    if(it == views.end() || it->second.second < bytes) {
+      // whole pages, so that small size changes reuse the view
+      const uint64_t page = sysconf(_SC_PAGESIZE);
+      const uint64_t base = addr & ~(page - 1);
+      const uint64_t len = (addr - base + bytes + page - 1) & ~(page - 1);
+      void * p = mmap(
+        0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t) base
+      );
+      if(p == MAP_FAILED) {
+        return 0;
+      }
+      if(it != views.end()) {
+        const uint64_t old_len = (addr - base + it->second.second + page - 1) & ~(page - 1);
+        munmap(it->second.first - (addr - base), old_len);
+      }
+      views[addr] = std::make_pair((uint8_t *) p + (addr - base), len - (addr - base));
+      it = views.find(addr);
+    }
+    return it->second.first;
+#else
+    (void) accelBuf;
+    (void) bytes;
+    return 0;
+#endif
+  }
+
   // allocate a GEMMContext compliant with the accelerator size
   gemmbitserial::GEMMContext allocGEMMContext(
     uint64_t lhsRows, uint64_t depth, uint64_t rhsRows,
@@ -158,32 +541,55 @@ public:
   // enable/disable the cycle counter
   // cleared on rising edge (i.e. 0->1 transition)
   // increments by 1 every cycle while enabled
+  // each enabled period is also timed on the host to refine fclk, see
+  // refine_fclk
   void perf_set_cc_enable(bool e) {
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    const double t0 = host_us();
     m_accel->set_perf_cc_enable(e ? 1 : 0);
+    const double t1 = host_us();
+    const bool was_on = m_cc_on.exchange(e);
+    if(!m_calibrate || m_calibrating || e == was_on) {
+      return;
+    }
+    if(e) {
+      m_cc_on_us = (t0 + t1) / 2;
+      m_cc_on_err_us = (t1 - t0) / 2;
+    } else {
+      refine_fclk(perf_get_cc(), (t0 + t1) / 2 - m_cc_on_us, (t1 - t0) / 2 + m_cc_on_err_us);
+    }
+  }
+
+  // latch the cycle counter and the state counters of all controllers. the
+  // counters are 64-bit and read as two register halves, so reading the
+  // latched values keeps the halves from tearing while the counters run.
+  void perf_snapshot() {
+    m_accel->set_perf_snapshot(1);
+    m_accel->set_perf_snapshot(0);
   }
 
-  // return cycle count
-  uint32_t perf_get_cc() {
-    return m_accel->get_perf_cc();
+  // return cycle count, taking a new snapshot
+  uint64_t perf_get_cc() {
+    perf_snapshot();
+    return (uint64_t) m_accel->get_perf_cc();
   }
 
   // get the number of cycles that elapsed in a given state
-  // for each controller
+  // for each controller, as of the last perf_get_cc
 
-  uint32_t perf_fetch_stats(ControllerState s) {
+  uint64_t perf_fetch_stats(ControllerState s) {
     m_accel->set_perf_prf_fetch_sel((uint32_t) s);
-    return m_accel->get_perf_prf_fetch_count();
+    return (uint64_t) m_accel->get_perf_prf_fetch_count();
   }
 
-  uint32_t perf_exec_stats(ControllerState s) {
+  uint64_t perf_exec_stats(ControllerState s) {
     m_accel->set_perf_prf_exec_sel((uint32_t) s);
-    return m_accel->get_perf_prf_exec_count();
+    return (uint64_t) m_accel->get_perf_prf_exec_count();
   }
 
-  uint32_t perf_result_stats(ControllerState s) {
-    cout << "Controller state: " << s << endl;
+  uint64_t perf_result_stats(ControllerState s) {
     m_accel->set_perf_prf_res_sel((uint32_t) s);
-    return m_accel->get_perf_prf_res_count();
+    return (uint64_t) m_accel->get_perf_prf_res_count();
   }
 
   static void printFetchRunCfg(FetchRunCfg r) {
@@ -235,27 +641,67 @@ public:
   // do a sanity check on a FetchRunCfg in terms of alignment and
   // out-of-bounds values
   void verifyFetchRunCfg(FetchRunCfg f) {
-    const size_t exec_to_fetch_width_ratio = m_cfg.dpaDimCommon / m_cfg.readChanWidth;
+    verifyFetchRunCfg(f, m_cfg);
+  }
+
+  static void verifyFetchRunCfg(FetchRunCfg f, const HardwareCfg & cfg) {
+    assert(isValidFetchRunCfg(f, cfg));
+  }
+
+  // whether a FetchRunCfg is aligned and stays within the BRAMs of cfg
+  static bool isValidFetchRunCfg(FetchRunCfg f, const HardwareCfg & cfg) {
+    const size_t exec_to_fetch_width_ratio = cfg.dpaDimCommon / cfg.readChanWidth;
+    // fetch nodes: one per LHS and RHS memory, LHS first
+    const size_t fetch_nodes_per_group = cfg.dpaDimLHS + cfg.dpaDimRHS;
     // ensure all DRAM accesses are aligned
-    assert(((uint64_t) f.dram_base) % FETCH_ADDRALIGN == 0);
-    assert(f.dram_block_offset_bytes % FETCH_ADDRALIGN == 0);
-    assert(f.dram_block_size_bytes % FETCH_SIZEALIGN == 0);
+    bool ok = ((uint64_t) f.dram_base) % FETCH_ADDRALIGN == 0;
+    ok &= f.dram_block_offset_bytes % FETCH_ADDRALIGN == 0;
+    ok &= f.dram_block_size_bytes % FETCH_SIZEALIGN == 0;
     // ensure that BRAM accesses are within existing range
-    assert(f.bram_id_start < get_fetch_nodes_per_group());
-    assert(f.bram_id_start + f.bram_id_range < get_fetch_nodes_per_group());
-    if(f.bram_id_start < get_fetch_first_rhs_id()) {
-      assert(f.bram_addr_base < m_cfg.lhsEntriesPerMem * exec_to_fetch_width_ratio);
+    ok &= f.bram_id_start < fetch_nodes_per_group;
+    ok &= (size_t) f.bram_id_start + f.bram_id_range < fetch_nodes_per_group;
+    if(f.bram_id_start < cfg.dpaDimLHS) {
+      ok &= f.bram_addr_base < cfg.lhsEntriesPerMem * exec_to_fetch_width_ratio;
     } else {
-      assert(f.bram_addr_base < m_cfg.rhsEntriesPerMem * exec_to_fetch_width_ratio);
+      ok &= f.bram_addr_base < cfg.rhsEntriesPerMem * exec_to_fetch_width_ratio;
     }
+    return ok;
+  }
+
+  // whether an ExecRunCfg reads within the tile memories of cfg and writes
+  // to an existing result memory region
+  static bool isValidExecRunCfg(ExecRunCfg e, const HardwareCfg & cfg) {
+    // offsets are in fetch words, each tile is several fetch words wide
+    const uint64_t exec_to_fetch_width_ratio = cfg.dpaDimCommon / cfg.readChanWidth;
+    const uint64_t tile_words = (uint64_t) e.numTiles * exec_to_fetch_width_ratio;
+    bool ok = e.lhsOffset + tile_words <= cfg.lhsEntriesPerMem * exec_to_fetch_width_ratio;
+    ok &= e.rhsOffset + tile_words <= cfg.rhsEntriesPerMem * exec_to_fetch_width_ratio;
+    ok &= e.shiftAmount <= cfg.maxShiftSteps;
+    ok &= e.writeAddr < EXECRES_TOKENS;
+    return ok;
   }
 
   // do a sanity check on a ResultRunCfg in terms of alignment and
   // out-of-bounds values
-  void verifyResultRunCfg(ResultRunCfg r) {
+  static void verifyResultRunCfg(ResultRunCfg r) {
+    assert(isValidResultRunCfg(r));
+  }
+
+  static bool isValidResultRunCfg(ResultRunCfg r) {
     // ensure all DRAM accesses are aligned to 8 bytes
-    assert(((uint64_t) r.dram_base) % 8 == 0);
-    assert(r.dram_skip % 8 == 0);
+    bool ok = ((uint64_t) r.dram_base) % 8 == 0;
+    ok &= r.dram_skip % 8 == 0;
+    ok &= r.resmem_addr < EXECRES_TOKENS;
+    return ok;
+  }
+
+  // poll done() until it returns true. short waits poll back to back, long
+  // waits sleep between polls so that they leave the host core free.
+  template <typename Cond> static void wait_until(Cond done) {
+    BitSerialMatMulBackoff backoff;
+    while(!done()) {
+      backoff.pause();
+    }
   }
 
   // get command counts in FIFOs
@@ -291,8 +737,35 @@ public:
 
   // reset the accelerator
   void reset() {
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
     m_platform->writeReg(0, 1);
     m_platform->writeReg(0, 0);
+    m_bram_owner = 0;
+    m_result_bytes = 0;
+  }
+
+  // the result stage counts the bytes it wrote since the last reset and
+  // compares that total against waitCompleteBytes, while schedules count
+  // from their own start. a schedule claims the bytes it will write before
+  // it runs, and adds the returned count to its waitCompleteBytes. the sum
+  // wraps around at 2^32 like the hardware counter.
+  uint32_t claim_result_bytes(size_t bytes) {
+    return m_result_bytes.fetch_add((uint32_t) bytes);
+  }
+
+  // result bytes claimed since the last reset
+  uint32_t resultBytes() const {
+    return m_result_bytes;
+  }
+
+  // whoever ran the last schedule, and so knows what is left in the BRAMs.
+  // executors use this to check that their tiles are still resident.
+  void setBRAMOwner(const void * owner) {
+    m_bram_owner = owner;
+  }
+
+  const void * bramOwner() const {
+    return m_bram_owner;
   }
 
   // enable/disable the execution of each stage
@@ -302,7 +775,7 @@ public:
     m_accel->set_result_enable(result);
   }
 
-  Op make_op(OpCode opcode, uint32_t syncChannel) {
+  static Op make_op(OpCode opcode, uint32_t syncChannel) {
     Op ret;
     ret.opcode = opcode;
     ret.syncChannel = syncChannel;
@@ -389,6 +862,106 @@ public:
     m_accel->set_result_runcfg_valid(0);
   }
 
+  // 64-bit words per entry in a DRAM-resident command queue
+  static size_t cmdq_words_per_entry(CmdQueue q) {
+    const size_t words[N_CMD_QUEUES] = {1, 1, 1, 4, 2, 3};
+    return words[q];
+  }
+
+  // encoders for DRAM-resident command queue entries, see CmdFetcher.scala
+  // for the layout
+  static void encode_op(Op op, uint64_t * w) {
+    w[0] = (uint64_t) op.opcode | ((uint64_t) op.syncChannel << 8);
+  }
+
+  static void encode_fetch_runcfg(FetchRunCfg cfg, uint64_t * w) {
+    // hw limitation: tiles_per_row is internally 16 bits
+    assert(cfg.tiles_per_row < (1 << 16));
+    w[0] = (uint64_t) cfg.dram_base;
+    w[1] = cfg.dram_block_size_bytes | ((uint64_t) cfg.dram_block_offset_bytes << 32);
+    w[2] = cfg.dram_block_count | ((uint64_t) cfg.tiles_per_row << 32);
+    w[3] = cfg.bram_addr_base | ((uint64_t) cfg.bram_id_start << 32) |
+      ((uint64_t) cfg.bram_id_range << 48);
+  }
+
+  static void encode_exec_runcfg(ExecRunCfg cfg, uint64_t * w) {
+    w[0] = cfg.lhsOffset | ((uint64_t) cfg.rhsOffset << 32);
+    w[1] = cfg.numTiles | ((uint64_t) cfg.shiftAmount << 32) |
+      ((uint64_t) (cfg.doNegate ? 1 : 0) << 40) |
+      ((uint64_t) (cfg.doClear ? 1 : 0) << 41) |
+      ((uint64_t) (cfg.writeEn ? 1 : 0) << 42) |
+      ((uint64_t) cfg.writeAddr << 48);
+  }
+
+  static void encode_result_runcfg(ResultRunCfg cfg, uint64_t * w) {
+    w[0] = (uint64_t) cfg.dram_base;
+    w[1] = cfg.dram_skip;
+    w[2] = cfg.waitCompleteBytes | ((uint64_t) cfg.resmem_addr << 32) |
+      ((uint64_t) (cfg.waitComplete ? 1 : 0) << 48);
+  }
+
+  // let the accelerator read its commands from DRAM-resident queues. base
+  // and count give the accel buffer address and entry count of each queue,
+  // indexed by CmdQueue. do not push commands from the host until
+  // dram_cmdqueues_busy() returns false.
+  void start_dram_cmdqueues(void * const * base, const size_t * count) {
+    for(int q = 0; q < N_CMD_QUEUES; q++) {
+      assert(((uint64_t) base[q]) % FETCH_SIZEALIGN == 0);
+    }
+    m_accel->set_cmdq_fetch_op_base((AccelDblReg) base[cmdqFetchOp]);
+    m_accel->set_cmdq_fetch_op_count(count[cmdqFetchOp]);
+    m_accel->set_cmdq_exec_op_base((AccelDblReg) base[cmdqExecOp]);
+    m_accel->set_cmdq_exec_op_count(count[cmdqExecOp]);
+    m_accel->set_cmdq_result_op_base((AccelDblReg) base[cmdqResultOp]);
+    m_accel->set_cmdq_result_op_count(count[cmdqResultOp]);
+    m_accel->set_cmdq_fetch_runcfg_base((AccelDblReg) base[cmdqFetchRunCfg]);
+    m_accel->set_cmdq_fetch_runcfg_count(count[cmdqFetchRunCfg]);
+    m_accel->set_cmdq_exec_runcfg_base((AccelDblReg) base[cmdqExecRunCfg]);
+    m_accel->set_cmdq_exec_runcfg_count(count[cmdqExecRunCfg]);
+    m_accel->set_cmdq_result_runcfg_base((AccelDblReg) base[cmdqResultRunCfg]);
+    m_accel->set_cmdq_result_runcfg_count(count[cmdqResultRunCfg]);
+    // rising edge on start loads the queue configs
+    m_accel->set_cmdq_start(1);
+    m_accel->set_cmdq_start(0);
+  }
+
+  // whether the command fetcher still has entries to push into the queues
+  bool dram_cmdqueues_busy() {
+    return m_accel->get_cmdq_busy() != 0;
+  }
+
+  // have the controllers record their events into a ring buffer of entries
+  // 64-bit words at base, see TraceBuffer.scala for the entry layout. starting
+  // resets the ring buffer, the timestamps and the counters below.
+  void trace_start(void * base, uint32_t entries) {
+    assert(((uint64_t) base) % FETCH_SIZEALIGN == 0);
+    assert(entries > 0);
+    m_accel->set_trace_enable(0);
+    m_accel->set_trace_base((AccelDblReg) base);
+    m_accel->set_trace_entries(entries);
+    m_accel->set_trace_enable(1);
+  }
+
+  // stop recording new events, events already recorded are still written
+  void trace_stop() {
+    m_accel->set_trace_enable(0);
+  }
+
+  // entries written to the ring buffer since trace_start
+  uint32_t trace_written() {
+    return m_accel->get_trace_written();
+  }
+
+  // events lost since trace_start because the trace writer fell behind
+  uint32_t trace_dropped() {
+    return m_accel->get_trace_dropped();
+  }
+
+  // whether recorded events are still on their way to the ring buffer
+  bool trace_busy() {
+    return m_accel->get_trace_busy() != 0;
+  }
+
   // initialize the tokens in FIFOs representing shared resources
   void init_resource_pools() {
     set_stage_enables(0, 0, 0);
@@ -432,10 +1005,162 @@ protected:
   BitSerialMatMulAccel * m_accel;
   WrapperRegDriver * m_platform;
   HardwareCfg m_cfg;
-  float m_fclk;
+  std::atomic<float> m_fclk;
+  // bounds on the relative error of m_fclk and of its cache entry
+  std::atomic<double> m_fclk_err;
+  std::atomic<double> m_fclk_cache_err;
+  // whether the estimate improved enough to be worth writing to the cache
+  std::atomic<bool> m_fclk_dirty;
+  // serializes refinements of the estimate with taking it for the cache
+  std::mutex m_fclk_lock;
+  // whether the platform has a real clock to calibrate against
+  bool m_calibrate;
+  std::atomic<bool> m_calibrating;
+  // host time the cycle counter was last enabled at, if it is running.
+  // the times are only used under the platform lock.
+  std::atomic<bool> m_cc_on;
+  double m_cc_on_us, m_cc_on_err_us;
+  AccelReg m_signature;
+  HostMapFxn m_hostmap;
+  const void * m_bram_owner;
+  std::atomic<uint32_t> m_result_bytes;
+  // GEMM serialization and the run_async feeder
+  std::mutex m_run_lock;
+  std::mutex m_feeder_lock;
+  std::condition_variable m_feeder_wake;
+  std::deque<std::shared_ptr<std::packaged_task<void()>>> m_feeder_queue;
+  std::thread m_feeder;
+  bool m_feeder_stop;
+
+  static bool read_via_pipe(const void * from, void * to, size_t bytes) {
+    int fd[2];
+    if(pipe(fd) != 0) {
+      return false;
+    }
+    const bool ok =
+      write(fd[1], from, bytes) == (ssize_t) bytes &&
+      read(fd[0], to, bytes) == (ssize_t) bytes;
+    close(fd[0]);
+    close(fd[1]);
+    return ok;
+  }
+
+  // feeder thread: run queued work in order until the driver is destroyed
+  void feed() {
+    std::unique_lock<std::mutex> lock(m_feeder_lock);
+    while(true) {
+      if(m_feeder_queue.empty()) {
+        if(m_feeder_stop) {
+          break;
+        }
+        m_feeder_wake.wait(lock);
+        continue;
+      }
+      std::shared_ptr<std::packaged_task<void()>> task = m_feeder_queue.front();
+      m_feeder_queue.pop_front();
+      lock.unlock();
+      {
+        std::lock_guard<std::mutex> run(m_run_lock);
+        (*task)();
+      }
+      lock.lock();
+    }
+  }
+
+  // measure fclk against the host clock. each cycle counter read happens
+  // between two host timestamps, which bounds its time. sampling stops once
+  // the resulting bound on the relative error is below tol, or after max_us.
+  // returns the bound reached.
+  double calibrate_fclk(double tol = FCLK_CAL_TOL, double max_us = FCLK_CAL_MAX_US) {
+    m_calibrating = true;
+    perf_set_cc_enable(false);
+    perf_set_cc_enable(true);
+    const CCSample s0 = sample_cc();
+    CCSample s;
+    double dt, err;
+    do {
+      usleep(FCLK_CAL_STEP_US);
+      s = sample_cc();
+      dt = s.us - s0.us;
+      err = (s0.err_us + s.err_us) / dt + 1.0 / (s.cc - s0.cc + 1);
+    } while((err > tol || dt < FCLK_CAL_MIN_US) && dt < max_us);
+    perf_set_cc_enable(false);
+    m_calibrating = false;
+    if(s.cc != s0.cc) {
+      std::lock_guard<std::mutex> lock(m_fclk_lock);
+      m_fclk = (s.cc - s0.cc) / dt;
+      m_fclk_err = err;
+    }
+    return err;
+  }
+
+  // a cycle counter read and the host time it happened at
+  typedef struct {
+    uint64_t cc;
+    double us, err_us;
+  } CCSample;
+
+  static double host_us() {
+    return std::chrono::duration<double, std::micro>(
+      std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+  }
+
+  CCSample sample_cc() {
+    CCSample s;
+    const double t0 = host_us();
+    s.cc = perf_get_cc();
+    const double t1 = host_us();
+    s.us = (t0 + t1) / 2;
+    s.err_us = (t1 - t0) / 2;
+    return s;
+  }
+
+  // use the cached fclk for this bitstream if there is one, so that startup
+  // does not wait for a calibration. otherwise calibrate now.
+  void init_fclk() {
+    if(!m_calibrate) {
+      return;
+    }
+    float fclk;
+    double err;
+    if(load_fclk_cache(fclk_cache_path(), fclk_cache_key(), fclk, err)) {
+      m_fclk = fclk;
+      m_fclk_err = err;
+      m_fclk_cache_err = err;
+    } else {
+      measure_fclk();
+    }
+  }
+
+  // refine fclk from a period the cycle counter ran for real work, done
+  // inline when the counter is stopped and cheap enough for the run path.
+  // each period gives an fclk range; overlapping ranges are intersected to
+  // tighten the estimate, a disjoint one means the cached value is stale and
+  // replaces it. save_fclk writes the estimate to the cache once it changed
+  // that way or became twice as accurate as the cached one.
+  void refine_fclk(uint64_t cycles, double us, double err_us) {
+    if(cycles == 0 || us <= err_us) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(m_fclk_lock);
+    const double f = cycles / us, err = err_us / us + 1.0 / cycles;
+    const double lo = f * (1 - err), hi = f * (1 + err);
+    const double cur = m_fclk;
+    const double clo = cur * (1 - m_fclk_err), chi = cur * (1 + m_fclk_err);
+    const bool stale = (hi < clo) || (lo > chi);
+    const double nlo = stale ? lo : (lo > clo ? lo : clo);
+    const double nhi = stale ? hi : (hi < chi ? hi : chi);
+    m_fclk = (nlo + nhi) / 2;
+    m_fclk_err = (nhi - nlo) / (nhi + nlo);
+    if(stale || m_fclk_err < m_fclk_cache_err / 2) {
+      m_fclk_dirty = true;
+    }
+  }
 
   // get the instantiated hardware config from accelerator
   void update_hw_cfg() {
+    m_signature = m_accel->get_signature();
     m_cfg.accWidth = m_accel->get_hw_accWidth();
     m_cfg.cmdQueueEntries = m_accel->get_hw_cmdQueueEntries();
     m_cfg.dpaDimCommon = m_accel->get_hw_dpaDimCommon();
@@ -0,0 +1,138 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef BitSerialMatMulAutotuner_H
+#define BitSerialMatMulAutotuner_H
+
+#include <cassert>
+#include <memory>
+#include <vector>
+#include "BitSerialMatMulAccelDriver.hpp"
+#include "BitSerialMatMulExecutor.hpp"
+#include "BitSerialMatMulPlan.hpp"
+#include "gemmbitserial/gemmbitserial.hpp"
+
+// measured runtime of one schedule config
+typedef struct {
+  ScheduleCfg sc;
+  uint64_t cycles;
+  // whether all timed runs gave the results of the first candidate
+  bool ok;
+} TuningResult;
+
+// The BitSerialMatMulAutotuner picks the schedule config for a shape by
+// timing every legal candidate on the accelerator with the cycle counter,
+// instead of relying on the DRAM traffic cost model. The winner goes into the
+// BitSerialMatMulTuningDB, so that plans built for the shape from then on use
+// it, and can be saved to disk. Runs equally against the emulation build, so
+// shapes can be tuned offline for an overlay before deploying it.
+class BitSerialMatMulAutotuner {
+public:
+  BitSerialMatMulAutotuner(
+    BitSerialMatMulAccelDriver * acc, WrapperRegDriver * platform,
+    // timed runs per candidate, the fastest one counts
+    unsigned int reps = 3
+  ) {
+    assert(reps >= 1);
+    m_acc = acc;
+    m_platform = platform;
+    m_reps = reps;
+  }
+
+  // time all candidates for the shape and record the fastest. the operand
+  // data does not affect the runtime, so the shape's matrices are used as is.
+  // all runs share one executor; each waits for its own results, see
+  // BitSerialMatMulAccelDriver::claim_result_bytes. a candidate whose results
+  // differ from those of the first one is timed but not picked.
+  // the plan cache is updated, so new executors of the shape use the winner.
+  TuningEntry tune(gemmbitserial::GEMMContext & shape) {
+    const HardwareCfg & hw = m_acc->hwcfg();
+    BitSerialMatMulExecutor exec(shape, m_acc, m_platform);
+    exec.setLHS(shape.lhs);
+    exec.setRHS(shape.rhs);
+    std::vector<ScheduleCfg> cands = exec.getPlan()->candidateScheduleCfgs();
+    std::shared_ptr<const BitSerialMatMulPlan> best;
+    uint64_t best_cycles = 0;
+    const size_t nres = shape.lhs.nrows * shape.rhs.nrows;
+    std::vector<ResultType> ref, res(nres);
+    m_results.clear();
+    for(auto & sc : cands) {
+      std::shared_ptr<const BitSerialMatMulPlan> plan(
+        new BitSerialMatMulPlan(shape, hw, sc)
+      );
+      exec.setPlan(plan);
+      TuningResult r;
+      r.sc = sc;
+      r.cycles = 0;
+      r.ok = true;
+      for(unsigned int i = 0; i < m_reps; i++) {
+        // time the cold plan, without tiles left over from the previous rep
+        m_acc->setBRAMOwner(0);
+        exec.run();
+        uint64_t cycles = exec.getLastRuntimeCycles();
+        if(i == 0 || cycles < r.cycles) {
+          r.cycles = cycles;
+        }
+        exec.getRes(res.data());
+        if(ref.empty()) {
+          ref = res;
+        }
+        r.ok &= (res == ref);
+      }
+      // ties go to the earlier candidate, as in the cost model
+      if(r.ok && (!best || r.cycles < best_cycles)) {
+        best = plan;
+        best_cycles = r.cycles;
+      }
+      m_results.push_back(r);
+    }
+    assert(best);
+    TuningEntry e;
+    e.sc = best->scheduleCfg();
+    e.cycles = best_cycles;
+    BitSerialMatMulTuningDB::instance().put(shape, hw, e);
+    BitSerialMatMulPlanCache::instance().insert(best);
+    return e;
+  }
+
+  // runtime of each candidate in the last tune(), in candidate order
+  const std::vector<TuningResult> & lastResults() const {
+    return m_results;
+  }
+
+protected:
+  BitSerialMatMulAccelDriver * m_acc;
+  WrapperRegDriver * m_platform;
+  unsigned int m_reps;
+  std::vector<TuningResult> m_results;
+};
+
+#endif
@@ -0,0 +1,434 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef BitSerialMatMulBenchmark_H
+#define BitSerialMatMulBenchmark_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "BitSerialMatMulAccelDriver.hpp"
+#include "BitSerialMatMulExecutor.hpp"
+#include "BitSerialMatMulPacker.hpp"
+#include "gemmbitserial/gemmbitserial.hpp"
+
+// sweep benchmark: times the phases of a GEMM (pack, upload, run, readback)
+// over the cross product of the shapes and bit widths in a config file, and
+// compares the run cycles against a baseline from an earlier build.
+//
+// config files have one key per line followed by its values, and # comments:
+//   lhsrows 64 256
+//   depth 1024 4096
+//   rhsrows 64
+//   lhsbits 1 2
+//   rhsbits 1 2
+//   lhssigned 0
+//   rhssigned 0 1
+//   warmup 2
+//   reps 10
+#define BENCH_DEFAULT_WARMUP        1
+#define BENCH_DEFAULT_REPS          5
+// relative increase of the median run cycles that counts as a regression
+#define BENCH_DEFAULT_THRESHOLD     0.05
+
+typedef struct {
+  size_t lhsRows, depth, rhsRows, lhsBits, rhsBits;
+  bool lhsSigned, rhsSigned;
+} BenchmarkShape;
+
+typedef struct {
+  std::vector<BenchmarkShape> shapes;
+  size_t warmup, reps;
+} BenchmarkConfig;
+
+// median and 99th percentile over the repetitions
+typedef struct {
+  uint64_t median, p99;
+} BenchmarkStat;
+
+typedef enum {
+  benchPack = 0, benchUpload, benchRun, benchReadback
+} BenchmarkPhase;
+#define N_BENCH_PHASES              4
+
+typedef struct {
+  BenchmarkShape shape;
+  size_t reps;
+  // run cycles, and wall time in ns for each BenchmarkPhase
+  BenchmarkStat cycles;
+  BenchmarkStat ns[N_BENCH_PHASES];
+  // binary GOPS at the median run cycles
+  float binaryGOPS;
+  // whether every repetition produced the right result
+  bool ok;
+} BenchmarkResult;
+
+static inline const char * getBenchmarkPhaseName(BenchmarkPhase p) {
+  switch(p) {
+    case benchPack: return "pack";
+    case benchUpload: return "upload";
+    case benchRun: return "run";
+    case benchReadback: return "readback";
+    default: return "unknown";
+  }
+}
+
+// identifies a shape in outputs and baselines, e.g. 64x1024x64:2b/1bs
+static inline std::string benchmarkShapeName(const BenchmarkShape & s) {
+  std::ostringstream o;
+  o << s.lhsRows << "x" << s.depth << "x" << s.rhsRows << ":";
+  o << s.lhsBits << "b" << (s.lhsSigned ? "s" : "") << "/";
+  o << s.rhsBits << "b" << (s.rhsSigned ? "s" : "");
+  return o.str();
+}
+
+// parse a sweep config, false on unknown keys or malformed values
+static inline bool parseBenchmarkConfig(const std::string & text, BenchmarkConfig & cfg) {
+  std::map<std::string, std::vector<size_t>> keys {
+    {"lhsrows", {}}, {"depth", {}}, {"rhsrows", {}}, {"lhsbits", {1}},
+    {"rhsbits", {1}}, {"lhssigned", {0}}, {"rhssigned", {0}},
+    {"warmup", {BENCH_DEFAULT_WARMUP}}, {"reps", {BENCH_DEFAULT_REPS}}
+  };
+  std::istringstream in(text);
+  std::string line;
+  while(std::getline(in, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream l(line);
+    std::string key;
+    if(!(l >> key)) {
+      continue;
+    }
+    if(!keys.count(key)) {
+      return false;
+    }
+    std::vector<size_t> values;
+    long long v;
+    while(l >> v) {
+      if(v < 0) {
+        return false;
+      }
+      values.push_back((size_t) v);
+    }
+    if(!l.eof() || values.empty()) {
+      return false;
+    }
+    keys[key] = values;
+  }
+  for(auto & k : keys) {
+    if(k.second.empty()) {
+      return false;
+    }
+  }
+  if(keys["warmup"].size() != 1 || keys["reps"].size() != 1 || keys["reps"][0] == 0) {
+    return false;
+  }
+  cfg.warmup = keys["warmup"][0];
+  cfg.reps = keys["reps"][0];
+  cfg.shapes.clear();
+  for(size_t m : keys["lhsrows"])
+  for(size_t k : keys["depth"])
+  for(size_t n : keys["rhsrows"])
+  for(size_t lb : keys["lhsbits"])
+  for(size_t rb : keys["rhsbits"])
+  for(size_t ls : keys["lhssigned"])
+  for(size_t rs : keys["rhssigned"]) {
+    // the packer takes 8-bit values
+    if(m == 0 || k == 0 || n == 0 || lb < 1 || lb > 8 || rb < 1 || rb > 8) {
+      return false;
+    }
+    cfg.shapes.push_back({m, k, n, lb, rb, ls != 0, rs != 0});
+  }
+  return true;
+}
+
+static inline bool loadBenchmarkConfig(const char * path, BenchmarkConfig & cfg) {
+  FILE * f = fopen(path, "r");
+  if(!f) {
+    return false;
+  }
+  std::string text;
+  char buf[4096];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    text.append(buf, n);
+  }
+  fclose(f);
+  return parseBenchmarkConfig(text, cfg);
+}
+
+// nearest-rank median and 99th percentile
+static inline BenchmarkStat benchmarkStat(std::vector<uint64_t> v) {
+  BenchmarkStat s = {0, 0};
+  if(v.empty()) {
+    return s;
+  }
+  std::sort(v.begin(), v.end());
+  s.median = v[(v.size() - 1) / 2];
+  s.p99 = v[(size_t) std::ceil(0.99 * v.size()) - 1];
+  return s;
+}
+
+// run one shape for warmup + reps repetitions on random data, checking each
+// result against the CPU. the repetitions reuse one executor without a reset
+// in between, each run waits for its own results, see
+// BitSerialMatMulAccelDriver::claim_result_bytes. they alternate between two
+// input sets, so a run that returned before its results were written shows
+// up as a mismatch instead of passing with those of the previous run.
+static inline BenchmarkResult runBenchmark(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc,
+  const BenchmarkShape & s, size_t warmup, size_t reps
+) {
+  typedef std::chrono::steady_clock clk;
+  auto ns = [](clk::time_point a, clk::time_point b) -> uint64_t {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(b - a).count();
+  };
+  BenchmarkResult r;
+  r.shape = s;
+  r.reps = reps;
+  r.ok = true;
+  gemmbitserial::GEMMContext ctx = acc->allocGEMMContext(
+    s.lhsRows, s.depth, s.rhsRows, s.lhsBits, s.rhsBits, s.lhsSigned, s.rhsSigned
+  );
+  std::vector<ResultType> res(s.lhsRows * s.rhsRows);
+  std::vector<uint8_t> lhs[2], rhs[2];
+  std::vector<ResultType> expected[2];
+  for(int k = 0; k < 2; k++) {
+    lhs[k].resize(s.lhsRows * s.depth);
+    rhs[k].resize(s.rhsRows * s.depth);
+    for(auto & v : lhs[k]) {
+      v = rand() % (1 << s.lhsBits);
+    }
+    for(auto & v : rhs[k]) {
+      v = rand() % (1 << s.rhsBits);
+    }
+    ctx.lhs.importRegular(lhs[k].data());
+    ctx.rhs.importRegular(rhs[k].data());
+    gemmbitserial::gemmBitSerial(ctx);
+    expected[k].assign(ctx.res, ctx.res + res.size());
+  }
+  BitSerialMatMulExecutor * runner = new BitSerialMatMulExecutor(ctx, acc, platform);
+  std::vector<uint64_t> cycles, phase_ns[N_BENCH_PHASES];
+  for(size_t i = 0; i < warmup + reps; i++) {
+    const size_t k = i % 2;
+    clk::time_point t0 = clk::now();
+    gemmbitserial::BitSerialMatrix lhsT = runner->lhsTarget();
+    gemmbitserial::BitSerialMatrix rhsT = runner->rhsTarget();
+    packBitSerial(lhs[k].data(), lhsT);
+    packBitSerial(rhs[k].data(), rhsT);
+    clk::time_point t1 = clk::now();
+    runner->commitLHS();
+    runner->commitRHS();
+    clk::time_point t2 = clk::now();
+    runner->run();
+    clk::time_point t3 = clk::now();
+    runner->getRes(res.data());
+    clk::time_point t4 = clk::now();
+    r.ok &= (res == expected[k]);
+    if(i >= warmup) {
+      cycles.push_back(runner->getLastRuntimeCycles());
+      phase_ns[benchPack].push_back(ns(t0, t1));
+      phase_ns[benchUpload].push_back(ns(t1, t2));
+      phase_ns[benchRun].push_back(ns(t2, t3));
+      phase_ns[benchReadback].push_back(ns(t3, t4));
+    }
+  }
+  r.cycles = benchmarkStat(cycles);
+  for(int p = 0; p < N_BENCH_PHASES; p++) {
+    r.ns[p] = benchmarkStat(phase_ns[p]);
+  }
+  r.binaryGOPS = r.cycles.median == 0 ? 0 :
+    runner->getWorkloadBinaryOpCount(false) / (r.cycles.median * runner->getNanosecondsPerCycle());
+  delete runner;
+  gemmbitserial::deallocGEMMContext(ctx);
+  return r;
+}
+
+static inline std::vector<BenchmarkResult> runBenchmarkSweep(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc,
+  const BenchmarkConfig & cfg
+) {
+  std::vector<BenchmarkResult> ret;
+  for(auto & s : cfg.shapes) {
+    ret.push_back(runBenchmark(platform, acc, s, cfg.warmup, cfg.reps));
+  }
+  return ret;
+}
+
+static inline std::string benchmarkCSVHeader() {
+  std::ostringstream o;
+  o << "shape,lhsRows,depth,rhsRows,lhsBits,rhsBits,lhsSigned,rhsSigned,reps,";
+  o << "cycles_median,cycles_p99";
+  for(int p = 0; p < N_BENCH_PHASES; p++) {
+    const char * n = getBenchmarkPhaseName((BenchmarkPhase) p);
+    o << "," << n << "_ns_median," << n << "_ns_p99";
+  }
+  o << ",binaryGOPS,ok";
+  return o.str();
+}
+
+static inline std::string benchmarkCSVRow(const BenchmarkResult & r) {
+  const BenchmarkShape & s = r.shape;
+  std::ostringstream o;
+  o << benchmarkShapeName(s) << "," << s.lhsRows << "," << s.depth << ",";
+  o << s.rhsRows << "," << s.lhsBits << "," << s.rhsBits << ",";
+  o << s.lhsSigned << "," << s.rhsSigned << "," << r.reps << ",";
+  o << r.cycles.median << "," << r.cycles.p99;
+  for(int p = 0; p < N_BENCH_PHASES; p++) {
+    o << "," << r.ns[p].median << "," << r.ns[p].p99;
+  }
+  o << "," << r.binaryGOPS << "," << r.ok;
+  return o.str();
+}
+
+static inline std::string benchmarkCSV(const std::vector<BenchmarkResult> & results) {
+  std::string ret = benchmarkCSVHeader() + "\n";
+  for(auto & r : results) {
+    ret += benchmarkCSVRow(r) + "\n";
+  }
+  return ret;
+}
+
+static inline std::string benchmarkJSON(const std::vector<BenchmarkResult> & results) {
+  std::ostringstream o;
+  o << "[";
+  for(size_t i = 0; i < results.size(); i++) {
+    const BenchmarkResult & r = results[i];
+    const BenchmarkShape & s = r.shape;
+    o << (i ? ",\n" : "\n") << "{\"shape\": \"" << benchmarkShapeName(s) << "\"";
+    o << ", \"lhsRows\": " << s.lhsRows << ", \"depth\": " << s.depth;
+    o << ", \"rhsRows\": " << s.rhsRows << ", \"lhsBits\": " << s.lhsBits;
+    o << ", \"rhsBits\": " << s.rhsBits;
+    o << ", \"lhsSigned\": " << (s.lhsSigned ? "true" : "false");
+    o << ", \"rhsSigned\": " << (s.rhsSigned ? "true" : "false");
+    o << ", \"reps\": " << r.reps;
+    o << ", \"cycles\": {\"median\": " << r.cycles.median << ", \"p99\": " << r.cycles.p99 << "}";
+    for(int p = 0; p < N_BENCH_PHASES; p++) {
+      o << ", \"" << getBenchmarkPhaseName((BenchmarkPhase) p) << "_ns\": {\"median\": ";
+      o << r.ns[p].median << ", \"p99\": " << r.ns[p].p99 << "}";
+    }
+    o << ", \"binaryGOPS\": " << r.binaryGOPS;
+    o << ", \"ok\": " << (r.ok ? "true" : "false") << "}";
+  }
+  o << "\n]\n";
+  return o.str();
+}
+
+static inline bool writeBenchmarkFile(const char * path, const std::string & text) {
+  FILE * f = fopen(path, "w");
+  if(!f) {
+    return false;
+  }
+  bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+  ok &= fclose(f) == 0;
+  return ok;
+}
+
+// median run cycles by shape name from a CSV written by benchmarkCSV
+static inline bool loadBenchmarkBaseline(
+  const char * path, std::map<std::string, uint64_t> & baseline
+) {
+  FILE * f = fopen(path, "r");
+  if(!f) {
+    return false;
+  }
+  std::string text;
+  char buf[4096];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    text.append(buf, n);
+  }
+  fclose(f);
+  std::istringstream in(text);
+  std::string line;
+  // locate the columns from the header
+  if(!std::getline(in, line)) {
+    return false;
+  }
+  std::vector<std::string> header;
+  std::istringstream h(line);
+  std::string col;
+  while(std::getline(h, col, ',')) {
+    header.push_back(col);
+  }
+  const size_t cyc = std::find(header.begin(), header.end(), "cycles_median") - header.begin();
+  if(header.empty() || header[0] != "shape" || cyc == header.size()) {
+    return false;
+  }
+  baseline.clear();
+  while(std::getline(in, line)) {
+    std::vector<std::string> cols;
+    std::istringstream l(line);
+    while(std::getline(l, col, ',')) {
+      cols.push_back(col);
+    }
+    if(cols.size() == header.size()) {
+      baseline[cols[0]] = strtoull(cols[cyc].c_str(), 0, 10);
+    }
+  }
+  return true;
+}
+
+// print the change in median run cycles against the baseline for each
+// shape, and return the number of shapes slower than baseline * (1 +
+// threshold) or with wrong results
+static inline size_t compareBenchmarkBaseline(
+  const std::vector<BenchmarkResult> & results,
+  const std::map<std::string, uint64_t> & baseline, double threshold,
+  std::ostream & o
+) {
+  size_t regressions = 0;
+  for(auto & r : results) {
+    const std::string name = benchmarkShapeName(r.shape);
+    o << name << ": " << r.cycles.median << " cycles";
+    auto b = baseline.find(name);
+    bool bad = !r.ok;
+    if(b == baseline.end() || b->second == 0) {
+      o << ", no baseline";
+    } else {
+      const double change = ((double) r.cycles.median - b->second) / b->second;
+      o << ", baseline " << b->second << " (" << (change >= 0 ? "+" : "") << 100 * change << "%)";
+      bad |= change > threshold;
+    }
+    if(!r.ok) {
+      o << ", WRONG RESULT";
+    }
+    o << (bad ? " REGRESSION" : "") << std::endl;
+    regressions += bad ? 1 : 0;
+  }
+  return regressions;
+}
+
+#endif
@@ -0,0 +1,186 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef BitSerialMatMulBufferPool_H
+#define BitSerialMatMulBufferPool_H
+
+#include <cassert>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <vector>
+#include "BitSerialMatMulAccelDriver.hpp"
+
+// statistics for a BitSerialMatMulBufferPool
+typedef struct {
+  // number of alloc calls, and how many were served from the free lists
+  uint64_t requests;
+  uint64_t hits;
+  // number of buffers allocated from the platform
+  uint64_t platform_allocs;
+  // bytes requested by live buffers, and their size class bytes
+  uint64_t in_use_bytes;
+  uint64_t reserved_bytes;
+  // bytes in free lists, allocated from the platform but unused
+  uint64_t cached_bytes;
+  // high-water marks
+  uint64_t peak_in_use_bytes;
+  uint64_t peak_held_bytes;
+} BufferPoolStats;
+
+// A BitSerialMatMulBufferPool hands out accelerator buffers from per-size-class
+// free lists, so that executors for a stream of varied shapes reuse buffers
+// instead of going to the platform allocator every time. Sizes are rounded up
+// to classes of 1x and 1.5x powers of two that are multiples of FETCH_ALIGN.
+// Buffers are returned to the platform only by trim() or the destructor.
+class BitSerialMatMulBufferPool {
+public:
+  BitSerialMatMulBufferPool(WrapperRegDriver * platform) {
+    m_platform = platform;
+    m_stats = BufferPoolStats();
+  }
+
+  ~BitSerialMatMulBufferPool() {
+    trim();
+  }
+
+  void * alloc(size_t bytes) {
+    const size_t cls = sizeClass(bytes);
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_stats.requests++;
+    void * ret;
+    std::vector<void *> & freelist = m_free[cls];
+    if(!freelist.empty()) {
+      ret = freelist.back();
+      freelist.pop_back();
+      m_stats.hits++;
+      m_stats.cached_bytes -= cls;
+    } else {
+      BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+      ret = m_platform->allocAccelBuffer(cls);
+      assert(((uint64_t) ret) % FETCH_ALIGN == 0);
+      m_stats.platform_allocs++;
+    }
+    m_live[ret] = std::make_pair(bytes, cls);
+    m_stats.in_use_bytes += bytes;
+    m_stats.reserved_bytes += cls;
+    m_stats.peak_in_use_bytes = max(m_stats.peak_in_use_bytes, m_stats.in_use_bytes);
+    m_stats.peak_held_bytes = max(m_stats.peak_held_bytes, heldBytes());
+    return ret;
+  }
+
+  void free(void * buf) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    auto it = m_live.find(buf);
+    assert(it != m_live.end());
+    const size_t bytes = it->second.first;
+    const size_t cls = it->second.second;
+    m_live.erase(it);
+    m_free[cls].push_back(buf);
+    m_stats.in_use_bytes -= bytes;
+    m_stats.reserved_bytes -= cls;
+    m_stats.cached_bytes += cls;
+  }
+
+  // return all unused buffers to the platform
+  void trim() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    for(auto & f : m_free) {
+      for(auto & buf : f.second) {
+        m_platform->deallocAccelBuffer(buf);
+      }
+      f.second.clear();
+    }
+    m_stats.cached_bytes = 0;
+  }
+
+  BufferPoolStats getStats() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_stats;
+  }
+
+  // fraction of alloc calls served without going to the platform
+  float getHitRate() {
+    BufferPoolStats s = getStats();
+    return s.requests == 0 ? 0 : (float) s.hits / s.requests;
+  }
+
+  // fraction of the accelerator memory held by the pool that is not used
+  // by live buffers, from size class rounding and from cached buffers
+  float getFragmentation() {
+    BufferPoolStats s = getStats();
+    const uint64_t held = s.reserved_bytes + s.cached_bytes;
+    return held == 0 ? 0 : 1 - (float) s.in_use_bytes / held;
+  }
+
+  void printStats() {
+    BufferPoolStats s = getStats();
+    std::cout << "Buffer pool: " << s.requests << " requests, ";
+    std::cout << 100 * getHitRate() << "% hits, ";
+    std::cout << s.platform_allocs << " platform allocs" << std::endl;
+    std::cout << "In use: " << s.in_use_bytes << " bytes (peak " << s.peak_in_use_bytes << ")";
+    std::cout << ", held: " << s.reserved_bytes + s.cached_bytes << " bytes (peak " << s.peak_held_bytes << ")";
+    std::cout << ", fragmentation: " << 100 * getFragmentation() << "%" << std::endl;
+  }
+
+  // size class for a request of given bytes
+  static size_t sizeClass(size_t bytes) {
+    if(bytes <= FETCH_ALIGN) {
+      return FETCH_ALIGN;
+    }
+    size_t p = FETCH_ALIGN;
+    while(p < bytes) {
+      p *= 2;
+    }
+    // the 1.5x class between p/2 and p, if it is aligned
+    const size_t mid = p / 2 + p / 4;
+    if(bytes <= mid && mid % FETCH_ALIGN == 0) {
+      return mid;
+    }
+    return p;
+  }
+
+protected:
+  WrapperRegDriver * m_platform;
+  std::mutex m_lock;
+  // free buffers for each size class
+  std::map<size_t, std::vector<void *>> m_free;
+  // live buffers: requested bytes and size class
+  std::map<void *, std::pair<size_t, size_t>> m_live;
+  BufferPoolStats m_stats;
+
+  uint64_t heldBytes() const {
+    return m_stats.reserved_bytes + m_stats.cached_bytes;
+  }
+};
+
+#endif
@@ -0,0 +1,198 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef BitSerialMatMulEpilogue_H
+#define BitSerialMatMulEpilogue_H
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include "BitSerialMatMulAccelDriver.hpp"
+#include "BitSerialMatMulPacker.hpp"
+#include "BitSerialMatMulThreads.hpp"
+#include "gemmbitserial/gemmbitserial.hpp"
+
+// post-processing of the GEMM result into a k-bit activation for the next
+// layer. result rows are RHS rows and channels are LHS rows. each output is
+//   y = (acc + bias[c]) * channelScale[c] * scale
+//   out = round(clamp(y, clampLo, clampHi)) + zeroPoint
+// saturated to the nbits range. if thresholds are given, they replace the
+// above and out is the number of thresholds that acc + bias[c] reaches,
+// offset by -2^(nbits-1) for signed outputs.
+typedef struct {
+  // per-channel bias, or 0
+  const int32_t * bias;
+  // per-channel scale, or 0, and a scale for all channels
+  const float * channelScale;
+  float scale;
+  // activation clamp on the scaled value, e.g. clampLo = 0 for ReLU
+  float clampLo;
+  float clampHi;
+  int32_t zeroPoint;
+  // output precision, at most 8 bits
+  uint32_t nbits;
+  bool outSigned;
+  // 2^nbits - 1 ascending thresholds per channel, or 0
+  const int32_t * thresholds;
+  // worker threads, 0 for one per hardware thread
+  unsigned threads;
+} EpilogueCfg;
+
+// an epilogue that only requantizes to nbits, fields can then be customized
+static inline EpilogueCfg makeEpilogueCfg(uint32_t nbits, bool outSigned) {
+  EpilogueCfg cfg;
+  cfg.bias = 0;
+  cfg.channelScale = 0;
+  cfg.scale = 1.0f;
+  cfg.clampLo = -INFINITY;
+  cfg.clampHi = INFINITY;
+  cfg.zeroPoint = 0;
+  cfg.nbits = nbits;
+  cfg.outSigned = outSigned;
+  cfg.thresholds = 0;
+  cfg.threads = 0;
+  return cfg;
+}
+
+static inline int32_t epilogueMinOut(const EpilogueCfg & cfg) {
+  return cfg.outSigned ? -(1 << (cfg.nbits - 1)) : 0;
+}
+
+static inline int32_t epilogueMaxOut(const EpilogueCfg & cfg) {
+  return cfg.outSigned ? (1 << (cfg.nbits - 1)) - 1 : (1 << cfg.nbits) - 1;
+}
+
+// apply the epilogue to one row of cols results
+static inline void epilogueRow(
+  const ResultType * src, int8_t * dst, size_t cols, const EpilogueCfg & cfg
+) {
+  if(cfg.thresholds) {
+    const size_t nthres = (1 << cfg.nbits) - 1;
+    const int32_t offset = epilogueMinOut(cfg);
+    for(size_t c = 0; c < cols; c++) {
+      const int32_t v = src[c] + (cfg.bias ? cfg.bias[c] : 0);
+      const int32_t * t = &cfg.thresholds[c * nthres];
+      int32_t cnt = 0;
+      for(size_t i = 0; i < nthres; i++) {
+        cnt += (v >= t[i]);
+      }
+      dst[c] = (int8_t)(cnt + offset);
+    }
+    return;
+  }
+  // fold the output range into the clamp, so that rounding and adding the
+  // zero point cannot leave the nbits range
+  const float qlo = (float)(epilogueMinOut(cfg) - cfg.zeroPoint);
+  const float qhi = (float)(epilogueMaxOut(cfg) - cfg.zeroPoint);
+  const float lo = cfg.clampLo > qlo ? cfg.clampLo : qlo;
+  const float hi = cfg.clampHi < qhi ? cfg.clampHi : qhi;
+  size_t c = 0;
+#if defined(__SSE2__)
+  const __m128 vscale = _mm_set1_ps(cfg.scale);
+  const __m128 vlo = _mm_set1_ps(lo), vhi = _mm_set1_ps(hi);
+  const __m128i vzp = _mm_set1_epi32(cfg.zeroPoint);
+  for(; c + 4 <= cols; c += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i *) &src[c]);
+    if(cfg.bias) {
+      a = _mm_add_epi32(a, _mm_loadu_si128((const __m128i *) &cfg.bias[c]));
+    }
+    __m128 cs = cfg.channelScale ? _mm_loadu_ps(&cfg.channelScale[c]) : _mm_set1_ps(1.0f);
+    __m128 y = _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(a), cs), vscale);
+    y = _mm_min_ps(_mm_max_ps(y, vlo), vhi);
+    __m128i q = _mm_add_epi32(_mm_cvtps_epi32(y), vzp);
+    // keep the low byte of each value, unsigned 8-bit outputs do not fit
+    // the signed saturation of _mm_packs_epi16
+    q = _mm_packs_epi32(q, q);
+    q = _mm_packus_epi16(_mm_and_si128(q, _mm_set1_epi16(0xff)), q);
+    int32_t w = _mm_cvtsi128_si32(q);
+    memcpy(&dst[c], &w, sizeof(w));
+  }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  const float32x4_t vscale = vdupq_n_f32(cfg.scale);
+  const float32x4_t vlo = vdupq_n_f32(lo), vhi = vdupq_n_f32(hi);
+  const int32x4_t vzp = vdupq_n_s32(cfg.zeroPoint);
+  for(; c + 4 <= cols; c += 4) {
+    int32x4_t a = vld1q_s32(&src[c]);
+    if(cfg.bias) {
+      a = vaddq_s32(a, vld1q_s32(&cfg.bias[c]));
+    }
+    float32x4_t cs = cfg.channelScale ? vld1q_f32(&cfg.channelScale[c]) : vdupq_n_f32(1.0f);
+    float32x4_t y = vmulq_f32(vmulq_f32(vcvtq_f32_s32(a), cs), vscale);
+    y = vminq_f32(vmaxq_f32(y, vlo), vhi);
+    int32x4_t q = vaddq_s32(neonRound(y), vzp);
+    int16x4_t h = vmovn_s32(q);
+    int8x8_t b = vmovn_s16(vcombine_s16(h, h));
+    int32_t w = vget_lane_s32(vreinterpret_s32_s8(b), 0);
+    memcpy(&dst[c], &w, sizeof(w));
+  }
+#endif
+  for(; c < cols; c++) {
+    const int32_t a = src[c] + (cfg.bias ? cfg.bias[c] : 0);
+    float y = (float) a * (cfg.channelScale ? cfg.channelScale[c] : 1.0f) * cfg.scale;
+    y = y < lo ? lo : y;
+    y = y > hi ? hi : y;
+    dst[c] = (int8_t)(lrintf(y) + cfg.zeroPoint);
+  }
+}
+
+// apply the epilogue to a rows x cols result with srcStride elements per row,
+// writing k-bit values into toQ (rows x cols) and/or bit-serial matrix toBS
+static inline void runEpilogue(
+  const ResultType * src, size_t srcStride, size_t rows, size_t cols,
+  const EpilogueCfg & cfg, int8_t * toQ, gemmbitserial::BitSerialMatrix * toBS
+) {
+  assert(cfg.nbits >= 1 && cfg.nbits <= 8);
+  if(toBS) {
+    assert(toBS->nrows == rows && toBS->ncols == cols);
+    assert(toBS->nbits == cfg.nbits && toBS->issigned == cfg.outSigned);
+    // clear the alignment rows, all other words are written below
+    for(size_t b = 0; b < toBS->nbits; b++) {
+      for(size_t r = rows; r < toBS->nrows_a; r++) {
+        memset(toBS->rowptr(b, r), 0, toBS->wordsPerRow() * sizeof(uint64_t));
+      }
+    }
+  }
+  parallelRows(rows, cols, cfg.threads, [&](size_t begin, size_t end) {
+    // staging for one row when only a bit-serial output is wanted
+    std::vector<int8_t> rowbuf(toQ ? 0 : cols);
+    for(size_t r = begin; r < end; r++) {
+      int8_t * q = toQ ? &toQ[r * cols] : rowbuf.data();
+      epilogueRow(&src[r * srcStride], q, cols, cfg);
+      if(toBS) {
+        packBitSerialRow(q, cols, *toBS, r);
+      }
+    }
+  });
+}
+
+#endif
@@ -29,140 +29,346 @@
 // OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#ifndef BitSerialMatMulExecutor_H
+#define BitSerialMatMulExecutor_H
+
 #include <cassert>
 #include <vector>
 #include <iomanip>
 #include <iostream>
 #include "BitSerialMatMulAccelDriver.hpp"
+#include "BitSerialMatMulBufferPool.hpp"
+#include "BitSerialMatMulEpilogue.hpp"
+#include "BitSerialMatMulMetrics.hpp"
+#include "BitSerialMatMulOperand.hpp"
+#include "BitSerialMatMulPerfReport.hpp"
+#include "BitSerialMatMulPlan.hpp"
+#include "BitSerialMatMulResultLayout.hpp"
 #include "gemmbitserial/gemmbitserial.hpp"
 
-#define min(x,y) (x < y ? x : y)
-#define max(x,y) (x > y ? x : y)
-#define INVALID_CACHE_ENTRY         (uint64_t) -1
+// completion handle for a GEMM started with runAsync()
+class BitSerialMatMulCompletion {
+public:
+  BitSerialMatMulCompletion() {
+  }
+
+  BitSerialMatMulCompletion(std::shared_future<void> f) {
+    m_done = f;
+  }
+
+  // whether the GEMM has finished, does not block
+  bool poll() const {
+    return !m_done.valid() ||
+      m_done.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  }
+
+  // block until the GEMM has finished
+  void wait() const {
+    if(m_done.valid()) {
+      m_done.wait();
+    }
+  }
+
+protected:
+  std::shared_future<void> m_done;
+};
 
 // TODO:
-// - define own context allocator for the accelerator, including
-// alignment requirements for lhs/rhs.
 // - do not use entire GEMMContext, only need shape
 // - (idea) add lockstep execution mode for debug purposes?
 
 class BitSerialMatMulExecutor {
+  friend class BitSerialMatMulSession;
 public:
   BitSerialMatMulExecutor(
     gemmbitserial::GEMMContext & shape,
     BitSerialMatMulAccelDriver * acc,
-    WrapperRegDriver * platform
+    WrapperRegDriver * platform,
+    // set to false when running inside a BitSerialMatMulSession, which owns
+    // the accelerator state
+    bool prepareAccel = true,
+    // accel buffers come from this pool if given, else from the platform
+    BitSerialMatMulBufferPool * pool = 0
   ) {
     m_shape = shape;
     m_acc = acc;
     m_hwcfg = m_acc->hwcfg();
     m_platform = platform;
-    m_bytes_to_fetch = 0;
-    m_bytes_to_write = 0;
+    m_pool = pool;
     // TODO verify alignment etc for instantiated hardware dimensions
-    // allocate accelerator memory for given shape
-    m_accelLHS = m_platform->allocAccelBuffer(lhsBytes());
-    m_accelRHS = m_platform->allocAccelBuffer(rhsBytes());
-    m_accelRes = m_platform->allocAccelBuffer(resBytes());
-    // indicate that nothing is cached on-chip yet
-    for(unsigned int i = 0; i < FETCHEXEC_TOKENS; i++) {
-      m_cached_lhs.push_back(INVALID_CACHE_ENTRY);
-      m_cached_rhs.push_back(INVALID_CACHE_ENTRY);
-    }
-    // build schedule for each stage based on shape
-    build_schedule_trivial();
+    // allocate accelerator memory for given shape. the operand buffers are
+    // allocated on first use, since operands may be bound instead
+    m_accelLHS = 0;
+    m_accelRHS = 0;
+    m_accelRes = alloc_accel(resBytes());
+    // commands are pushed by the host unless DRAM commands are enabled
+    m_dram_cmds = false;
+    m_accelCmds = 0;
+    // packing targets are mapped views of accel memory, or staging buffers
+    // allocated on first use when accel memory is not host-visible
+    m_stagingLHS = 0;
+    m_stagingRHS = 0;
+    // get the instructions for this shape, only generated the first time
+    // a shape is seen on this hardware config
+    m_plan = BitSerialMatMulPlanCache::instance().get(m_shape, m_hwcfg);
+    m_run = m_plan;
+    // resolved once here, so recording never goes through the registry
+    m_metrics = BitSerialMatMulMetrics::instance().get(m_shape, m_hwcfg);
+    // nothing of ours is in BRAM yet
+    m_cached_lhs.assign(m_plan->cachedLHS().size(), INVALID_CACHE_ENTRY);
+    m_cached_rhs.assign(m_plan->cachedRHS().size(), INVALID_CACHE_ENTRY);
     // uncomment to see the generated instructions
     //printFetchQueue();
     //printExecQueue();
     clear_all_queue_pointers();
-    // prepare the accelerator for operation
-    m_acc->reset();
-    m_acc->init_resource_pools();
-    m_acc->set_stage_enables(1, 1, 1);
+    m_res_base = 0;
+    // no run yet, reports are all zeros until the first one
+    m_cycles = 0;
+    for(int i = 0; i < N_CTRL_STATES; i++) {
+      m_fetch_cstate_cycles[i] = 0;
+      m_exec_cstate_cycles[i] = 0;
+      m_result_cstate_cycles[i] = 0;
+    }
+    if(prepareAccel) {
+      // prepare the accelerator for operation
+      std::lock_guard<std::mutex> lock(m_acc->run_lock());
+      BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+      m_acc->reset();
+      m_acc->init_resource_pools();
+      m_acc->set_stage_enables(1, 1, 1);
+    }
   }
 
   ~BitSerialMatMulExecutor() {
+    // the feeder may still be using the buffers
+    waitPending();
     // deinitialize allocated memory
-    m_platform->deallocAccelBuffer(m_accelLHS);
-    m_platform->deallocAccelBuffer(m_accelRHS);
-    m_platform->deallocAccelBuffer(m_accelRes);
+    if(m_accelLHS) {
+      free_accel(m_accelLHS);
+    }
+    if(m_accelRHS) {
+      free_accel(m_accelRHS);
+    }
+    free_accel(m_accelRes);
+    if(m_accelCmds) {
+      free_accel(m_accelCmds);
+    }
+    delete [] m_stagingLHS;
+    delete [] m_stagingRHS;
+  }
+
+  // have the accelerator read the instructions from DRAM-resident command
+  // queues instead of pushing each one from the host
+  void setDRAMCommands(bool enable) {
+    m_dram_cmds = enable;
   }
 
   void setLHS(gemmbitserial::BitSerialMatrix from) {
+    waitPending();
     assert(m_shape.lhs.nrows_a == from.nrows_a);
     assert(m_shape.lhs.nbits == from.nbits);
     // copy host -> accel
-    m_platform->copyBufferHostToAccel(from.data, m_accelLHS, lhsBytes());
-    // invalidate cache
-    for(unsigned int i = 0; i < FETCHEXEC_TOKENS; i++) {
-      m_cached_lhs[i] = INVALID_CACHE_ENTRY;
-    }
+    BitSerialMatMulScopedTimer t(m_metrics->uploadNs);
+    upload(from.data, own_lhs(), lhsBytes());
+    set_lhs_operand(BitSerialMatMulOperandHandle());
   }
 
   void setRHS(gemmbitserial::BitSerialMatrix from) {
+    waitPending();
     assert(m_shape.rhs.nrows_a == from.nrows_a);
     assert(m_shape.rhs.nbits == from.nbits);
     // copy host -> accel
-    m_platform->copyBufferHostToAccel(from.data, m_accelRHS, rhsBytes());
-    // invalidate cache
-    for(unsigned int i = 0; i < FETCHEXEC_TOKENS; i++) {
-      m_cached_rhs[i] = INVALID_CACHE_ENTRY;
+    BitSerialMatMulScopedTimer t(m_metrics->uploadNs);
+    upload(from.data, own_rhs(), rhsBytes());
+    set_rhs_operand(BitSerialMatMulOperandHandle());
+  }
+
+  // use a device-resident operand as the LHS/RHS, no data is copied. the
+  // executor holds a reference until another operand is bound or set.
+  void bindLHS(BitSerialMatMulOperandHandle op) {
+    waitPending();
+    assert(op && op->matches(m_shape.lhs));
+    set_lhs_operand(op);
+  }
+
+  void bindRHS(BitSerialMatMulOperandHandle op) {
+    waitPending();
+    assert(op && op->matches(m_shape.rhs));
+    set_rhs_operand(op);
+  }
+
+  // matrices with the shape of the LHS/RHS operand to pack into, e.g. with
+  // importRegular, followed by commitLHS/commitRHS. when the platform maps
+  // accel memory into the host, these point straight into the accel buffers
+  // and packing writes the operand exactly once.
+  gemmbitserial::BitSerialMatrix lhsTarget() {
+    waitPending();
+    gemmbitserial::BitSerialMatrix m = m_shape.lhs;
+    m.data = target(own_lhs(), m_stagingLHS, lhsBytes());
+    return m;
+  }
+
+  gemmbitserial::BitSerialMatrix rhsTarget() {
+    waitPending();
+    gemmbitserial::BitSerialMatrix m = m_shape.rhs;
+    m.data = target(own_rhs(), m_stagingRHS, rhsBytes());
+    return m;
+  }
+
+  // make the data packed into lhsTarget()/rhsTarget() visible to the
+  // accelerator, only copies when accel memory is not mapped
+  void commitLHS() {
+    waitPending();
+    if(!m_acc->hostPtr(own_lhs(), lhsBytes())) {
+      assert(m_stagingLHS != 0);
+      BitSerialMatMulScopedTimer t(m_metrics->uploadNs);
+      upload(m_stagingLHS, m_accelLHS, lhsBytes());
     }
+    set_lhs_operand(BitSerialMatMulOperandHandle());
   }
 
-  void getRes(ResultType * to) {
-    // result alignment
-    size_t alignedResElems = m_shape.rhs.nrows_a * m_shape.lhs.nrows_a;
-    ResultType * host_res = new ResultType[alignedResElems];
-    // copy aligned result into host buffer
-    m_platform->copyBufferAccelToHost(m_accelRes, host_res, resBytes());
-    // copy all real data (non-alignment) parts of result
-    const size_t bpr = m_shape.lhs.nrows * sizeof(ResultType);
-    for(size_t i = 0; i < m_shape.rhs.nrows; i++) {
-      memcpy(
-        &to[i * m_shape.lhs.nrows], &host_res[i * m_shape.lhs.nrows_a], bpr
-      );
+  void commitRHS() {
+    waitPending();
+    if(!m_acc->hostPtr(own_rhs(), rhsBytes())) {
+      assert(m_stagingRHS != 0);
+      BitSerialMatMulScopedTimer t(m_metrics->uploadNs);
+      upload(m_stagingRHS, m_accelRHS, rhsBytes());
     }
-    delete [] host_res;
+    set_rhs_operand(BitSerialMatMulOperandHandle());
+  }
+
+  // read back the result in the given layout. to must hold
+  // lhs.nrows * rhs.nrows elements, or resBytes() for resPadded.
+  void getRes(ResultType * to, ResultLayout layout = resRowMajor) {
+    waitPending();
+    BitSerialMatMulScopedTimer t(m_metrics->readbackNs);
+    const size_t lhsRows = m_shape.lhs.nrows, lhsRowsA = m_shape.lhs.nrows_a;
+    const size_t rhsRows = m_shape.rhs.nrows;
+    if(layout == resPadded) {
+      download(m_accelRes, to, resBytes());
+      return;
+    }
+    const ResultType * src = (const ResultType *) m_acc->hostPtr(m_accelRes, resBytes());
+    if(!src && layout == resRowMajor && lhsRows == lhsRowsA) {
+      // no row padding, copy straight into place
+      download(m_accelRes, to, rhsRows * lhsRows * sizeof(ResultType));
+      return;
+    }
+    if(!src) {
+      // one bulk readback, then unpad or transpose on the host
+      src = host_res();
+    }
+    if(layout == resRowMajor) {
+      resultUnpadRows(src, lhsRowsA, to, rhsRows, lhsRows);
+    } else {
+      resultUnpadTranspose(src, lhsRowsA, to, rhsRows, lhsRows);
+    }
+  }
+
+  // read back the result and apply the epilogue in the same pass, giving
+  // one row of k-bit values per RHS row in to
+  void getRes(int8_t * to, const EpilogueCfg & cfg) {
+    waitPending();
+    BitSerialMatMulScopedTimer t(m_metrics->readbackNs);
+    runEpilogue(
+      host_res(), m_shape.lhs.nrows_a, m_shape.rhs.nrows, m_shape.lhs.nrows,
+      cfg, to, 0
+    );
+  }
+
+  // as above, but packed into a bit-serial matrix of rhs.nrows x lhs.nrows,
+  // e.g. the RHS operand of the next layer
+  void getRes(gemmbitserial::BitSerialMatrix & to, const EpilogueCfg & cfg) {
+    waitPending();
+    BitSerialMatMulScopedTimer t(m_metrics->readbackNs);
+    runEpilogue(
+      host_res(), m_shape.lhs.nrows_a, m_shape.rhs.nrows, m_shape.lhs.nrows,
+      cfg, 0, &to
+    );
   }
 
   void run() {
+    waitPending();
+    std::lock_guard<std::mutex> lock(m_acc->run_lock());
+    execute();
+  }
+
+  // start the GEMM and return right away. the feeder thread of the
+  // accelerator driver keeps the instruction queues topped up until the GEMM
+  // finishes, so the caller can prepare the next inputs in the meantime.
+  // GEMMs from all executors on the same driver run in submission order.
+  // setLHS/setRHS/getRes and run wait for the pending GEMM before touching
+  // the accelerator.
+  BitSerialMatMulCompletion runAsync() {
+    waitPending();
+    m_pending = BitSerialMatMulCompletion(
+      m_acc->run_async([this] { execute(); })
+    );
+    return m_pending;
+  }
+
+  // block until the GEMM started with runAsync() has finished
+  void waitPending() {
+    m_pending.wait();
+  }
+
+protected:
+  // run the schedule to completion on the calling thread, the caller holds
+  // the run lock of the accelerator
+  void execute() {
+    BitSerialMatMulScopedTimer t(m_metrics->latencyNs);
+    if(m_dram_cmds) {
+      m_run = m_plan;
+      run_dram_cmds();
+      update_residency();
+      record_run();
+      return;
+    }
+    m_run = select_plan();
+    m_res_base = m_acc->claim_result_bytes(m_run->resBytes());
     clear_all_queue_pointers();
-    m_acc->set_stage_enables(0, 0, 0);
-    // initial fill-up of the instruction queues
-    fill_fetch_op();
-    fill_fetch_runcfg();
-    fill_exec_op();
-    fill_exec_runcfg();
-    fill_result_op();
-    fill_result_runcfg();
-    // start the cycle counter
-    m_acc->perf_set_cc_enable(true);
-    // enable all stages
-    m_acc->set_stage_enables(1, 1, 1);
+    {
+      BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+      m_acc->set_stage_enables(0, 0, 0);
+      // initial fill-up of the instruction queues
+      fill_queues();
+      // start the cycle counter
+      m_acc->perf_set_cc_enable(true);
+      // enable all stages
+      m_acc->set_stage_enables(1, 1, 1);
+    }
     // run the generated schedule -- keep pushing operands until all generated
-    // instructions have been pushed
+    // instructions have been pushed, backing off while the queues are full
+    BitSerialMatMulBackoff backoff;
     while(!allPushed()) {
-      fill_fetch_op();
-      fill_fetch_runcfg();
-      fill_exec_op();
-      fill_exec_runcfg();
-      fill_result_op();
-      fill_result_runcfg();
+      if(fill_queues()) {
+        backoff.reset();
+      } else {
+        backoff.pause();
+      }
     }
     // wait until the result stage has no instructions std::left (= all finished)
-    while(!allFinished());
-    // disable all stages
-    m_acc->set_stage_enables(0, 0, 0);
-    // stop the cycle counter
-    m_acc->perf_set_cc_enable(false);
-    m_cycles = m_acc->perf_get_cc();
-    // fetch the number of cycles spent in different states for each stage
-    updateFetchStateCounters();
-    updateExecStateCounters();
-    updateResultStateCounters();
+    BitSerialMatMulAccelDriver::wait_until([this] {
+      BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+      return allFinished();
+    });
+    {
+      BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+      // disable all stages
+      m_acc->set_stage_enables(0, 0, 0);
+      // stop the cycle counter
+      m_acc->perf_set_cc_enable(false);
+      m_cycles = m_acc->perf_get_cc();
+      // fetch the number of cycles spent in different states for each stage
+      updateFetchStateCounters();
+      updateExecStateCounters();
+      updateResultStateCounters();
+    }
+    update_residency();
+    record_run();
   }
 
+public:
   size_t lhsBytes() const {
     return m_shape.lhs.wordsPerBitplane() * m_shape.lhs.nbits * sizeof(PackedBitGroupType);
   }
@@ -175,33 +381,69 @@ public:
     return m_shape.lhs.nrows_a * m_shape.rhs.nrows_a * sizeof(ResultType);
   }
 
+  ScheduleCfg getScheduleCfg() const {
+    return m_plan->scheduleCfg();
+  }
+
+  static const char * getScheduleOrderName(ScheduleOrder o) {
+    return BitSerialMatMulPlan::getScheduleOrderName(o);
+  }
+
+  std::shared_ptr<const BitSerialMatMulPlan> getPlan() const {
+    return m_plan;
+  }
+
+  // run a specific plan for this shape instead of the cached one, e.g. an
+  // autotuning candidate
+  void setPlan(std::shared_ptr<const BitSerialMatMulPlan> plan) {
+    waitPending();
+    assert(
+      BitSerialMatMulPlanKey(plan->shape(), plan->hwcfg()) ==
+      BitSerialMatMulPlanKey(m_plan->shape(), m_plan->hwcfg())
+    );
+    m_plan = plan;
+    m_run = plan;
+    // BRAM slots depend on the schedule, so forget what was resident
+    m_cached_lhs.assign(m_plan->cachedLHS().size(), INVALID_CACHE_ENTRY);
+    m_cached_rhs.assign(m_plan->cachedRHS().size(), INVALID_CACHE_ENTRY);
+    drop_dram_cmds();
+  }
+
+  // DRAM bytes read by the last run, less than getPlan()->bytesToFetch()
+  // when tiles left in BRAM by the previous run could be reused
+  uint64_t getLastRunFetchBytes() const {
+    return m_run->bytesToFetch();
+  }
+
   // performance counters and related performance reporting functions
   // ===========================================================================
   float getNanosecondsPerCycle() const {
     return 1000.0 / m_acc->fclk_MHz();
   }
 
-  float getLastRuntimeCycles() const {
-    return (float) m_cycles;
+  // counts are carried as 64-bit integers or doubles, since a float loses
+  // precision above 2^24 cycles or ops
+  uint64_t getLastRuntimeCycles() const {
+    return m_cycles;
   }
 
-  float getLastRuntimeNanoseconds() const {
-    return getLastRuntimeCycles() * getNanosecondsPerCycle();
+  double getLastRuntimeNanoseconds() const {
+    return (double) getLastRuntimeCycles() * getNanosecondsPerCycle();
   }
 
-  float getWorkloadOpCount(bool inclPadding = true) const {
+  double getWorkloadOpCount(bool inclPadding = true) const {
     if(inclPadding) {
-      return 2 * m_shape.lhs.nrows_a * m_shape.rhs.nrows_a * m_shape.lhs.ncols_a;
+      return 2.0 * m_shape.lhs.nrows_a * m_shape.rhs.nrows_a * m_shape.lhs.ncols_a;
     } else {
-      return 2 * m_shape.lhs.nrows * m_shape.rhs.nrows * m_shape.lhs.ncols;
+      return 2.0 * m_shape.lhs.nrows * m_shape.rhs.nrows * m_shape.lhs.ncols;
     }
   }
 
-  float getWorkloadBinaryOpCount(bool inclPadding = true) const {
+  double getWorkloadBinaryOpCount(bool inclPadding = true) const {
     return getWorkloadOpCount(inclPadding) * m_shape.lhs.nbits * m_shape.rhs.nbits;
   }
 
-  float getLastRunBinaryGOPS(bool inclPadding = true) const {
+  double getLastRunBinaryGOPS(bool inclPadding = true) const {
     // giga-ops per second = ops per nanosecond
     return getWorkloadBinaryOpCount(inclPadding) / getLastRuntimeNanoseconds();
   }
@@ -256,6 +498,45 @@ public:
     return getHWPeakBinaryOpsPerCycle() / getHWWriteBW();
   }
 
+  // the numbers of printPerfSummary and printPerfDetails for the last run, for
+  // writing out with perfReportJSON or perfReportCSVRow
+  PerfReport getPerfReport() const {
+    PerfReport r;
+    r.lhsRows = m_shape.lhs.nrows;
+    r.depth = m_shape.lhs.ncols;
+    r.rhsRows = m_shape.rhs.nrows;
+    r.lhsBits = m_shape.lhs.nbits;
+    r.rhsBits = m_shape.rhs.nbits;
+    r.scheduleOrder = getScheduleOrderName(m_run->scheduleCfg().order);
+    r.l0PerL1 = m_run->scheduleCfg().l0_per_l1;
+    r.cycles = m_cycles;
+    r.fclkMHz = m_acc->fclk_MHz();
+    r.nanoseconds = getLastRuntimeNanoseconds();
+    r.binaryOps = getWorkloadBinaryOpCount(true);
+    r.actualBinaryOps = getWorkloadBinaryOpCount(false);
+    r.achievedGOPS = perfRatio(r.binaryOps, r.nanoseconds);
+    r.peakGOPS = getHWPeakBinaryGOPS();
+    r.readOI = getWorkloadReadOI();
+    r.writeOI = getWorkloadWriteOI();
+    r.hwCompBoundReadOI = getHWCompBoundReadOI();
+    r.hwCompBoundWriteOI = getHWCompBoundWriteOI();
+    r.bytesRead = m_run->bytesToFetch();
+    r.bytesWritten = m_run->bytesToWrite();
+    r.peakReadBW = getHWReadBW();
+    r.effectiveReadBW = perfRatio(r.bytesRead, r.cycles);
+    r.fetchReadBW = perfRatio(r.bytesRead, m_fetch_cstate_cycles[csRun]);
+    r.peakWriteBW = getHWWriteBW();
+    r.effectiveWriteBW = perfRatio(r.bytesWritten, r.cycles);
+    r.resultWriteBW = perfRatio(r.bytesWritten, m_result_cstate_cycles[csRun]);
+    for(int i = 0; i < N_CTRL_STATES; i++) {
+      r.fetchCycles[i] = m_fetch_cstate_cycles[i];
+      r.execCycles[i] = m_exec_cstate_cycles[i];
+      r.resultCycles[i] = m_result_cstate_cycles[i];
+    }
+    classifyPerfReport(r);
+    return r;
+  }
+
   void printPerfSummary() {
     std::cout << "Performance Summary ====================================" << std::endl;
     std::cout << "Total workload: " << getWorkloadBinaryOpCount(true) << " binary ops" << std::endl;
@@ -263,9 +544,11 @@ public:
     std::cout << "(" << 100*getWorkloadBinaryOpCount(false)/getWorkloadBinaryOpCount(true) << "%)" << std::endl;
     std::cout << "Input matrix bytes: LHS " << lhsBytes() << " RHS " << rhsBytes() << std::endl;
     std::cout << "Result matrix bytes: " << resBytes() << std::endl;
-    std::cout << "Instructions: " << m_fetch_op.size() << " fetch ";
-    std::cout << m_exec_op.size() << " execute ";
-    std::cout << m_result_op.size() << " result" << std::endl;
+    std::cout << "Instructions: " << m_run->fetchOps().size() << " fetch ";
+    std::cout << m_run->execOps().size() << " execute ";
+    std::cout << m_run->resultOps().size() << " result" << std::endl;
+    std::cout << "Schedule: " << getScheduleOrderName(getScheduleCfg().order);
+    std::cout << ", " << getScheduleCfg().l0_per_l1 << " L0 tiles per L1 tile" << std::endl;
     std::cout << "HW input matrix buffer bytes: " << getHWBufSize() << std::endl;
     std::cout << "HW peak perf: " << getHWPeakBinaryGOPS() << " binary GOPS" << std::endl;
     std::cout << "HW fclk: " << m_acc->fclk_MHz() << " MHz" << std::endl;
@@ -308,63 +591,90 @@ public:
     std::cout << std::endl;
 
     std::cout << "Memory System ==========================================" << std::endl;
-    std::cout << "DRAM reads: " << m_bytes_to_fetch << " bytes" << std::endl;
-    float rd_bw = (float)m_bytes_to_fetch / getLastRuntimeCycles();
-    float rd_fetchact_bw = (float) m_bytes_to_fetch / m_fetch_cstate_cycles[csRun];
+    std::cout << "DRAM reads: " << m_run->bytesToFetch() << " bytes" << std::endl;
+    float rd_bw = (double) m_run->bytesToFetch() / getLastRuntimeCycles();
+    float rd_fetchact_bw = (double) m_run->bytesToFetch() / m_fetch_cstate_cycles[csRun];
     std::cout << "HW peak rd bandwidth: " << getHWReadBW() << " bytes/cycle" << std::endl;
     std::cout << "Effective rd bandwidth: " << rd_bw << " bytes/cycle (";
     std::cout << 100*rd_bw/getHWReadBW() << "%)" << std::endl;
     std::cout << "Fetch rd bandwidth: " << rd_fetchact_bw << " bytes/cycle (";
     std::cout << 100*rd_fetchact_bw/getHWReadBW() << "%)" << std::endl;
 
-    std::cout << "DRAM writes: " << m_bytes_to_write << " bytes" << std::endl;
-    float wr_bw = (float)m_bytes_to_write / getLastRuntimeCycles();
-    float wr_resact_bw = (float) m_bytes_to_write / m_result_cstate_cycles[csRun];
+    std::cout << "DRAM writes: " << m_run->bytesToWrite() << " bytes" << std::endl;
+    float wr_bw = (double) m_run->bytesToWrite() / getLastRuntimeCycles();
+    float wr_resact_bw = (double) m_run->bytesToWrite() / m_result_cstate_cycles[csRun];
     std::cout << "HW peak wr bandwidth: " << getHWWriteBW() << " bytes/cycle" << std::endl;
     std::cout << "Effective wr bandwidth: " << wr_bw << " bytes/cycle (";
     std::cout << 100*wr_bw/getHWWriteBW() << "%)" << std::endl;
     std::cout << "Result wr bandwidth: " << wr_resact_bw << " bytes/cycle (";
     std::cout << 100*wr_resact_bw/getHWWriteBW() << "%)" << std::endl;
 
-    float exec_eff = getWorkloadBinaryOpCount(true) / ((m_exec_cstate_cycles[csRun] * getHWPeakBinaryOpsPerCycle()));
+    float exec_eff = getWorkloadBinaryOpCount(true) / ((double) m_exec_cstate_cycles[csRun] * getHWPeakBinaryOpsPerCycle());
     std::cout << "Execute stage efficiency: " << 100*exec_eff << "%" << std::endl;
+    PerfReport r = getPerfReport();
+    std::cout << "Bottleneck: " << getBottleneckName(r.bottleneck);
+    std::cout << " (" << 100*r.limitingRatio << "%)" << std::endl;
     std::cout << "========================================================" << std::endl;
   }
 
 protected:
-  uint32_t m_cycles;
-  uint32_t m_fetch_cstate_cycles[N_CTRL_STATES];
-  uint32_t m_exec_cstate_cycles[N_CTRL_STATES];
-  uint32_t m_result_cstate_cycles[N_CTRL_STATES];
-  uint32_t m_bytes_to_fetch, m_bytes_to_write;
+  uint64_t m_cycles;
+  uint64_t m_fetch_cstate_cycles[N_CTRL_STATES];
+  uint64_t m_exec_cstate_cycles[N_CTRL_STATES];
+  uint64_t m_result_cstate_cycles[N_CTRL_STATES];
 
   gemmbitserial::GEMMContext m_shape;
   BitSerialMatMulAccelDriver * m_acc;
   WrapperRegDriver * m_platform;
+  BitSerialMatMulBufferPool * m_pool;
   HardwareCfg m_hwcfg;
 
   void * m_accelLHS;
   void * m_accelRHS;
   void * m_accelRes;
-
-  std::vector<Op> m_fetch_op, m_exec_op, m_result_op;
-  std::vector<FetchRunCfg> m_fetch_runcfg;
-  std::vector<ExecRunCfg> m_exec_runcfg;
-  std::vector<ResultRunCfg> m_result_runcfg;
+  // host copy of the padded result for transposing readbacks and the
+  // epilogue, when accel memory is not mapped
+  std::vector<ResultType> m_res_readback;
+  // device-resident operands bound in place of m_accelLHS/m_accelRHS
+  BitSerialMatMulOperandHandle m_boundLHS, m_boundRHS;
+  // host-side packing targets when accel memory is not mapped
+  PackedBitGroupType * m_stagingLHS;
+  PackedBitGroupType * m_stagingRHS;
+  // DRAM-resident command queues, built on first use
+  bool m_dram_cmds;
+  void * m_accelCmds;
+  void * m_cmdq_base[N_CMD_QUEUES];
+  size_t m_cmdq_count[N_CMD_QUEUES];
+  // indices of the waitComplete entries in the result runcfg queue
+  std::vector<size_t> m_cmdq_waits;
+  // GEMM started by runAsync(), if any
+  BitSerialMatMulCompletion m_pending;
+
+  // generated instructions, shared with other executors of the same shape
+  std::shared_ptr<const BitSerialMatMulPlan> m_plan;
+  // plan of the current or last run: m_plan, or a resident variant of it
+  std::shared_ptr<const BitSerialMatMulPlan> m_run;
+  // process-wide metrics for this shape
+  BitSerialMatMulShapeMetrics * m_metrics;
   size_t m_fetch_op_ptr, m_result_op_ptr, m_exec_op_ptr;
   size_t m_fetch_runcfg_ptr, m_result_runcfg_ptr, m_exec_runcfg_ptr;
+  // result bytes claimed on the accelerator before the current or last run
+  uint32_t m_res_base;
 
-  // keep track of what we have in the on-chip memory to avoid re-fetching
+  // keep track of what our last run left in the on-chip memory to avoid
+  // re-fetching, one entry per BRAM slot. invalidated when an operand
+  // changes, and only valid while we are the accelerator's BRAM owner.
   std::vector<uint64_t> m_cached_lhs, m_cached_rhs;
 
   void printExecQueue() {
     std::vector<string> opName {"run", "send", "receive"};
     int runcfg_cnt = 0;
-    for(int i = 0; i < m_exec_op.size(); i++) {
-      std::cout << "Exec op " << i << " type " << opName[m_exec_op[i].opcode];
-      std::cout << " channel " << m_exec_op[i].syncChannel << std::endl;
-      if(m_exec_op[i].opcode == opRun) {
-        m_acc->printExecRunCfg(m_exec_runcfg[runcfg_cnt]);
+    const std::vector<Op> & ops = m_plan->execOps();
+    for(int i = 0; i < ops.size(); i++) {
+      std::cout << "Exec op " << i << " type " << opName[ops[i].opcode];
+      std::cout << " channel " << ops[i].syncChannel << std::endl;
+      if(ops[i].opcode == opRun) {
+        m_acc->printExecRunCfg(m_plan->execRunCfgs()[runcfg_cnt]);
         runcfg_cnt++;
       }
     }
@@ -373,47 +683,17 @@ protected:
   void printFetchQueue() {
     std::vector<string> opName {"run", "send", "receive"};
     int runcfg_cnt = 0;
-    for(int i = 0; i < m_fetch_op.size(); i++) {
-      std::cout << "Fetch op " << i << " type " << opName[m_fetch_op[i].opcode];
-      std::cout << " channel " << m_fetch_op[i].syncChannel << std::endl;
-      if(m_fetch_op[i].opcode == opRun) {
-        m_acc->printFetchRunCfg(m_fetch_runcfg[runcfg_cnt]);
+    const std::vector<Op> & ops = m_plan->fetchOps();
+    for(int i = 0; i < ops.size(); i++) {
+      std::cout << "Fetch op " << i << " type " << opName[ops[i].opcode];
+      std::cout << " channel " << ops[i].syncChannel << std::endl;
+      if(ops[i].opcode == opRun) {
+        m_acc->printFetchRunCfg(get_fetch_runcfg(*m_plan, runcfg_cnt));
         runcfg_cnt++;
       }
     }
   }
 
-  void makeinstr_fetch_run(FetchRunCfg r) {
-    if(r.dram_block_size_bytes == r.dram_block_offset_bytes) {
-      // merge consecutive blocks to speed up fetch:
-      // one big block instead of several smaller ones
-      r.dram_block_size_bytes *= r.dram_block_count;
-      r.dram_block_offset_bytes *= r.dram_block_count;
-      r.dram_block_count = 1;
-    }
-    // ensure generated runcfg for fetch is valid
-    m_acc->verifyFetchRunCfg(r);
-    // count requested fetch bytes for statistics
-    uint32_t fetchPerGroup = r.dram_block_size_bytes * r.dram_block_count;
-    m_bytes_to_fetch += fetchPerGroup;
-    m_fetch_op.push_back(m_acc->make_op(opRun, 0));
-    m_fetch_runcfg.push_back(r);
-  }
-
-  void makeinstr_exec_run(ExecRunCfg r) {
-    m_exec_op.push_back(m_acc->make_op(opRun, 0));
-    m_exec_runcfg.push_back(r);
-  }
-
-  void makeinstr_result_run(ResultRunCfg rrc) {
-    // ensure generated runcfg for result is valid
-    m_acc->verifyResultRunCfg(rrc);
-    // count result bytes for statistics
-    m_bytes_to_write += m_hwcfg.dpaDimLHS * m_hwcfg.dpaDimRHS * sizeof(ResultType);
-    m_result_op.push_back(m_acc->make_op(opRun, 0));
-    m_result_runcfg.push_back(rrc);
-  }
-
   void clear_all_queue_pointers() {
     // set queue pointers to zero
     m_fetch_op_ptr = m_result_op_ptr = m_exec_op_ptr = 0;
@@ -423,84 +703,366 @@ protected:
   // whether all instruction execution has finished
   // = no instrs in result queue and all instrs pushed to queue
   bool allFinished() {
-    return m_acc->res_opcount() == 0 && m_result_op_ptr == m_result_op.size();
+    return m_acc->res_opcount() == 0 && m_result_op_ptr == m_run->resultOps().size();
+  }
+
+  // number of ops and runcfgs pushed so far in this run
+  size_t pushedCount() const {
+    return
+      m_fetch_op_ptr + m_exec_op_ptr + m_result_op_ptr +
+      m_fetch_runcfg_ptr + m_exec_runcfg_ptr + m_result_runcfg_ptr;
+  }
+
+  // push as much as the queues accept, returns true if anything was pushed
+  bool fill_queues() {
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    const size_t pushed = pushedCount();
+    fill_fetch_op();
+    fill_fetch_runcfg();
+    fill_exec_op();
+    fill_exec_runcfg();
+    fill_result_op();
+    fill_result_runcfg();
+    return pushedCount() != pushed;
   }
 
   // whether all instructions have been pushed to the queues
   bool allPushed() {
     return
-      m_fetch_op_ptr == m_fetch_op.size() &&
-      m_exec_op_ptr == m_exec_op.size() &&
-      m_result_op_ptr == m_result_op.size();
+      m_fetch_op_ptr == m_run->fetchOps().size() &&
+      m_exec_op_ptr == m_run->execOps().size() &&
+      m_result_op_ptr == m_run->resultOps().size();
   }
 
   void fill_fetch_op() {
-    while(!m_acc->fetch_op_full() && m_fetch_op_ptr < m_fetch_op.size()) {
-      m_acc->push_fetch_op(m_fetch_op[m_fetch_op_ptr++]);
+    const std::vector<Op> & ops = m_run->fetchOps();
+    while(!m_acc->fetch_op_full() && m_fetch_op_ptr < ops.size()) {
+      m_acc->push_fetch_op(ops[m_fetch_op_ptr++]);
     }
   }
 
   void fill_exec_op() {
-    while(!m_acc->exec_op_full() && m_exec_op_ptr < m_exec_op.size()) {
-      m_acc->push_exec_op(m_exec_op[m_exec_op_ptr++]);
+    const std::vector<Op> & ops = m_run->execOps();
+    while(!m_acc->exec_op_full() && m_exec_op_ptr < ops.size()) {
+      m_acc->push_exec_op(ops[m_exec_op_ptr++]);
     }
   }
 
   void fill_result_op() {
-    while(!m_acc->result_op_full() && m_result_op_ptr < m_result_op.size()) {
-      m_acc->push_result_op(m_result_op[m_result_op_ptr++]);
+    const std::vector<Op> & ops = m_run->resultOps();
+    while(!m_acc->result_op_full() && m_result_op_ptr < ops.size()) {
+      m_acc->push_result_op(ops[m_result_op_ptr++]);
     }
   }
 
   void fill_fetch_runcfg() {
-    while(!m_acc->fetch_runcfg_full() && m_fetch_runcfg_ptr < m_fetch_runcfg.size()) {
-      m_acc->push_fetch_runcfg(m_fetch_runcfg[m_fetch_runcfg_ptr++]);
+    while(!m_acc->fetch_runcfg_full() && m_fetch_runcfg_ptr < m_run->fetchRunCfgs().size()) {
+      m_acc->push_fetch_runcfg(get_fetch_runcfg(*m_run, m_fetch_runcfg_ptr++));
     }
   }
 
   void fill_exec_runcfg() {
-    while(!m_acc->exec_runcfg_full() && m_exec_runcfg_ptr < m_exec_runcfg.size()) {
-      m_acc->push_exec_runcfg(m_exec_runcfg[m_exec_runcfg_ptr++]);
+    const std::vector<ExecRunCfg> & runcfgs = m_run->execRunCfgs();
+    while(!m_acc->exec_runcfg_full() && m_exec_runcfg_ptr < runcfgs.size()) {
+      m_acc->push_exec_runcfg(runcfgs[m_exec_runcfg_ptr++]);
     }
   }
 
   void fill_result_runcfg() {
-    while(!m_acc->result_runcfg_full() && m_result_runcfg_ptr < m_result_runcfg.size()) {
-      m_acc->push_result_runcfg(m_result_runcfg[m_result_runcfg_ptr++]);
+    while(!m_acc->result_runcfg_full() && m_result_runcfg_ptr < m_run->resultRunCfgs().size()) {
+      m_acc->push_result_runcfg(
+        get_result_runcfg(*m_run, m_result_runcfg_ptr++, m_res_base)
+      );
+    }
+  }
+
+  void * alloc_accel(size_t bytes) {
+    if(m_pool) {
+      return m_pool->alloc(bytes);
+    }
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    return m_platform->allocAccelBuffer(bytes);
+  }
+
+  // host <-> accel transfers, under the platform lock since the feeder may
+  // be doing register I/O at the same time
+  void upload(const void * from, void * to, size_t bytes) {
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    m_platform->copyBufferHostToAccel((void *) from, to, bytes);
+  }
+
+  void download(void * from, void * to, size_t bytes) {
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    m_platform->copyBufferAccelToHost(from, to, bytes);
+  }
+
+  // host pointer to pack an operand into: the mapped accel buffer if there is
+  // one, else the staging buffer, allocated on first use
+  PackedBitGroupType * target(
+    void * accelBuf, PackedBitGroupType * & staging, size_t bytes
+  ) {
+    void * mapped = m_acc->hostPtr(accelBuf, bytes);
+    if(mapped) {
+      return (PackedBitGroupType *) mapped;
+    }
+    if(!staging) {
+      staging = new PackedBitGroupType[bytes / sizeof(PackedBitGroupType)];
+    }
+    return staging;
+  }
+
+  // padded result readable from the host: the mapped accel buffer if there
+  // is one, else a readback buffer that is reused across calls
+  const ResultType * host_res() {
+    const ResultType * mapped = (const ResultType *) m_acc->hostPtr(m_accelRes, resBytes());
+    if(mapped) {
+      return mapped;
+    }
+    m_res_readback.resize(m_shape.rhs.nrows * m_shape.lhs.nrows_a);
+    download(
+      m_accelRes, m_res_readback.data(), m_res_readback.size() * sizeof(ResultType)
+    );
+    return m_res_readback.data();
+  }
+
+  static bool any_resident(const std::vector<uint64_t> & tags) {
+    for(auto & t : tags) {
+      if(t != INVALID_CACHE_ENTRY) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // pick the plan for the next run. if tiles from our last run are still in
+  // BRAM and their operand has not changed since, use the resident variant
+  // that skips fetching them, provided it expects exactly those tiles.
+  std::shared_ptr<const BitSerialMatMulPlan> select_plan() {
+    if(m_acc->bramOwner() != this) {
+      // someone else has run on the accelerator since
+      m_cached_lhs.assign(m_cached_lhs.size(), INVALID_CACHE_ENTRY);
+      m_cached_rhs.assign(m_cached_rhs.size(), INVALID_CACHE_ENTRY);
+    }
+    const bool lhs = any_resident(m_cached_lhs);
+    const bool rhs = any_resident(m_cached_rhs);
+    if(!lhs && !rhs) {
+      return m_plan;
+    }
+    std::shared_ptr<const BitSerialMatMulPlan> v = m_plan->residentVariant(lhs, rhs);
+    if((lhs && v->startLHS() != m_cached_lhs) || (rhs && v->startRHS() != m_cached_rhs)) {
+      return m_plan;
+    }
+    return v;
+  }
+
+  // add the run just finished to the metrics of this shape
+  void record_run() {
+    const uint64_t instrs = m_run->fetchOps().size() + m_run->execOps().size() +
+      m_run->resultOps().size();
+    m_metrics->runs.fetch_add(1, std::memory_order_relaxed);
+    m_metrics->bytesFetched.fetch_add(m_run->bytesToFetch(), std::memory_order_relaxed);
+    m_metrics->bytesWritten.fetch_add(m_run->bytesToWrite(), std::memory_order_relaxed);
+    m_metrics->instructions.fetch_add(instrs, std::memory_order_relaxed);
+    m_metrics->cycles.record(m_cycles);
+  }
+
+  // remember what the run just finished left in BRAM
+  void update_residency() {
+    m_cached_lhs = m_run->cachedLHS();
+    m_cached_rhs = m_run->cachedRHS();
+    m_acc->setBRAMOwner(this);
+  }
+
+  // this executor's own operand buffers, allocated on first use
+  void * own_lhs() {
+    if(!m_accelLHS) {
+      m_accelLHS = alloc_accel(lhsBytes());
     }
+    return m_accelLHS;
   }
 
-  // helper functions for generating sync instructions
-  void makeinstr_fetch_sync_getexecbuffer() {
-    m_fetch_op.push_back(m_acc->make_op(opReceiveToken, 0));
+  void * own_rhs() {
+    if(!m_accelRHS) {
+      m_accelRHS = alloc_accel(rhsBytes());
+    }
+    return m_accelRHS;
   }
 
-  void makeinstr_fetch_sync_putexecbuffer() {
-    m_fetch_op.push_back(m_acc->make_op(opSendToken, 0));
+  // the buffers the schedule fetches from
+  void * lhs_buf() {
+    return m_boundLHS ? m_boundLHS->accelBuf() : own_lhs();
   }
 
-  void makeinstr_exec_sync_getfetchbuffer() {
-    m_exec_op.push_back(m_acc->make_op(opReceiveToken, 0));
+  void * rhs_buf() {
+    return m_boundRHS ? m_boundRHS->accelBuf() : own_rhs();
   }
 
-  void makeinstr_exec_sync_putfetchbuffer() {
-    m_exec_op.push_back(m_acc->make_op(opSendToken, 0));
+  // switch to a bound operand, or back to the own buffer for an empty
+  // handle. the new data is not in BRAM, and DRAM commands that point at
+  // the old buffer must be rebuilt.
+  void set_lhs_operand(BitSerialMatMulOperandHandle op) {
+    if(op != m_boundLHS) {
+      drop_dram_cmds();
+    } else if(op) {
+      // bound operands are immutable, so rebinding keeps BRAM contents
+      return;
+    }
+    m_boundLHS = op;
+    for(unsigned int i = 0; i < m_cached_lhs.size(); i++) {
+      m_cached_lhs[i] = INVALID_CACHE_ENTRY;
+    }
   }
 
-  void makeinstr_exec_sync_getresultbuffer() {
-    m_exec_op.push_back(m_acc->make_op(opReceiveToken, 1));
+  void set_rhs_operand(BitSerialMatMulOperandHandle op) {
+    if(op != m_boundRHS) {
+      drop_dram_cmds();
+    } else if(op) {
+      // bound operands are immutable, so rebinding keeps BRAM contents
+      return;
+    }
+    m_boundRHS = op;
+    for(unsigned int i = 0; i < m_cached_rhs.size(); i++) {
+      m_cached_rhs[i] = INVALID_CACHE_ENTRY;
+    }
   }
 
-  void makeinstr_exec_sync_putresultbuffer() {
-    m_exec_op.push_back(m_acc->make_op(opSendToken, 1));
+  void drop_dram_cmds() {
+    if(m_accelCmds) {
+      free_accel(m_accelCmds);
+      m_accelCmds = 0;
+    }
   }
 
-  void makeinstr_result_sync_getexecbuffer() {
-    m_result_op.push_back(m_acc->make_op(opReceiveToken, 0));
+  void free_accel(void * buf) {
+    if(m_pool) {
+      m_pool->free(buf);
+    } else {
+      BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+      m_platform->deallocAccelBuffer(buf);
+    }
   }
 
-  void makeinstr_result_sync_putexecbuffer() {
-    m_result_op.push_back(m_acc->make_op(opSendToken, 0));
+  // rebind a fetch runcfg from the plan to this executor's buffers
+  FetchRunCfg get_fetch_runcfg(const BitSerialMatMulPlan & plan, size_t i) {
+    FetchRunCfg r = plan.fetchRunCfgs()[i];
+    void * base = (plan.fetchBuffers()[i] == bufLHS) ? lhs_buf() : rhs_buf();
+    r.dram_base = (void *)((uint64_t) base + (uint64_t) r.dram_base);
+    return r;
+  }
+
+  // rebind a result runcfg from the plan to this executor's result buffer,
+  // and the final wait to the result bytes claimed before it, see
+  // BitSerialMatMulAccelDriver::claim_result_bytes
+  ResultRunCfg get_result_runcfg(
+    const BitSerialMatMulPlan & plan, size_t i, uint32_t res_base
+  ) {
+    ResultRunCfg r = plan.resultRunCfgs()[i];
+    if(!r.waitComplete) {
+      r.dram_base = (void *)((uint64_t) m_accelRes + (uint64_t) r.dram_base);
+    } else {
+      r.waitCompleteBytes += res_base;
+    }
+    return r;
+  }
+
+  // encode the plan, rebound to this executor's buffers, into command
+  // queues in accel DRAM. each queue starts at a FETCH_ADDRALIGN boundary.
+  void build_dram_cmds() {
+    m_cmdq_count[cmdqFetchOp] = m_plan->fetchOps().size();
+    m_cmdq_count[cmdqExecOp] = m_plan->execOps().size();
+    m_cmdq_count[cmdqResultOp] = m_plan->resultOps().size();
+    m_cmdq_count[cmdqFetchRunCfg] = m_plan->fetchRunCfgs().size();
+    m_cmdq_count[cmdqExecRunCfg] = m_plan->execRunCfgs().size();
+    m_cmdq_count[cmdqResultRunCfg] = m_plan->resultRunCfgs().size();
+    const size_t words_align = FETCH_ADDRALIGN / sizeof(uint64_t);
+    size_t start[N_CMD_QUEUES];
+    size_t total_words = 0;
+    for(int q = 0; q < N_CMD_QUEUES; q++) {
+      start[q] = total_words;
+      total_words += m_cmdq_count[q] * m_acc->cmdq_words_per_entry((CmdQueue) q);
+      total_words = words_align * ((total_words + words_align - 1) / words_align);
+    }
+    std::vector<uint64_t> words(total_words, 0);
+    const std::vector<Op> * ops[] = {
+      &m_plan->fetchOps(), &m_plan->execOps(), &m_plan->resultOps()
+    };
+    for(int q = cmdqFetchOp; q <= cmdqResultOp; q++) {
+      for(size_t i = 0; i < ops[q]->size(); i++) {
+        m_acc->encode_op((*ops[q])[i], &words[start[q] + i]);
+      }
+    }
+    size_t w = start[cmdqFetchRunCfg];
+    for(size_t i = 0; i < m_cmdq_count[cmdqFetchRunCfg]; i++) {
+      m_acc->encode_fetch_runcfg(get_fetch_runcfg(*m_plan, i), &words[w]);
+      w += m_acc->cmdq_words_per_entry(cmdqFetchRunCfg);
+    }
+    w = start[cmdqExecRunCfg];
+    for(size_t i = 0; i < m_cmdq_count[cmdqExecRunCfg]; i++) {
+      m_acc->encode_exec_runcfg(m_plan->execRunCfgs()[i], &words[w]);
+      w += m_acc->cmdq_words_per_entry(cmdqExecRunCfg);
+    }
+    // the waits are encoded again before each run, see rebase_dram_cmds
+    w = start[cmdqResultRunCfg];
+    m_cmdq_waits.clear();
+    for(size_t i = 0; i < m_cmdq_count[cmdqResultRunCfg]; i++) {
+      m_acc->encode_result_runcfg(get_result_runcfg(*m_plan, i, 0), &words[w]);
+      if(m_plan->resultRunCfgs()[i].waitComplete) {
+        m_cmdq_waits.push_back(i);
+      }
+      w += m_acc->cmdq_words_per_entry(cmdqResultRunCfg);
+    }
+    const size_t cmd_bytes = max(total_words, 1) * sizeof(uint64_t);
+    m_accelCmds = alloc_accel(cmd_bytes);
+    upload(words.data(), m_accelCmds, cmd_bytes);
+    for(int q = 0; q < N_CMD_QUEUES; q++) {
+      m_cmdq_base[q] = (void *)((uint64_t) m_accelCmds + start[q] * sizeof(uint64_t));
+    }
+  }
+
+  // rewrite the waits in the DRAM result runcfg queue for the result bytes
+  // claimed before this run
+  void rebase_dram_cmds() {
+    const size_t words = m_acc->cmdq_words_per_entry(cmdqResultRunCfg);
+    std::vector<uint64_t> w(words);
+    for(auto i : m_cmdq_waits) {
+      m_acc->encode_result_runcfg(get_result_runcfg(*m_plan, i, m_res_base), w.data());
+      void * to = (void *)((uint64_t) m_cmdq_base[cmdqResultRunCfg] + i * words * sizeof(uint64_t));
+      upload(w.data(), to, words * sizeof(uint64_t));
+    }
+  }
+
+  // run with the accelerator reading its commands from DRAM, the host only
+  // starts the command fetcher and waits for completion
+  void run_dram_cmds() {
+    if(!m_accelCmds) {
+      build_dram_cmds();
+    }
+    m_res_base = m_acc->claim_result_bytes(m_plan->resBytes());
+    rebase_dram_cmds();
+    {
+      BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+      m_acc->set_stage_enables(0, 0, 0);
+      m_acc->start_dram_cmdqueues(m_cmdq_base, m_cmdq_count);
+      // start the cycle counter
+      m_acc->perf_set_cc_enable(true);
+      // enable all stages
+      m_acc->set_stage_enables(1, 1, 1);
+    }
+    // wait until all commands are fetched and the result stage is done
+    BitSerialMatMulAccelDriver::wait_until([this] {
+      BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+      return !m_acc->dram_cmdqueues_busy() && m_acc->res_opcount() == 0;
+    });
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    // disable all stages
+    m_acc->set_stage_enables(0, 0, 0);
+    // stop the cycle counter
+    m_acc->perf_set_cc_enable(false);
+    m_cycles = m_acc->perf_get_cc();
+    // fetch the number of cycles spent in different states for each stage
+    updateFetchStateCounters();
+    updateExecStateCounters();
+    updateResultStateCounters();
   }
 
   void updateFetchStateCounters() {
@@ -516,248 +1078,10 @@ protected:
   }
 
   void updateResultStateCounters() {
-    cout << "Updates result state counters" << endl;
     for(int i = 0; i < N_CTRL_STATES; i++) {
       m_result_cstate_cycles[i] = m_acc->perf_result_stats((ControllerState) i);
     }
   }
+};
 
-  // get the pointer to the start of given result tile
-  void * get_result_tile_ptr(const size_t lhs_tile, const size_t rhs_tile) {
-    uint32_t lhs_ind = m_hwcfg.dpaDimLHS * lhs_tile;
-    uint32_t rhs_ind = m_hwcfg.dpaDimRHS * rhs_tile;
-    assert(lhs_ind < lhs_eff_rows());
-    assert(rhs_ind < rhs_eff_rows());
-    size_t ind = rhs_ind * lhs_eff_rows() + lhs_ind;
-    assert((ind * sizeof(ResultType)) < resBytes());
-    uint64_t ret = (uint64_t)m_accelRes + (ind * sizeof(ResultType));
-    return (void*) ret;
-  }
-
-  const size_t lhs_eff_rows() {
-    return m_shape.lhs.nrows_a;
-  }
-
-  const size_t rhs_eff_rows() {
-    return m_shape.rhs.nrows_a;
-  }
-
-  void build_schedule_trivial() {
-    HardwareCfg cfg = m_acc->hwcfg();
-    const uint32_t dpa_y = cfg.dpaDimLHS; // DPA Y dimension
-    const uint32_t dpa_x = cfg.dpaDimRHS; // DPA X dimension
-    const uint32_t dpa_z = cfg.dpaDimCommon; // DPA z dimension (64)
-    const uint32_t dpa_z_bytes = dpa_z / 8;
-    gemmbitserial::BitSerialMatrix lhs = m_shape.lhs; // Matrix for lhs and rhs
-    gemmbitserial::BitSerialMatrix rhs = m_shape.rhs;
-    int current_bram_region = 0;
-    const size_t bram_regions = FETCHEXEC_TOKENS;
-    int current_resmem_region = 0;
-    const size_t resmem_regions = EXECRES_TOKENS;
-
-    assert(dpa_z >= cfg.readChanWidth);
-    assert(dpa_z % cfg.readChanWidth == 0);
-    const size_t exec_to_fetch_width_ratio = dpa_z / cfg.readChanWidth;
-
-    const uint32_t lhs_l0_per_bram = cfg.lhsEntriesPerMem / bram_regions;
-    const uint32_t rhs_l0_per_bram = cfg.rhsEntriesPerMem / bram_regions;
-
-    const size_t lhs_bytes_per_l0 = dpa_y * dpa_z / 8;
-    const size_t rhs_bytes_per_l0 = dpa_x * dpa_z / 8;
-    // L1 tile. min 1 L0 tile, maximum L0 tiles that fit into OCM.
-    // only tiled along the common dimension
-    const size_t l0_per_stripe = lhs.ncols_a / dpa_z;
-    const size_t lhs_l0_per_l1 = min(lhs_l0_per_bram, l0_per_stripe);
-    const size_t lhs_bytes_per_l1 = lhs_l0_per_l1 * lhs_bytes_per_l0;
-    const size_t rhs_l0_per_l1 = min(rhs_l0_per_bram, l0_per_stripe);
-    const size_t rhs_bytes_per_l1 = rhs_l0_per_l1 * rhs_bytes_per_l0;
-    // L2 tile. min 1 L1 tile, maximum L1 tiles that fit into OCM.
-    // tiled along either:
-    // only common dimension if rows are wider than BRAM (hw-bound)
-    // only lhs/rhs dimension if rows are smaller than BRAM (sw-bound)
-    const size_t lhs_max_l1_hw = lhs_l0_per_bram / lhs_l0_per_l1;
-    const size_t lhs_max_l1_sw = lhs_eff_rows() / dpa_y;
-    const size_t lhs_l1_per_l2 = min(lhs_max_l1_hw, lhs_max_l1_sw);
-    const size_t lhs_bytes_per_l2 = lhs_l1_per_l2 * lhs_bytes_per_l1;
-    const size_t rhs_max_l1_hw = rhs_l0_per_bram / rhs_l0_per_l1;
-    const size_t rhs_max_l1_sw = rhs_eff_rows() / dpa_x;
-    const size_t rhs_l1_per_l2 = min(rhs_max_l1_hw, rhs_max_l1_sw);
-    const size_t rhs_bytes_per_l2 = rhs_l1_per_l2 * rhs_bytes_per_l1;
-    // total L2 tile counts in the matrices
-    // TODO use the minimum-sized of LHS or RHS BRAM capacity here
-    const size_t z_l2_per_matrix = max(1, (lhs.ncols_a / dpa_z) / lhs_l0_per_bram); //l1 tiles per z direction
-    // the L2 tile count obtained by total_bytes / L2_tiles does not have any
-    // axis information (e.g. may be product of LHS and Z tiling)
-    // so divide by the common dimension tiling factor
-    const size_t lhs_l2_per_matrix = (lhsBytes() / lhs_bytes_per_l2) / z_l2_per_matrix; // l1 tiles in y direction per l2 tile
-    const size_t rhs_l2_per_matrix = (rhsBytes() / rhs_bytes_per_l2) / z_l2_per_matrix; // l1 tiles in x direction per l2 tile
-
-    // TODO l1 tile size is not guaranteed to evenly divide the matrix
-    // due to partial tiles, and same with l2 tile size. need to handle this
-    // either by smart padding/alignment during allocation, or changing tile
-    // upper bounds.
-    assert(lhsBytes() % lhs_bytes_per_l2 == 0);
-    assert(rhsBytes() % rhs_bytes_per_l2 == 0);
-
-    // ensure the LHS rows are integer multiples of the DPA dims
-    assert(0 == lhs_eff_rows() % dpa_y);
-    assert(0 == rhs_eff_rows() % dpa_x);
-    assert(0 == lhs.ncols_a % dpa_z);
-    //Binary matrix
-    assert(lhs.nbits == 1 && rhs.nbits == 1);
-
-    /*lhs.printSummary();
-    rhs.printSummary();
-    lhs.printHex();
-    rhs.printHex();
-    cout << "lhs_bytes_per_l0	" <<	lhs_bytes_per_l0	<< endl;
-    cout << "rhs_bytes_per_l0	" <<	rhs_bytes_per_l0	<< endl;
-    cout << "lhs_l0_per_bram	" <<	lhs_l0_per_bram	<< endl;
-    cout << "rhs_l0_per_bram	" <<	rhs_l0_per_bram	<< endl;
-    cout << "l0_per_stripe	" <<	l0_per_stripe	<< endl;
-    cout << "lhs_l0_per_l1	" <<	lhs_l0_per_l1	<< endl;
-    cout << "lhs_bytes_per_l1	" <<	lhs_bytes_per_l1	<< endl;
-    cout << "rhs_l0_per_l1	" <<	rhs_l0_per_l1	<< endl;
-    cout << "rhs_bytes_per_l1	" <<	rhs_bytes_per_l1	<< endl;
-    cout << "lhs_max_l1_hw	" <<	lhs_max_l1_hw	<< endl;
-    cout << "lhs_max_l1_sw	" <<	lhs_max_l1_sw	<< endl;
-    cout << "lhs_l1_per_l2	" <<	lhs_l1_per_l2	<< endl;
-    cout << "lhs_bytes_per_l2	" <<	lhs_bytes_per_l2	<< endl;
-    cout << "rhs_max_l1_hw	" <<	rhs_max_l1_hw	<< endl;
-    cout << "rhs_max_l1_sw	" <<	rhs_max_l1_sw	<< endl;
-    cout << "rhs_l1_per_l2	" <<	rhs_l1_per_l2	<< endl;
-    cout << "rhs_bytes_per_l2	" <<	rhs_bytes_per_l2	<< endl;
-    cout << "z_l2_per_matrix " << z_l2_per_matrix << endl;
-    cout << "lhs_l2_per_matrix	" <<	lhs_l2_per_matrix	<< endl;
-    cout << "rhs_l2_per_matrix	" <<	rhs_l2_per_matrix	<< endl;*/
-
-    const uint64_t fetch_base_lhs = (uint64_t) m_accelLHS;
-    const uint64_t fetch_base_rhs = (uint64_t) m_accelRHS;
-    uint64_t res_base = (uint64_t) m_accelRes;
-
-    for(int lhs_l2 = 0; lhs_l2 < lhs_l2_per_matrix; lhs_l2++) {
-      for(int rhs_l2 = 0; rhs_l2 < rhs_l2_per_matrix; rhs_l2++) {
-        for(int z_l2 = 0; z_l2 < z_l2_per_matrix; z_l2++) {
-          // acquire fetch buffers to fill
-          makeinstr_fetch_sync_getexecbuffer();
-          FetchRunCfg frc;
-          // TODO avoid redundant fetches here
-          // fetch lhs l2 tile
-          frc.bram_addr_base = current_bram_region * lhs_l0_per_bram * exec_to_fetch_width_ratio;
-          frc.bram_id_start = 0;
-          frc.bram_id_range = dpa_y - 1;
-
-          size_t bytesPerFetchGroup, bytesPerRow;
-          bytesPerRow = (lhs.ncols_a / 8);
-          bytesPerFetchGroup = lhs_bytes_per_l2;
-          // was: lhs_l0_per_l1 * lhs_l1_per_l2
-          frc.tiles_per_row = lhs_l0_per_l1 * exec_to_fetch_width_ratio;
-          // size of each block in bytes (contiguous in memory)
-          frc.dram_block_size_bytes = lhs_l0_per_l1 * dpa_z_bytes;
-          frc.dram_base = (void *)(fetch_base_lhs + lhs_l2*z_l2_per_matrix*lhs_bytes_per_l2 + z_l2 * frc.dram_block_size_bytes);
-          // number of blocks to fetch
-          assert(bytesPerFetchGroup % frc.dram_block_size_bytes == 0);
-          assert(bytesPerFetchGroup / frc.dram_block_size_bytes >= 1);
-          frc.dram_block_count = bytesPerFetchGroup / frc.dram_block_size_bytes;
-          // offset to next block to be fetched
-          frc.dram_block_offset_bytes = bytesPerRow;
-          // only issue fetch if not already in cache
-          if(m_cached_lhs[current_bram_region] != (uint64_t) frc.dram_base) {
-            //m_acc->printFetchRunCfg(frc);
-            makeinstr_fetch_run(frc);
-            m_cached_lhs[current_bram_region] = (uint64_t) frc.dram_base;
-          }
-
-          // fetch rhs l2 tile
-          frc.bram_addr_base = current_bram_region * rhs_l0_per_bram * exec_to_fetch_width_ratio;
-          frc.bram_id_start = dpa_y;
-          frc.bram_id_range = dpa_x - 1;
-          bytesPerFetchGroup = rhs_bytes_per_l2;
-          // was: rhs_l0_per_l1 * rhs_l1_per_l2
-          frc.tiles_per_row = rhs_l0_per_l1 * exec_to_fetch_width_ratio;
-          // size of each block in bytes (contiguous in memory)
-          frc.dram_block_size_bytes = rhs_l0_per_l1 * dpa_z_bytes;
-          frc.dram_base = (void *)(fetch_base_rhs + rhs_l2*z_l2_per_matrix*rhs_bytes_per_l2 + z_l2 * frc.dram_block_size_bytes);
-          // number of blocks to fetch
-          assert(bytesPerFetchGroup % frc.dram_block_size_bytes == 0);
-          assert(bytesPerFetchGroup / frc.dram_block_size_bytes >= 1);
-          frc.dram_block_count = bytesPerFetchGroup / frc.dram_block_size_bytes;
-          // offset to next block to be fetched
-          frc.dram_block_offset_bytes = bytesPerRow;
-
-          // only issue fetch if not already in cache
-          if(m_cached_rhs[current_bram_region] != (uint64_t) frc.dram_base) {
-            //m_acc->printFetchRunCfg(frc);
-            makeinstr_fetch_run(frc);
-            m_cached_rhs[current_bram_region] = (uint64_t) frc.dram_base;
-          }
-
-          // send the prepared buffers to exec
-          makeinstr_fetch_sync_putexecbuffer();
-
-          // process the fetched L2 tile
-          // exec stage acquires input matrix buffers
-          makeinstr_exec_sync_getfetchbuffer();
-          // process combinations of L1 tiles within the L2 tile
-          for(int lhs_l1 = 0; lhs_l1 < lhs_l1_per_l2; lhs_l1++) {
-            for(int rhs_l1 = 0; rhs_l1 < rhs_l1_per_l2; rhs_l1++) {
-              if(z_l2 == z_l2_per_matrix - 1) {
-                // about to finish a new stripe
-                // exec stage acquires new result buffer
-                makeinstr_exec_sync_getresultbuffer();
-              }
-              ExecRunCfg erc;
-              erc.numTiles = lhs_l0_per_l1;
-              erc.lhsOffset = current_bram_region * lhs_l0_per_bram + lhs_l1 * erc.numTiles;
-              erc.lhsOffset *= exec_to_fetch_width_ratio;
-              erc.rhsOffset = current_bram_region * rhs_l0_per_bram + rhs_l1 * erc.numTiles;
-              erc.rhsOffset *= exec_to_fetch_width_ratio;
-              erc.doNegate = 0;
-              erc.shiftAmount = 0;
-              erc.doClear = (z_l2 == 0 ? 1 : 0); // clear when starting new stripe
-              // write result at the end of z tile
-              erc.writeEn = (z_l2 == z_l2_per_matrix - 1 ? 1 : 0);
-              erc.writeAddr = current_resmem_region;
-              //m_acc->printExecRunCfg(erc);
-              makeinstr_exec_run(erc);
-
-              if(z_l2 == z_l2_per_matrix - 1) {
-                // finishing a stripe: release result buffer from exec
-                makeinstr_exec_sync_putresultbuffer();
-                // result stage: acquire result buffer
-                makeinstr_result_sync_getexecbuffer();
-                // generate result
-                ResultRunCfg rrc;
-                rrc.resmem_addr = current_resmem_region;
-                // find the inds of which L1 tile we are currently working on
-                size_t lhs_tile = lhs_l1_per_l2 * lhs_l2 + lhs_l1;
-                size_t rhs_tile = rhs_l1_per_l2 * rhs_l2 + rhs_l1;
-                rrc.dram_base = get_result_tile_ptr(lhs_tile, rhs_tile);
-                rrc.dram_skip = lhs_eff_rows() * sizeof(ResultType);
-                rrc.waitComplete = false;
-                rrc.waitCompleteBytes = 0;
-                makeinstr_result_run(rrc);
-                makeinstr_result_sync_putexecbuffer();
-                // use next resmem region for next time
-                current_resmem_region = current_resmem_region < resmem_regions-1 ? current_resmem_region + 1 : 0;
-              }
-            }
-          }
-          // finished processing L2 tile
-          // exec releases input matrix buffers
-          makeinstr_exec_sync_putfetchbuffer();
-          current_bram_region = current_bram_region < bram_regions-1 ? current_bram_region + 1 : 0;
-        }
-      }
-    }
-    // wait until all result writes are complete
-    ResultRunCfg rrc;
-    rrc.waitComplete = true;
-    rrc.waitCompleteBytes = resBytes();
-    // these params are ignored when waitComplete = true
-    rrc.resmem_addr = 0;
-    rrc.dram_base = 0;
-    rrc.dram_skip = 0;
-    makeinstr_result_run(rrc);
-  }
-};
\ No newline at end of file
+#endif
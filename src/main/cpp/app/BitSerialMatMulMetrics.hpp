@@ -0,0 +1,342 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef BitSerialMatMulMetrics_H
+#define BitSerialMatMulMetrics_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include "BitSerialMatMulAccelDriver.hpp"
+#include "BitSerialMatMulPlan.hpp"
+#include "gemmbitserial/gemmbitserial.hpp"
+
+// sub-buckets per power of two in the histograms, 2^5 gives a relative
+// error of at most 1/32 for each recorded value
+#define HIST_SUB_BITS               5
+#define HIST_SUB_BUCKETS            (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS                ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+// largest power of two used as a Prometheus bucket bound
+#define HIST_PROM_MAX_EXP           40
+
+// HDR-style histogram of 64-bit values: exact below HIST_SUB_BUCKETS, then
+// HIST_SUB_BUCKETS linear buckets for every power of two. recording is a few
+// relaxed atomic adds, so any number of threads can record concurrently.
+// readers see each counter atomically, but not all of them at one instant.
+class BitSerialMatMulHistogram {
+public:
+  BitSerialMatMulHistogram() {
+    reset();
+  }
+
+  void record(uint64_t v) {
+    m_buckets[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(v, std::memory_order_relaxed);
+    uint64_t m = m_min.load(std::memory_order_relaxed);
+    while(v < m && !m_min.compare_exchange_weak(m, v, std::memory_order_relaxed));
+    m = m_max.load(std::memory_order_relaxed);
+    while(v > m && !m_max.compare_exchange_weak(m, v, std::memory_order_relaxed));
+  }
+
+  uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+  uint64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+  uint64_t maxValue() const { return m_max.load(std::memory_order_relaxed); }
+
+  uint64_t minValue() const {
+    return count() ? m_min.load(std::memory_order_relaxed) : 0;
+  }
+
+  // smallest recorded value v such that a fraction q of all values are <= v,
+  // up to the bucket resolution
+  uint64_t quantile(double q) const {
+    const uint64_t n = count();
+    if(n == 0) {
+      return 0;
+    }
+    uint64_t rank = (uint64_t)(q * n + 0.5);
+    rank = (rank < 1) ? 1 : rank;
+    uint64_t seen = 0;
+    for(size_t i = 0; i < HIST_BUCKETS; i++) {
+      seen += m_buckets[i].load(std::memory_order_relaxed);
+      if(seen >= rank) {
+        const uint64_t hi = bucket_max(i);
+        return (hi < maxValue()) ? hi : maxValue();
+      }
+    }
+    return maxValue();
+  }
+
+  // number of recorded values <= v, exact when v + 1 is a bucket boundary,
+  // e.g. for all v = 2^k - 1
+  uint64_t countAtMost(uint64_t v) const {
+    uint64_t ret = 0;
+    for(size_t i = 0; i < HIST_BUCKETS && bucket_max(i) <= v; i++) {
+      ret += m_buckets[i].load(std::memory_order_relaxed);
+    }
+    return ret;
+  }
+
+  void reset() {
+    for(size_t i = 0; i < HIST_BUCKETS; i++) {
+      m_buckets[i].store(0, std::memory_order_relaxed);
+    }
+    m_count.store(0, std::memory_order_relaxed);
+    m_sum.store(0, std::memory_order_relaxed);
+    m_min.store((uint64_t) -1, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+  }
+
+protected:
+  std::atomic<uint64_t> m_buckets[HIST_BUCKETS];
+  std::atomic<uint64_t> m_count, m_sum, m_min, m_max;
+
+  static size_t bucket(uint64_t v) {
+    if(v < HIST_SUB_BUCKETS) {
+      return v;
+    }
+    const int e = 63 - __builtin_clzll(v);
+    const int shift = e - HIST_SUB_BITS;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + ((v >> shift) & (HIST_SUB_BUCKETS - 1));
+  }
+
+  // largest value that falls into bucket i
+  static uint64_t bucket_max(size_t i) {
+    if(i < HIST_SUB_BUCKETS) {
+      return i;
+    }
+    const int shift = i / HIST_SUB_BUCKETS - 1;
+    const uint64_t sub = i % HIST_SUB_BUCKETS;
+    return ((HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+  }
+};
+
+// counters for all GEMMs of one shape on one hardware config. the executor
+// records into these directly, without going through the registry.
+struct BitSerialMatMulShapeMetrics {
+  // shape as "<lhs rows>x<depth>x<rhs rows>", bits and signedness as
+  // "<lhs>x<rhs>", hardware config as from hwcfgString, used as labels
+  std::string shape, bits, sgn, hwcfg;
+  std::atomic<uint64_t> runs, bytesFetched, bytesWritten, instructions;
+  // accelerator cycles and wall-clock run time per GEMM
+  BitSerialMatMulHistogram cycles, latencyNs;
+  // host to accel copies of the operands, accel to host result reads
+  BitSerialMatMulHistogram uploadNs, readbackNs;
+
+  void reset() {
+    runs.store(0, std::memory_order_relaxed);
+    bytesFetched.store(0, std::memory_order_relaxed);
+    bytesWritten.store(0, std::memory_order_relaxed);
+    instructions.store(0, std::memory_order_relaxed);
+    cycles.reset();
+    latencyNs.reset();
+    uploadNs.reset();
+    readbackNs.reset();
+  }
+};
+
+// records the time from construction to destruction into a histogram
+class BitSerialMatMulScopedTimer {
+public:
+  BitSerialMatMulScopedTimer(BitSerialMatMulHistogram & h) : m_hist(h) {
+    m_start = std::chrono::steady_clock::now();
+  }
+
+  ~BitSerialMatMulScopedTimer() {
+    m_hist.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - m_start
+    ).count());
+  }
+
+protected:
+  BitSerialMatMulHistogram & m_hist;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+// Process-wide registry of per-shape metrics, for services that run many
+// GEMMs and need more than the counters of the last run. Looking up a shape
+// takes a lock, which executors do once when they are created; recording
+// only touches the atomics of the shape's entry. Entries live as long as the
+// process, reset() only zeroes them. Snapshots can be exported as
+// Prometheus text or JSON at any time.
+class BitSerialMatMulMetrics {
+public:
+  static BitSerialMatMulMetrics & instance() {
+    static BitSerialMatMulMetrics m;
+    return m;
+  }
+
+  BitSerialMatMulShapeMetrics * get(
+    const gemmbitserial::GEMMContext & shape, const HardwareCfg & hwcfg
+  ) {
+    BitSerialMatMulPlanKey key(shape, hwcfg);
+    std::lock_guard<std::mutex> lock(m_lock);
+    auto it = m_index.find(key);
+    if(it != m_index.end()) {
+      return it->second;
+    }
+    m_shapes.emplace_back();
+    BitSerialMatMulShapeMetrics * m = &m_shapes.back();
+    m->shape = std::to_string(shape.lhs.nrows) + "x" + std::to_string(shape.lhs.ncols) +
+      "x" + std::to_string(shape.rhs.nrows);
+    m->bits = std::to_string(shape.lhs.nbits) + "x" + std::to_string(shape.rhs.nbits);
+    m->sgn = std::to_string(shape.lhs.issigned) + "x" + std::to_string(shape.rhs.issigned);
+    m->hwcfg = hwcfgString(hwcfg);
+    m->reset();
+    m_index[key] = m;
+    return m;
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    for(auto & m : m_shapes) {
+      m.reset();
+    }
+  }
+
+  // Prometheus text exposition format. histograms get power-of-two buckets,
+  // with bounds of 2^k - 1 so that the counts are exact
+  std::string prometheusText() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    std::ostringstream o;
+    const char * counters[4][2] = {
+      {"bismo_gemm_runs_total", "GEMMs run"},
+      {"bismo_gemm_fetch_bytes_total", "bytes read from DRAM by the fetch stage"},
+      {"bismo_gemm_write_bytes_total", "bytes written to DRAM by the result stage"},
+      {"bismo_gemm_instructions_total", "instructions issued to the stages"}
+    };
+    for(int c = 0; c < 4; c++) {
+      o << "# HELP " << counters[c][0] << " " << counters[c][1] << "\n";
+      o << "# TYPE " << counters[c][0] << " counter\n";
+      for(auto & m : m_shapes) {
+        const std::atomic<uint64_t> * v[4] = {
+          &m.runs, &m.bytesFetched, &m.bytesWritten, &m.instructions
+        };
+        o << counters[c][0] << "{" << labels(m) << "} ";
+        o << v[c]->load(std::memory_order_relaxed) << "\n";
+      }
+    }
+    const char * hists[4][2] = {
+      {"bismo_gemm_cycles", "accelerator cycles per GEMM"},
+      {"bismo_gemm_latency_nanoseconds", "wall-clock time per GEMM"},
+      {"bismo_gemm_upload_nanoseconds", "time per operand upload"},
+      {"bismo_gemm_readback_nanoseconds", "time per result readback"}
+    };
+    for(int h = 0; h < 4; h++) {
+      o << "# HELP " << hists[h][0] << " " << hists[h][1] << "\n";
+      o << "# TYPE " << hists[h][0] << " histogram\n";
+      for(auto & m : m_shapes) {
+        const BitSerialMatMulHistogram & hist = *histograms(m)[h];
+        for(int k = 0; k <= HIST_PROM_MAX_EXP; k++) {
+          const uint64_t le = (((uint64_t) 1) << k) - 1;
+          o << hists[h][0] << "_bucket{" << labels(m) << ",le=\"" << le << "\"} ";
+          o << hist.countAtMost(le) << "\n";
+        }
+        o << hists[h][0] << "_bucket{" << labels(m) << ",le=\"+Inf\"} " << hist.count() << "\n";
+        o << hists[h][0] << "_sum{" << labels(m) << "} " << hist.sum() << "\n";
+        o << hists[h][0] << "_count{" << labels(m) << "} " << hist.count() << "\n";
+      }
+    }
+    return o.str();
+  }
+
+  // JSON snapshot with counters and histogram percentiles per shape
+  std::string jsonSnapshot() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    std::ostringstream o;
+    const char * names[4] = {"cycles", "latencyNs", "uploadNs", "readbackNs"};
+    o << "{\"shapes\": [";
+    bool first = true;
+    for(auto & m : m_shapes) {
+      o << (first ? "" : ", ") << "{\"shape\": \"" << m.shape << "\", \"bits\": \"";
+      o << m.bits << "\", \"signed\": \"" << m.sgn << "\", \"hwcfg\": \"" << m.hwcfg << "\"";
+      o << ", \"runs\": " << m.runs.load(std::memory_order_relaxed);
+      o << ", \"bytesFetched\": " << m.bytesFetched.load(std::memory_order_relaxed);
+      o << ", \"bytesWritten\": " << m.bytesWritten.load(std::memory_order_relaxed);
+      o << ", \"instructions\": " << m.instructions.load(std::memory_order_relaxed);
+      for(int h = 0; h < 4; h++) {
+        const BitSerialMatMulHistogram & hist = *histograms(m)[h];
+        o << ", \"" << names[h] << "\": {\"count\": " << hist.count();
+        o << ", \"sum\": " << hist.sum() << ", \"min\": " << hist.minValue();
+        o << ", \"p50\": " << hist.quantile(0.5) << ", \"p90\": " << hist.quantile(0.9);
+        o << ", \"p99\": " << hist.quantile(0.99) << ", \"p999\": " << hist.quantile(0.999);
+        o << ", \"max\": " << hist.maxValue() << "}";
+      }
+      o << "}";
+      first = false;
+    }
+    o << "]}";
+    return o.str();
+  }
+
+  // write the Prometheus text to a file, e.g. for the node exporter's
+  // textfile collector. written to a temporary file first and renamed, so
+  // readers never see a partial file. returns false on I/O errors.
+  bool writePrometheus(const char * path) {
+    const std::string text = prometheusText();
+    const std::string tmp = std::string(path) + ".tmp";
+    FILE * f = fopen(tmp.c_str(), "w");
+    if(!f) {
+      return false;
+    }
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    ok &= fclose(f) == 0;
+    ok = ok && rename(tmp.c_str(), path) == 0;
+    return ok;
+  }
+
+protected:
+  BitSerialMatMulMetrics() {
+  }
+
+  static std::string labels(const BitSerialMatMulShapeMetrics & m) {
+    return "shape=\"" + m.shape + "\",bits=\"" + m.bits + "\",signed=\"" + m.sgn +
+      "\",hwcfg=\"" + m.hwcfg + "\"";
+  }
+
+  static std::vector<const BitSerialMatMulHistogram *> histograms(
+    const BitSerialMatMulShapeMetrics & m
+  ) {
+    return {&m.cycles, &m.latencyNs, &m.uploadNs, &m.readbackNs};
+  }
+
+  std::mutex m_lock;
+  // std::list keeps entries in place, so executors can hold pointers to them
+  std::list<BitSerialMatMulShapeMetrics> m_shapes;
+  std::map<BitSerialMatMulPlanKey, BitSerialMatMulShapeMetrics *> m_index;
+};
+
+#endif
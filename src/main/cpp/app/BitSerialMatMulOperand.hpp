@@ -0,0 +1,293 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef BitSerialMatMulOperand_H
+#define BitSerialMatMulOperand_H
+
+#include <cassert>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "BitSerialMatMulAccelDriver.hpp"
+#include "BitSerialMatMulBufferPool.hpp"
+#include "gemmbitserial/gemmbitserial.hpp"
+
+// A BitSerialMatMulOperand is a packed matrix uploaded once into accelerator
+// DRAM, e.g. the weights of a layer. It can be bound as the LHS or RHS of any
+// number of executors with a matching shape, which then fetch straight from
+// it instead of their own buffer. Handles are reference-counted through
+// std::shared_ptr, and the buffer is freed with the last handle.
+class BitSerialMatMulOperand {
+public:
+  BitSerialMatMulOperand(
+    WrapperRegDriver * platform, const gemmbitserial::BitSerialMatrix & m,
+    BitSerialMatMulBufferPool * pool = 0
+  ) {
+    m_platform = platform;
+    m_pool = pool;
+    m_shape = m;
+    m_shape.data = 0;
+    m_bytes = m.wordsPerBitplane() * m.nbits * sizeof(PackedBitGroupType);
+    // the pool takes the platform lock itself, after its own lock
+    m_accelBuf = m_pool ? m_pool->alloc(m_bytes) : 0;
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    if(!m_accelBuf) {
+      m_accelBuf = m_platform->allocAccelBuffer(m_bytes);
+    }
+    m_platform->copyBufferHostToAccel(m.data, m_accelBuf, m_bytes);
+  }
+
+  ~BitSerialMatMulOperand() {
+    if(m_pool) {
+      m_pool->free(m_accelBuf);
+    } else {
+      BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+      m_platform->deallocAccelBuffer(m_accelBuf);
+    }
+  }
+
+  void * accelBuf() const {
+    return m_accelBuf;
+  }
+
+  size_t bytes() const {
+    return m_bytes;
+  }
+
+  // shape of the uploaded matrix, without host data
+  const gemmbitserial::BitSerialMatrix & shape() const {
+    return m_shape;
+  }
+
+  // whether this operand can stand in for a matrix of the given shape
+  bool matches(const gemmbitserial::BitSerialMatrix & m) const {
+    return m.nrows_a == m_shape.nrows_a && m.ncols_a == m_shape.ncols_a &&
+      m.nbits == m_shape.nbits && m.issigned == m_shape.issigned;
+  }
+
+protected:
+  WrapperRegDriver * m_platform;
+  BitSerialMatMulBufferPool * m_pool;
+  gemmbitserial::BitSerialMatrix m_shape;
+  size_t m_bytes;
+  void * m_accelBuf;
+};
+
+typedef std::shared_ptr<BitSerialMatMulOperand> BitSerialMatMulOperandHandle;
+
+// named operands kept resident in accelerator DRAM under a byte budget. when
+// an upload would exceed the budget, the least recently used operands that
+// are not held by anyone outside the store are evicted. evicted operands
+// must be uploaded again by their owner.
+class BitSerialMatMulOperandStore {
+public:
+  BitSerialMatMulOperandStore(
+    WrapperRegDriver * platform, size_t budgetBytes,
+    BitSerialMatMulBufferPool * pool = 0
+  ) {
+    m_platform = platform;
+    m_pool = pool;
+    m_budget = budgetBytes;
+    m_resident_bytes = 0;
+    m_uploads = 0;
+    m_evictions = 0;
+  }
+
+  // upload m under key, replacing any previous operand with that key.
+  // returns an empty handle if m does not fit in the budget even after
+  // evicting everything that is not in use, the previous operand is then
+  // kept.
+  BitSerialMatMulOperandHandle put(
+    const std::string & key, const gemmbitserial::BitSerialMatrix & m
+  ) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    const size_t bytes = footprint(
+      m.wordsPerBitplane() * m.nbits * sizeof(PackedBitGroupType)
+    );
+    if(!make_room(bytes, key)) {
+      return BitSerialMatMulOperandHandle();
+    }
+    erase(key);
+    BitSerialMatMulOperandHandle h =
+      std::make_shared<BitSerialMatMulOperand>(m_platform, m, m_pool);
+    m_lru.push_front(key);
+    m_entries[key] = std::make_pair(h, m_lru.begin());
+    m_resident_bytes += bytes;
+    m_uploads++;
+    return h;
+  }
+
+  // the operand stored under key, or an empty handle if it was never put
+  // or has been evicted
+  BitSerialMatMulOperandHandle get(const std::string & key) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    auto it = m_entries.find(key);
+    if(it == m_entries.end()) {
+      return BitSerialMatMulOperandHandle();
+    }
+    // mark as most recently used
+    m_lru.splice(m_lru.begin(), m_lru, it->second.second);
+    return it->second.first;
+  }
+
+  // drop the store's reference, the buffer is freed once unused and counts
+  // against the budget until then
+  void remove(const std::string & key) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    erase(key);
+  }
+
+  // device memory held by stored operands and by replaced or removed ones
+  // that are still in use, in buffer pool size classes if there is a pool
+  size_t residentBytes() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_resident_bytes + detached_bytes();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_entries.size();
+  }
+
+  uint64_t uploads() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_uploads;
+  }
+
+  uint64_t evictions() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_evictions;
+  }
+
+protected:
+  typedef std::list<std::string>::iterator LRUPos;
+
+  WrapperRegDriver * m_platform;
+  BitSerialMatMulBufferPool * m_pool;
+  size_t m_budget;
+  size_t m_resident_bytes;
+  uint64_t m_uploads;
+  uint64_t m_evictions;
+  mutable std::mutex m_lock;
+  // most recently used first
+  std::list<std::string> m_lru;
+  std::map<std::string, std::pair<BitSerialMatMulOperandHandle, LRUPos>> m_entries;
+  // replaced or removed operands that executors still hold, with their
+  // footprint. their buffers are freed with the last handle.
+  std::list<std::pair<std::weak_ptr<BitSerialMatMulOperand>, size_t>> m_detached;
+
+  // device memory taken by an operand of the given size
+  size_t footprint(size_t bytes) const {
+    return m_pool ? BitSerialMatMulBufferPool::sizeClass(bytes) : bytes;
+  }
+
+  size_t detached_bytes() const {
+    size_t ret = 0;
+    for(auto & d : m_detached) {
+      ret += d.first.expired() ? 0 : d.second;
+    }
+    return ret;
+  }
+
+  // forget detached operands that have been freed
+  void reap() {
+    auto it = m_detached.begin();
+    while(it != m_detached.end()) {
+      if(it->first.expired()) {
+        it = m_detached.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  void erase(const std::string & key) {
+    auto it = m_entries.find(key);
+    if(it != m_entries.end()) {
+      const BitSerialMatMulOperandHandle & h = it->second.first;
+      const size_t bytes = footprint(h->bytes());
+      m_resident_bytes -= bytes;
+      if(h.use_count() > 1) {
+        m_detached.push_back(std::make_pair(std::weak_ptr<BitSerialMatMulOperand>(h), bytes));
+      }
+      m_lru.erase(it->second.second);
+      m_entries.erase(it);
+    }
+  }
+
+  // whether only the store holds the operand, so no executor is bound to it
+  static bool unused(const BitSerialMatMulOperandHandle & h) {
+    return h.use_count() == 1;
+  }
+
+  // evict unused operands, least recently used first, until bytes fit. the
+  // operand under replaceKey, if any, is about to be replaced: it is not
+  // evicted, and its footprint is free if it is unused. evicts nothing if
+  // bytes would not fit after evicting everything that is unused.
+  bool make_room(size_t bytes, const std::string & replaceKey) {
+    reap();
+    size_t used = m_resident_bytes + detached_bytes();
+    size_t reclaimable = 0;
+    for(auto & e : m_entries) {
+      if(unused(e.second.first)) {
+        const size_t b = footprint(e.second.first->bytes());
+        reclaimable += b;
+        if(e.first == replaceKey) {
+          used -= b;
+          reclaimable -= b;
+        }
+      }
+    }
+    if(used + bytes > m_budget + reclaimable) {
+      return false;
+    }
+    auto pos = m_lru.end();
+    while(used + bytes > m_budget && pos != m_lru.begin()) {
+      --pos;
+      auto it = m_entries.find(*pos);
+      if(*pos != replaceKey && unused(it->second.first)) {
+        auto victim = pos++;
+        const size_t b = footprint(it->second.first->bytes());
+        m_resident_bytes -= b;
+        used -= b;
+        m_entries.erase(it);
+        m_lru.erase(victim);
+        m_evictions++;
+      }
+    }
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,279 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef BitSerialMatMulPacker_H
+#define BitSerialMatMulPacker_H
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include "BitSerialMatMulAccelDriver.hpp"
+#include "BitSerialMatMulThreads.hpp"
+#include "gemmbitserial/gemmbitserial.hpp"
+
+// bit-plane packing of 8-bit matrices into gemmbitserial::BitSerialMatrix,
+// the layout allocGEMMContext produces for the accelerator. produces the
+// same bits as BitSerialMatrix::importRegular, but extracts 64 columns of a
+// bit plane at a time and splits the rows across threads.
+
+#if !defined(__SSE2__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+// A64-only NEON operations used by the kernels, with ARMv7 equivalents so
+// that 32-bit boards such as the Zynq-7000 also take the SIMD paths
+static inline uint64_t neonAddAcross(uint8x8_t v) {
+#if defined(__aarch64__)
+  return vaddv_u8(v);
+#else
+  return vget_lane_u64(vpaddl_u32(vpaddl_u16(vpaddl_u8(v))), 0);
+#endif
+}
+
+static inline float32x4_t neonDiv(float32x4_t a, float32x4_t b) {
+#if defined(__aarch64__)
+  return vdivq_f32(a, b);
+#else
+  // no vector divide, and a reciprocal estimate would not match the scalar
+  // path, so divide lane by lane
+  float x[4], y[4];
+  vst1q_f32(x, a);
+  vst1q_f32(y, b);
+  for(size_t i = 0; i < 4; i++) {
+    x[i] /= y[i];
+  }
+  return vld1q_f32(x);
+#endif
+}
+
+// round to nearest even like lrintf, for values clamped to the k-bit range
+static inline int32x4_t neonRound(float32x4_t y) {
+#if defined(__aarch64__)
+  return vcvtnq_s32_f32(y);
+#else
+  // adding and subtracting 1.5 * 2^23 rounds to an integer, which then
+  // converts exactly
+  const float32x4_t magic = vdupq_n_f32(12582912.0f);
+  return vcvtq_s32_f32(vsubq_f32(vaddq_f32(y, magic), magic));
+#endif
+}
+#endif
+
+// pack 64 8-bit values into one word per bit plane. word b is written to
+// dst[b * planeStride].
+static inline void packBitSerialChunk(
+  const uint8_t * src, size_t nbits, uint64_t * dst, size_t planeStride
+) {
+#if defined(__SSE2__)
+  __m128i v[4];
+  for(size_t k = 0; k < 4; k++) {
+    v[k] = _mm_loadu_si128((const __m128i *) &src[16 * k]);
+  }
+  for(size_t b = 0; b < nbits; b++) {
+    // move bit b into the top bit of each byte and gather the top bits.
+    // 16-bit shifts are fine since bits from the low byte never reach the
+    // top of the high byte.
+    const __m128i cnt = _mm_cvtsi32_si128(7 - (int) b);
+    uint64_t word = 0;
+    for(size_t k = 0; k < 4; k++) {
+      uint64_t m = (uint16_t) _mm_movemask_epi8(_mm_sll_epi16(v[k], cnt));
+      word |= m << (16 * k);
+    }
+    dst[b * planeStride] = word;
+  }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  const int8_t posv[16] = {0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7};
+  const int8x16_t pos = vld1q_s8(posv);
+  uint8x16_t v[4];
+  for(size_t k = 0; k < 4; k++) {
+    v[k] = vld1q_u8(&src[16 * k]);
+  }
+  for(size_t b = 0; b < nbits; b++) {
+    // isolate bit b of each byte, move it to the lane position and add up
+    const int8x16_t shr = vdupq_n_s8(-(int8_t) b);
+    uint64_t word = 0;
+    for(size_t k = 0; k < 4; k++) {
+      uint8x16_t bits = vandq_u8(vshlq_u8(v[k], shr), vdupq_n_u8(1));
+      bits = vshlq_u8(bits, pos);
+      uint64_t lo = neonAddAcross(vget_low_u8(bits));
+      uint64_t hi = neonAddAcross(vget_high_u8(bits));
+      word |= (lo | (hi << 8)) << (16 * k);
+    }
+    dst[b * planeStride] = word;
+  }
+#else
+  uint64_t v[8];
+  memcpy(v, src, sizeof(v));
+  for(size_t b = 0; b < nbits; b++) {
+    uint64_t word = 0;
+    for(size_t k = 0; k < 8; k++) {
+      // gather bit b of the 8 bytes into the top byte with one multiply
+      uint64_t m = ((v[k] >> b) & 0x0101010101010101ULL) * 0x0102040810204080ULL;
+      word |= (m >> 56) << (8 * k);
+    }
+    dst[b * planeStride] = word;
+  }
+#endif
+}
+
+// pack one row of cols 8-bit values into row of a bit-serial matrix, the
+// alignment columns are zeroed
+template <typename T>
+void packBitSerialRow(
+  const T * src, size_t cols, gemmbitserial::BitSerialMatrix & to, size_t row
+) {
+  static_assert(sizeof(T) == 1, "packBitSerialRow packs 8-bit values");
+  const uint8_t * s = (const uint8_t *) src;
+  const size_t wpr = to.wordsPerRow();
+  const size_t planeStride = to.wordsPerBitplane();
+  uint64_t * dst = to.rowptr(0, row);
+  size_t w = 0;
+  for(; (w + 1) * 64 <= cols; w++) {
+    packBitSerialChunk(&s[w * 64], to.nbits, &dst[w], planeStride);
+  }
+  if(w < wpr) {
+    // last partial chunk, padded with zeroes
+    uint8_t tail[64] = {0};
+    if(w * 64 < cols) {
+      memcpy(tail, &s[w * 64], cols - w * 64);
+    }
+    packBitSerialChunk(tail, to.nbits, &dst[w], planeStride);
+    for(w++; w < wpr; w++) {
+      for(size_t b = 0; b < to.nbits; b++) {
+        dst[b * planeStride + w] = 0;
+      }
+    }
+  }
+}
+
+// pack a dense row-major nrows x ncols matrix into a bit-serial matrix,
+// including the alignment rows and columns, so no clearAll is needed
+template <typename T>
+void packBitSerial(
+  const T * src, gemmbitserial::BitSerialMatrix & to, unsigned threads = 0
+) {
+  const size_t rows = to.nrows, cols = to.ncols;
+  parallelRows(to.nrows_a, to.ncols_a, threads, [&](size_t begin, size_t end) {
+    for(size_t r = begin; r < end; r++) {
+      if(r < rows) {
+        packBitSerialRow(&src[r * cols], cols, to, r);
+      } else {
+        for(size_t b = 0; b < to.nbits; b++) {
+          memset(to.rowptr(b, r), 0, to.wordsPerRow() * sizeof(uint64_t));
+        }
+      }
+    }
+  });
+}
+
+// quantize n <= 64 floats to round(x / scale) + zeroPoint, clamped to
+// [lo, hi] before adding the zero point, and zero-fill the rest of dst
+static inline void quantizeChunk(
+  const float * src, size_t n, float scale, int32_t zeroPoint,
+  float lo, float hi, uint8_t * dst
+) {
+  size_t c = 0;
+#if defined(__SSE2__)
+  const __m128 vscale = _mm_set1_ps(scale);
+  const __m128 vlo = _mm_set1_ps(lo), vhi = _mm_set1_ps(hi);
+  const __m128i vzp = _mm_set1_epi32(zeroPoint);
+  for(; c + 4 <= n; c += 4) {
+    __m128 y = _mm_div_ps(_mm_loadu_ps(&src[c]), vscale);
+    y = _mm_min_ps(_mm_max_ps(y, vlo), vhi);
+    __m128i q = _mm_add_epi32(_mm_cvtps_epi32(y), vzp);
+    // keep the low byte of each value
+    q = _mm_packs_epi32(q, q);
+    q = _mm_packus_epi16(_mm_and_si128(q, _mm_set1_epi16(0xff)), q);
+    int32_t w = _mm_cvtsi128_si32(q);
+    memcpy(&dst[c], &w, sizeof(w));
+  }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  const float32x4_t vscale = vdupq_n_f32(scale);
+  const float32x4_t vlo = vdupq_n_f32(lo), vhi = vdupq_n_f32(hi);
+  const int32x4_t vzp = vdupq_n_s32(zeroPoint);
+  for(; c + 4 <= n; c += 4) {
+    float32x4_t y = neonDiv(vld1q_f32(&src[c]), vscale);
+    y = vminq_f32(vmaxq_f32(y, vlo), vhi);
+    int32x4_t q = vaddq_s32(neonRound(y), vzp);
+    int16x4_t h = vmovn_s32(q);
+    int8x8_t b = vmovn_s16(vcombine_s16(h, h));
+    int32_t w = vget_lane_s32(vreinterpret_s32_s8(b), 0);
+    memcpy(&dst[c], &w, sizeof(w));
+  }
+#endif
+  for(; c < n; c++) {
+    float y = src[c] / scale;
+    y = y < lo ? lo : y;
+    y = y > hi ? hi : y;
+    dst[c] = (uint8_t)(lrintf(y) + zeroPoint);
+  }
+  for(; c < 64; c++) {
+    dst[c] = 0;
+  }
+}
+
+// quantize a dense row-major nrows x ncols float matrix to the precision and
+// signedness of a bit-serial matrix and pack it, in one pass. scale and
+// zeroPoint hold one value for the whole matrix, or one per row if perRow is
+// set. zeroPoint may be 0 for no zero point.
+static inline void quantizePackBitSerial(
+  const float * src, gemmbitserial::BitSerialMatrix & to,
+  const float * scale, const int32_t * zeroPoint, bool perRow,
+  unsigned threads = 0
+) {
+  assert(to.nbits >= 1 && to.nbits <= 8);
+  const size_t rows = to.nrows, cols = to.ncols;
+  const int32_t qmin = to.issigned ? -(1 << (to.nbits - 1)) : 0;
+  const int32_t qmax = to.issigned ? (1 << (to.nbits - 1)) - 1 : (1 << to.nbits) - 1;
+  parallelRows(to.nrows_a, to.ncols_a, threads, [&](size_t begin, size_t end) {
+    uint8_t chunk[64];
+    const size_t wpr = to.wordsPerRow();
+    const size_t planeStride = to.wordsPerBitplane();
+    for(size_t r = begin; r < end; r++) {
+      uint64_t * dst = to.rowptr(0, r);
+      if(r >= rows) {
+        for(size_t b = 0; b < to.nbits; b++) {
+          memset(&dst[b * planeStride], 0, wpr * sizeof(uint64_t));
+        }
+        continue;
+      }
+      const float s = scale[perRow ? r : 0];
+      const int32_t zp = zeroPoint ? zeroPoint[perRow ? r : 0] : 0;
+      const float lo = (float)(qmin - zp), hi = (float)(qmax - zp);
+      for(size_t w = 0; w < wpr; w++) {
+        const size_t c0 = w * 64;
+        const size_t n = c0 + 64 <= cols ? 64 : (c0 < cols ? cols - c0 : 0);
+        quantizeChunk(&src[r * cols + c0], n, s, zp, lo, hi, chunk);
+        packBitSerialChunk(chunk, to.nbits, &dst[w], planeStride);
+      }
+    }
+  });
+}
+
+#endif
@@ -0,0 +1,351 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef BitSerialMatMulPerfModel_H
+#define BitSerialMatMulPerfModel_H
+
+#include <cassert>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include "BitSerialMatMulAccelDriver.hpp"
+#include "BitSerialMatMulPlan.hpp"
+#include "gemmbitserial/gemmbitserial.hpp"
+
+// cycle costs of the hardware that are not part of the HardwareCfg. the
+// defaults follow the Chisel sources: one cycle in csGetCmd per op, the
+// DMA and DPA pipeline latencies, and a typical DRAM round trip.
+typedef struct {
+  // cycles in csGetCmd to decode each op
+  uint32_t getCmdCycles;
+  // cycles in csSend to hand over a token
+  uint32_t sendCycles;
+  // fixed cost of a fetch run: DRAM read latency and DMA-to-BRAM pipeline
+  uint32_t fetchRunCycles;
+  // extra cost per DRAM block in a fetch run, for the new burst
+  uint32_t fetchBlockCycles;
+  // fixed cost of an exec run: BRAM read and DPA pipeline latency
+  uint32_t execRunCycles;
+  // fixed cost of a result run writing a tile
+  uint32_t resultRunCycles;
+  // cost of a result run that waits for all writes to complete
+  uint32_t resultWaitCycles;
+} PerfModelParams;
+
+static inline PerfModelParams defaultPerfModelParams() {
+  PerfModelParams p;
+  p.getCmdCycles = 1;
+  p.sendCycles = 1;
+  p.fetchRunCycles = 40;
+  p.fetchBlockCycles = 2;
+  p.execRunCycles = 10;
+  p.resultRunCycles = 20;
+  p.resultWaitCycles = 40;
+  return p;
+}
+
+// predicted runtime of a plan, in the same terms as the executor's
+// performance counters
+typedef struct {
+  uint64_t cycles;
+  uint64_t fetch_cstate_cycles[N_CTRL_STATES];
+  uint64_t exec_cstate_cycles[N_CTRL_STATES];
+  uint64_t result_cstate_cycles[N_CTRL_STATES];
+} PerfPrediction;
+
+// The BitSerialMatMulPerfModel predicts the runtime of a plan without running
+// it. Each stage walks its op stream, spending the modeled cycles per op,
+// and the token FIFOs between the stages carry the time each token was sent,
+// so a receive waits until the matching send has happened. This gives the
+// overlap between the stages and the per-stage state cycles that
+// printPerfDetails reports. The model assumes the command queues never run
+// empty, i.e. the host or the command fetcher keeps up.
+class BitSerialMatMulPerfModel {
+public:
+  BitSerialMatMulPerfModel(
+    const HardwareCfg & hwcfg, PerfModelParams params = defaultPerfModelParams()
+  ) {
+    m_hwcfg = hwcfg;
+    m_params = params;
+  }
+
+  PerfPrediction predict(const BitSerialMatMulPlan & plan) const {
+    Stage st[3];
+    st[0].ops = &plan.fetchOps();
+    st[1].ops = &plan.execOps();
+    st[2].ops = &plan.resultOps();
+    // token FIFOs as (from, to) pairs of stage and sync channel
+    std::deque<uint64_t> fetch_to_exec, exec_to_fetch, exec_to_res, res_to_exec;
+    // tokens handed out by init_resource_pools before the first run
+    exec_to_fetch.assign(FETCHEXEC_TOKENS, 0);
+    res_to_exec.assign(EXECRES_TOKENS, 0);
+    // send and receive FIFOs of each stage, indexed by sync channel
+    std::deque<uint64_t> * send[3][2] = {
+      {&fetch_to_exec, 0}, {&exec_to_fetch, &exec_to_res}, {&res_to_exec, 0}
+    };
+    std::deque<uint64_t> * recv[3][2] = {
+      {&exec_to_fetch, 0}, {&fetch_to_exec, &res_to_exec}, {&exec_to_res, 0}
+    };
+    bool progress = true;
+    while(progress) {
+      progress = false;
+      for(int s = 0; s < 3; s++) {
+        // run the stage until it blocks on a token or runs out of ops
+        while(st[s].next < st[s].ops->size()) {
+          const Op & op = (*st[s].ops)[st[s].next];
+          assert(op.syncChannel < 2);
+          if(op.opcode == opReceiveToken) {
+            std::deque<uint64_t> * q = recv[s][op.syncChannel];
+            assert(q != 0);
+            if(q->empty()) {
+              break;
+            }
+            st[s].spend(csGetCmd, m_params.getCmdCycles);
+            // at least one cycle, more if the token was sent later
+            const uint64_t ready = (q->front() > st[s].now + 1) ? q->front() : st[s].now + 1;
+            st[s].spend(csReceive, ready - st[s].now);
+            q->pop_front();
+          } else if(op.opcode == opSendToken) {
+            std::deque<uint64_t> * q = send[s][op.syncChannel];
+            assert(q != 0);
+            st[s].spend(csGetCmd, m_params.getCmdCycles);
+            st[s].spend(csSend, m_params.sendCycles);
+            q->push_back(st[s].now);
+          } else {
+            st[s].spend(csGetCmd, m_params.getCmdCycles);
+            st[s].spend(csRun, run_cycles(plan, s, st[s].runs++));
+          }
+          st[s].next++;
+          progress = true;
+        }
+      }
+    }
+    PerfPrediction ret;
+    ret.cycles = 0;
+    for(int s = 0; s < 3; s++) {
+      // a blocked stage means the token handshakes of the plan are broken
+      assert(st[s].next == st[s].ops->size());
+      if(st[s].now > ret.cycles) {
+        ret.cycles = st[s].now;
+      }
+    }
+    uint64_t * cstate[3] = {
+      ret.fetch_cstate_cycles, ret.exec_cstate_cycles, ret.result_cstate_cycles
+    };
+    for(int s = 0; s < 3; s++) {
+      // stages that finish early wait for the next op until the end
+      st[s].spend(csGetCmd, ret.cycles - st[s].now);
+      for(int i = 0; i < N_CTRL_STATES; i++) {
+        cstate[s][i] = st[s].cstate[i];
+      }
+    }
+    return ret;
+  }
+
+  // print a prediction in the same layout as printPerfDetails
+  static void printPrediction(const PerfPrediction & p) {
+    int colwidth = 11;
+    std::cout << "Predicted Cycles Spent in ControllerState ==============" << std::endl;
+    std::cout << std::left << std::setw(colwidth) << "Stage";
+    std::cout << std::left << std::setw(colwidth) << "csGetCmd";
+    std::cout << std::left << std::setw(colwidth) << "csRun";
+    std::cout << std::left << std::setw(colwidth) << "csSend";
+    std::cout << std::left << std::setw(colwidth) << "csReceive" << std::endl;
+    const char * names[3] = {"Fetch", "Execute", "Result"};
+    const uint64_t * cstate[3] = {
+      p.fetch_cstate_cycles, p.exec_cstate_cycles, p.result_cstate_cycles
+    };
+    for(int s = 0; s < 3; s++) {
+      std::cout << std::left << std::setw(colwidth) << names[s];
+      for(int i = 0; i < N_CTRL_STATES; i++) {
+        std::cout << std::left << std::setw(colwidth) << cstate[s][i];
+      }
+      std::cout << std::endl;
+    }
+    std::cout << "Runtime: " << p.cycles << " cycles" << std::endl;
+    std::cout << "========================================================" << std::endl;
+  }
+
+protected:
+  HardwareCfg m_hwcfg;
+  PerfModelParams m_params;
+
+  // progress of one stage through its op stream
+  struct Stage {
+    const std::vector<Op> * ops;
+    size_t next = 0;
+    // runcfgs consumed so far
+    size_t runs = 0;
+    uint64_t now = 0;
+    uint64_t cstate[N_CTRL_STATES] = {0};
+
+    void spend(ControllerState s, uint64_t cycles) {
+      cstate[s] += cycles;
+      now += cycles;
+    }
+  };
+
+  static uint64_t div_ceil(uint64_t a, uint64_t b) {
+    return (a + b - 1) / b;
+  }
+
+  // cycles in csRun for the i-th run op of the given stage
+  uint64_t run_cycles(const BitSerialMatMulPlan & plan, int stage, size_t i) const {
+    if(stage == 0) {
+      const FetchRunCfg & f = plan.fetchRunCfgs()[i];
+      const uint64_t bytes = (uint64_t) f.dram_block_size_bytes * f.dram_block_count;
+      return m_params.fetchRunCycles + div_ceil(bytes, m_hwcfg.readChanWidth / 8) +
+        (uint64_t) m_params.fetchBlockCycles * f.dram_block_count;
+    } else if(stage == 1) {
+      // one L0 tile per cycle for the whole L1 tile
+      return m_params.execRunCycles + plan.execRunCfgs()[i].numTiles;
+    } else {
+      const ResultRunCfg & r = plan.resultRunCfgs()[i];
+      if(r.waitComplete) {
+        return m_params.resultWaitCycles;
+      }
+      const uint64_t bytes = m_hwcfg.dpaDimLHS * m_hwcfg.dpaDimRHS * sizeof(ResultType);
+      return m_params.resultRunCycles + div_ceil(bytes, m_hwcfg.writeChanWidth / 8);
+    }
+  }
+};
+
+// one GEMM of a workload to explore overlays for, e.g. a layer of a model
+typedef struct {
+  uint64_t lhsRows, depth, rhsRows;
+  uint64_t lhsBits, rhsBits;
+  bool lhsSigned, rhsSigned;
+} GEMMShape;
+
+// predicted runtime of a workload on one overlay
+typedef struct {
+  HardwareCfg hwcfg;
+  // total over all shapes of the workload, and per shape
+  uint64_t cycles;
+  std::vector<uint64_t> shapeCycles;
+  // peak binary ops per cycle, as a measure of the overlay's size
+  uint64_t peakBinaryOpsPerCycle;
+} OverlayEstimate;
+
+// GEMMContext describing the shape only, without allocating any matrix data.
+// aligned like allocGEMMContext, and to a whole L0 tile for wide overlays.
+static inline gemmbitserial::GEMMContext makeGEMMShape(
+  const GEMMShape & s, const HardwareCfg & hw
+) {
+  const uint64_t colalign = (hw.dpaDimCommon > FETCH_ALIGN * 8) ? hw.dpaDimCommon : FETCH_ALIGN * 8;
+  gemmbitserial::GEMMContext c = gemmbitserial::GEMMContext();
+  gemmbitserial::BitSerialMatrix * m[2] = {&c.lhs, &c.rhs};
+  const uint64_t rows[2] = {s.lhsRows, s.rhsRows};
+  const uint64_t bits[2] = {s.lhsBits, s.rhsBits};
+  const bool sgn[2] = {s.lhsSigned, s.rhsSigned};
+  const uint64_t rowalign[2] = {hw.dpaDimLHS, hw.dpaDimRHS};
+  for(int i = 0; i < 2; i++) {
+    m[i]->nbits = bits[i];
+    m[i]->issigned = sgn[i];
+    m[i]->nrows = rows[i];
+    m[i]->ncols = s.depth;
+    m[i]->nrows_a = (rows[i] + rowalign[i] - 1) / rowalign[i] * rowalign[i];
+    m[i]->ncols_a = (s.depth + colalign - 1) / colalign * colalign;
+    m[i]->data = 0;
+  }
+  c.lhsBlock = hw.dpaDimLHS;
+  c.rhsBlock = hw.dpaDimRHS;
+  c.res = 0;
+  return c;
+}
+
+// rank hypothetical overlays for a workload by predicted runtime. every
+// combination of the given DPA dimensions (the M, K and N of the overlay
+// build) is considered, with the remaining parameters taken from base.
+// overlays that cannot run all shapes of the workload are left out. returns
+// the fastest first, ties go to the smaller overlay.
+static inline std::vector<OverlayEstimate> exploreOverlays(
+  const HardwareCfg & base, const std::vector<uint32_t> & dimsLHS,
+  const std::vector<uint32_t> & dimsCommon, const std::vector<uint32_t> & dimsRHS,
+  const std::vector<GEMMShape> & workload,
+  PerfModelParams params = defaultPerfModelParams()
+) {
+  std::vector<OverlayEstimate> ret;
+  for(auto m : dimsLHS) {
+    for(auto k : dimsCommon) {
+      for(auto n : dimsRHS) {
+        OverlayEstimate e;
+        e.hwcfg = base;
+        e.hwcfg.dpaDimLHS = m;
+        e.hwcfg.dpaDimCommon = k;
+        e.hwcfg.dpaDimRHS = n;
+        e.cycles = 0;
+        e.peakBinaryOpsPerCycle = 2 * (uint64_t) m * k * n;
+        BitSerialMatMulPerfModel model(e.hwcfg, params);
+        bool supported = true;
+        for(auto & s : workload) {
+          gemmbitserial::GEMMContext shape = makeGEMMShape(s, e.hwcfg);
+          if(!BitSerialMatMulPlan::isSupported(shape, e.hwcfg)) {
+            supported = false;
+            break;
+          }
+          BitSerialMatMulPlan plan(shape, e.hwcfg);
+          e.shapeCycles.push_back(model.predict(plan).cycles);
+          e.cycles += e.shapeCycles.back();
+        }
+        if(supported) {
+          ret.push_back(e);
+        }
+      }
+    }
+  }
+  std::stable_sort(ret.begin(), ret.end(),
+    [](const OverlayEstimate & a, const OverlayEstimate & b) {
+      if(a.cycles != b.cycles) {
+        return a.cycles < b.cycles;
+      }
+      return a.peakBinaryOpsPerCycle < b.peakBinaryOpsPerCycle;
+    }
+  );
+  return ret;
+}
+
+static inline void printOverlayRanking(
+  const std::vector<OverlayEstimate> & ranking, size_t top = 10
+) {
+  std::cout << "Overlay Ranking ========================================" << std::endl;
+  for(size_t i = 0; i < ranking.size() && i < top; i++) {
+    const OverlayEstimate & e = ranking[i];
+    std::cout << i + 1 << ". " << e.hwcfg.dpaDimLHS << "x" << e.hwcfg.dpaDimCommon;
+    std::cout << "x" << e.hwcfg.dpaDimRHS << ": " << e.cycles << " cycles, ";
+    std::cout << e.peakBinaryOpsPerCycle << " peak binary ops/cycle (";
+    std::cout << 100.0 * e.cycles / ranking[0].cycles << "% of best)" << std::endl;
+  }
+  std::cout << "========================================================" << std::endl;
+}
+
+#endif
@@ -0,0 +1,184 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef BitSerialMatMulPerfReport_H
+#define BitSerialMatMulPerfReport_H
+
+#include <sstream>
+#include <string>
+#include "BitSerialMatMulAccelDriver.hpp"
+
+// a stage counts as the bottleneck when it spent at least this fraction of
+// the runtime in csRun, otherwise the run is sync-bound
+#define BOTTLENECK_RUN_FRACTION     0.5
+
+typedef enum {
+  boundFetch = 0, boundExec, boundResult, boundSync
+} Bottleneck;
+
+// machine-readable summary of one run, see printPerfSummary and
+// printPerfDetails for the meaning of the fields
+typedef struct {
+  // shape and schedule
+  uint64_t lhsRows, depth, rhsRows, lhsBits, rhsBits;
+  const char * scheduleOrder;
+  uint32_t l0PerL1;
+  // runtime
+  uint64_t cycles;
+  float fclkMHz;
+  double nanoseconds;
+  // work and compute roofline
+  double binaryOps, actualBinaryOps;
+  float achievedGOPS, peakGOPS;
+  float readOI, writeOI, hwCompBoundReadOI, hwCompBoundWriteOI;
+  // memory system, bandwidths in bytes per cycle
+  uint64_t bytesRead, bytesWritten;
+  float peakReadBW, effectiveReadBW, fetchReadBW;
+  float peakWriteBW, effectiveWriteBW, resultWriteBW;
+  // cycles per ControllerState for each stage
+  uint64_t fetchCycles[N_CTRL_STATES];
+  uint64_t execCycles[N_CTRL_STATES];
+  uint64_t resultCycles[N_CTRL_STATES];
+  // limiting stage, and the fraction of the runtime it spent in csRun, or
+  // for sync-bound runs the fraction no stage was running
+  Bottleneck bottleneck;
+  float limitingRatio;
+} PerfReport;
+
+static inline const char * getBottleneckName(Bottleneck b) {
+  switch(b) {
+    case boundFetch: return "fetch-bound";
+    case boundExec: return "exec-bound";
+    case boundResult: return "result-bound";
+    case boundSync: return "sync-bound";
+  }
+  return "unknown";
+}
+
+// a / b, or 0 when there is nothing to divide by, so reports stay valid JSON
+static inline float perfRatio(double a, double b) {
+  return b > 0 ? a / b : 0;
+}
+
+// fill in the bottleneck fields from the stage cycles
+static inline void classifyPerfReport(PerfReport & r) {
+  const uint64_t run[3] = {
+    r.fetchCycles[csRun], r.execCycles[csRun], r.resultCycles[csRun]
+  };
+  int busiest = 0;
+  for(int s = 1; s < 3; s++) {
+    if(run[s] > run[busiest]) {
+      busiest = s;
+    }
+  }
+  const float busy = perfRatio(run[busiest], r.cycles);
+  if(busy >= BOTTLENECK_RUN_FRACTION) {
+    r.bottleneck = (Bottleneck) busiest;
+    r.limitingRatio = busy;
+  } else {
+    r.bottleneck = boundSync;
+    r.limitingRatio = 1 - busy;
+  }
+}
+
+// one JSON object per report
+static inline std::string perfReportJSON(const PerfReport & r) {
+  std::ostringstream o;
+  const char * stages[3] = {"fetch", "exec", "result"};
+  const uint64_t * cs[3] = {r.fetchCycles, r.execCycles, r.resultCycles};
+  const char * states[N_CTRL_STATES] = {"csGetCmd", "csRun", "csSend", "csReceive"};
+  o << "{\"shape\": {\"lhsRows\": " << r.lhsRows << ", \"depth\": " << r.depth;
+  o << ", \"rhsRows\": " << r.rhsRows << ", \"lhsBits\": " << r.lhsBits;
+  o << ", \"rhsBits\": " << r.rhsBits << "}";
+  o << ", \"schedule\": {\"order\": \"" << r.scheduleOrder << "\", \"l0PerL1\": " << r.l0PerL1 << "}";
+  o << ", \"cycles\": " << r.cycles << ", \"fclkMHz\": " << r.fclkMHz;
+  o << ", \"nanoseconds\": " << r.nanoseconds;
+  o << ", \"binaryOps\": " << r.binaryOps << ", \"actualBinaryOps\": " << r.actualBinaryOps;
+  o << ", \"achievedGOPS\": " << r.achievedGOPS << ", \"peakGOPS\": " << r.peakGOPS;
+  o << ", \"readOI\": " << r.readOI << ", \"writeOI\": " << r.writeOI;
+  o << ", \"hwCompBoundReadOI\": " << r.hwCompBoundReadOI;
+  o << ", \"hwCompBoundWriteOI\": " << r.hwCompBoundWriteOI;
+  o << ", \"bytesRead\": " << r.bytesRead << ", \"bytesWritten\": " << r.bytesWritten;
+  o << ", \"peakReadBW\": " << r.peakReadBW << ", \"effectiveReadBW\": " << r.effectiveReadBW;
+  o << ", \"fetchReadBW\": " << r.fetchReadBW;
+  o << ", \"peakWriteBW\": " << r.peakWriteBW << ", \"effectiveWriteBW\": " << r.effectiveWriteBW;
+  o << ", \"resultWriteBW\": " << r.resultWriteBW;
+  o << ", \"stages\": {";
+  for(int s = 0; s < 3; s++) {
+    o << (s ? ", " : "") << "\"" << stages[s] << "\": {";
+    for(int i = 0; i < N_CTRL_STATES; i++) {
+      o << (i ? ", " : "") << "\"" << states[i] << "\": " << cs[s][i];
+    }
+    o << "}";
+  }
+  o << "}";
+  o << ", \"bottleneck\": \"" << getBottleneckName(r.bottleneck) << "\"";
+  o << ", \"limitingRatio\": " << r.limitingRatio << "}";
+  return o.str();
+}
+
+// CSV header matching perfReportCSVRow
+static inline std::string perfReportCSVHeader() {
+  std::ostringstream o;
+  o << "lhsRows,depth,rhsRows,lhsBits,rhsBits,scheduleOrder,l0PerL1,";
+  o << "cycles,fclkMHz,nanoseconds,binaryOps,actualBinaryOps,achievedGOPS,peakGOPS,";
+  o << "readOI,writeOI,hwCompBoundReadOI,hwCompBoundWriteOI,bytesRead,bytesWritten,";
+  o << "peakReadBW,effectiveReadBW,fetchReadBW,peakWriteBW,effectiveWriteBW,resultWriteBW";
+  for(const char * s : {"fetch", "exec", "result"}) {
+    for(const char * st : {"csGetCmd", "csRun", "csSend", "csReceive"}) {
+      o << "," << s << "_" << st;
+    }
+  }
+  o << ",bottleneck,limitingRatio";
+  return o.str();
+}
+
+static inline std::string perfReportCSVRow(const PerfReport & r) {
+  std::ostringstream o;
+  o << r.lhsRows << "," << r.depth << "," << r.rhsRows << "," << r.lhsBits << ",";
+  o << r.rhsBits << "," << r.scheduleOrder << "," << r.l0PerL1 << ",";
+  o << r.cycles << "," << r.fclkMHz << "," << r.nanoseconds << ",";
+  o << r.binaryOps << "," << r.actualBinaryOps << "," << r.achievedGOPS << ",";
+  o << r.peakGOPS << "," << r.readOI << "," << r.writeOI << ",";
+  o << r.hwCompBoundReadOI << "," << r.hwCompBoundWriteOI << ",";
+  o << r.bytesRead << "," << r.bytesWritten << ",";
+  o << r.peakReadBW << "," << r.effectiveReadBW << "," << r.fetchReadBW << ",";
+  o << r.peakWriteBW << "," << r.effectiveWriteBW << "," << r.resultWriteBW;
+  for(const uint64_t * cs : {r.fetchCycles, r.execCycles, r.resultCycles}) {
+    for(int i = 0; i < N_CTRL_STATES; i++) {
+      o << "," << cs[i];
+    }
+  }
+  o << "," << getBottleneckName(r.bottleneck) << "," << r.limitingRatio;
+  return o.str();
+}
+
+#endif
@@ -0,0 +1,1457 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef BitSerialMatMulPlan_H
+#define BitSerialMatMulPlan_H
+
+#include <cassert>
+#include <atomic>
+#include <cinttypes>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "BitSerialMatMulAccelDriver.hpp"
+#include "gemmbitserial/gemmbitserial.hpp"
+
+#define min(x,y) (x < y ? x : y)
+#define max(x,y) (x > y ? x : y)
+#define INVALID_CACHE_ENTRY         (uint64_t) -1
+// serialized plan format: magic string and version, bump the version
+// whenever the encoding changes
+#define PLAN_MAGIC                  "BISMOPLN"
+#define PLAN_MAGIC_BYTES            8
+#define PLAN_FORMAT_VERSION         1
+// tuning database text format
+#define TUNING_DB_MAGIC             "BISMOTUNE"
+#define TUNING_DB_FORMAT_VERSION    1
+// plans kept by the plan cache before the least recently used are dropped
+#define PLAN_CACHE_DEFAULT_CAPACITY 256
+
+// loop orders for visiting the output tiles. the DPA accumulators hold one
+// output tile at a time, so the common dimension is always innermost.
+typedef enum {
+  // LHS L2 tile outermost, all RHS tiles stream past it
+  orderLHSStationary = 0,
+  // RHS L2 tile outermost, all LHS tiles stream past it
+  orderRHSStationary,
+  // serpentine walk over the output tiles, so that consecutive output tiles
+  // always share an operand tile
+  orderOutputStationary
+} ScheduleOrder;
+
+// loop order and L1 tile size (in L0 tiles along the common dimension)
+typedef struct {
+  ScheduleOrder order;
+  uint32_t l0_per_l1;
+} ScheduleCfg;
+
+// accelerator buffer that a DRAM address in a plan is relative to
+typedef enum {
+  bufLHS = 0, bufRHS, bufRes
+} PlanBuffer;
+
+// A BitSerialMatMulPlan holds the generated instructions for one GEMM shape
+// on one hardware config. All DRAM addresses in the runcfgs are offsets into
+// the LHS, RHS or result buffer, so the same plan can be executed on any set
+// of buffers by adding the buffer base addresses when pushing the runcfgs.
+class BitSerialMatMulPlan {
+public:
+  BitSerialMatMulPlan(
+    const gemmbitserial::GEMMContext & shape, const HardwareCfg & hwcfg
+  ) {
+    m_shape = shape;
+    m_hwcfg = hwcfg;
+    m_bytes_to_fetch = 0;
+    m_bytes_to_write = 0;
+    // build schedule for each stage based on shape, using the loop order
+    // and tile size that minimize DRAM reads
+    m_schedule = choose_schedule_cfg();
+    build_schedule(m_schedule, true);
+  }
+
+  // build the plan with the given schedule config, e.g. one picked by the
+  // autotuner. must be one of candidateScheduleCfgs() for this shape.
+  BitSerialMatMulPlan(
+    const gemmbitserial::GEMMContext & shape, const HardwareCfg & hwcfg,
+    const ScheduleCfg & sc
+  ) {
+    m_shape = shape;
+    m_hwcfg = hwcfg;
+    m_bytes_to_fetch = 0;
+    m_bytes_to_write = 0;
+    m_schedule = sc;
+    build_schedule(m_schedule, true);
+  }
+
+  size_t lhsBytes() const {
+    return m_shape.lhs.wordsPerBitplane() * m_shape.lhs.nbits * sizeof(PackedBitGroupType);
+  }
+
+  size_t rhsBytes() const {
+    return m_shape.rhs.wordsPerBitplane() * m_shape.rhs.nbits * sizeof(PackedBitGroupType);
+  }
+
+  size_t resBytes() const {
+    return m_shape.lhs.nrows_a * m_shape.rhs.nrows_a * sizeof(ResultType);
+  }
+
+  const std::vector<Op> & fetchOps() const { return m_fetch_op; }
+  const std::vector<Op> & execOps() const { return m_exec_op; }
+  const std::vector<Op> & resultOps() const { return m_result_op; }
+  const std::vector<FetchRunCfg> & fetchRunCfgs() const { return m_fetch_runcfg; }
+  const std::vector<ExecRunCfg> & execRunCfgs() const { return m_exec_runcfg; }
+  const std::vector<ResultRunCfg> & resultRunCfgs() const { return m_result_runcfg; }
+  // buffer that each fetch runcfg reads from
+  const std::vector<PlanBuffer> & fetchBuffers() const { return m_fetch_buf; }
+  // tiles left in each BRAM slot after the plan has executed
+  const std::vector<uint64_t> & cachedLHS() const { return m_cached_lhs; }
+  const std::vector<uint64_t> & cachedRHS() const { return m_cached_rhs; }
+  // tiles the plan expects in each BRAM slot when it starts, all
+  // INVALID_CACHE_ENTRY except for resident variants
+  const std::vector<uint64_t> & startLHS() const { return m_start_lhs; }
+  const std::vector<uint64_t> & startRHS() const { return m_start_rhs; }
+
+  // variant of this plan for running it again while the LHS and/or RHS tiles
+  // it leaves in BRAM are still there, which skips fetching those again.
+  // built on first use and kept with the plan.
+  std::shared_ptr<const BitSerialMatMulPlan> residentVariant(
+    bool lhsResident, bool rhsResident
+  ) const {
+    assert(lhsResident || rhsResident);
+    std::lock_guard<std::mutex> lock(m_variant_lock);
+    std::shared_ptr<const BitSerialMatMulPlan> & v =
+      m_variants[(lhsResident ? 1 : 0) + (rhsResident ? 2 : 0)];
+    if(!v) {
+      BitSerialMatMulPlan * p = new BitSerialMatMulPlan();
+      p->m_shape = m_shape;
+      p->m_hwcfg = m_hwcfg;
+      p->m_schedule = m_schedule;
+      p->m_bytes_to_fetch = 0;
+      p->m_bytes_to_write = 0;
+      // replay this plan to find the BRAM state it leaves behind, and keep
+      // only the operands that are still resident
+      BRAMState bram;
+      p->build_schedule(m_schedule, false, &bram);
+      if(!lhsResident) {
+        bram.lhs_tags.assign(bram.lhs_tags.size(), INVALID_CACHE_ENTRY);
+        bram.lhs_last_use.assign(bram.lhs_last_use.size(), 0);
+      }
+      if(!rhsResident) {
+        bram.rhs_tags.assign(bram.rhs_tags.size(), INVALID_CACHE_ENTRY);
+        bram.rhs_last_use.assign(bram.rhs_last_use.size(), 0);
+      }
+      p->build_schedule(m_schedule, true, &bram);
+      v.reset(p);
+    }
+    return v;
+  }
+
+  uint64_t bytesToFetch() const { return m_bytes_to_fetch; }
+  uint64_t bytesToWrite() const { return m_bytes_to_write; }
+  ScheduleCfg scheduleCfg() const { return m_schedule; }
+
+  // all legal schedule configs considered by the cost model and the
+  // autotuner: each loop order, with the largest L1 tile and some smaller
+  // ones that allow more tiles to stay resident in BRAM
+  std::vector<ScheduleCfg> candidateScheduleCfgs() const {
+    return candidateScheduleCfgs(m_shape, m_hwcfg);
+  }
+
+  static std::vector<ScheduleCfg> candidateScheduleCfgs(
+    const gemmbitserial::GEMMContext & shape, const HardwareCfg & hwcfg
+  ) {
+    std::vector<ScheduleCfg> ret;
+    const size_t l0_per_stripe = shape.lhs.ncols_a / hwcfg.dpaDimCommon;
+    const size_t z_align = max(1, FETCH_ADDRALIGN / (hwcfg.dpaDimCommon / 8));
+    const size_t l0_max = max_l0_per_l1(shape, hwcfg);
+    std::vector<size_t> l1_sizes {l0_max};
+    for(size_t l0 = l0_max / 2; l0 >= z_align && l1_sizes.size() < 4; l0 /= 2) {
+      // smaller tiles split the stripe along z, so keep them aligned
+      if(l0 < l0_per_stripe && l0 % z_align == 0) {
+        l1_sizes.push_back(l0);
+      }
+    }
+    const ScheduleOrder orders[] = {
+      orderLHSStationary, orderRHSStationary, orderOutputStationary
+    };
+    for(auto & l0 : l1_sizes) {
+      for(auto & o : orders) {
+        ScheduleCfg sc;
+        sc.order = o;
+        sc.l0_per_l1 = l0;
+        ret.push_back(sc);
+      }
+    }
+    return ret;
+  }
+
+  const HardwareCfg & hwcfg() const { return m_hwcfg; }
+
+  // whether a plan can be built for the shape on the hardware config, e.g.
+  // when exploring hypothetical overlays. the checks match the assertions
+  // in schedule generation.
+  static bool isSupported(
+    const gemmbitserial::GEMMContext & shape, const HardwareCfg & hwcfg
+  ) {
+    if(hwcfg.dpaDimCommon < hwcfg.readChanWidth || hwcfg.dpaDimCommon % hwcfg.readChanWidth != 0) {
+      return false;
+    }
+    if(shape.lhs.ncols_a % hwcfg.dpaDimCommon != 0) {
+      return false;
+    }
+    const size_t l0_per_stripe = shape.lhs.ncols_a / hwcfg.dpaDimCommon;
+    const size_t lhs_cap = hwcfg.lhsEntriesPerMem / FETCHEXEC_TOKENS / shape.lhs.nbits;
+    const size_t rhs_cap = hwcfg.rhsEntriesPerMem / FETCHEXEC_TOKENS / shape.rhs.nbits;
+    if(lhs_cap < 1 || rhs_cap < 1) {
+      return false;
+    }
+    const size_t cap = min(lhs_cap, rhs_cap);
+    const size_t z_align = max(1, FETCH_ADDRALIGN / (hwcfg.dpaDimCommon / 8));
+    return cap >= l0_per_stripe || cap >= z_align;
+  }
+
+  static const char * getScheduleOrderName(ScheduleOrder o) {
+    switch(o) {
+      case orderLHSStationary: return "LHS-stationary";
+      case orderRHSStationary: return "RHS-stationary";
+      default: return "output-stationary";
+    }
+  }
+
+  // Binary plan format, all fields little-endian:
+  // - header: magic, format version, HardwareCfg, operand shapes, schedule
+  //   config, byte counts and the number of entries in each section
+  // - fetch, exec and result ops, one byte each (opcode | channel << 2)
+  // - fetch, exec and result runcfgs as fixed-size records
+  // - BRAM slot tags left after the plan has executed
+  // - FNV-1a checksum over everything before it
+  // DRAM addresses are stored as buffer offsets, so the encoding is position
+  // independent and can be read straight from a mapped file.
+  std::vector<uint8_t> serialize() const {
+    std::vector<uint8_t> b;
+    b.insert(b.end(), PLAN_MAGIC, PLAN_MAGIC + PLAN_MAGIC_BYTES);
+    put32(b, PLAN_FORMAT_VERSION);
+    const HardwareCfg & c = m_hwcfg;
+    for(uint32_t v : {c.accWidth, c.cmdQueueEntries, c.dpaDimCommon,
+      c.dpaDimLHS, c.dpaDimRHS, c.lhsEntriesPerMem, c.maxShiftSteps,
+      c.readChanWidth, c.rhsEntriesPerMem, c.writeChanWidth}) {
+      put32(b, v);
+    }
+    for(const gemmbitserial::BitSerialMatrix * m : {&m_shape.lhs, &m_shape.rhs}) {
+      put64(b, m->nrows);
+      put64(b, m->ncols);
+      put64(b, m->nrows_a);
+      put64(b, m->ncols_a);
+      put32(b, m->nbits);
+      put8(b, m->issigned);
+    }
+    put8(b, m_schedule.order);
+    put32(b, m_schedule.l0_per_l1);
+    put64(b, m_bytes_to_fetch);
+    put64(b, m_bytes_to_write);
+    put32(b, m_fetch_op.size());
+    put32(b, m_exec_op.size());
+    put32(b, m_result_op.size());
+    put32(b, m_fetch_runcfg.size());
+    put32(b, m_exec_runcfg.size());
+    put32(b, m_result_runcfg.size());
+    put32(b, m_cached_lhs.size());
+    put32(b, m_cached_rhs.size());
+    for(const std::vector<Op> * ops : {&m_fetch_op, &m_exec_op, &m_result_op}) {
+      for(auto & op : *ops) {
+        put8(b, op.opcode | (op.syncChannel << 2));
+      }
+    }
+    for(size_t i = 0; i < m_fetch_runcfg.size(); i++) {
+      const FetchRunCfg & f = m_fetch_runcfg[i];
+      put8(b, m_fetch_buf[i]);
+      put32(b, f.bram_addr_base);
+      put16(b, f.bram_id_start);
+      put16(b, f.bram_id_range);
+      put64(b, (uint64_t) f.dram_base);
+      put32(b, f.dram_block_offset_bytes);
+      put32(b, f.dram_block_size_bytes);
+      put32(b, f.dram_block_count);
+      put32(b, f.tiles_per_row);
+    }
+    for(auto & e : m_exec_runcfg) {
+      put32(b, e.lhsOffset);
+      put32(b, e.rhsOffset);
+      put32(b, e.numTiles);
+      put32(b, e.writeAddr);
+      put8(b, e.shiftAmount);
+      put8(b, (e.doNegate ? 1 : 0) | (e.doClear ? 2 : 0) | (e.writeEn ? 4 : 0));
+    }
+    for(auto & r : m_result_runcfg) {
+      put64(b, (uint64_t) r.dram_base);
+      put64(b, r.dram_skip);
+      put32(b, r.resmem_addr);
+      put32(b, r.waitCompleteBytes);
+      put8(b, r.waitComplete);
+    }
+    for(const std::vector<uint64_t> * tags : {&m_cached_lhs, &m_cached_rhs}) {
+      for(auto & t : *tags) {
+        put64(b, t);
+      }
+    }
+    put32(b, checksum(b.data(), b.size()));
+    return b;
+  }
+
+  // decode a serialized plan for the hardware config hwcfg, returns nullptr
+  // if the data is truncated, corrupted, in another format version, built
+  // for another hardware config or contains instructions that would access
+  // BRAM or DRAM out of bounds
+  static std::shared_ptr<const BitSerialMatMulPlan> deserialize(
+    const uint8_t * data, size_t bytes, const HardwareCfg & hwcfg
+  ) {
+    if(bytes < PLAN_MAGIC_BYTES + 8 || memcmp(data, PLAN_MAGIC, PLAN_MAGIC_BYTES) != 0) {
+      return nullptr;
+    }
+    if(checksum(data, bytes - 4) != Reader(data + bytes - 4, 4).get32()) {
+      return nullptr;
+    }
+    Reader r(data + PLAN_MAGIC_BYTES, bytes - PLAN_MAGIC_BYTES - 4);
+    if(r.get32() != PLAN_FORMAT_VERSION) {
+      return nullptr;
+    }
+    std::shared_ptr<BitSerialMatMulPlan> p(new BitSerialMatMulPlan());
+    HardwareCfg & c = p->m_hwcfg;
+    for(uint32_t * v : {&c.accWidth, &c.cmdQueueEntries, &c.dpaDimCommon,
+      &c.dpaDimLHS, &c.dpaDimRHS, &c.lhsEntriesPerMem, &c.maxShiftSteps,
+      &c.readChanWidth, &c.rhsEntriesPerMem, &c.writeChanWidth}) {
+      *v = r.get32();
+    }
+    if(memcmp(&c, &hwcfg, sizeof(HardwareCfg)) != 0) {
+      return nullptr;
+    }
+    // only the shape is restored, the plan does not refer to operand data
+    memset(&p->m_shape, 0, sizeof(p->m_shape));
+    for(gemmbitserial::BitSerialMatrix * m : {&p->m_shape.lhs, &p->m_shape.rhs}) {
+      m->nrows = r.get64();
+      m->ncols = r.get64();
+      m->nrows_a = r.get64();
+      m->ncols_a = r.get64();
+      m->nbits = r.get32();
+      m->issigned = r.get8() != 0;
+    }
+    p->m_schedule.order = (ScheduleOrder) r.get8();
+    p->m_schedule.l0_per_l1 = r.get32();
+    p->m_bytes_to_fetch = r.get64();
+    p->m_bytes_to_write = r.get64();
+    const size_t n_fetch_op = r.get32(), n_exec_op = r.get32(), n_result_op = r.get32();
+    const size_t n_fetch_rc = r.get32(), n_exec_rc = r.get32(), n_result_rc = r.get32();
+    const size_t n_lhs_tags = r.get32(), n_rhs_tags = r.get32();
+    // check the section sizes before allocating anything
+    const size_t body_bytes = n_fetch_op + n_exec_op + n_result_op +
+      n_fetch_rc * 33 + n_exec_rc * 18 + n_result_rc * 25 +
+      (n_lhs_tags + n_rhs_tags) * 8;
+    if(r.failed() || r.left() != body_bytes) {
+      return nullptr;
+    }
+    std::vector<Op> * ops[] = {&p->m_fetch_op, &p->m_exec_op, &p->m_result_op};
+    const size_t n_ops[] = {n_fetch_op, n_exec_op, n_result_op};
+    for(int q = 0; q < 3; q++) {
+      ops[q]->resize(n_ops[q]);
+      for(auto & op : *ops[q]) {
+        uint8_t v = r.get8();
+        op.opcode = (OpCode) (v & 3);
+        op.syncChannel = v >> 2;
+      }
+    }
+    p->m_fetch_runcfg.resize(n_fetch_rc);
+    p->m_fetch_buf.resize(n_fetch_rc);
+    for(size_t i = 0; i < n_fetch_rc; i++) {
+      FetchRunCfg & f = p->m_fetch_runcfg[i];
+      p->m_fetch_buf[i] = (PlanBuffer) r.get8();
+      f.bram_addr_base = r.get32();
+      f.bram_id_start = r.get16();
+      f.bram_id_range = r.get16();
+      f.dram_base = (void *) r.get64();
+      f.dram_block_offset_bytes = r.get32();
+      f.dram_block_size_bytes = r.get32();
+      f.dram_block_count = r.get32();
+      f.tiles_per_row = r.get32();
+    }
+    p->m_exec_runcfg.resize(n_exec_rc);
+    for(auto & e : p->m_exec_runcfg) {
+      e.lhsOffset = r.get32();
+      e.rhsOffset = r.get32();
+      e.numTiles = r.get32();
+      e.writeAddr = r.get32();
+      e.shiftAmount = r.get8();
+      uint8_t flags = r.get8();
+      e.doNegate = (flags & 1) ? 1 : 0;
+      e.doClear = (flags & 2) != 0;
+      e.writeEn = (flags & 4) != 0;
+    }
+    p->m_result_runcfg.resize(n_result_rc);
+    for(auto & rr : p->m_result_runcfg) {
+      rr.dram_base = (void *) r.get64();
+      rr.dram_skip = r.get64();
+      rr.resmem_addr = r.get32();
+      rr.waitCompleteBytes = r.get32();
+      rr.waitComplete = r.get8() != 0;
+    }
+    p->m_cached_lhs.resize(n_lhs_tags);
+    p->m_cached_rhs.resize(n_rhs_tags);
+    // saved plans always start from empty BRAM
+    p->m_start_lhs.assign(n_lhs_tags, INVALID_CACHE_ENTRY);
+    p->m_start_rhs.assign(n_rhs_tags, INVALID_CACHE_ENTRY);
+    for(std::vector<uint64_t> * tags : {&p->m_cached_lhs, &p->m_cached_rhs}) {
+      for(auto & t : *tags) {
+        t = r.get64();
+      }
+    }
+    if(r.failed() || !p->isValid()) {
+      return nullptr;
+    }
+    return p;
+  }
+
+  // FNV-1a checksum that ends a serialized plan
+  static uint32_t checksum(const uint8_t * data, size_t bytes) {
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < bytes; i++) {
+      h = (h ^ data[i]) * 16777619u;
+    }
+    return h;
+  }
+
+  // write the serialized plan to a file, returns false on I/O errors
+  bool save(const char * path) const {
+    std::vector<uint8_t> b = serialize();
+    FILE * f = fopen(path, "wb");
+    if(!f) {
+      return false;
+    }
+    bool ok = fwrite(b.data(), 1, b.size(), f) == b.size();
+    ok &= fclose(f) == 0;
+    return ok;
+  }
+
+  // map a plan file into memory and decode it for the hardware config
+  // hwcfg, returns nullptr on errors
+  static std::shared_ptr<const BitSerialMatMulPlan> load(
+    const char * path, const HardwareCfg & hwcfg
+  ) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+      return nullptr;
+    }
+    struct stat st;
+    std::shared_ptr<const BitSerialMatMulPlan> ret;
+    if(fstat(fd, &st) == 0 && st.st_size > 0) {
+      void * m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(m != MAP_FAILED) {
+        ret = deserialize((const uint8_t *) m, st.st_size, hwcfg);
+        munmap(m, st.st_size);
+      }
+    }
+    close(fd);
+    return ret;
+  }
+
+  const gemmbitserial::GEMMContext & shape() const { return m_shape; }
+
+  // number of result tiles written to DRAM
+  size_t resultTiles() const {
+    size_t ret = 0;
+    for(auto & r : m_result_runcfg) {
+      ret += r.waitComplete ? 0 : 1;
+    }
+    return ret;
+  }
+
+  // whether next can start fetching while prev is still executing. the
+  // first fetch of a plan may run concurrently with the last exec of the
+  // plan before it, so the BRAM regions they touch must not overlap.
+  static bool canOverlap(
+    const BitSerialMatMulPlan & prev, const BitSerialMatMulPlan & next
+  ) {
+    const HardwareCfg & cfg = next.m_hwcfg;
+    const size_t ratio = cfg.dpaDimCommon / cfg.readChanWidth;
+    const size_t bytes_per_beat = cfg.readChanWidth / 8;
+    // [start, end) BRAM address ranges, LHS and RHS
+    std::vector<std::pair<size_t, size_t>> written[2], read[2];
+    // fetches before the first token is handed to exec
+    size_t rc = 0;
+    for(auto & op : next.m_fetch_op) {
+      if(op.opcode == opSendToken) {
+        break;
+      } else if(op.opcode == opRun) {
+        const FetchRunCfg & f = next.m_fetch_runcfg[rc++];
+        const size_t brams = f.bram_id_range + 1;
+        const size_t beats = f.dram_block_size_bytes * f.dram_block_count / bytes_per_beat;
+        const int side = (f.bram_id_start < cfg.dpaDimLHS) ? 0 : 1;
+        written[side].push_back(std::make_pair(
+          f.bram_addr_base, f.bram_addr_base + (beats + brams - 1) / brams
+        ));
+      }
+    }
+    // exec runs after the last token received from fetch
+    rc = prev.m_exec_runcfg.size();
+    for(size_t i = prev.m_exec_op.size(); i > 0; i--) {
+      const Op & op = prev.m_exec_op[i - 1];
+      if(op.opcode == opReceiveToken && op.syncChannel == 0) {
+        break;
+      } else if(op.opcode == opRun) {
+        const ExecRunCfg & e = prev.m_exec_runcfg[--rc];
+        read[0].push_back(std::make_pair(e.lhsOffset, e.lhsOffset + e.numTiles * ratio));
+        read[1].push_back(std::make_pair(e.rhsOffset, e.rhsOffset + e.numTiles * ratio));
+      }
+    }
+    for(int side = 0; side < 2; side++) {
+      for(auto & w : written[side]) {
+        for(auto & r : read[side]) {
+          if(w.first < r.second && r.first < w.second) {
+            return false;
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+protected:
+  // used when decoding a serialized plan
+  BitSerialMatMulPlan() {
+  }
+
+  // check a decoded plan against its hardware config: known opcodes and
+  // buffers, runcfgs within the BRAMs and DRAM accesses within the buffers
+  bool isValid() const {
+    const HardwareCfg & c = m_hwcfg;
+    if(m_schedule.order > orderOutputStationary || m_shape.lhs.nbits == 0 ||
+      m_shape.rhs.nbits == 0 || m_shape.lhs.ncols_a != m_shape.rhs.ncols_a ||
+      !isSupported(m_shape, c)) {
+      return false;
+    }
+    for(const std::vector<Op> * ops : {&m_fetch_op, &m_exec_op, &m_result_op}) {
+      for(auto & op : *ops) {
+        // exec uses channel 0 towards fetch and 1 towards result
+        if(op.opcode > opReceiveToken || op.syncChannel > 1) {
+          return false;
+        }
+      }
+    }
+    for(size_t i = 0; i < m_fetch_runcfg.size(); i++) {
+      const FetchRunCfg & f = m_fetch_runcfg[i];
+      if(m_fetch_buf[i] != bufLHS && m_fetch_buf[i] != bufRHS) {
+        return false;
+      }
+      if(!BitSerialMatMulAccelDriver::isValidFetchRunCfg(f, c)) {
+        return false;
+      }
+      const uint64_t buf_bytes = m_fetch_buf[i] == bufLHS ? lhsBytes() : rhsBytes();
+      const uint64_t end = f.dram_block_count == 0 ? 0 :
+        (uint64_t) f.dram_base + (uint64_t) (f.dram_block_count - 1) *
+        f.dram_block_offset_bytes + f.dram_block_size_bytes;
+      if(end > buf_bytes) {
+        return false;
+      }
+    }
+    for(auto & e : m_exec_runcfg) {
+      if(!BitSerialMatMulAccelDriver::isValidExecRunCfg(e, c)) {
+        return false;
+      }
+    }
+    for(auto & r : m_result_runcfg) {
+      if(!BitSerialMatMulAccelDriver::isValidResultRunCfg(r)) {
+        return false;
+      }
+      // each result tile is dpaDimRHS rows of dpaDimLHS results
+      const uint64_t end = (uint64_t) r.dram_base +
+        (uint64_t) (c.dpaDimRHS - 1) * r.dram_skip +
+        c.dpaDimLHS * sizeof(ResultType);
+      if(!r.waitComplete && end > resBytes()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static void put8(std::vector<uint8_t> & b, uint8_t v) {
+    b.push_back(v);
+  }
+
+  static void put16(std::vector<uint8_t> & b, uint16_t v) {
+    put8(b, v & 0xff);
+    put8(b, v >> 8);
+  }
+
+  static void put32(std::vector<uint8_t> & b, uint32_t v) {
+    put16(b, v & 0xffff);
+    put16(b, v >> 16);
+  }
+
+  static void put64(std::vector<uint8_t> & b, uint64_t v) {
+    put32(b, v & 0xffffffff);
+    put32(b, v >> 32);
+  }
+
+  // bounds-checked little-endian reader over a serialized plan
+  class Reader {
+  public:
+    Reader(const uint8_t * data, size_t bytes) {
+      m_data = data;
+      m_left = bytes;
+      m_failed = false;
+    }
+    uint8_t get8() {
+      if(m_left == 0) {
+        m_failed = true;
+        return 0;
+      }
+      m_left--;
+      return *m_data++;
+    }
+    uint16_t get16() {
+      uint16_t lo = get8();
+      return lo | ((uint16_t) get8() << 8);
+    }
+    uint32_t get32() {
+      uint32_t lo = get16();
+      return lo | ((uint32_t) get16() << 16);
+    }
+    uint64_t get64() {
+      uint64_t lo = get32();
+      return lo | ((uint64_t) get32() << 32);
+    }
+    size_t left() const { return m_left; }
+    bool failed() const { return m_failed; }
+  protected:
+    const uint8_t * m_data;
+    size_t m_left;
+    bool m_failed;
+  };
+
+  gemmbitserial::GEMMContext m_shape;
+  HardwareCfg m_hwcfg;
+  uint64_t m_bytes_to_fetch, m_bytes_to_write;
+
+  std::vector<Op> m_fetch_op, m_exec_op, m_result_op;
+  std::vector<FetchRunCfg> m_fetch_runcfg;
+  std::vector<ExecRunCfg> m_exec_runcfg;
+  std::vector<ResultRunCfg> m_result_runcfg;
+  std::vector<PlanBuffer> m_fetch_buf;
+
+  // loop order and tile size used for the generated schedule
+  ScheduleCfg m_schedule;
+  // on-chip memory contents at the start and end of the schedule, one
+  // entry per slot
+  std::vector<uint64_t> m_start_lhs, m_start_rhs;
+  std::vector<uint64_t> m_cached_lhs, m_cached_rhs;
+  // resident variants, indexed by lhsResident + 2 * rhsResident
+  mutable std::mutex m_variant_lock;
+  mutable std::shared_ptr<const BitSerialMatMulPlan> m_variants[4];
+
+  // BRAM slot contents and LRU state at some point of a schedule
+  typedef struct {
+    std::vector<uint64_t> lhs_tags, rhs_tags;
+    std::vector<uint64_t> lhs_last_use, rhs_last_use;
+    uint64_t now;
+  } BRAMState;
+
+  void makeinstr_fetch_run(FetchRunCfg r, PlanBuffer buf) {
+    if(r.dram_block_size_bytes == r.dram_block_offset_bytes) {
+      // merge consecutive blocks to speed up fetch:
+      // one big block instead of several smaller ones
+      r.dram_block_size_bytes *= r.dram_block_count;
+      r.dram_block_offset_bytes *= r.dram_block_count;
+      r.dram_block_count = 1;
+    }
+    // ensure generated runcfg for fetch is valid. buffers are aligned to
+    // FETCH_ADDRALIGN, so checking the offsets is enough
+    BitSerialMatMulAccelDriver::verifyFetchRunCfg(r, m_hwcfg);
+    // count requested fetch bytes for statistics
+    uint64_t fetchPerGroup = (uint64_t) r.dram_block_size_bytes * r.dram_block_count;
+    m_bytes_to_fetch += fetchPerGroup;
+    m_fetch_op.push_back(BitSerialMatMulAccelDriver::make_op(opRun, 0));
+    m_fetch_runcfg.push_back(r);
+    m_fetch_buf.push_back(buf);
+  }
+
+  void makeinstr_exec_run(ExecRunCfg r) {
+    m_exec_op.push_back(BitSerialMatMulAccelDriver::make_op(opRun, 0));
+    m_exec_runcfg.push_back(r);
+  }
+
+  void makeinstr_result_run(ResultRunCfg rrc) {
+    // ensure generated runcfg for result is valid
+    BitSerialMatMulAccelDriver::verifyResultRunCfg(rrc);
+    // count result bytes for statistics
+    m_bytes_to_write += (uint64_t) m_hwcfg.dpaDimLHS * m_hwcfg.dpaDimRHS * sizeof(ResultType);
+    m_result_op.push_back(BitSerialMatMulAccelDriver::make_op(opRun, 0));
+    m_result_runcfg.push_back(rrc);
+  }
+
+  // helper functions for generating sync instructions
+  void makeinstr_fetch_sync_getexecbuffer() {
+    m_fetch_op.push_back(BitSerialMatMulAccelDriver::make_op(opReceiveToken, 0));
+  }
+
+  void makeinstr_fetch_sync_putexecbuffer() {
+    m_fetch_op.push_back(BitSerialMatMulAccelDriver::make_op(opSendToken, 0));
+  }
+
+  void makeinstr_exec_sync_getfetchbuffer() {
+    m_exec_op.push_back(BitSerialMatMulAccelDriver::make_op(opReceiveToken, 0));
+  }
+
+  void makeinstr_exec_sync_putfetchbuffer() {
+    m_exec_op.push_back(BitSerialMatMulAccelDriver::make_op(opSendToken, 0));
+  }
+
+  void makeinstr_exec_sync_getresultbuffer() {
+    m_exec_op.push_back(BitSerialMatMulAccelDriver::make_op(opReceiveToken, 1));
+  }
+
+  void makeinstr_exec_sync_putresultbuffer() {
+    m_exec_op.push_back(BitSerialMatMulAccelDriver::make_op(opSendToken, 1));
+  }
+
+  void makeinstr_result_sync_getexecbuffer() {
+    m_result_op.push_back(BitSerialMatMulAccelDriver::make_op(opReceiveToken, 0));
+  }
+
+  void makeinstr_result_sync_putexecbuffer() {
+    m_result_op.push_back(BitSerialMatMulAccelDriver::make_op(opSendToken, 0));
+  }
+
+  // get the offset of the start of given result tile in the result buffer
+  uint64_t get_result_tile_offset(const size_t lhs_tile, const size_t rhs_tile) {
+    uint32_t lhs_ind = m_hwcfg.dpaDimLHS * lhs_tile;
+    uint32_t rhs_ind = m_hwcfg.dpaDimRHS * rhs_tile;
+    assert(lhs_ind < lhs_eff_rows());
+    assert(rhs_ind < rhs_eff_rows());
+    size_t ind = rhs_ind * lhs_eff_rows() + lhs_ind;
+    assert((ind * sizeof(ResultType)) < resBytes());
+    return ind * sizeof(ResultType);
+  }
+
+  const size_t lhs_eff_rows() {
+    return m_shape.lhs.nrows_a;
+  }
+
+  const size_t rhs_eff_rows() {
+    return m_shape.rhs.nrows_a;
+  }
+
+  // tiling parameters shared by all loop orders, derived from the hardware
+  // config, the shape and the L1 tile size along the common dimension
+  typedef struct {
+    size_t l0_per_stripe, l0_per_l1, z_l2_per_matrix;
+    size_t lhs_max_l1_sw, lhs_l1_per_l2, lhs_l2_per_matrix;
+    size_t rhs_max_l1_sw, rhs_l1_per_l2, rhs_l2_per_matrix;
+    // BRAM slots (one L2 tile with all bit planes) per operand
+    size_t lhs_l0_per_slot, lhs_slots;
+    size_t rhs_l0_per_slot, rhs_slots;
+  } TilingParams;
+
+  // L1 tile size along the common dimension that fills half of the BRAM
+  // (one buffer per fetch-exec token), aligned as required for z splits
+  size_t max_l0_per_l1() const {
+    return max_l0_per_l1(m_shape, m_hwcfg);
+  }
+
+  static size_t max_l0_per_l1(
+    const gemmbitserial::GEMMContext & shape, const HardwareCfg & hwcfg
+  ) {
+    const size_t dpa_z_bytes = hwcfg.dpaDimCommon / 8;
+    const size_t l0_per_stripe = shape.lhs.ncols_a / hwcfg.dpaDimCommon;
+    const size_t lhs_cap = hwcfg.lhsEntriesPerMem / FETCHEXEC_TOKENS / shape.lhs.nbits;
+    const size_t rhs_cap = hwcfg.rhsEntriesPerMem / FETCHEXEC_TOKENS / shape.rhs.nbits;
+    // each L2 tile must fit all its bit planes into one BRAM buffer
+    assert(lhs_cap >= 1 && rhs_cap >= 1);
+    size_t l0_per_l1 = min(min(lhs_cap, rhs_cap), l0_per_stripe);
+    if(l0_per_l1 < l0_per_stripe) {
+      // z tiles other than the first start in the middle of a row, so the
+      // L1 tile must keep those starting addresses aligned for the fetch
+      const size_t z_align = max(1, FETCH_ADDRALIGN / dpa_z_bytes);
+      assert(l0_per_l1 >= z_align);
+      l0_per_l1 -= l0_per_l1 % z_align;
+    }
+    return l0_per_l1;
+  }
+
+  TilingParams make_tiling(size_t l0_per_l1) {
+    const uint32_t dpa_y = m_hwcfg.dpaDimLHS;
+    const uint32_t dpa_x = m_hwcfg.dpaDimRHS;
+    const size_t lhs_l0_per_bram_plane = m_hwcfg.lhsEntriesPerMem / FETCHEXEC_TOKENS / m_shape.lhs.nbits;
+    const size_t rhs_l0_per_bram_plane = m_hwcfg.rhsEntriesPerMem / FETCHEXEC_TOKENS / m_shape.rhs.nbits;
+    TilingParams t;
+    // L1 tile. min 1 L0 tile, maximum L0 tiles that fit into OCM.
+    // only tiled along the common dimension, and the same for LHS and RHS
+    // since the exec stage uses a single numTiles for both
+    t.l0_per_stripe = m_shape.lhs.ncols_a / m_hwcfg.dpaDimCommon;
+    t.l0_per_l1 = l0_per_l1;
+    assert(l0_per_l1 >= 1 && l0_per_l1 <= lhs_l0_per_bram_plane);
+    assert(l0_per_l1 <= rhs_l0_per_bram_plane);
+    // L2 tile. min 1 L1 tile, maximum L1 tiles that fit into OCM.
+    // tiled along either:
+    // only common dimension if rows are wider than BRAM (hw-bound)
+    // only lhs/rhs dimension if rows are smaller than BRAM (sw-bound)
+    // sizes are given per bit plane, each L2 tile holds all bit planes
+    // the DPA accumulators can only hold one L1 tile pair across z tiles, so
+    // L2 tiles are one L1 tile large when the stripe does not fit on-chip
+    const bool z_split = (l0_per_l1 < t.l0_per_stripe);
+    const size_t lhs_max_l1_hw = z_split ? 1 : lhs_l0_per_bram_plane / l0_per_l1;
+    t.lhs_max_l1_sw = lhs_eff_rows() / dpa_y;
+    t.lhs_l1_per_l2 = min(lhs_max_l1_hw, t.lhs_max_l1_sw);
+    const size_t rhs_max_l1_hw = z_split ? 1 : rhs_l0_per_bram_plane / l0_per_l1;
+    t.rhs_max_l1_sw = rhs_eff_rows() / dpa_x;
+    t.rhs_l1_per_l2 = min(rhs_max_l1_hw, t.rhs_max_l1_sw);
+    // total L2 tile counts in the matrices. the last tile along each axis
+    // may be a partial (ragged) tile, which gets its own reduced-size
+    // fetch, exec and result runcfgs
+    t.z_l2_per_matrix = (t.l0_per_stripe + l0_per_l1 - 1) / l0_per_l1;
+    t.lhs_l2_per_matrix = (t.lhs_max_l1_sw + t.lhs_l1_per_l2 - 1) / t.lhs_l1_per_l2;
+    t.rhs_l2_per_matrix = (t.rhs_max_l1_sw + t.rhs_l1_per_l2 - 1) / t.rhs_l1_per_l2;
+    // each operand's BRAM is split into as many L2 tile slots as fit. small
+    // tiles get more slots, so more of them can stay resident between uses
+    t.lhs_l0_per_slot = t.lhs_l1_per_l2 * l0_per_l1 * m_shape.lhs.nbits;
+    t.lhs_slots = m_hwcfg.lhsEntriesPerMem / t.lhs_l0_per_slot;
+    t.rhs_l0_per_slot = t.rhs_l1_per_l2 * l0_per_l1 * m_shape.rhs.nbits;
+    t.rhs_slots = m_hwcfg.rhsEntriesPerMem / t.rhs_l0_per_slot;
+    // a slot in use by an in-flight L2 tile must never be evicted, which
+    // LRU guarantees as long as there is at least one slot per token
+    assert(t.lhs_slots >= FETCHEXEC_TOKENS && t.rhs_slots >= FETCHEXEC_TOKENS);
+    return t;
+  }
+
+  // find the BRAM slot holding the given tile (keyed by its DRAM address),
+  // or pick the least recently used slot to fetch it into.
+  // returns true if the tile is already resident.
+  bool lookup_slot(
+    std::vector<uint64_t> & tags, std::vector<uint64_t> & last_use,
+    uint64_t key, uint64_t now, size_t & slot
+  ) {
+    slot = 0;
+    for(size_t i = 0; i < tags.size(); i++) {
+      if(tags[i] == key) {
+        slot = i;
+        last_use[i] = now;
+        return true;
+      }
+      if(last_use[i] < last_use[slot]) {
+        slot = i;
+      }
+    }
+    tags[slot] = key;
+    last_use[slot] = now;
+    return false;
+  }
+
+  // order in which the output L2 tiles are visited
+  std::vector<std::pair<size_t, size_t>> make_output_tile_order(
+    const TilingParams & t, ScheduleOrder order
+  ) {
+    std::vector<std::pair<size_t, size_t>> ret;
+    for(size_t o = 0; o < (order == orderRHSStationary ? t.rhs_l2_per_matrix : t.lhs_l2_per_matrix); o++) {
+      for(size_t i = 0; i < (order == orderRHSStationary ? t.lhs_l2_per_matrix : t.rhs_l2_per_matrix); i++) {
+        if(order == orderLHSStationary) {
+          ret.push_back(std::make_pair(o, i));
+        } else if(order == orderRHSStationary) {
+          ret.push_back(std::make_pair(i, o));
+        } else {
+          // serpentine walk: every other LHS stripe visits the RHS tiles in
+          // reverse, so the RHS tile at each turn is reused
+          size_t rhs_l2 = (o % 2 == 0) ? i : t.rhs_l2_per_matrix - 1 - i;
+          ret.push_back(std::make_pair(o, rhs_l2));
+        }
+      }
+    }
+    return ret;
+  }
+
+  // generate the instructions for the given schedule config, or only count
+  // the DRAM bytes it would fetch if emit is false. returns the fetched bytes.
+  // if bram is given and holds a state, the schedule starts from that BRAM
+  // state instead of empty BRAM. the end state is returned in bram.
+  uint64_t build_schedule(ScheduleCfg sc, bool emit, BRAMState * bram = 0) {
+    HardwareCfg cfg = m_hwcfg;
+    const uint32_t dpa_y = cfg.dpaDimLHS; // DPA Y dimension
+    const uint32_t dpa_x = cfg.dpaDimRHS; // DPA X dimension
+    const uint32_t dpa_z = cfg.dpaDimCommon; // DPA z dimension (64)
+    const uint32_t dpa_z_bytes = dpa_z / 8;
+    gemmbitserial::BitSerialMatrix lhs = m_shape.lhs; // Matrix for lhs and rhs
+    gemmbitserial::BitSerialMatrix rhs = m_shape.rhs;
+    int current_resmem_region = 0;
+    const size_t resmem_regions = EXECRES_TOKENS;
+    uint64_t fetched_bytes = 0;
+
+    assert(dpa_z >= cfg.readChanWidth);
+    assert(dpa_z % cfg.readChanWidth == 0);
+    const size_t exec_to_fetch_width_ratio = dpa_z / cfg.readChanWidth;
+
+    const TilingParams t = make_tiling(sc.l0_per_l1);
+    // BRAM words between the bit planes of an L2 tile, sized for full tiles
+    const size_t lhs_l0_per_l2_plane = t.lhs_l1_per_l2 * t.l0_per_l1;
+    const size_t rhs_l0_per_l2_plane = t.rhs_l1_per_l2 * t.l0_per_l1;
+    // bytes between the starts of two consecutive bit planes in DRAM
+    const size_t lhs_bytes_per_plane = lhsBytes() / lhs.nbits;
+    const size_t rhs_bytes_per_plane = rhsBytes() / rhs.nbits;
+    const size_t bytesPerRow = lhs.ncols_a / 8;
+
+    // ensure the LHS rows are integer multiples of the DPA dims
+    assert(0 == lhs_eff_rows() % dpa_y);
+    assert(0 == rhs_eff_rows() % dpa_x);
+    assert(0 == lhs.ncols_a % dpa_z);
+    // bit plane weights are applied by the shifter in the DPUs
+    assert(lhs.nbits + rhs.nbits - 2 <= cfg.maxShiftSteps);
+
+    // DRAM addresses are offsets into the LHS and RHS buffers
+    const uint64_t fetch_base_lhs = 0;
+    const uint64_t fetch_base_rhs = 0;
+
+    // keep track of the L2 tiles in each BRAM slot, LRU replacement
+    std::vector<uint64_t> lhs_tags(t.lhs_slots, INVALID_CACHE_ENTRY);
+    std::vector<uint64_t> rhs_tags(t.rhs_slots, INVALID_CACHE_ENTRY);
+    std::vector<uint64_t> lhs_last_use(t.lhs_slots, 0);
+    std::vector<uint64_t> rhs_last_use(t.rhs_slots, 0);
+    uint64_t now = 0;
+    if(bram && !bram->lhs_tags.empty()) {
+      assert(bram->lhs_tags.size() == t.lhs_slots);
+      assert(bram->rhs_tags.size() == t.rhs_slots);
+      lhs_tags = bram->lhs_tags;
+      rhs_tags = bram->rhs_tags;
+      lhs_last_use = bram->lhs_last_use;
+      rhs_last_use = bram->rhs_last_use;
+      now = bram->now;
+    }
+    if(emit) {
+      m_start_lhs = lhs_tags;
+      m_start_rhs = rhs_tags;
+    }
+
+    std::vector<std::pair<size_t, size_t>> out_tiles = make_output_tile_order(t, sc.order);
+    for(auto & out_tile : out_tiles) {
+      const size_t lhs_l2 = out_tile.first;
+      const size_t rhs_l2 = out_tile.second;
+      // L1 tiles in this L2 tile, fewer for the last (partial) tile
+      const size_t lhs_l1_in_l2 = min(t.lhs_l1_per_l2, t.lhs_max_l1_sw - lhs_l2 * t.lhs_l1_per_l2);
+      const size_t rhs_l1_in_l2 = min(t.rhs_l1_per_l2, t.rhs_max_l1_sw - rhs_l2 * t.rhs_l1_per_l2);
+      // the DPA accumulators hold the output tile, so z is always innermost
+      for(size_t z_l2 = 0; z_l2 < t.z_l2_per_matrix; z_l2++) {
+        // L0 tiles in this L1 tile, fewer for the last (partial) z tile
+        const size_t l0_in_l1 = min(t.l0_per_l1, t.l0_per_stripe - z_l2 * t.l0_per_l1);
+        const size_t z_offset_bytes = z_l2 * t.l0_per_l1 * dpa_z_bytes;
+        const uint64_t lhs_tile_base = fetch_base_lhs + lhs_l2 * t.lhs_l1_per_l2 * dpa_y * bytesPerRow + z_offset_bytes;
+        const uint64_t rhs_tile_base = fetch_base_rhs + rhs_l2 * t.rhs_l1_per_l2 * dpa_x * bytesPerRow + z_offset_bytes;
+        size_t lhs_slot, rhs_slot;
+        now++;
+        const bool lhs_hit = lookup_slot(lhs_tags, lhs_last_use, lhs_tile_base, now, lhs_slot);
+        const bool rhs_hit = lookup_slot(rhs_tags, rhs_last_use, rhs_tile_base, now, rhs_slot);
+        if(!lhs_hit) {
+          fetched_bytes += lhs.nbits * lhs_l1_in_l2 * dpa_y * l0_in_l1 * dpa_z_bytes;
+        }
+        if(!rhs_hit) {
+          fetched_bytes += rhs.nbits * rhs_l1_in_l2 * dpa_x * l0_in_l1 * dpa_z_bytes;
+        }
+        if(!emit) {
+          continue;
+        }
+        // acquire fetch buffers to fill
+        makeinstr_fetch_sync_getexecbuffer();
+        FetchRunCfg frc;
+        // fetch lhs l2 tile, one fetch per bit plane
+        // only issue fetch if not already resident
+        if(!lhs_hit) {
+          frc.bram_id_start = 0;
+          frc.bram_id_range = dpa_y - 1;
+          frc.tiles_per_row = l0_in_l1 * exec_to_fetch_width_ratio;
+          // size of each block in bytes (contiguous in memory)
+          frc.dram_block_size_bytes = l0_in_l1 * dpa_z_bytes;
+          // number of blocks to fetch: one per row
+          frc.dram_block_count = lhs_l1_in_l2 * dpa_y;
+          // offset to next block to be fetched
+          frc.dram_block_offset_bytes = bytesPerRow;
+          for(int lhs_b = 0; lhs_b < lhs.nbits; lhs_b++) {
+            frc.bram_addr_base = lhs_slot * t.lhs_l0_per_slot + lhs_b * lhs_l0_per_l2_plane;
+            frc.bram_addr_base *= exec_to_fetch_width_ratio;
+            frc.dram_base = (void *)(lhs_tile_base + lhs_b * lhs_bytes_per_plane);
+            //BitSerialMatMulAccelDriver::printFetchRunCfg(frc);
+            makeinstr_fetch_run(frc, bufLHS);
+          }
+        }
+
+        // fetch rhs l2 tile, one fetch per bit plane
+        if(!rhs_hit) {
+          frc.bram_id_start = dpa_y;
+          frc.bram_id_range = dpa_x - 1;
+          frc.tiles_per_row = l0_in_l1 * exec_to_fetch_width_ratio;
+          // size of each block in bytes (contiguous in memory)
+          frc.dram_block_size_bytes = l0_in_l1 * dpa_z_bytes;
+          // number of blocks to fetch: one per row
+          frc.dram_block_count = rhs_l1_in_l2 * dpa_x;
+          // offset to next block to be fetched
+          frc.dram_block_offset_bytes = bytesPerRow;
+          for(int rhs_b = 0; rhs_b < rhs.nbits; rhs_b++) {
+            frc.bram_addr_base = rhs_slot * t.rhs_l0_per_slot + rhs_b * rhs_l0_per_l2_plane;
+            frc.bram_addr_base *= exec_to_fetch_width_ratio;
+            frc.dram_base = (void *)(rhs_tile_base + rhs_b * rhs_bytes_per_plane);
+            //BitSerialMatMulAccelDriver::printFetchRunCfg(frc);
+            makeinstr_fetch_run(frc, bufRHS);
+          }
+        }
+
+        // send the prepared buffers to exec
+        makeinstr_fetch_sync_putexecbuffer();
+
+        // process the fetched L2 tile
+        // exec stage acquires input matrix buffers
+        makeinstr_exec_sync_getfetchbuffer();
+        // process combinations of L1 tiles within the L2 tile
+        for(int lhs_l1 = 0; lhs_l1 < lhs_l1_in_l2; lhs_l1++) {
+          for(int rhs_l1 = 0; rhs_l1 < rhs_l1_in_l2; rhs_l1++) {
+            if(z_l2 == t.z_l2_per_matrix - 1) {
+              // about to finish a new stripe
+              // exec stage acquires new result buffer
+              makeinstr_exec_sync_getresultbuffer();
+            }
+            // process all combinations of bit planes for this L1 tile pair.
+            // the bit plane loops are innermost so the fetched L2 tile is
+            // reused for every bit plane pair, and DRAM traffic does not
+            // grow with lhs.nbits * rhs.nbits
+            for(int lhs_b = 0; lhs_b < lhs.nbits; lhs_b++) {
+              for(int rhs_b = 0; rhs_b < rhs.nbits; rhs_b++) {
+                // the MSB plane of a signed matrix has negative weight
+                const bool neg_lhs = lhs.issigned && (lhs_b == lhs.nbits - 1);
+                const bool neg_rhs = rhs.issigned && (rhs_b == rhs.nbits - 1);
+                const bool first_bitpair = (lhs_b == 0) && (rhs_b == 0);
+                const bool last_bitpair = (lhs_b == lhs.nbits - 1) && (rhs_b == rhs.nbits - 1);
+                ExecRunCfg erc;
+                erc.numTiles = l0_in_l1;
+                erc.lhsOffset = lhs_slot * t.lhs_l0_per_slot + lhs_b * lhs_l0_per_l2_plane + lhs_l1 * erc.numTiles;
+                erc.lhsOffset *= exec_to_fetch_width_ratio;
+                erc.rhsOffset = rhs_slot * t.rhs_l0_per_slot + rhs_b * rhs_l0_per_l2_plane + rhs_l1 * erc.numTiles;
+                erc.rhsOffset *= exec_to_fetch_width_ratio;
+                erc.doNegate = (neg_lhs ^ neg_rhs) ? 1 : 0;
+                erc.shiftAmount = lhs_b + rhs_b;
+                // clear when starting new stripe
+                erc.doClear = (z_l2 == 0 && first_bitpair ? 1 : 0);
+                // write result at the end of z tile
+                erc.writeEn = (z_l2 == t.z_l2_per_matrix - 1 && last_bitpair ? 1 : 0);
+                erc.writeAddr = current_resmem_region;
+                //BitSerialMatMulAccelDriver::printExecRunCfg(erc);
+                makeinstr_exec_run(erc);
+              }
+            }
+
+            if(z_l2 == t.z_l2_per_matrix - 1) {
+              // finishing a stripe: release result buffer from exec
+              makeinstr_exec_sync_putresultbuffer();
+              // result stage: acquire result buffer
+              makeinstr_result_sync_getexecbuffer();
+              // generate result
+              ResultRunCfg rrc;
+              rrc.resmem_addr = current_resmem_region;
+              // find the inds of which L1 tile we are currently working on
+              size_t lhs_tile = t.lhs_l1_per_l2 * lhs_l2 + lhs_l1;
+              size_t rhs_tile = t.rhs_l1_per_l2 * rhs_l2 + rhs_l1;
+              rrc.dram_base = (void *) get_result_tile_offset(lhs_tile, rhs_tile);
+              rrc.dram_skip = lhs_eff_rows() * sizeof(ResultType);
+              rrc.waitComplete = false;
+              rrc.waitCompleteBytes = 0;
+              makeinstr_result_run(rrc);
+              makeinstr_result_sync_putexecbuffer();
+              // use next resmem region for next time
+              current_resmem_region = current_resmem_region < resmem_regions-1 ? current_resmem_region + 1 : 0;
+            }
+          }
+        }
+        // finished processing L2 tile
+        // exec releases input matrix buffers
+        makeinstr_exec_sync_putfetchbuffer();
+      }
+    }
+    if(emit) {
+      // wait until all result writes are complete
+      ResultRunCfg rrc;
+      rrc.waitComplete = true;
+      rrc.waitCompleteBytes = resBytes();
+      // these params are ignored when waitComplete = true
+      rrc.resmem_addr = 0;
+      rrc.dram_base = 0;
+      rrc.dram_skip = 0;
+      makeinstr_result_run(rrc);
+      // remember what is left in the on-chip memories
+      m_cached_lhs = lhs_tags;
+      m_cached_rhs = rhs_tags;
+    }
+    if(bram) {
+      bram->lhs_tags = lhs_tags;
+      bram->rhs_tags = rhs_tags;
+      bram->lhs_last_use = lhs_last_use;
+      bram->rhs_last_use = rhs_last_use;
+      bram->now = now;
+    }
+    return fetched_bytes;
+  }
+
+  // pick the schedule config that fetches the fewest DRAM bytes. ties go to
+  // the earlier candidate, which uses larger L1 tiles (fewer instructions)
+  ScheduleCfg choose_schedule_cfg() {
+    std::vector<ScheduleCfg> cands = candidateScheduleCfgs();
+    ScheduleCfg best = cands[0];
+    uint64_t best_bytes = build_schedule(best, false);
+    for(size_t i = 1; i < cands.size(); i++) {
+      uint64_t bytes = build_schedule(cands[i], false);
+      if(bytes < best_bytes) {
+        best = cands[i];
+        best_bytes = bytes;
+      }
+    }
+    return best;
+  }
+};
+
+// key that identifies a plan: the aligned shape, bit widths and signedness
+// of the operands, and the hardware config
+class BitSerialMatMulPlanKey {
+public:
+  BitSerialMatMulPlanKey(
+    const gemmbitserial::GEMMContext & shape, const HardwareCfg & hwcfg
+  ) {
+    const gemmbitserial::BitSerialMatrix & l = shape.lhs;
+    const gemmbitserial::BitSerialMatrix & r = shape.rhs;
+    m_fields = {
+      l.nrows, l.ncols, l.nrows_a, l.ncols_a, l.nbits, l.issigned,
+      r.nrows, r.ncols, r.nrows_a, r.ncols_a, r.nbits, r.issigned,
+      hwcfg.accWidth, hwcfg.cmdQueueEntries, hwcfg.dpaDimCommon,
+      hwcfg.dpaDimLHS, hwcfg.dpaDimRHS, hwcfg.lhsEntriesPerMem,
+      hwcfg.maxShiftSteps, hwcfg.readChanWidth, hwcfg.rhsEntriesPerMem,
+      hwcfg.writeChanWidth
+    };
+  }
+
+  // rebuild a key from its fields, e.g. as read from the tuning database
+  BitSerialMatMulPlanKey(const std::vector<uint64_t> & fields) {
+    m_fields = fields;
+  }
+
+  bool operator<(const BitSerialMatMulPlanKey & other) const {
+    return m_fields < other.m_fields;
+  }
+
+  bool operator==(const BitSerialMatMulPlanKey & other) const {
+    return m_fields == other.m_fields;
+  }
+
+  const std::vector<uint64_t> & fields() const { return m_fields; }
+
+  static const size_t numFields = 22;
+
+protected:
+  std::vector<uint64_t> m_fields;
+};
+
+// measured best schedule config for one plan key
+typedef struct {
+  ScheduleCfg sc;
+  // runtime of the plan built with sc when it was tuned
+  uint64_t cycles;
+} TuningEntry;
+
+// process-wide database of autotuned schedule configs, consulted by the plan
+// cache whenever it builds a new plan. stored on disk as a text file with
+// one line per plan key: the key fields, loop order, L1 tile size and cycles.
+class BitSerialMatMulTuningDB {
+public:
+  static BitSerialMatMulTuningDB & instance() {
+    static BitSerialMatMulTuningDB db;
+    return db;
+  }
+
+  // get the tuned schedule config for the shape, returns false if untuned
+  // or if the stored config is not one of the candidates for the shape, as
+  // in a stale or hand-edited database
+  bool lookup(
+    const gemmbitserial::GEMMContext & shape, const HardwareCfg & hwcfg,
+    TuningEntry & e
+  ) {
+    BitSerialMatMulPlanKey key(shape, hwcfg);
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      auto it = m_entries.find(key);
+      if(it == m_entries.end()) {
+        return false;
+      }
+      e = it->second;
+    }
+    for(auto & sc : BitSerialMatMulPlan::candidateScheduleCfgs(shape, hwcfg)) {
+      if(sc.order == e.sc.order && sc.l0_per_l1 == e.sc.l0_per_l1) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // record a tuning result, replacing any previous one for the same key
+  void put(
+    const gemmbitserial::GEMMContext & shape, const HardwareCfg & hwcfg,
+    const TuningEntry & e
+  ) {
+    BitSerialMatMulPlanKey key(shape, hwcfg);
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_entries[key] = e;
+  }
+
+  // merge the entries of a database file into this one. returns false if the
+  // file could not be read or is malformed, in which case nothing is merged.
+  bool load(const char * path) {
+    FILE * f = fopen(path, "r");
+    if(!f) {
+      return false;
+    }
+    std::map<BitSerialMatMulPlanKey, TuningEntry> read;
+    unsigned int version = 0;
+    bool ok = fscanf(f, TUNING_DB_MAGIC " %u", &version) == 1;
+    ok &= (version == TUNING_DB_FORMAT_VERSION);
+    while(ok) {
+      std::vector<uint64_t> fields(BitSerialMatMulPlanKey::numFields);
+      uint64_t order, l0_per_l1, cycles;
+      int n = fscanf(f, "%" SCNu64, &fields[0]);
+      if(n == EOF) {
+        break;
+      }
+      ok = (n == 1);
+      for(size_t i = 1; ok && i < fields.size(); i++) {
+        ok = fscanf(f, "%" SCNu64, &fields[i]) == 1;
+      }
+      ok = ok && fscanf(f, "%" SCNu64 " %" SCNu64 " %" SCNu64, &order, &l0_per_l1, &cycles) == 3;
+      ok = ok && (order <= orderOutputStationary) && (l0_per_l1 >= 1);
+      if(ok) {
+        TuningEntry e;
+        e.sc.order = (ScheduleOrder) order;
+        e.sc.l0_per_l1 = l0_per_l1;
+        e.cycles = cycles;
+        read[BitSerialMatMulPlanKey(fields)] = e;
+      }
+    }
+    fclose(f);
+    if(ok) {
+      std::lock_guard<std::mutex> lock(m_lock);
+      for(auto & e : read) {
+        m_entries[e.first] = e.second;
+      }
+    }
+    return ok;
+  }
+
+  // write all entries to a file, returns false on I/O errors
+  bool save(const char * path) {
+    FILE * f = fopen(path, "w");
+    if(!f) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(m_lock);
+    bool ok = fprintf(f, TUNING_DB_MAGIC " %u\n", TUNING_DB_FORMAT_VERSION) > 0;
+    for(auto & e : m_entries) {
+      for(auto & v : e.first.fields()) {
+        ok &= fprintf(f, "%" PRIu64 " ", v) > 0;
+      }
+      ok &= fprintf(
+        f, "%u %" PRIu32 " %" PRIu64 "\n",
+        (unsigned int) e.second.sc.order, e.second.sc.l0_per_l1, e.second.cycles
+      ) > 0;
+    }
+    ok &= fclose(f) == 0;
+    return ok;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_entries.clear();
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_entries.size();
+  }
+
+protected:
+  BitSerialMatMulTuningDB() {
+  }
+
+  std::mutex m_lock;
+  std::map<BitSerialMatMulPlanKey, TuningEntry> m_entries;
+};
+
+// process-wide cache of plans, so that repeated GEMMs of the same shape skip
+// schedule generation entirely. plans are immutable once built and are
+// shared between all executors using them. the cache holds up to
+// capacity() plans and drops the least recently used beyond that.
+class BitSerialMatMulPlanCache {
+public:
+  static BitSerialMatMulPlanCache & instance() {
+    static BitSerialMatMulPlanCache cache;
+    return cache;
+  }
+
+  std::shared_ptr<const BitSerialMatMulPlan> get(
+    const gemmbitserial::GEMMContext & shape, const HardwareCfg & hwcfg
+  ) {
+    BitSerialMatMulPlanKey key(shape, hwcfg);
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      std::shared_ptr<const BitSerialMatMulPlan> plan = find(key);
+      if(plan) {
+        m_hits++;
+        return plan;
+      }
+      m_misses++;
+    }
+    // build without holding the lock, lookups of other shapes go on
+    // meanwhile. use the autotuned schedule if there is one, else the cost
+    // model's.
+    TuningEntry tuned;
+    std::shared_ptr<const BitSerialMatMulPlan> plan(
+      BitSerialMatMulTuningDB::instance().lookup(shape, hwcfg, tuned) ?
+      new BitSerialMatMulPlan(shape, hwcfg, tuned.sc) :
+      new BitSerialMatMulPlan(shape, hwcfg)
+    );
+    std::lock_guard<std::mutex> lock(m_lock);
+    // another thread may have built the same plan in the meantime
+    std::shared_ptr<const BitSerialMatMulPlan> other = find(key);
+    if(other) {
+      return other;
+    }
+    put(key, plan);
+    return plan;
+  }
+
+  // add a prebuilt plan, e.g. one loaded from disk, replacing any cached
+  // plan for the same shape and hardware config
+  void insert(std::shared_ptr<const BitSerialMatMulPlan> plan) {
+    BitSerialMatMulPlanKey key(plan->shape(), plan->hwcfg());
+    std::lock_guard<std::mutex> lock(m_lock);
+    put(key, plan);
+  }
+
+  // load a plan file for the hardware config hwcfg into the cache, returns
+  // false if it could not be read or is not valid for hwcfg
+  bool load(const char * path, const HardwareCfg & hwcfg) {
+    std::shared_ptr<const BitSerialMatMulPlan> plan =
+      BitSerialMatMulPlan::load(path, hwcfg);
+    if(!plan) {
+      return false;
+    }
+    insert(plan);
+    return true;
+  }
+
+  // drop all cached plans. executors keep the plans they already hold.
+  void clear() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_plans.clear();
+    m_lru.clear();
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_plans.size();
+  }
+
+  // limit the number of cached plans, at least 1
+  void setCapacity(size_t plans) {
+    assert(plans >= 1);
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_capacity = plans;
+    trim();
+  }
+
+  size_t capacity() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_capacity;
+  }
+
+  uint64_t hits() const { return m_hits; }
+  uint64_t misses() const { return m_misses; }
+
+protected:
+  typedef std::list<BitSerialMatMulPlanKey>::iterator LRUPos;
+
+  BitSerialMatMulPlanCache() {
+    m_hits = 0;
+    m_misses = 0;
+    m_capacity = PLAN_CACHE_DEFAULT_CAPACITY;
+  }
+
+  // cached plan for key marked as most recently used, or null. needs m_lock.
+  std::shared_ptr<const BitSerialMatMulPlan> find(const BitSerialMatMulPlanKey & key) {
+    auto it = m_plans.find(key);
+    if(it == m_plans.end()) {
+      return std::shared_ptr<const BitSerialMatMulPlan>();
+    }
+    m_lru.splice(m_lru.begin(), m_lru, it->second.second);
+    return it->second.first;
+  }
+
+  // needs m_lock
+  void put(const BitSerialMatMulPlanKey & key, std::shared_ptr<const BitSerialMatMulPlan> plan) {
+    auto it = m_plans.find(key);
+    if(it != m_plans.end()) {
+      m_lru.erase(it->second.second);
+      m_plans.erase(it);
+    }
+    m_lru.push_front(key);
+    m_plans[key] = std::make_pair(plan, m_lru.begin());
+    trim();
+  }
+
+  // drop least recently used plans beyond the capacity. needs m_lock.
+  void trim() {
+    while(m_plans.size() > m_capacity) {
+      m_plans.erase(m_lru.back());
+      m_lru.pop_back();
+    }
+  }
+
+  std::mutex m_lock;
+  // most recently used first
+  std::list<BitSerialMatMulPlanKey> m_lru;
+  std::map<BitSerialMatMulPlanKey, std::pair<std::shared_ptr<const BitSerialMatMulPlan>, LRUPos>> m_plans;
+  size_t m_capacity;
+  std::atomic<uint64_t> m_hits, m_misses;
+};
+
+#endif
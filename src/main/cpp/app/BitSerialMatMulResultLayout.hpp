@@ -0,0 +1,131 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef BitSerialMatMulResultLayout_H
+#define BitSerialMatMulResultLayout_H
+
+#include <cstring>
+#include "BitSerialMatMulAccelDriver.hpp"
+
+// layouts that BitSerialMatMulExecutor::getRes can produce. the accelerator
+// writes the result as one row per RHS row, each padded to lhs.nrows_a.
+typedef enum {
+  // one row of lhs.nrows elements per RHS row, as produced by gemmBitSerial
+  resRowMajor = 0,
+  // one row of rhs.nrows elements per LHS row
+  resColMajor,
+  // the padded buffer exactly as written by the accelerator, resBytes() long
+  resPadded
+} ResultLayout;
+
+// copy a rows x cols block out of a padded matrix with srcStride elements
+// per row into a dense one
+static inline void resultUnpadRows(
+  const ResultType * src, size_t srcStride, ResultType * dst,
+  size_t rows, size_t cols
+) {
+  if(srcStride == cols) {
+    memcpy(dst, src, rows * cols * sizeof(ResultType));
+    return;
+  }
+  for(size_t r = 0; r < rows; r++) {
+    memcpy(&dst[r * cols], &src[r * srcStride], cols * sizeof(ResultType));
+  }
+}
+
+// transpose one 4x4 block
+static inline void resultTranspose4x4(
+  const ResultType * src, size_t srcStride, ResultType * dst, size_t dstStride
+) {
+#if defined(__SSE2__)
+  __m128i r0 = _mm_loadu_si128((const __m128i *) &src[0 * srcStride]);
+  __m128i r1 = _mm_loadu_si128((const __m128i *) &src[1 * srcStride]);
+  __m128i r2 = _mm_loadu_si128((const __m128i *) &src[2 * srcStride]);
+  __m128i r3 = _mm_loadu_si128((const __m128i *) &src[3 * srcStride]);
+  __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+  __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+  __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+  __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+  _mm_storeu_si128((__m128i *) &dst[0 * dstStride], _mm_unpacklo_epi64(t0, t1));
+  _mm_storeu_si128((__m128i *) &dst[1 * dstStride], _mm_unpackhi_epi64(t0, t1));
+  _mm_storeu_si128((__m128i *) &dst[2 * dstStride], _mm_unpacklo_epi64(t2, t3));
+  _mm_storeu_si128((__m128i *) &dst[3 * dstStride], _mm_unpackhi_epi64(t2, t3));
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  int32x4x2_t p01 = vtrnq_s32(vld1q_s32(&src[0 * srcStride]), vld1q_s32(&src[1 * srcStride]));
+  int32x4x2_t p23 = vtrnq_s32(vld1q_s32(&src[2 * srcStride]), vld1q_s32(&src[3 * srcStride]));
+  vst1q_s32(&dst[0 * dstStride], vcombine_s32(vget_low_s32(p01.val[0]), vget_low_s32(p23.val[0])));
+  vst1q_s32(&dst[1 * dstStride], vcombine_s32(vget_low_s32(p01.val[1]), vget_low_s32(p23.val[1])));
+  vst1q_s32(&dst[2 * dstStride], vcombine_s32(vget_high_s32(p01.val[0]), vget_high_s32(p23.val[0])));
+  vst1q_s32(&dst[3 * dstStride], vcombine_s32(vget_high_s32(p01.val[1]), vget_high_s32(p23.val[1])));
+#else
+  for(size_t r = 0; r < 4; r++) {
+    for(size_t c = 0; c < 4; c++) {
+      dst[c * dstStride + r] = src[r * srcStride + c];
+    }
+  }
+#endif
+}
+
+// write the transpose of a rows x cols block out of a padded matrix with
+// srcStride elements per row into a dense cols x rows matrix
+static inline void resultUnpadTranspose(
+  const ResultType * src, size_t srcStride, ResultType * dst,
+  size_t rows, size_t cols
+) {
+  // work on cache-sized blocks, in 4x4 SIMD transposes
+  const size_t blk = 64;
+  for(size_t rb = 0; rb < rows; rb += blk) {
+    const size_t re = rb + blk < rows ? rb + blk : rows;
+    for(size_t cb = 0; cb < cols; cb += blk) {
+      const size_t ce = cb + blk < cols ? cb + blk : cols;
+      size_t r = rb;
+      for(; r + 4 <= re; r += 4) {
+        size_t c = cb;
+        for(; c + 4 <= ce; c += 4) {
+          resultTranspose4x4(&src[r * srcStride + c], srcStride, &dst[c * rows + r], rows);
+        }
+        for(; c < ce; c++) {
+          for(size_t i = r; i < r + 4; i++) {
+            dst[c * rows + i] = src[i * srcStride + c];
+          }
+        }
+      }
+      for(; r < re; r++) {
+        for(size_t c = cb; c < ce; c++) {
+          dst[c * rows + r] = src[r * srcStride + c];
+        }
+      }
+    }
+  }
+}
+
+#endif
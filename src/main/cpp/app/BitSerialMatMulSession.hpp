@@ -0,0 +1,358 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef BitSerialMatMulSession_H
+#define BitSerialMatMulSession_H
+
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "BitSerialMatMulAccelDriver.hpp"
+#include "BitSerialMatMulExecutor.hpp"
+
+// A BitSerialMatMulSession keeps the accelerator running across GEMMs. The
+// tokens are initialized once, the stages stay enabled, and a background
+// feeder appends the instructions of each submitted job to the live queues
+// right after those of the previous job. The fetch stage of the next job thus
+// overlaps the exec and result stages of the current one.
+// Executors used with a session must be constructed with prepareAccel =
+// false, and must not be touched until their job has completed.
+// The session holds the run lock of the accelerator for its lifetime, so
+// run() and runAsync() of other executors wait until it is destroyed. It
+// must be destroyed on the thread that created it.
+class BitSerialMatMulSession {
+public:
+  BitSerialMatMulSession(BitSerialMatMulAccelDriver * acc) :
+    m_run_guard(acc->run_lock()) {
+    m_acc = acc;
+    m_next_job_id = 0;
+    m_result_ops_pushed = 0;
+    m_result_ops_end = 0;
+    m_resmem_offset = 0;
+    m_last_done_cc = 0;
+    m_stop = false;
+    m_last_plan = nullptr;
+    // prepare the accelerator once for all jobs
+    {
+      BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+      m_acc->reset();
+      m_acc->init_resource_pools();
+      m_acc->perf_set_cc_enable(true);
+      m_acc->set_stage_enables(1, 1, 1);
+    }
+    m_feeder = std::thread([this] { feed(); });
+  }
+
+  ~BitSerialMatMulSession() {
+    waitAll();
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      m_stop = true;
+    }
+    m_wake.notify_all();
+    m_feeder.join();
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    m_acc->set_stage_enables(0, 0, 0);
+    m_acc->perf_set_cc_enable(false);
+  }
+
+  // queue the GEMM prepared in exec (plan and operands already set) to run
+  // after all previously submitted jobs. returns the job ID.
+  size_t submit(BitSerialMatMulExecutor & exec) {
+    std::shared_ptr<Job> job(new Job());
+    const BitSerialMatMulPlan & plan = *exec.m_plan;
+    job->ops[0] = plan.fetchOps();
+    job->ops[1] = plan.execOps();
+    job->ops[2] = plan.resultOps();
+    job->metrics = exec.m_metrics;
+    job->fetch_bytes = plan.bytesToFetch();
+    job->write_bytes = plan.bytesToWrite();
+    job->instrs = job->ops[0].size() + job->ops[1].size() + job->ops[2].size();
+    job->submitted = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(m_lock);
+    if(m_last_plan && !BitSerialMatMulPlan::canOverlap(*m_last_plan, plan)) {
+      // the first fetch of this job would overwrite BRAM contents that the
+      // last exec of the previous job may still be reading: let fetch wait
+      // for all fetch-exec tokens, i.e. for exec to finish, then hand them
+      // back through exec
+      std::vector<Op> barrier;
+      for(int i = 0; i < FETCHEXEC_TOKENS; i++) {
+        barrier.push_back(m_acc->make_op(opReceiveToken, 0));
+      }
+      for(int i = 0; i < FETCHEXEC_TOKENS; i++) {
+        barrier.push_back(m_acc->make_op(opSendToken, 0));
+      }
+      job->ops[0].insert(job->ops[0].begin(), barrier.begin(), barrier.end());
+      job->ops[1].insert(job->ops[1].begin(), barrier.begin(), barrier.end());
+    }
+    // bind DRAM addresses to the executor's buffers, and continue the
+    // result memory region rotation of the previous job
+    for(size_t i = 0; i < plan.fetchRunCfgs().size(); i++) {
+      job->fetch_runcfg.push_back(exec.get_fetch_runcfg(plan, i));
+    }
+    for(auto e : plan.execRunCfgs()) {
+      e.writeAddr = (e.writeAddr + m_resmem_offset) % EXECRES_TOKENS;
+      job->exec_runcfg.push_back(e);
+    }
+    // jobs write their results in submission order
+    const uint32_t res_base = m_acc->claim_result_bytes(plan.resBytes());
+    for(size_t i = 0; i < plan.resultRunCfgs().size(); i++) {
+      ResultRunCfg r = exec.get_result_runcfg(plan, i, res_base);
+      if(!r.waitComplete) {
+        r.resmem_addr = (r.resmem_addr + m_resmem_offset) % EXECRES_TOKENS;
+      }
+      job->result_runcfg.push_back(r);
+    }
+    m_resmem_offset = (m_resmem_offset + plan.resultTiles()) % EXECRES_TOKENS;
+    m_last_plan = exec.m_plan;
+    // the jobs overwrite BRAM contents that executors may have left
+    m_acc->setBRAMOwner(this);
+    job->id = m_next_job_id++;
+    job->result_ops_end = m_result_ops_end + job->ops[2].size();
+    m_result_ops_end = job->result_ops_end;
+    job->done = job->done_promise.get_future().share();
+    m_jobs.push_back(job);
+    m_all_jobs.push_back(job);
+    m_wake.notify_all();
+    return job->id;
+  }
+
+  // completion handle for a submitted job
+  BitSerialMatMulCompletion completion(size_t job_id) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    assert(job_id < m_all_jobs.size());
+    return BitSerialMatMulCompletion(m_all_jobs[job_id]->done);
+  }
+
+  // block until the given job has finished
+  void wait(size_t job_id) {
+    completion(job_id).wait();
+  }
+
+  // block until all submitted jobs have finished
+  void waitAll() {
+    std::vector<BitSerialMatMulCompletion> pending;
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      for(auto & j : m_jobs) {
+        pending.push_back(BitSerialMatMulCompletion(j->done));
+      }
+    }
+    for(auto & c : pending) {
+      c.wait();
+    }
+  }
+
+  // clock cycles attributed to a finished job: from when it started, or
+  // from when the previous job finished if that was later, until it finished.
+  // with a warm pipeline this is the job's contribution to total runtime.
+  uint64_t getJobCycles(size_t job_id) {
+    wait(job_id);
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_all_jobs[job_id]->cycles;
+  }
+
+protected:
+  typedef struct Job {
+    size_t id;
+    // op streams for fetch, exec and result
+    std::vector<Op> ops[3];
+    std::vector<FetchRunCfg> fetch_runcfg;
+    std::vector<ExecRunCfg> exec_runcfg;
+    std::vector<ResultRunCfg> result_runcfg;
+    size_t op_ptr[3] = {0, 0, 0};
+    size_t fetch_runcfg_ptr = 0, exec_runcfg_ptr = 0, result_runcfg_ptr = 0;
+    // total result ops pushed by the session at the end of this job
+    uint64_t result_ops_end;
+    bool started = false;
+    uint64_t start_cc = 0;
+    uint64_t cycles = 0;
+    // recorded into the shape's metrics when the job finishes
+    BitSerialMatMulShapeMetrics * metrics;
+    uint64_t fetch_bytes, write_bytes, instrs;
+    std::chrono::steady_clock::time_point submitted;
+    std::promise<void> done_promise;
+    std::shared_future<void> done;
+  } Job;
+
+  BitSerialMatMulAccelDriver * m_acc;
+  // keeps executor runs off the accelerator while the session owns it
+  std::unique_lock<std::mutex> m_run_guard;
+  std::mutex m_lock;
+  std::condition_variable m_wake;
+  std::thread m_feeder;
+  bool m_stop;
+  // jobs that have not finished yet, oldest first
+  std::deque<std::shared_ptr<Job>> m_jobs;
+  // all jobs by ID, kept for cycle reporting
+  std::vector<std::shared_ptr<Job>> m_all_jobs;
+  std::shared_ptr<const BitSerialMatMulPlan> m_last_plan;
+  size_t m_next_job_id;
+  uint64_t m_result_ops_pushed;
+  uint64_t m_result_ops_end;
+  size_t m_resmem_offset;
+  uint64_t m_last_done_cc;
+
+  // first job with instructions left to push for the given stage
+  Job * stage_job(int stage) {
+    for(auto & j : m_jobs) {
+      if(j->op_ptr[stage] < j->ops[stage].size()) {
+        return j.get();
+      }
+    }
+    return nullptr;
+  }
+
+  void mark_started(Job * j) {
+    if(!j->started) {
+      j->started = true;
+      j->start_cc = m_acc->perf_get_cc();
+    }
+  }
+
+  // push as many instructions as the queues accept, returns true if
+  // anything was pushed
+  bool fill() {
+    bool pushed = false;
+    Job * j;
+    while((j = stage_job(0)) && !m_acc->fetch_op_full()) {
+      const Op & op = j->ops[0][j->op_ptr[0]];
+      if(op.opcode == opRun) {
+        if(m_acc->fetch_runcfg_full()) {
+          break;
+        }
+        m_acc->push_fetch_runcfg(j->fetch_runcfg[j->fetch_runcfg_ptr++]);
+      }
+      mark_started(j);
+      m_acc->push_fetch_op(op);
+      j->op_ptr[0]++;
+      pushed = true;
+    }
+    while((j = stage_job(1)) && !m_acc->exec_op_full()) {
+      const Op & op = j->ops[1][j->op_ptr[1]];
+      if(op.opcode == opRun) {
+        if(m_acc->exec_runcfg_full()) {
+          break;
+        }
+        m_acc->push_exec_runcfg(j->exec_runcfg[j->exec_runcfg_ptr++]);
+      }
+      mark_started(j);
+      m_acc->push_exec_op(op);
+      j->op_ptr[1]++;
+      pushed = true;
+    }
+    while((j = stage_job(2)) && !m_acc->result_op_full()) {
+      const Op & op = j->ops[2][j->op_ptr[2]];
+      if(op.opcode == opRun) {
+        if(m_acc->result_runcfg_full()) {
+          break;
+        }
+        m_acc->push_result_runcfg(j->result_runcfg[j->result_runcfg_ptr++]);
+      }
+      mark_started(j);
+      m_acc->push_result_op(op);
+      j->op_ptr[2]++;
+      m_result_ops_pushed++;
+      pushed = true;
+    }
+    return pushed;
+  }
+
+  // retire finished jobs. result ops leave the queue when they complete, so
+  // a job is done once all of its result ops have left the queue.
+  void retire() {
+    if(m_jobs.empty()) {
+      return;
+    }
+    const uint64_t result_ops_done = m_result_ops_pushed - m_acc->res_opcount();
+    while(!m_jobs.empty() && result_ops_done >= m_jobs.front()->result_ops_end) {
+      std::shared_ptr<Job> j = m_jobs.front();
+      m_jobs.pop_front();
+      const uint64_t cc = m_acc->perf_get_cc();
+      const uint64_t from = (j->start_cc > m_last_done_cc) ? j->start_cc : m_last_done_cc;
+      j->cycles = cc - from;
+      m_last_done_cc = cc;
+      record(*j);
+      j->done_promise.set_value();
+    }
+  }
+
+  // add a finished job to the metrics of its shape. the latency includes
+  // the time the job spent queued behind earlier jobs.
+  void record(const Job & j) {
+    BitSerialMatMulShapeMetrics * m = j.metrics;
+    m->runs.fetch_add(1, std::memory_order_relaxed);
+    m->bytesFetched.fetch_add(j.fetch_bytes, std::memory_order_relaxed);
+    m->bytesWritten.fetch_add(j.write_bytes, std::memory_order_relaxed);
+    m->instructions.fetch_add(j.instrs, std::memory_order_relaxed);
+    m->cycles.record(j.cycles);
+    m->latencyNs.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - j.submitted
+    ).count());
+  }
+
+  // background feeder: keep the queues topped up and retire finished jobs.
+  // between polls it waits on m_wake, which also lets submitters and
+  // waiters in; the wait grows while the accelerator makes no progress.
+  void feed() {
+    std::unique_lock<std::mutex> lock(m_lock);
+    BitSerialMatMulBackoff backoff;
+    while(true) {
+      if(m_jobs.empty()) {
+        if(m_stop) {
+          break;
+        }
+        m_wake.wait(lock);
+        backoff.reset();
+        continue;
+      }
+      bool progress;
+      {
+        BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+        const size_t pending = m_jobs.size();
+        progress = fill();
+        retire();
+        progress |= (m_jobs.size() != pending);
+      }
+      if(progress) {
+        backoff.reset();
+      }
+      m_wake.wait_for(lock, std::chrono::microseconds(backoff.step()));
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,176 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef BitSerialMatMulThreads_H
+#define BitSerialMatMulThreads_H
+
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "BitSerialMatMulAccelDriver.hpp"
+
+// number of worker threads to use when 0 is requested
+static inline unsigned defaultThreadCount() {
+  unsigned n = std::thread::hardware_concurrency();
+  return n == 0 ? 1 : n;
+}
+
+// worker threads kept across calls, so that packing and epilogues of small
+// layers do not pay for starting threads each time. the workers sleep while
+// there is nothing to do. several threads may run tasks at the same time.
+class BitSerialMatMulThreadPool {
+public:
+  static BitSerialMatMulThreadPool & instance() {
+    static BitSerialMatMulThreadPool pool;
+    return pool;
+  }
+
+  ~BitSerialMatMulThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      m_stop = true;
+    }
+    m_wake.notify_all();
+    for(auto & w : m_workers) {
+      w.join();
+    }
+  }
+
+  // call fn(i) for i in [0, tasks) on up to workers + 1 threads, the calling
+  // thread included, and return when all calls have returned
+  void run(size_t tasks, size_t workers, const std::function<void(size_t)> & fn) {
+    Batch b;
+    b.fn = &fn;
+    b.tasks = tasks;
+    b.next = 0;
+    b.left = tasks;
+    std::unique_lock<std::mutex> lock(m_lock);
+    while(m_workers.size() < workers) {
+      m_workers.push_back(std::thread([this] { work(); }));
+    }
+    m_batches.push_back(&b);
+    m_wake.notify_all();
+    // the calling thread takes tasks too, then waits for the rest
+    while(b.next < b.tasks) {
+      const size_t i = b.next++;
+      lock.unlock();
+      fn(i);
+      lock.lock();
+      b.left--;
+    }
+    m_batches.remove(&b);
+    while(b.left > 0) {
+      m_done.wait(lock);
+    }
+  }
+
+protected:
+  typedef struct {
+    const std::function<void(size_t)> * fn;
+    size_t tasks, next, left;
+  } Batch;
+
+  BitSerialMatMulThreadPool() {
+    m_stop = false;
+  }
+
+  // first batch with tasks nobody has taken yet
+  Batch * next_batch() {
+    for(auto b : m_batches) {
+      if(b->next < b->tasks) {
+        return b;
+      }
+    }
+    return 0;
+  }
+
+  void work() {
+    std::unique_lock<std::mutex> lock(m_lock);
+    while(true) {
+      Batch * b = next_batch();
+      if(!b) {
+        if(m_stop) {
+          break;
+        }
+        m_wake.wait(lock);
+        continue;
+      }
+      const size_t i = b->next++;
+      lock.unlock();
+      (*b->fn)(i);
+      lock.lock();
+      if(--b->left == 0) {
+        m_done.notify_all();
+      }
+    }
+  }
+
+  std::mutex m_lock;
+  std::condition_variable m_wake, m_done;
+  std::vector<std::thread> m_workers;
+  // batches of the threads currently in run(), oldest first
+  std::list<Batch *> m_batches;
+  bool m_stop;
+};
+
+// split rows [0, rows) into contiguous chunks and call fn(begin, end) for
+// each chunk, spread over the threads of the pool. small jobs run on the
+// calling thread, since handing them out costs more than it saves.
+template <typename Fxn>
+void parallelRows(size_t rows, size_t workPerRow, unsigned threads, Fxn fn) {
+  const size_t minWorkPerThread = 1 << 16;
+  if(threads == 0) {
+    threads = defaultThreadCount();
+  }
+  size_t maxThreads = (rows * workPerRow) / minWorkPerThread;
+  if(maxThreads < threads) {
+    threads = maxThreads > 0 ? maxThreads : 1;
+  }
+  if(threads > rows) {
+    threads = rows > 0 ? rows : 1;
+  }
+  if(threads == 1) {
+    fn((size_t) 0, rows);
+    return;
+  }
+  const size_t chunk = (rows + threads - 1) / threads;
+  const size_t chunks = (rows + chunk - 1) / chunk;
+  BitSerialMatMulThreadPool::instance().run(chunks, threads - 1, [&](size_t i) {
+    const size_t begin = i * chunk;
+    fn(begin, begin + chunk < rows ? begin + chunk : rows);
+  });
+}
+
+#endif
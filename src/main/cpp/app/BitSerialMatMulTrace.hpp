@@ -0,0 +1,240 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef BitSerialMatMulTrace_H
+#define BitSerialMatMulTrace_H
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "BitSerialMatMulAccelDriver.hpp"
+
+// decoding of the hardware event trace, see TraceBuffer.scala for the ring
+// buffer entry layout
+#define TRACE_CYCLE_BITS            48
+#define TRACE_DEFAULT_ENTRIES       65536
+
+typedef enum {
+  traceRunStart = 0, traceRunEnd, traceSend, traceRecvStart, traceRecvEnd
+} TraceEventKind;
+
+typedef enum {
+  traceFetch = 0, traceExec, traceResult
+} TraceStage;
+#define N_TRACE_STAGES              3
+
+typedef struct {
+  // cycles since the trace was started
+  uint64_t cycle;
+  TraceEventKind kind;
+  TraceStage stage;
+  uint32_t channel;
+} TraceEvent;
+
+static inline const char * getTraceStageName(TraceStage s) {
+  switch(s) {
+    case traceFetch: return "fetch";
+    case traceExec: return "exec";
+    case traceResult: return "result";
+    default: return "unknown";
+  }
+}
+
+static inline TraceEvent decodeTraceEntry(uint64_t w) {
+  TraceEvent e;
+  e.cycle = w & ((1ULL << TRACE_CYCLE_BITS) - 1);
+  e.kind = (TraceEventKind) ((w >> 48) & 0x7);
+  e.stage = (TraceStage) ((w >> 51) & 0x3);
+  e.channel = (uint32_t) ((w >> 53) & 0x3);
+  return e;
+}
+
+// decode a ring buffer of the given size after written entries, oldest first.
+// once the ring has wrapped, only the last entries events are left.
+static inline std::vector<TraceEvent> decodeTraceRing(
+  const uint64_t * ring, size_t entries, uint64_t written
+) {
+  std::vector<TraceEvent> ret;
+  const size_t n = written < entries ? written : entries;
+  const size_t first = written < entries ? 0 : written % entries;
+  for(size_t i = 0; i < n; i++) {
+    TraceEvent e = decodeTraceEntry(ring[(first + i) % entries]);
+    if(e.kind <= traceRecvEnd && e.stage < N_TRACE_STAGES) {
+      ret.push_back(e);
+    }
+  }
+  // the stages share the write channel, so their events are interleaved out
+  // of order. each stage's own events are in order and keep it.
+  std::stable_sort(
+    ret.begin(), ret.end(),
+    [](const TraceEvent & a, const TraceEvent & b) { return a.cycle < b.cycle; }
+  );
+  return ret;
+}
+
+// Chrome/Perfetto trace event JSON, one thread per stage. runs and token
+// waits become complete events, token sends instant events. starts without
+// an end and ends whose start was overwritten in the ring are left out.
+static inline std::string traceChromeJSON(
+  const std::vector<TraceEvent> & events, float fclkMHz
+) {
+  std::ostringstream o;
+  bool first = true;
+  auto sep = [&]() -> std::ostringstream & {
+    o << (first ? "\n" : ",\n");
+    first = false;
+    return o;
+  };
+  auto us = [&](uint64_t cycle) -> double {
+    return (double) cycle / fclkMHz;
+  };
+  o << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+  for(int s = 0; s < N_TRACE_STAGES; s++) {
+    sep() << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << s;
+    o << ", \"args\": {\"name\": \"" << getTraceStageName((TraceStage) s) << "\"}}";
+  }
+  // start event of the span each stage is in, if any
+  const TraceEvent * open[N_TRACE_STAGES] = {0, 0, 0};
+  for(const TraceEvent & e : events) {
+    const TraceEvent * & start = open[e.stage];
+    switch(e.kind) {
+      case traceRunStart:
+      case traceRecvStart:
+        start = &e;
+        break;
+      case traceRunEnd:
+      case traceRecvEnd:
+        if(start && start->kind == (e.kind == traceRunEnd ? traceRunStart : traceRecvStart)) {
+          const bool run = e.kind == traceRunEnd;
+          sep() << "{\"name\": \"" << (run ? "run" : "wait token");
+          o << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << e.stage;
+          o << ", \"ts\": " << us(start->cycle);
+          o << ", \"dur\": " << us(e.cycle - start->cycle);
+          o << ", \"args\": {\"cycles\": " << e.cycle - start->cycle;
+          if(!run) {
+            o << ", \"channel\": " << e.channel;
+          }
+          o << "}}";
+        }
+        start = 0;
+        break;
+      case traceSend:
+        sep() << "{\"name\": \"send token\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 0";
+        o << ", \"tid\": " << e.stage << ", \"ts\": " << us(e.cycle);
+        o << ", \"args\": {\"channel\": " << e.channel << "}}";
+        break;
+    }
+  }
+  o << "\n]}\n";
+  return o.str();
+}
+
+// records the hardware event trace into an accel buffer and reads it back.
+// the trace covers all executors sharing the accelerator.
+class BitSerialMatMulTracer {
+public:
+  BitSerialMatMulTracer(
+    WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc,
+    uint32_t entries = TRACE_DEFAULT_ENTRIES
+  ) {
+    m_platform = platform;
+    m_acc = acc;
+    m_entries = entries;
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    m_buf = m_platform->allocAccelBuffer(m_entries * sizeof(uint64_t));
+    m_running = false;
+    m_written = 0;
+    m_dropped = 0;
+  }
+
+  ~BitSerialMatMulTracer() {
+    if(m_running) {
+      stop();
+    }
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    m_platform->deallocAccelBuffer(m_buf);
+  }
+
+  // clear the ring buffer and start recording
+  void start() {
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    m_acc->trace_start(m_buf, m_entries);
+    m_running = true;
+  }
+
+  // stop recording and return the events left in the ring buffer
+  std::vector<TraceEvent> stop() {
+    assert(m_running);
+    BitSerialMatMulPlatformGuard guard(bismo_platform_lock());
+    m_acc->trace_stop();
+    while(m_acc->trace_busy());
+    m_running = false;
+    m_written = m_acc->trace_written();
+    m_dropped = m_acc->trace_dropped();
+    std::vector<uint64_t> ring(m_entries);
+    m_platform->copyBufferAccelToHost(m_buf, ring.data(), m_entries * sizeof(uint64_t));
+    return decodeTraceRing(ring.data(), m_entries, m_written);
+  }
+
+  // entries written and events dropped by the last recording
+  uint64_t written() const {
+    return m_written;
+  }
+
+  uint64_t dropped() const {
+    return m_dropped;
+  }
+
+  // stop recording and write the trace as Chrome/Perfetto JSON, e.g. for
+  // chrome://tracing or ui.perfetto.dev
+  bool writeChromeTrace(const char * path) {
+    const std::string text = traceChromeJSON(stop(), m_acc->fclk_MHz());
+    FILE * f = fopen(path, "w");
+    if(!f) {
+      return false;
+    }
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    ok &= fclose(f) == 0;
+    return ok;
+  }
+
+protected:
+  WrapperRegDriver * m_platform;
+  BitSerialMatMulAccelDriver * m_acc;
+  void * m_buf;
+  uint32_t m_entries;
+  bool m_running;
+  uint64_t m_written, m_dropped;
+};
+
+#endif
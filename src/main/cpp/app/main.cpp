@@ -59,6 +59,91 @@ void benchmark_interactive(
   }
 }
 
+// compare the packing throughput of packBitSerial against importRegular
+void benchmark_packer(BitSerialMatMulAccelDriver * acc) {
+  const size_t reps = 5;
+  vector<vector<size_t>> shapes {{256, 4096}, {1024, 4096}, {4096, 4096}};
+  for(auto & s : shapes) {
+    const size_t nrows = s[0], ncols = s[1];
+    uint8_t * m = new uint8_t[nrows * ncols];
+    for(size_t nbits = 1; nbits <= 8; nbits *= 2) {
+      generateRandomVector(nbits, nrows * ncols, m);
+      GEMMContext ctx = acc->allocGEMMContext(
+        nrows, ncols, 1, nbits, 1, false, false
+      );
+      auto t0 = chrono::steady_clock::now();
+      for(size_t i = 0; i < reps; i++) {
+        ctx.lhs.importRegular(m);
+      }
+      auto t1 = chrono::steady_clock::now();
+      for(size_t i = 0; i < reps; i++) {
+        packBitSerial(m, ctx.lhs);
+      }
+      auto t2 = chrono::steady_clock::now();
+      double ms_import = chrono::duration<double, milli>(t1 - t0).count() / reps;
+      double ms_pack = chrono::duration<double, milli>(t2 - t1).count() / reps;
+      cout << nrows << "x" << ncols << ":" << nbits << "b importRegular ";
+      cout << ms_import << " ms, packBitSerial " << ms_pack << " ms (";
+      cout << ms_import / ms_pack << "x)" << endl;
+      deallocGEMMContext(ctx);
+    }
+    delete [] m;
+  }
+}
+
+// time the schedule candidates of some typical shapes on this overlay, and
+// add the winners to the tuning database file
+void tune_shapes(
+  WrapperRegDriver * platform, BitSerialMatMulAccelDriver * acc,
+  const char * path = "bismo_tuning.db"
+) {
+  const HardwareCfg & hw = acc->hwcfg();
+  BitSerialMatMulTuningDB & db = BitSerialMatMulTuningDB::instance();
+  // start from the existing entries, if any
+  db.load(path);
+  BitSerialMatMulAutotuner tuner(acc, platform);
+  // shapes as (lhs rows, rhs rows, cols, lhs bits, rhs bits)
+  vector<vector<size_t>> shapes {
+    {4*hw.dpaDimLHS, 4*hw.dpaDimRHS, hw.dpaDimCommon*hw.lhsEntriesPerMem/2, 2, 2},
+    {8*hw.dpaDimLHS, 2*hw.dpaDimRHS, hw.dpaDimCommon*hw.lhsEntriesPerMem, 2, 2},
+    {2*hw.dpaDimLHS, 8*hw.dpaDimRHS, hw.dpaDimCommon*hw.lhsEntriesPerMem*2, 1, 1},
+    {4*hw.dpaDimLHS, 4*hw.dpaDimRHS, hw.dpaDimCommon*hw.lhsEntriesPerMem*4, 4, 2}
+  };
+  for(auto & s : shapes) {
+    GEMMContext ctx = acc->allocGEMMContext(s[0], s[2], s[1], s[3], s[4], false, false);
+    BitSerialMatMulPlan plan(ctx, hw);
+    TuningEntry e = tuner.tune(ctx);
+    cout << s[0] << "x" << s[2] << "x" << s[1] << ":" << s[3] << "b/" << s[4] << "b ";
+    cout << BitSerialMatMulPlan::getScheduleOrderName(e.sc.order) << " L1 ";
+    cout << e.sc.l0_per_l1 << ": " << e.cycles << " cycles";
+    for(auto & r : tuner.lastResults()) {
+      if(r.sc.order == plan.scheduleCfg().order && r.sc.l0_per_l1 == plan.scheduleCfg().l0_per_l1) {
+        cout << " (cost model pick: " << r.cycles << " cycles)";
+      }
+    }
+    cout << endl;
+    deallocGEMMContext(ctx);
+  }
+  if(!db.save(path)) {
+    cout << "Could not write " << path << endl;
+  }
+}
+
+// rank overlay sizes by predicted runtime for the layers of a model, here
+// the convolutions of a small CNN as GEMMs
+void explore_overlays(BitSerialMatMulAccelDriver * acc) {
+  vector<GEMMShape> layers {
+    {64, 3*3*64, 56*56, 2, 2, false, false},
+    {128, 3*3*128, 28*28, 2, 2, false, false},
+    {256, 3*3*256, 14*14, 2, 2, false, false},
+    {512, 3*3*512, 7*7, 2, 2, false, false},
+    {10, 512, 1, 2, 2, false, false}
+  };
+  vector<uint32_t> dims {2, 4, 8, 16};
+  vector<uint32_t> dimsCommon {64, 128, 256};
+  printOverlayRanking(exploreOverlays(acc->hwcfg(), dims, dimsCommon, dims, layers));
+}
+
 int main(int argc, char const *argv[]) {
   WrapperRegDriver * platform = initPlatform();
   BitSerialMatMulAccelDriver * acc = new BitSerialMatMulAccelDriver(platform);
@@ -66,12 +151,42 @@ int main(int argc, char const *argv[]) {
 
   // Uncomment to enable interactive benchmarking:
   // benchmark_interactive(platform, acc);
+  // Uncomment to compare bit-plane packers:
+  // benchmark_packer(acc);
+  // Uncomment to autotune schedules for this overlay:
+  // tune_shapes(platform, acc);
+  // Uncomment to rank overlay sizes for a model by predicted runtime:
+  // explore_overlays(acc);
 
   bool all_OK = true;
   all_OK &= test_binary_onchip_onetile(platform, acc);
+  all_OK &= test_binary_size_independent(platform, acc);
   all_OK &= test_binary_onchip_multitile(platform, acc);
   all_OK &= test_binary_offchip_multitile(platform, acc);
   all_OK &= test_binary_offchip_widerows_multitile(platform, acc);
+  all_OK &= test_multibit_onchip_multitile(platform, acc);
+  all_OK &= test_multibit_offchip_widerows_multitile(platform, acc);
+  all_OK &= test_ragged_multitile(platform, acc);
+  all_OK &= test_plan_cache(platform, acc);
+  all_OK &= test_plan_save_load(platform, acc);
+  all_OK &= test_dram_cmdqueues(platform, acc);
+  all_OK &= test_async_run(platform, acc);
+  all_OK &= test_session(platform, acc);
+  all_OK &= test_buffer_pool(platform, acc);
+  all_OK &= test_zero_copy_pack(platform, acc);
+  all_OK &= test_result_layouts(platform, acc);
+  all_OK &= test_epilogue(platform, acc);
+  all_OK &= test_packer(platform, acc);
+  all_OK &= test_quantize_pack(platform, acc);
+  all_OK &= test_operand_store(platform, acc);
+  all_OK &= test_bram_residency(platform, acc);
+  all_OK &= test_autotuner(platform, acc);
+  all_OK &= test_perf_model(platform, acc);
+  all_OK &= test_perf_report(platform, acc);
+  all_OK &= test_metrics(platform, acc);
+  all_OK &= test_trace(platform, acc);
+  all_OK &= test_fclk_cache(platform, acc);
+  all_OK &= test_benchmark(platform, acc);
 
   if(all_OK) {
     cout << "All tests passed succesfully" << endl;
@@ -0,0 +1,104 @@
+// Copyright (c) 2018 Norwegian University of Science and Technology (NTNU)
+//
+// BSD v3 License
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of [project] nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+using namespace std;
+#include "BitSerialMatMulBenchmark.hpp"
+
+// sweep benchmark binary, see BitSerialMatMulBenchmark.hpp for the config
+// format. exits with 1 if any shape regressed against the baseline or
+// produced wrong results.
+void usage(const char * name) {
+  cout << "Usage: " << name << " <sweep config> [--csv <file>] [--json <file>]";
+  cout << " [--baseline <csv file>] [--threshold <fraction>]" << endl;
+}
+
+int main(int argc, char const *argv[]) {
+  const char * cfg_path = 0, * csv_path = 0, * json_path = 0, * baseline_path = 0;
+  double threshold = BENCH_DEFAULT_THRESHOLD;
+  for(int i = 1; i < argc; i++) {
+    const bool has_value = i + 1 < argc;
+    if(!strcmp(argv[i], "--csv") && has_value) {
+      csv_path = argv[++i];
+    } else if(!strcmp(argv[i], "--json") && has_value) {
+      json_path = argv[++i];
+    } else if(!strcmp(argv[i], "--baseline") && has_value) {
+      baseline_path = argv[++i];
+    } else if(!strcmp(argv[i], "--threshold") && has_value) {
+      threshold = atof(argv[++i]);
+    } else if(argv[i][0] != '-' && !cfg_path) {
+      cfg_path = argv[i];
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  BenchmarkConfig cfg;
+  if(!cfg_path) {
+    usage(argv[0]);
+    return 2;
+  }
+  if(!loadBenchmarkConfig(cfg_path, cfg)) {
+    cout << "Could not read sweep config " << cfg_path << endl;
+    return 2;
+  }
+  map<string, uint64_t> baseline;
+  if(baseline_path && !loadBenchmarkBaseline(baseline_path, baseline)) {
+    cout << "Could not read baseline " << baseline_path << endl;
+    return 2;
+  }
+
+  WrapperRegDriver * platform = initPlatform();
+  BitSerialMatMulAccelDriver * acc = new BitSerialMatMulAccelDriver(platform);
+  acc->print_hwcfg_summary();
+  vector<BenchmarkResult> results = runBenchmarkSweep(platform, acc, cfg);
+  delete acc;
+  deinitPlatform(platform);
+
+  cout << benchmarkCSV(results);
+  bool ok = true;
+  if(csv_path && !writeBenchmarkFile(csv_path, benchmarkCSV(results))) {
+    cout << "Could not write " << csv_path << endl;
+    ok = false;
+  }
+  if(json_path && !writeBenchmarkFile(json_path, benchmarkJSON(results))) {
+    cout << "Could not write " << json_path << endl;
+    ok = false;
+  }
+  size_t regressions = compareBenchmarkBaseline(results, baseline, threshold, cout);
+  if(regressions) {
+    cout << regressions << " of " << results.size() << " shapes regressed" << endl;
+  }
+  return (ok && !regressions) ? 0 : 1;
+}
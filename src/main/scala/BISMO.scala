@@ -147,19 +147,22 @@ class BitSerialMatMulParams(
 }
 
 // Bundle to expose performance counter data to the CPU
+// the counters are 64-bit and wider than the host registers, so the host
+// raises snapshot to latch all of them and then reads the latched values
 class BitSerialMatMulPerf(myP: BitSerialMatMulParams) extends Bundle {
-  val cc = Output(UInt(32.W))
+  val cc = Output(UInt(64.W))
   val cc_enable = Input(Bool())
+  val snapshot = Input(Bool())
   val prf_fetch = new Bundle {
-    val count = Output(UInt(32.W))
+    val count = Output(UInt(64.W))
     val sel = Input(UInt(log2Up(4).W))
   }
   val prf_exec = new Bundle {
-    val count = Output(UInt(32.W))
+    val count = Output(UInt(64.W))
     val sel = Input(UInt(2.W))
   }
   val prf_res = new Bundle {
-    val count = Output(UInt(32.W))
+    val count = Output(UInt(64.W))
     val sel = Input(UInt(log2Up(4).W))
   }
 
@@ -199,6 +202,10 @@ class BitSerialMatMulAccel(
     val fetch_op_count = Output(UInt(32.W))
     val exec_op_count = Output(UInt(32.W))
     val result_op_count = Output(UInt(32.W))
+    // DRAM-resident command queues, read by the accelerator itself
+    val cmdq = new CmdFetcherCtrlIO
+    // event trace ring buffer in DRAM
+    val trace = new TraceBufferCtrlIO
     // instantiated hardware config
     val hw = Output(new BitSerialMatMulHWCfg(32))
     // performance counter I/O
@@ -216,6 +223,10 @@ class BitSerialMatMulAccel(
   val fetchCtrl = Module(new FetchController(myP.fetchStageParams)).io
   val execCtrl = Module(new ExecController(myP.execStageParams)).io
   val resultCtrl = Module(new ResultController(myP.resultStageParams)).io
+  // instantiate the command fetcher for DRAM-resident command queues
+  val cmdFetcher = Module(new CmdFetcher(myP)).io
+  // instantiate the event trace writer
+  val traceBuf = Module(new TraceBuffer(myP)).io
   // instantiate op and runcfg queues
   val fetchOpQ = Module(new FPGAQueue(chiselTypeOf(io.fetch_op.bits), myP.cmdQueueEntries)).io
   val execOpQ = Module(new FPGAQueue(chiselTypeOf(io.exec_op.bits), myP.cmdQueueEntries)).io
@@ -294,29 +305,58 @@ class BitSerialMatMulAccel(
     vld.ready := enq.ready
   }
 
+  // helper function to feed a command queue from both the host and the
+  // command fetcher. host writes have priority, since the pulse generator
+  // cannot retry them.
+  def enqFromHostOrDRAM[T <: Data](
+      enq: DecoupledIO[T],
+      host: DecoupledIO[T],
+      dram: DecoupledIO[T]
+  ) = {
+    val arb = Module(new Arbiter(chiselTypeOf(enq.bits), 2)).io
+    enqPulseGenFromValid(arb.in(0), host)
+    arb.in(1) <> dram
+    arb.out <> enq
+  }
+
   // wire-up: command queues and pulse generators for fetch stage
   fetchCtrl.enable := io.fetch_enable
   io.fetch_op_count := fetchOpQ.count
   fetchOpQ.deq <> fetchCtrl.op
   fetchRunCfgQ.deq <> fetchCtrl.runcfg
-  enqPulseGenFromValid(fetchOpQ.enq, io.fetch_op)
-  enqPulseGenFromValid(fetchRunCfgQ.enq, io.fetch_runcfg)
+  enqFromHostOrDRAM(fetchOpQ.enq, io.fetch_op, cmdFetcher.fetch_op)
+  enqFromHostOrDRAM(fetchRunCfgQ.enq, io.fetch_runcfg, cmdFetcher.fetch_runcfg)
 
   // wire-up: command queues and pulse generators for exec stage
   execCtrl.enable := io.exec_enable
   io.exec_op_count := execOpQ.count
   execOpQ.deq <> execCtrl.op
   execRunCfgQ.deq <> execCtrl.runcfg
-  enqPulseGenFromValid(execOpQ.enq, io.exec_op)
-  enqPulseGenFromValid(execRunCfgQ.enq, io.exec_runcfg)
+  enqFromHostOrDRAM(execOpQ.enq, io.exec_op, cmdFetcher.exec_op)
+  enqFromHostOrDRAM(execRunCfgQ.enq, io.exec_runcfg, cmdFetcher.exec_runcfg)
 
   // wire-up: command queues and pulse generators for result stage
   resultCtrl.enable := io.result_enable
   io.result_op_count := resultOpQ.count
   resultOpQ.deq <> resultCtrl.op
   resultRunCfgQ.deq <> resultCtrl.runcfg
-  enqPulseGenFromValid(resultOpQ.enq, io.result_op)
-  enqPulseGenFromValid(resultRunCfgQ.enq, io.result_runcfg)
+  enqFromHostOrDRAM(resultOpQ.enq, io.result_op, cmdFetcher.result_op)
+  enqFromHostOrDRAM(resultRunCfgQ.enq, io.result_runcfg, cmdFetcher.result_runcfg)
+
+  // wire-up: command fetcher
+  cmdFetcher.ctrl <> io.cmdq
+  cmdFetcher.queue_count(CmdFetcher.qFetchOp) := fetchOpQ.count
+  cmdFetcher.queue_count(CmdFetcher.qExecOp) := execOpQ.count
+  cmdFetcher.queue_count(CmdFetcher.qResultOp) := resultOpQ.count
+  cmdFetcher.queue_count(CmdFetcher.qFetchRunCfg) := fetchRunCfgQ.count
+  cmdFetcher.queue_count(CmdFetcher.qExecRunCfg) := execRunCfgQ.count
+  cmdFetcher.queue_count(CmdFetcher.qResultRunCfg) := resultRunCfgQ.count
+
+  // wire-up: event trace
+  traceBuf.ctrl <> io.trace
+  traceBuf.events(TraceBuffer.stageFetch) := fetchCtrl.trace
+  traceBuf.events(TraceBuffer.stageExec) := execCtrl.trace
+  traceBuf.events(TraceBuffer.stageResult) := resultCtrl.trace
 
   // wire-up: fetch controller and stage
   fetchStage.start := fetchCtrl.start
@@ -331,9 +371,25 @@ class BitSerialMatMulAccel(
   resultCtrl.done := resultStage.done
   resultStage.csr := resultCtrl.stageO
 
-  // wire-up: read channels to fetch stage
-  fetchStage.dram.rd_req <> io.memPort(0).memRdReq
-  io.memPort(0).memRdRsp <> fetchStage.dram.rd_rsp
+  // wire-up: read channels to fetch stage and command fetcher
+  val rdReqArb = Module(
+    new RRArbiter(chiselTypeOf(fetchStage.dram.rd_req.bits), 2)
+  ).io
+  rdReqArb.in(0) <> fetchStage.dram.rd_req
+  rdReqArb.in(1) <> cmdFetcher.dram.rd_req
+  rdReqArb.out <> io.memPort(0).memRdReq
+  // route read responses by channel ID
+  val rdRsp = io.memPort(0).memRdRsp
+  val rdRspToCmd = rdRsp.bits.channelID === CmdFetcher.chanID.U
+  fetchStage.dram.rd_rsp.bits := rdRsp.bits
+  fetchStage.dram.rd_rsp.valid := rdRsp.valid & !rdRspToCmd
+  cmdFetcher.dram.rd_rsp.bits := rdRsp.bits
+  cmdFetcher.dram.rd_rsp.valid := rdRsp.valid & rdRspToCmd
+  rdRsp.ready := Mux(
+    rdRspToCmd,
+    cmdFetcher.dram.rd_rsp.ready,
+    fetchStage.dram.rd_rsp.ready
+  )
   // wire-up: BRAM ports (fetch and exec stages)
   // port 0 used by fetch stage for writes
   // port 1 used by execute stage for reads
@@ -370,26 +426,70 @@ class BitSerialMatMulAccel(
     resmem(m)(n).ports(1).req := resultStage.resmem_req(m)(n)
     resultStage.resmem_rsp(m)(n) := resmem(m)(n).ports(1).rsp
   }
-  // wire-up: write channels from result stage
-  resultStage.dram.wr_req <> io.memPort(0).memWrReq
-  resultStage.dram.wr_dat <> io.memPort(0).memWrDat
-  io.memPort(0).memWrRsp <> resultStage.dram.wr_rsp
+  // wire-up: write channels from result stage and trace writer
+  // all write requests are single-beat, so the data beats are sent in the
+  // order the requests were accepted
+  val wrReqArb = Module(
+    new RRArbiter(chiselTypeOf(resultStage.dram.wr_req.bits), 2)
+  ).io
+  val wrOrder = Module(new FPGAQueue(UInt(1.W), 16)).io
+  val wrReq = io.memPort(0).memWrReq
+  wrReqArb.in(0) <> resultStage.dram.wr_req
+  wrReqArb.in(1) <> traceBuf.dram.wr_req
+  wrReq.valid := wrReqArb.out.valid & wrOrder.enq.ready
+  wrReq.bits := wrReqArb.out.bits
+  wrReqArb.out.ready := wrReq.ready & wrOrder.enq.ready
+  wrOrder.enq.valid := wrReq.fire
+  wrOrder.enq.bits := wrReqArb.chosen
+  val wrDat = io.memPort(0).memWrDat
+  val wrDatToTrace = wrOrder.deq.bits === 1.U
+  wrDat.valid := wrOrder.deq.valid & Mux(
+    wrDatToTrace,
+    traceBuf.dram.wr_dat.valid,
+    resultStage.dram.wr_dat.valid
+  )
+  wrDat.bits := Mux(
+    wrDatToTrace,
+    traceBuf.dram.wr_dat.bits,
+    resultStage.dram.wr_dat.bits
+  )
+  resultStage.dram.wr_dat.ready := wrOrder.deq.valid & !wrDatToTrace & wrDat.ready
+  traceBuf.dram.wr_dat.ready := wrOrder.deq.valid & wrDatToTrace & wrDat.ready
+  wrOrder.deq.ready := wrDat.fire
+  // route write responses by channel ID
+  val wrRsp = io.memPort(0).memWrRsp
+  val wrRspToTrace = wrRsp.bits.channelID === TraceBuffer.chanID.U
+  resultStage.dram.wr_rsp.bits := wrRsp.bits
+  resultStage.dram.wr_rsp.valid := wrRsp.valid & !wrRspToTrace
+  traceBuf.dram.wr_rsp.bits := wrRsp.bits
+  traceBuf.dram.wr_rsp.valid := wrRsp.valid & wrRspToTrace
+  wrRsp.ready := Mux(
+    wrRspToTrace,
+    traceBuf.dram.wr_rsp.ready,
+    resultStage.dram.wr_rsp.ready
+  )
 
   // set default signature
   io.signature := makeDefaultSignature()
 
   // performance counters
   val regCCEnablePrev = RegNext(io.perf.cc_enable)
-  val regCC = RegInit(0.U(32.W))
-  io.perf.cc := regCC
+  val regCC = RegInit(0.U(64.W))
+  val regCCSnap = RegInit(0.U(64.W))
+  io.perf.cc := regCCSnap
   // reset cycle counter on rising edge of cc_enable
   when(io.perf.cc_enable & !regCCEnablePrev) { regCC := 0.U }
     // increment cycle counter while cc_enable is high
     .elsewhen(io.perf.cc_enable & regCCEnablePrev) { regCC := regCC + 1.U }
+  // latch the cycle counter together with the state counters
+  when(io.perf.snapshot) { regCCSnap := regCC }
 
   fetchCtrl.perf.start := io.perf.cc_enable
   execCtrl.perf.start := io.perf.cc_enable
   resultCtrl.perf.start := io.perf.cc_enable
+  fetchCtrl.perf.snapshot := io.perf.snapshot
+  execCtrl.perf.snapshot := io.perf.snapshot
+  resultCtrl.perf.snapshot := io.perf.snapshot
 
   io.perf.prf_fetch.count := fetchCtrl.perf.count
   fetchCtrl.perf.sel := io.perf.prf_fetch.sel 
@@ -0,0 +1,265 @@
+package bismo
+
+import chisel3._
+import chisel3.util._
+import fpgatidbits.dma._
+import fpgatidbits.streams._
+
+// The CmdFetcher lets BISMO read its instruction streams from DRAM, instead of
+// having the host push every op and runcfg through the register file. The host
+// writes a base address and an entry count for each of the six command queues
+// and pulses start. The CmdFetcher then reads the entries in bursts, issuing a
+// burst only when its destination queue has room for all of it, so that read
+// responses never stall the read channel it shares with the FetchStage.
+
+// Each queue in DRAM is an array of entries, each made up of 64-bit
+// little-endian words:
+// op:            w0 = opcode[7:0] | token_channel[15:8]
+// fetch runcfg:  w0 = dram_base
+//                w1 = dram_block_size_bytes[31:0] | dram_block_offset_bytes[63:32]
+//                w2 = dram_block_count[31:0] | tiles_per_row[47:32]
+//                w3 = bram_addr_base[31:0] | bram_id_start[47:32] | bram_id_range[63:48]
+// exec runcfg:   w0 = lhsOffset[31:0] | rhsOffset[63:32]
+//                w1 = numTiles[31:0] | shiftAmount[39:32] | negate[40] |
+//                     clear_before_first_accumulation[41] | writeEn[42] |
+//                     writeAddr[63:48]
+// result runcfg: w0 = dram_base
+//                w1 = dram_skip
+//                w2 = waitCompleteBytes[31:0] | resmem_addr[47:32] | waitComplete[48]
+object CmdFetcher {
+  // queue indices, also the order of the queues in CmdFetcherCtrlIO
+  val qFetchOp = 0
+  val qExecOp = 1
+  val qResultOp = 2
+  val qFetchRunCfg = 3
+  val qExecRunCfg = 4
+  val qResultRunCfg = 5
+  val numQueues = 6
+  // 64-bit words per entry for each queue
+  val wordsPerEntry = Seq(1, 1, 1, 4, 2, 3)
+  val maxWordsPerEntry = wordsPerEntry.max
+  val bytesPerWord = 8
+  // largest read request, the AXI3 burst limit
+  val maxBeatsPerReq = 16
+  // read requests must not cross this boundary
+  val pageBytes = 4096
+  // channel ID for command reads, FetchStage reads use channel 0
+  val chanID = 1
+}
+
+// DRAM location of one command queue
+class CmdQueueDRAMCfg extends Bundle {
+  // address of the first entry
+  val base = UInt(64.W)
+  // number of entries
+  val count = UInt(32.W)
+}
+
+// host controls for the CmdFetcher
+class CmdFetcherCtrlIO extends Bundle {
+  // rising edge loads the queue configs below and starts fetching
+  val start = Input(Bool())
+  // high until all entries have been pushed into the command queues
+  val busy = Output(Bool())
+  val fetch_op = Input(new CmdQueueDRAMCfg)
+  val exec_op = Input(new CmdQueueDRAMCfg)
+  val result_op = Input(new CmdQueueDRAMCfg)
+  val fetch_runcfg = Input(new CmdQueueDRAMCfg)
+  val exec_runcfg = Input(new CmdQueueDRAMCfg)
+  val result_runcfg = Input(new CmdQueueDRAMCfg)
+}
+
+// a burst of entries requested from DRAM for one queue
+class CmdFetcherBurst(maxEntries: Int) extends Bundle {
+  val queue = UInt(log2Up(CmdFetcher.numQueues).W)
+  val entries = UInt(log2Up(maxEntries + 1).W)
+}
+
+class CmdFetcher(myP: BitSerialMatMulParams) extends Module {
+  import CmdFetcher._
+  val io = IO(new Bundle {
+    val ctrl = new CmdFetcherCtrlIO
+    // current number of entries in each command queue
+    val queue_count = Input(Vec(numQueues, UInt(32.W)))
+    // decoded commands to each queue
+    val fetch_op = Decoupled(new ControllerCmd(1, 1))
+    val exec_op = Decoupled(new ControllerCmd(2, 2))
+    val result_op = Decoupled(new ControllerCmd(1, 1))
+    val fetch_runcfg = Decoupled(new FetchStageCtrlIO(myP.fetchStageParams))
+    val exec_runcfg = Decoupled(new ExecStageCtrlIO(myP.execStageParams))
+    val result_runcfg = Decoupled(new ResultStageCtrlIO(myP.resultStageParams))
+    // DRAM read channel
+    val dram = new FetchStageDRAMIO(myP.fetchStageParams)
+  })
+  // entries are assembled from 64-bit beats
+  Predef.assert(myP.mrp.dataWidth == 64)
+  // half the queue per burst, so fetching overlaps with draining
+  val burstEntries = math.max(1, myP.cmdQueueEntries / 2)
+  val cfgs = Seq(
+    io.ctrl.fetch_op, io.ctrl.exec_op, io.ctrl.result_op,
+    io.ctrl.fetch_runcfg, io.ctrl.exec_runcfg, io.ctrl.result_runcfg
+  )
+  val wordsPerEntryVec = VecInit(wordsPerEntry.map(_.U(3.W)))
+
+  // next address and entries left to request for each queue
+  val regBase = Reg(Vec(numQueues, UInt(64.W)))
+  val regLeft = RegInit(VecInit(Seq.fill(numQueues)(0.U(32.W))))
+  // entries requested but not yet pushed into each queue
+  val regInFlight = RegInit(VecInit(Seq.fill(numQueues)(0.U(32.W))))
+  val startPulse = io.ctrl.start & !RegNext(io.ctrl.start)
+  io.ctrl.busy := regLeft.map(_ =/= 0.U).reduce(_ || _) ||
+    regInFlight.map(_ =/= 0.U).reduce(_ || _)
+
+  // request generation: pick a queue with room for a burst, round-robin
+  val sIdle :: sReq :: Nil = Enum(2)
+  val regState = RegInit(sIdle)
+  val regLastQueue = RegInit(0.U(log2Up(numQueues).W))
+  val regAddr = Reg(UInt(64.W))
+  val regBeatsLeft = RegInit(0.U(log2Up(burstEntries * maxWordsPerEntry + 1).W))
+  // each burst is read with as few multi-beat requests as possible, split
+  // only at the request size limit and at page boundaries
+  val beatsToPageEnd = (pageBytes.U - regAddr(log2Up(pageBytes) - 1, 0)) >>
+    log2Up(bytesPerWord)
+  val cappedBeats = Mux(
+    regBeatsLeft < maxBeatsPerReq.U,
+    regBeatsLeft,
+    maxBeatsPerReq.U
+  )
+  val reqBeats = Mux(cappedBeats < beatsToPageEnd, cappedBeats, beatsToPageEnd)
+  val pending = Module(
+    new FPGAQueue(new CmdFetcherBurst(burstEntries), 4)
+  ).io
+
+  val burst = VecInit(regLeft.map(l => Mux(l < burstEntries.U, l, burstEntries.U)))
+  val canIssue = VecInit((0 until numQueues).map { q =>
+    regLeft(q) =/= 0.U &&
+    (io.queue_count(q) + regInFlight(q) + burst(q) <= myP.cmdQueueEntries.U)
+  }).asUInt
+  val afterLast = VecInit((0 until numQueues).map(q => q.U > regLastQueue)).asUInt
+  val maskedIssue = canIssue & afterLast
+  val selQueue = Mux(
+    maskedIssue.orR, PriorityEncoder(maskedIssue), PriorityEncoder(canIssue)
+  )
+  val selEntries = burst(selQueue)
+  val selBytes = selEntries * wordsPerEntryVec(selQueue) * bytesPerWord.U
+  val issue = (regState === sIdle) & !startPulse & canIssue.orR & pending.enq.ready
+
+  pending.enq.valid := issue
+  pending.enq.bits.queue := selQueue
+  pending.enq.bits.entries := selEntries
+
+  io.dram.rd_req.valid := (regState === sReq)
+  io.dram.rd_req.bits.channelID := chanID.U
+  io.dram.rd_req.bits.isWrite := false.B
+  io.dram.rd_req.bits.addr := regAddr
+  io.dram.rd_req.bits.numBytes := reqBeats * bytesPerWord.U
+  io.dram.rd_req.bits.metaData := 0.U
+
+  when(startPulse) {
+    for (q <- 0 until numQueues) {
+      regBase(q) := cfgs(q).base
+      regLeft(q) := cfgs(q).count
+    }
+  }
+
+  switch(regState) {
+    is(sIdle) {
+      when(issue) {
+        regLastQueue := selQueue
+        regAddr := regBase(selQueue)
+        regBeatsLeft := selEntries * wordsPerEntryVec(selQueue)
+        regBase(selQueue) := regBase(selQueue) + selBytes
+        regLeft(selQueue) := regLeft(selQueue) - selEntries
+        regState := sReq
+      }
+    }
+    is(sReq) {
+      when(io.dram.rd_req.fire) {
+        regAddr := regAddr + reqBeats * bytesPerWord.U
+        regBeatsLeft := regBeatsLeft - reqBeats
+        when(regBeatsLeft === reqBeats) { regState := sIdle }
+      }
+    }
+  }
+
+  // response handling: assemble entries and push them into their queues
+  val regWordInd = RegInit(0.U(log2Up(maxWordsPerEntry).W))
+  val regEntriesDone = RegInit(0.U(log2Up(burstEntries + 1).W))
+  val regWords = Reg(Vec(maxWordsPerEntry, UInt(64.W)))
+  val rspQueue = pending.deq.bits.queue
+  val lastWord = regWordInd === wordsPerEntryVec(rspQueue) - 1.U
+  val entryWords = Wire(Vec(maxWordsPerEntry, UInt(64.W)))
+  for (i <- 0 until maxWordsPerEntry) {
+    entryWords(i) := Mux(regWordInd === i.U, io.dram.rd_rsp.bits.readData, regWords(i))
+  }
+  val entry = entryWords.asUInt
+  def field(word: Int, lo: Int, w: Int): UInt = entry(64 * word + lo + w - 1, 64 * word + lo)
+  def flag(word: Int, bit: Int): Bool = entry(64 * word + bit)
+
+  val outs = Seq(
+    io.fetch_op, io.exec_op, io.result_op,
+    io.fetch_runcfg, io.exec_runcfg, io.result_runcfg
+  )
+  val outReady = VecInit(outs.map(_.ready))
+  val rspActive = io.dram.rd_rsp.valid & pending.deq.valid
+  io.dram.rd_rsp.ready := pending.deq.valid & (!lastWord | outReady(rspQueue))
+  val entryDone = rspActive & lastWord & outReady(rspQueue)
+  for (q <- 0 until numQueues) {
+    outs(q).valid := rspActive & lastWord & (rspQueue === q.U)
+  }
+  val lastEntry = regEntriesDone === pending.deq.bits.entries - 1.U
+  pending.deq.ready := entryDone & lastEntry
+
+  when(rspActive & !lastWord) {
+    regWords(regWordInd) := io.dram.rd_rsp.bits.readData
+    regWordInd := regWordInd + 1.U
+  }
+  when(entryDone) {
+    regWordInd := 0.U
+    regEntriesDone := Mux(lastEntry, 0.U, regEntriesDone + 1.U)
+  }
+
+  // keep track of in-flight entries per queue
+  for (q <- 0 until numQueues) {
+    val inc = Mux(issue & (selQueue === q.U), selEntries, 0.U)
+    val dec = Mux(entryDone & (rspQueue === q.U), 1.U, 0.U)
+    regInFlight(q) := regInFlight(q) + inc - dec
+  }
+  when(startPulse) {
+    // a new start abandons anything left from a previous one
+    regState := sIdle
+  }
+
+  // decode entries
+  for (op <- Seq(io.fetch_op, io.exec_op, io.result_op)) {
+    op.bits.opcode := field(0, 0, op.bits.opcode.getWidth)
+    op.bits.token_channel := field(0, 8, op.bits.token_channel.getWidth)
+  }
+
+  val frc = io.fetch_runcfg.bits
+  frc.dram_base := field(0, 0, 64)
+  frc.dram_block_size_bytes := field(1, 0, 32)
+  frc.dram_block_offset_bytes := field(1, 32, 32)
+  frc.dram_block_count := field(2, 0, 32)
+  frc.tiles_per_row := field(2, 32, 16)
+  frc.bram_addr_base := field(3, 0, frc.bram_addr_base.getWidth)
+  frc.bram_id_start := field(3, 32, frc.bram_id_start.getWidth)
+  frc.bram_id_range := field(3, 48, frc.bram_id_range.getWidth)
+
+  val erc = io.exec_runcfg.bits
+  erc.lhsOffset := field(0, 0, 32)
+  erc.rhsOffset := field(0, 32, 32)
+  erc.numTiles := field(1, 0, 32)
+  erc.shiftAmount := field(1, 32, erc.shiftAmount.getWidth)
+  erc.negate := flag(1, 40)
+  erc.clear_before_first_accumulation := flag(1, 41)
+  erc.writeEn := flag(1, 42)
+  erc.writeAddr := field(1, 48, erc.writeAddr.getWidth)
+
+  val rrc = io.result_runcfg.bits
+  rrc.dram_base := field(0, 0, 64)
+  rrc.dram_skip := field(1, 0, 64)
+  rrc.waitCompleteBytes := field(2, 0, 32)
+  rrc.resmem_addr := field(2, 32, rrc.resmem_addr.getWidth)
+  rrc.waitComplete := flag(2, 48)
+}
@@ -4,7 +4,6 @@ import chisel3._
 import chisel3.util._
 import fpgatidbits.ocm._
 import fpgatidbits.streams._
-import fpgatidbits.profiler._
 
 // The Controller Module receives instructions, sets up parameters for its
 // stage, launches and monitors stage execution, and performs token enq/deq
@@ -52,10 +51,14 @@ class BaseController[Ts <: Bundle](
     // state profiler output
     val perf = new Bundle {
       val start = Input(Bool())
-      val count = Output(UInt(32.W))
+      // latch all state counters, count reads the latched values
+      val snapshot = Input(Bool())
+      val count = Output(UInt(64.W))
       val sel = Input(UInt(log2Up(4).W))
       
     }
+    // event trace output, see TraceBuffer.scala
+    val trace = Output(Valid(new TraceEvent))
   })
   // default values
   io.op.ready := false.B
@@ -67,6 +70,9 @@ class BaseController[Ts <: Bundle](
     io.sync_out(i).valid := false.B
     io.sync_out(i).bits := false.B
   }
+  io.trace.valid := false.B
+  io.trace.bits.kind := TraceBuffer.evRunStart.U
+  io.trace.bits.channel := io.op.bits.token_channel
 
   val sGetCmd :: sRun :: sSend :: sReceive :: Nil = Enum(4)
   val regState = RegInit(sGetCmd)
@@ -83,10 +89,14 @@ class BaseController[Ts <: Bundle](
           io.op.bits.opcode === Opcodes.opRun && io.runcfg.valid && !io.done
         ) {
           regState := sRun
+          io.trace.valid := true.B
+          io.trace.bits.kind := TraceBuffer.evRunStart.U
         }.elsewhen(io.op.bits.opcode === Opcodes.opSendToken) {
           regState := sSend
         }.elsewhen(io.op.bits.opcode === Opcodes.opReceiveToken) {
           regState := sReceive
+          io.trace.valid := true.B
+          io.trace.bits.kind := TraceBuffer.evRecvStart.U
         }
       }
     }
@@ -97,6 +107,8 @@ class BaseController[Ts <: Bundle](
         // pop from command queue when done
         io.op.ready := true.B
         io.runcfg.ready := true.B
+        io.trace.valid := true.B
+        io.trace.bits.kind := TraceBuffer.evRunEnd.U
         // get new command
         regState := sGetCmd
       }
@@ -108,6 +120,8 @@ class BaseController[Ts <: Bundle](
       when(sendChannel.ready) {
         regState := sGetCmd
         io.op.ready := true.B
+        io.trace.valid := true.B
+        io.trace.bits.kind := TraceBuffer.evSend.U
       }
     }
     is(sReceive) {
@@ -117,16 +131,27 @@ class BaseController[Ts <: Bundle](
       when(receiveChannel.valid) {
         regState := sGetCmd
         io.op.ready := true.B
+        io.trace.valid := true.B
+        io.trace.bits.kind := TraceBuffer.evRecvEnd.U
       }
     }
   }
 
-  // state profiler
-  val profiler = Module(new StateProfiler(4)).io
-  io.perf.count := profiler.count
-  profiler.sel := io.perf.sel
-  profiler.start := io.perf.start & io.enable
-  profiler.probe := regState
+  // state profiler: cycles spent in each state, cleared on the rising edge of
+  // profStart and counted while it is high. 64-bit, so that long runs do not
+  // wrap, and read through a snapshot so the host sees both halves of a count
+  // from the same cycle.
+  val profStart = io.perf.start & io.enable
+  val regProfStartPrev = RegNext(profStart)
+  val regStateCycles = RegInit(VecInit(Seq.fill(4)(0.U(64.W))))
+  val regStateCyclesSnap = RegInit(VecInit(Seq.fill(4)(0.U(64.W))))
+  when(profStart & !regProfStartPrev) {
+    for (i <- 0 until 4) { regStateCycles(i) := 0.U }
+  }.elsewhen(profStart) {
+    regStateCycles(regState) := regStateCycles(regState) + 1.U
+  }
+  when(io.perf.snapshot) { regStateCyclesSnap := regStateCycles }
+  io.perf.count := regStateCyclesSnap(io.perf.sel)
 }
 
 // derived classes for each type of controller.
@@ -0,0 +1,141 @@
+package bismo
+
+import chisel3._
+import chisel3.util._
+import fpgatidbits.dma._
+import fpgatidbits.streams._
+
+// The TraceBuffer records a timestamped event for each instruction boundary
+// and token operation in the three stage controllers, and writes the events
+// into a ring buffer in DRAM that the host decodes afterwards. The host writes
+// the buffer base and size in entries and raises enable; the rising edge
+// resets the write pointer, the timestamp and the counters. Events that do
+// not fit into the per-stage queues are dropped and counted, so tracing
+// never stalls the controllers.
+
+// Each ring buffer entry is one 64-bit little-endian word:
+// cycle[47:0] | kind[50:48] | stage[52:51] | channel[54:53]
+// where cycle counts from the rising edge of enable.
+object TraceBuffer {
+  // event kinds
+  val evRunStart = 0
+  val evRunEnd = 1
+  val evSend = 2
+  val evRecvStart = 3
+  val evRecvEnd = 4
+  // event sources, also the order of the events in the TraceBuffer IO
+  val stageFetch = 0
+  val stageExec = 1
+  val stageResult = 2
+  val numStages = 3
+  val cycleBits = 48
+  val entryBytes = 8
+  // channel ID for trace writes, ResultStage writes use channel 0
+  val chanID = 1
+}
+
+// one event emitted by a controller
+class TraceEvent extends Bundle {
+  val kind = UInt(3.W)
+  val channel = UInt(2.W)
+}
+
+// host controls for the TraceBuffer
+class TraceBufferCtrlIO extends Bundle {
+  // rising edge resets the ring buffer, events are recorded while high
+  val enable = Input(Bool())
+  // address of the first entry
+  val base = Input(UInt(64.W))
+  // number of entries in the ring buffer
+  val entries = Input(UInt(32.W))
+  // entries written to DRAM and events dropped since enable went high
+  val written = Output(UInt(32.W))
+  val dropped = Output(UInt(32.W))
+  // high while recorded events are not yet written to DRAM
+  val busy = Output(Bool())
+}
+
+class TraceBuffer(myP: BitSerialMatMulParams, queueEntries: Int = 16)
+    extends Module {
+  import TraceBuffer._
+  val io = IO(new Bundle {
+    val ctrl = new TraceBufferCtrlIO
+    // events from each stage controller
+    val events = Vec(numStages, Flipped(Valid(new TraceEvent)))
+    // DRAM write channel
+    val dram = new ResultStageDRAMIO(myP.resultStageParams)
+  })
+  // each entry is written as one 64-bit beat
+  Predef.assert(myP.mrp.dataWidth == 64)
+  val startPulse = io.ctrl.enable & !RegNext(io.ctrl.enable)
+
+  // timestamp
+  val regCycle = RegInit(0.U(cycleBits.W))
+  when(startPulse) { regCycle := 0.U }
+    .elsewhen(io.ctrl.enable) { regCycle := regCycle + 1.U }
+
+  // per-stage event queues, packed into ring buffer entries
+  val regDropped = RegInit(0.U(32.W))
+  val eventQs = Seq.fill(numStages) {
+    Module(new FPGAQueue(UInt(64.W), queueEntries)).io
+  }
+  for (s <- 0 until numStages) {
+    val ev = io.events(s)
+    eventQs(s).enq.valid := io.ctrl.enable & !startPulse & ev.valid
+    eventQs(s).enq.bits := Cat(
+      ev.bits.channel, s.U(2.W), ev.bits.kind, regCycle
+    )
+  }
+  val dropNow = (0 until numStages).map { s =>
+    Mux(eventQs(s).enq.valid & !eventQs(s).enq.ready, 1.U(2.W), 0.U(2.W))
+  }.reduce(_ + _)
+  when(startPulse) { regDropped := 0.U }
+    .otherwise { regDropped := regDropped + dropNow }
+  io.ctrl.dropped := regDropped
+
+  // pick events round-robin, the queue keeps the chosen entry stable while
+  // its request and data are being issued
+  val arb = Module(new RRArbiter(UInt(64.W), numStages)).io
+  for (s <- 0 until numStages) { arb.in(s) <> eventQs(s).deq }
+  val entry = FPGAQueue(arb.out, 2)
+
+  // issue one single-beat write request and one data beat per entry
+  val regPtr = RegInit(0.U(32.W))
+  val regReqDone = RegInit(false.B)
+  val regDatDone = RegInit(false.B)
+  io.dram.wr_req.valid := entry.valid & !regReqDone
+  io.dram.wr_req.bits.channelID := chanID.U
+  io.dram.wr_req.bits.isWrite := true.B
+  io.dram.wr_req.bits.addr := io.ctrl.base + regPtr * entryBytes.U
+  io.dram.wr_req.bits.numBytes := entryBytes.U
+  io.dram.wr_req.bits.metaData := 0.U
+  io.dram.wr_dat.valid := entry.valid & !regDatDone
+  io.dram.wr_dat.bits := entry.bits
+  entry.ready := (regReqDone | io.dram.wr_req.ready) &
+    (regDatDone | io.dram.wr_dat.ready)
+
+  when(entry.fire) {
+    regReqDone := false.B
+    regDatDone := false.B
+    regPtr := Mux(regPtr === io.ctrl.entries - 1.U, 0.U, regPtr + 1.U)
+  }.otherwise {
+    when(io.dram.wr_req.fire) { regReqDone := true.B }
+    when(io.dram.wr_dat.fire) { regDatDone := true.B }
+  }
+  when(startPulse) { regPtr := 0.U }
+
+  // count issued and completed writes
+  val regIssued = RegInit(0.U(32.W))
+  val regWritten = RegInit(0.U(32.W))
+  io.dram.wr_rsp.ready := true.B
+  when(startPulse) {
+    regIssued := 0.U
+    regWritten := 0.U
+  }.otherwise {
+    when(entry.fire) { regIssued := regIssued + 1.U }
+    when(io.dram.wr_rsp.valid) { regWritten := regWritten + 1.U }
+  }
+  io.ctrl.written := regWritten
+  io.ctrl.busy := eventQs.map(_.deq.valid).reduce(_ || _) || entry.valid ||
+    (regIssued =/= regWritten)
+}
@@ -24,6 +24,8 @@ class EmuTestExecStage(p: PlatformWrapperParams) extends GenericAccelerator(p) {
     // base control signals
     val start = Input(Bool())                   // hold high while running
     val done = Output(Bool())                   // high when done until start=0
+    // clock cycles from start to done, held until the next start
+    val cycles = Output(UInt(32.W))
     val cfg = new ExecStageCfgIO()
     val csr = Input(new ExecStageCtrlIO(myP))
     // write access to input matrix tile memory
@@ -49,6 +51,10 @@ class EmuTestExecStage(p: PlatformWrapperParams) extends GenericAccelerator(p) {
   rmm.csr <> io.csr
   rmm.start := io.start
   io.done := rmm.done
+  val regCycles = RegInit(0.U(32.W))
+  when(io.start & !RegNext(io.start)) { regCycles := 0.U }
+    .elsewhen(io.start & !rmm.done) { regCycles := regCycles + 1.U }
+  io.cycles := regCycles
   // the signature can be e.g. used for checking that the accelerator has the
   // correct version. here the signature is regenerated from the current date.
   io.signature := makeDefaultSignature()
@@ -25,6 +25,12 @@ class EmuTestResultStage(
     // base control signals
     val start = Input(Bool()) // hold high while running
     val done = Output(Bool()) // high when done until start=0
+    // clock cycles from start to done, held until the next start
+    val cycles = Output(UInt(32.W))
+    // clock cycles with DRAM writes requested or in flight, cleared by
+    // perf_clear
+    val perf_clear = Input(Bool())
+    val wr_busy_cycles = Output(UInt(32.W))
     val csr = Input(new ResultStageCtrlIO(myP))
     val accwr_en = Input(Bool())
     val accwr_lhs = Input(UInt(log2Up(myP.dpa_lhs).W))
@@ -52,6 +58,10 @@ class EmuTestResultStage(
   val res = Module(new ResultStage(myP)).io
   res.start := io.start
   io.done := res.done
+  val regCycles = RegInit(0.U(32.W))
+  when(io.start & !RegNext(io.start)) { regCycles := 0.U }
+    .elsewhen(io.start & !res.done) { regCycles := regCycles + 1.U }
+  io.cycles := regCycles
   res.csr <> io.csr
   for (lhs <- 0 until myP.dpa_lhs) {
     for (rhs <- 0 until myP.dpa_rhs) {
@@ -72,6 +82,16 @@ class EmuTestResultStage(
   res.dram.wr_req <> io.memPort(0).memWrReq
   res.dram.wr_dat <> io.memPort(0).memWrDat
   io.memPort(0).memWrRsp <> res.dram.wr_rsp
+  // writes are single-beat, so each request gets one response
+  val regWrIssued = RegInit(0.U(32.W))
+  val regWrDone = RegInit(0.U(32.W))
+  val regWrBusyCycles = RegInit(0.U(32.W))
+  when(io.memPort(0).memWrReq.fire) { regWrIssued := regWrIssued + 1.U }
+  when(io.memPort(0).memWrRsp.fire) { regWrDone := regWrDone + 1.U }
+  val wrBusy = io.memPort(0).memWrReq.valid | (regWrIssued =/= regWrDone)
+  when(io.perf_clear) { regWrBusyCycles := 0.U }
+    .elsewhen(wrBusy) { regWrBusyCycles := regWrBusyCycles + 1.U }
+  io.wr_busy_cycles := regWrBusyCycles
   // when(io.memPort(0).memWrDat.bits =/= 0.U) {
   //   printf("bits: %x \n", io.memPort(0).memWrDat.bits)
   // }
@@ -1,82 +1,92 @@
+#include <cstdlib>
 #include <iostream>
+#include <iomanip>
 #include "platform.h"
 #include "EmuTestExecStage.hpp"
 
-// Cosim test for basic ExecStage behavior
+// Cosim test and efficiency microbenchmark for ExecStage. Fills the tile
+// memories with random data, then sweeps the number of tiles, the shift
+// amount and negation, checks the results against a software model and
+// reports the fraction of clock cycles spent on useful tiles.
 
 using namespace std;
 
+// DPA dimensions and tile memory depth of the hardware
+#define DPA_M 2
+#define DPA_N 2
+#define DPA_K 64
+#define TILEMEM_ENTRIES 1024
+
 WrapperRegDriver * p;
 EmuTestExecStage * t;
 
-//function prototypes
-void BramTransferLHS(uint64_t *lmat, int StartAddr, int steps, int sel);
-void BramTransferRHS(uint64_t  *rmat, int StartAddr, int steps, int sel);
-void testmul(uint8_t tilenum, uint8_t shiftAmt, uint8_t l_offset, uint8_t r_offset, uint8_t neg, bool acc_clear);
-void testres();
+uint64_t lhs[DPA_M][TILEMEM_ENTRIES];
+uint64_t rhs[DPA_N][TILEMEM_ENTRIES];
 
 void BramTransferLHS(uint64_t *lmat, int StartAddr, int steps, int sel){
-  // initialize the LHS matrix memory
-  cout << "starting lhs"  << endl;
-  t->set_tilemem_lhs_sel(sel); //
+  t->set_tilemem_lhs_sel(sel);
   for (int i = StartAddr ; i < StartAddr+steps ; i++){
-    t->set_tilemem_lhs_addr(i); //
+    t->set_tilemem_lhs_addr(i);
     t->set_tilemem_lhs_data(*lmat);
-    cout <<"Element "<<i<<"  "<< *lmat << endl;
-    t->set_tilemem_lhs_write(1); // select the
-    t->set_tilemem_lhs_write(0); ///
+    t->set_tilemem_lhs_write(1);
+    t->set_tilemem_lhs_write(0);
     lmat++;
   }
 }
 
-/*
-This is for the right hand side
-*/
 void BramTransferRHS(uint64_t *rmat, int StartAddr, int steps, int sel){
-  cout << "starting rhs"  << endl;
-  t->set_tilemem_rhs_sel(sel); //
+  t->set_tilemem_rhs_sel(sel);
   for (int i = StartAddr ; i < StartAddr+steps ; i++){
-    t->set_tilemem_rhs_addr(i); //
+    t->set_tilemem_rhs_addr(i);
     t->set_tilemem_rhs_data(*rmat);
-    cout <<"Element "<<i<<"  "<< *rmat << endl;
-    t->set_tilemem_rhs_write(1); //
-    t->set_tilemem_rhs_write(0); //
+    t->set_tilemem_rhs_write(1);
+    t->set_tilemem_rhs_write(0);
     rmat++;
   }
 }
 
-
-
-void testmul(
-  uint8_t tilenum, uint8_t shiftAmt, uint8_t l_offset, uint8_t r_offset,
+// run the ExecStage and return the clock cycles from start to done
+uint32_t testmul(
+  uint32_t tilenum, uint8_t shiftAmt, uint8_t l_offset, uint8_t r_offset,
   uint8_t neg, bool acc_clear, uint8_t writeAddr, bool do_write
 ){
-	t->set_csr_negate(neg);
-	t->set_csr_shiftAmount(shiftAmt);
-	t->set_csr_numTiles(tilenum);
-	t->set_csr_lhsOffset(l_offset);
-	t->set_csr_rhsOffset(r_offset);
+  t->set_csr_negate(neg);
+  t->set_csr_shiftAmount(shiftAmt);
+  t->set_csr_numTiles(tilenum);
+  t->set_csr_lhsOffset(l_offset);
+  t->set_csr_rhsOffset(r_offset);
   t->set_csr_writeAddr(writeAddr);
   t->set_csr_writeEn(do_write ? 1 : 0);
-	t->set_csr_clear_before_first_accumulation(acc_clear ? 1: 0);
+  t->set_csr_clear_before_first_accumulation(acc_clear ? 1: 0);
   // launch the accelerator
-	t->set_start(1);
-	while (t->get_done() !=1){};
-	t->set_start(0);
-	// read result memory at (0, 0)
+  t->set_start(1);
+  while (t->get_done() !=1){};
+  t->set_start(0);
+  return t->get_cycles();
 }
 
 int32_t testres(uint8_t r, uint8_t c){
-  int32_t result;
-  // read result memory at (0, 0)
+  // read result memory at (r, c)
   t->set_resmem_addr_c(c);
   t->set_resmem_addr_r(r);
   t->set_resmem_addr_e(0);
-  result = t->get_resmem_data() ;
-  return result;
+  return t->get_resmem_data();
 }
 
+// software model of one accumulation over the first tilenum tiles, with the
+// same 32-bit wraparound as the accumulators
+int32_t expected(int r, int c, uint32_t tilenum, uint8_t shiftAmt, bool neg){
+  uint32_t acc = 0;
+  for (uint32_t i = 0; i < tilenum; i++) {
+    uint32_t pc = __builtin_popcountll(lhs[r][i] & rhs[c][i]) << shiftAmt;
+    acc = neg ? acc - pc : acc + pc;
+  }
+  return (int32_t) acc;
+}
 
+uint64_t rand64(){
+  return ((uint64_t) rand() << 48) ^ ((uint64_t) rand() << 24) ^ rand();
+}
 
 int main()
 {
@@ -84,88 +94,48 @@ int main()
   try {
     p = initPlatform();
     t = new EmuTestExecStage(p);
-    // Matrix Arrays
-    uint64_t i1[10];
-    uint64_t i2[10];
-    uint64_t i3[10];
-    uint64_t i4[10];
-    uint64_t *i1_p;
-    uint64_t *i2_p;
-    uint64_t *i3_p;
-    uint64_t *i4_p;
-
-    uint64_t resul[10];
-
-    uint64_t LAddr = 0;
-    uint16_t RAddr = 0;
-    uint64_t AddrStep = 10;
-    uint8_t  tiles = 2;
-    uint8_t  shift = 1;
-
-    int32_t r00,r01,r10,r11;
-    int32_t c00,c01,c10,c11;
-
-    bool t00 = true;
-    bool t01 = true;
-    bool t10 = true;
-    bool t11 = true;
-
     t_okay = true;
-    // create a known test matrix
-    // The matrix is 2.dpex * 2.dpez times, same for dpey
-    for (int ic = 0; ic <AddrStep; ic ++ ){
-      i1[ic] = (uint64_t) 0x00000000000000ff;
-      i2[ic] = (uint64_t) 0x00000000000008f0;
-      i3[ic] = (uint64_t) 0x00000000000000af;
-      i4[ic] = (uint64_t) 0x0000000000000af0;
+
+    srand(2018);
+    for (int i = 0; i < DPA_M; i++) {
+      for (int j = 0; j < TILEMEM_ENTRIES; j++) lhs[i][j] = rand64();
+      BramTransferLHS(lhs[i], 0, TILEMEM_ENTRIES, i);
+    }
+    for (int i = 0; i < DPA_N; i++) {
+      for (int j = 0; j < TILEMEM_ENTRIES; j++) rhs[i][j] = rand64();
+      BramTransferRHS(rhs[i], 0, TILEMEM_ENTRIES, i);
+    }
+
+    const uint32_t tile_counts[] = {1, 2, 4, 16, 64, 256, 1024};
+    const uint8_t shifts[] = {0, 1, 7};
+    cout << "numTiles,shift,negate,cycles,efficiency,binops_per_cycle,ok" << endl;
+    for (uint32_t tiles : tile_counts) {
+      for (uint8_t shift : shifts) {
+        for (uint8_t neg = 0; neg < 2; neg++) {
+          uint32_t cycles = testmul(tiles, shift, 0, 0, neg, true, 0, true);
+          bool ok = true;
+          for (int r = 0; r < DPA_M; r++) {
+            for (int c = 0; c < DPA_N; c++) {
+              int32_t res = testres(r, c);
+              int32_t exp = expected(r, c, tiles, shift, neg);
+              if (res != exp) {
+                cout << "mismatch at (" << r << ", " << c << "): expected ";
+                cout << exp << " found " << res << endl;
+                ok = false;
+              }
+            }
+          }
+          t_okay &= ok;
+          // each tile is one cycle of work for the DPA in the ideal case
+          double binops = 2.0 * DPA_M * DPA_N * DPA_K * tiles;
+          cout << tiles << "," << (int) shift << "," << (int) neg << ",";
+          cout << cycles << "," << fixed << setprecision(3);
+          cout << (cycles ? (double) tiles / cycles : 0.0) << ",";
+          cout << (cycles ? binops / cycles : 0.0) << "," << ok << endl;
+        }
+      }
     }
 
-  	// Pointers to the required addresses
-  	i1_p = i1;
-  	i2_p = i2;
-  	i3_p = i3;
-  	i4_p = i4;
-
-  	// Begin Transfer
-  	//  Initialize the BRAM with the variables
-  	BramTransferRHS(i1_p,RAddr,AddrStep,0);
-  	BramTransferRHS(i2_p,RAddr,AddrStep,1);
-  	BramTransferLHS(i3_p,LAddr,AddrStep,0);
-  	BramTransferLHS(i4_p,LAddr,AddrStep,1);
-
-    // Actual Multiplication
-  	cout << "Starting Multiply" <<endl;
-
-    testmul(tiles,shift,0,0,0,true,0,true);
-    r00 = testres(0,0);
-    r01 = testres(0,1);
-    r10 = testres(1,0);
-    r11 = testres(1,1);
-
-    cout << "Expected Values for this test" << endl;
-    c00 = 6*tiles*(shift+1);
-    c01 = 2*tiles*(shift+1);
-    c10 = 4*tiles*(shift+1);
-    c11 = 5*tiles*(shift+1);
-
-    t00 = c00 == r00 ;
-    t01 = c01 == r01 ;
-    t10 = c10 == r10 ;
-    t11 = c11 == r11 ;
-
-    t_okay = t00 && t01 && t10 && t11;
-    cout <<r00<<endl;
-    cout <<r01<<endl;
-    cout <<r10<<endl;
-    cout <<r11<<endl;
-    cout <<c00<<endl;
-    cout <<c01<<endl;
-    cout <<c10<<endl;
-    cout <<c11<<endl;
-    cout <<t00<<endl;
-    cout <<t01<<endl;
-    cout <<t10<<endl;
-    cout <<t11<<endl;
     if(t_okay) {
       cout << "Test passed";
     } else {
@@ -179,4 +149,4 @@ int main()
     cout << "Exception: " << e << endl;
   }
   return t_okay ? 0 : -1;
-}
\ No newline at end of file
+}
@@ -1,15 +1,20 @@
 #include <cassert>
 #include <iostream>
+#include <iomanip>
 using namespace std;
 #include "platform.h"
 #include "EmuTestFetchStage.hpp"
 
-// Cosim test for basic FetchStage behavior
+// Cosim test and throughput microbenchmark for FetchStage. Sweeps the DRAM
+// block size, block count and BRAM ID range, checks the BRAM contents after
+// each transfer and reports the fetched bytes per clock cycle.
 
 // number of entries in each BRAM
 #define BRAM_ENTRIES  (1 << 10)
 // number of BRAMs
 #define BRAM_COUNT    4
+// bytes per BRAM entry
+#define BRAM_WORD_BYTES 8
 
 WrapperRegDriver * p;
 EmuTestFetchStage * dut;
@@ -32,73 +37,55 @@ uint64_t bram_read(int sel, int addr) {
   return dut->get_bram_rsp();
 }
 
-void exec_and_wait() {
+// run the FetchStage and return the clock cycles from start to done. the
+// counter is cleared when start goes low, so it is read before that.
+uint32_t exec_and_wait() {
   dut->set_start(1);
   while(dut->get_done() != 1);
+  uint32_t cycles = dut->get_perf_cycles();
   dut->set_start(0);
+  return cycles;
 }
 
-void set_up_transfer_singletarget(
-  void * accel_buf, uint32_t nbytes,
-  uint32_t bram_sel, uint32_t bram_base, uint32_t bram_nwrites) {
-  assert(bram_nwrites == nbytes/8);
-  assert(bram_sel >= 0 && bram_sel < BRAM_COUNT);
-  assert(bram_base >= 0 && ((bram_base + bram_nwrites) < BRAM_ENTRIES));
-  dut->set_csr_bram_id_start(bram_sel);
-  dut->set_csr_bram_id_range(bram_sel);
-  dut->set_csr_bram_addr_base(bram_base);
-  dut->set_csr_tiles_per_row(bram_nwrites);
-
-  dut->set_csr_dram_block_size_bytes(nbytes);
-  dut->set_csr_dram_base((AccelDblReg) accel_buf);
-  // this test uses a single block
-  dut->set_csr_dram_block_offset_bytes(0);
-  dut->set_csr_dram_block_count(1);
-}
-
-void set_up_transfer_multitarget(void * accel_buf, uint32_t nbytes,
-  uint32_t bram_start, uint32_t bram_idrange, uint32_t bram_base,
-  uint32_t writes_per_bram_turn
+void set_up_transfer(void * accel_buf, uint32_t block_bytes,
+  uint32_t block_count, uint32_t bram_start, uint32_t bram_idrange,
+  uint32_t bram_base, uint32_t writes_per_bram_turn
 ) {
   dut->set_csr_bram_id_start(bram_start);
   dut->set_csr_bram_id_range(bram_idrange);
   dut->set_csr_bram_addr_base(bram_base);
   dut->set_csr_tiles_per_row(writes_per_bram_turn);
 
-  dut->set_csr_dram_block_size_bytes(nbytes);
+  dut->set_csr_dram_block_size_bytes(block_bytes);
   dut->set_csr_dram_base((AccelDblReg) accel_buf);
-  // this test uses a single block
-  dut->set_csr_dram_block_offset_bytes(0);
-  dut->set_csr_dram_block_count(1);
+  // blocks are back-to-back in DRAM
+  dut->set_csr_dram_block_offset_bytes(block_bytes);
+  dut->set_csr_dram_block_count(block_count);
 }
 
-void memcpy_from_bram(int bram_sel, int bram_base, int nbytes, void *dest) {
-  assert(nbytes % 8 == 0);
-  uint64_t * dest_8b = (uint64_t *) dest;
-  for(int i = 0; i < nbytes/8; i++) {
-    dest_8b[i] = bram_read(bram_sel, bram_base+i);
-  }
-}
-
-int memcmp_from_bram(int bram_sel, int bram_base, int nbytes, void *cmp) {
-  assert(nbytes % 8 == 0);
-  uint64_t * dest_8b = (uint64_t *) cmp;
-  int ret = 0;
-  for(int i = 0; i < nbytes/8; i++) {
-    if(dest_8b[i] != bram_read(bram_sel, bram_base+i)) {
-      ret = -1;
-      cout << "difference in memcmp_from_bram!" << endl;
-      cout << "expected: " << dest_8b[i];
-      cout << " found: " << bram_read(bram_sel, bram_base+i) << endl;
+// check that word w of the transfer landed where the route generator puts
+// it: writes_per_bram_turn words to each BRAM in the ID range in turn, then
+// back to the first BRAM at the next free address
+bool check_brams(uint64_t * expected, uint32_t nwords, uint32_t bram_start,
+  uint32_t bram_idrange, uint32_t bram_base, uint32_t writes_per_bram_turn
+) {
+  bool ok = true;
+  uint32_t nbrams = bram_idrange + 1;
+  for(uint32_t w = 0; w < nwords; w++) {
+    uint32_t turn = w / writes_per_bram_turn;
+    int sel = bram_start + (turn % nbrams);
+    int addr = bram_base + (turn / nbrams) * writes_per_bram_turn +
+      (w % writes_per_bram_turn);
+    uint64_t found = bram_read(sel, addr);
+    if(found != expected[w]) {
+      if(ok) {
+        cout << "difference in BRAM " << sel << " addr " << addr << endl;
+        cout << "expected: " << expected[w] << " found: " << found << endl;
+      }
+      ok = false;
     }
   }
-  return ret;
-}
-
-void zero_bram(int bram_sel) {
-  for(int i = 0; i < BRAM_ENTRIES; i++) {
-    bram_write(bram_sel, i, 0);
-  }
+  return ok;
 }
 
 int main()
@@ -116,47 +103,43 @@ int main()
   cout << "BRAM simple access test passed? " << bram_OK << endl;
   all_OK &= bram_OK;
 
-  // copy a block of data to a single target BRAM
-  // TODO set up mask here to exclude other channels
-  bool singletarget_dram_OK = true;
-  size_t nwords = 8;
-  size_t nbytes = nwords * sizeof(uint64_t);
-  uint32_t target_bram = 1;
-  uint64_t * hostbuf = new uint64_t[nwords];
-  for(int i = 0; i < nwords; i++) {
-    hostbuf[i] = i+1;
+  const uint32_t block_bytes[] = {64, 512, 2048};
+  const uint32_t block_counts[] = {1, 4, 16};
+  const uint32_t bram_idranges[] = {0, 1, BRAM_COUNT-1};
+  const size_t max_bytes = BRAM_ENTRIES * BRAM_COUNT * BRAM_WORD_BYTES;
+  uint64_t * hostbuf = new uint64_t[max_bytes / BRAM_WORD_BYTES];
+  void * accelbuf = p->allocAccelBuffer(max_bytes);
+  uint64_t run = 0;
+
+  cout << "block_bytes,block_count,bram_id_range,bytes,cycles,bytes_per_cycle,ok" << endl;
+  for(uint32_t bsize : block_bytes) {
+    for(uint32_t bcount : block_counts) {
+      for(uint32_t brange : bram_idranges) {
+        // one block per BRAM turn, skip transfers that do not fit
+        uint32_t words_per_block = bsize / BRAM_WORD_BYTES;
+        uint32_t turns_per_bram = (bcount + brange) / (brange + 1);
+        if(turns_per_bram * words_per_block > BRAM_ENTRIES) {
+          continue;
+        }
+        uint32_t nbytes = bsize * bcount;
+        uint32_t nwords = nbytes / BRAM_WORD_BYTES;
+        // a new pattern for each run, so stale BRAM contents never match
+        run++;
+        for(uint32_t i = 0; i < nwords; i++) {
+          hostbuf[i] = (run << 32) | (i + 1);
+        }
+        p->copyBufferHostToAccel(hostbuf, accelbuf, nbytes);
+        set_up_transfer(accelbuf, bsize, bcount, 0, brange, 0, words_per_block);
+        uint32_t cycles = exec_and_wait();
+        bool ok = check_brams(hostbuf, nwords, 0, brange, 0, words_per_block);
+        all_OK &= ok;
+        cout << bsize << "," << bcount << "," << brange << "," << nbytes;
+        cout << "," << cycles << "," << fixed << setprecision(3);
+        cout << (cycles ? (double) nbytes / cycles : 0.0) << "," << ok << endl;
+      }
+    }
   }
-  void * accelbuf = p->allocAccelBuffer(nbytes);
-  p->copyBufferHostToAccel(hostbuf, accelbuf, nbytes);
-  set_up_transfer_singletarget(accelbuf, nbytes, target_bram, 0, nwords);
-  exec_and_wait();
-  singletarget_dram_OK &= (memcmp_from_bram(target_bram, 0, nbytes, hostbuf) == 0);
-  cout << "DRAM to single-target test passed? " << singletarget_dram_OK << endl;
-  all_OK &= singletarget_dram_OK;
-
-  delete [] hostbuf;
-  p->deallocAccelBuffer(accelbuf);
 
-  // copy data into all BRAMs (in turn) from a single DRAM transfer
-  bool multitarget_dram_OK = true;
-  size_t nwords_per_bram = 16;
-  size_t nbytes_per_bram = nwords_per_bram * sizeof(uint64_t);
-  nwords = nwords_per_bram * BRAM_COUNT;
-  nbytes = nwords * sizeof(uint64_t);
-  hostbuf = new uint64_t[nwords];
-  for(int i = 0; i < nwords; i++) {
-    hostbuf[i] = i+10;
-  }
-  accelbuf = p->allocAccelBuffer(nbytes);
-  p->copyBufferHostToAccel(hostbuf, accelbuf, nbytes);
-  set_up_transfer_multitarget(accelbuf, nbytes, 0, BRAM_COUNT-1, 0, nwords_per_bram);
-  exec_and_wait();
-  for(int i = 0; i < BRAM_COUNT; i++) {
-    multitarget_dram_OK &= (memcmp_from_bram(i, 0, nbytes_per_bram, &hostbuf[i * nwords_per_bram]) == 0);
-  }
-  cout << "DRAM to multi-target test passed? " << multitarget_dram_OK << endl;
-  all_OK &= multitarget_dram_OK;
-  
   if(all_OK) {
     cout << "Test passed" << endl;
   } else {
@@ -166,9 +149,8 @@ int main()
   delete [] hostbuf;
   p->deallocAccelBuffer(accelbuf);
 
-
   delete dut;
   deinitPlatform(p);
 
   return all_OK ? 0 : -1;
-}
\ No newline at end of file
+}
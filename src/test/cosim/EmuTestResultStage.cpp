@@ -5,21 +5,31 @@ using namespace std;
 #include "platform.h"
 #include "EmuTestResultStage.hpp"
 
-// Cosim test for basic ResultStage behavior
+// Cosim test and write throughput microbenchmark for ResultStage. Writes a
+// sequence of result tiles for several values of dram_skip, checks the
+// written data and reports the bytes per clock cycle for issuing the writes
+// and for completing them in DRAM.
 
 #define DPA_LHS 2
 #define DPA_RHS 2
+// number of tiles written for each dram_skip
+#define NUM_TILES 32
 typedef int32_t ResultType;
 
 WrapperRegDriver *p;
 EmuTestResultStage *dut;
+// bytes written since the start, ResultStage counts completed writes from
+// its reset so waitCompleteBytes is cumulative
+size_t total_bytes = 0;
 
-void exec_and_wait()
+// run the ResultStage and return the clock cycles from start to done
+uint32_t exec_and_wait()
 {
   dut->set_start(1);
   while (dut->get_done() != 1)
     ;
   dut->set_start(0);
+  return dut->get_cycles();
 }
 
 // get offset of element (x, y) in a 1D array[nx][ny]
@@ -28,23 +38,21 @@ int offset2D(int x, int y, int ny)
   return x * ny + y;
 }
 
-void do_result_write(void *accel_buf, int ind_rhs, int ind_lhs, int num_rhs, int num_lhs)
+uint32_t do_result_write(uint64_t base, uint64_t skip)
 {
-  size_t stride = num_lhs * sizeof(ResultType);
-  uint64_t base = sizeof(int32_t) * offset2D(ind_rhs, ind_lhs, num_lhs) + (uint64_t)accel_buf;
-
   dut->set_csr_dram_base(base);
-  dut->set_csr_dram_skip(stride);
+  dut->set_csr_dram_skip(skip);
   dut->set_csr_waitComplete(0);
   dut->set_csr_waitCompleteBytes(0);
   dut->set_csr_resmem_addr(0);
-  exec_and_wait();
+  total_bytes += sizeof(ResultType) * DPA_LHS * DPA_RHS;
+  return exec_and_wait();
 }
 
-void do_result_waitcomplete(size_t nbytes)
+void do_result_waitcomplete()
 {
   dut->set_csr_waitComplete(1);
-  dut->set_csr_waitCompleteBytes(nbytes);
+  dut->set_csr_waitCompleteBytes(total_bytes);
   exec_and_wait();
 }
 
@@ -57,6 +65,12 @@ void write_resmem(int lhs, int rhs, int val)
   dut->set_accwr_en(0);
 }
 
+// value written for element (lhs, rhs) of tile t
+ResultType tile_value(int t, int lhs, int rhs)
+{
+  return (t << 8) | (rhs << 4) | (lhs + 1);
+}
+
 int main()
 {
   bool all_OK = true;
@@ -68,6 +82,7 @@ int main()
   size_t nbytes = sizeof(ResultType) * nrhs * nlhs;
   uint32_t *hostbuf = new uint32_t[nrhs * nlhs];
   void *accelbuf = p->allocAccelBuffer(nbytes);
+  size_t stride = nlhs * sizeof(ResultType);
 
   // each tile is written to memory in column-major order, with appropriate
   // stride to account for the tiling. e.g the 2x2 DPA array:
@@ -85,55 +100,88 @@ int main()
   // |  3  |  7  |
   // |  4  |  8  |
   //  ‾‾‾‾‾‾‾‾‾‾‾
-
-  // dut->set_acc_in_0_0(1);
   write_resmem(0, 0, 1);
-  // dut->set_acc_in_1_0(2);
   write_resmem(1, 0, 2);
-  // dut->set_acc_in_0_1(5);
   write_resmem(0, 1, 5);
-  // dut->set_acc_in_1_1(6);
   write_resmem(1, 1, 6);
-  do_result_write(accelbuf, 0 * DPA_RHS, 0 * DPA_LHS, nrhs, nlhs);
+  do_result_write((uint64_t)accelbuf + sizeof(ResultType) * offset2D(0, 0, nlhs), stride);
 
-  // dut->set_acc_in_0_0(3);
   write_resmem(0, 0, 3);
-  // dut->set_acc_in_1_0(4);
   write_resmem(1, 0, 4);
-  // dut->set_acc_in_0_1(7);
   write_resmem(0, 1, 7);
-  // dut->set_acc_in_1_1(8);
   write_resmem(1, 1, 8);
-  do_result_write(accelbuf, 0 * DPA_RHS, 1 * DPA_LHS, nrhs, nlhs);
+  do_result_write((uint64_t)accelbuf + sizeof(ResultType) * offset2D(0, DPA_LHS, nlhs), stride);
 
   // wait until all writes are completed
-  do_result_waitcomplete(nbytes);
+  do_result_waitcomplete();
 
   p->copyBufferAccelToHost(accelbuf, hostbuf, nbytes);
 
   for (int i = 0; i < nrhs * nlhs; i++)
   {
-    simple_res_OK &= (hostbuf[i] == i + 1);
+    if (hostbuf[i] != i + 1)
+    {
+      cout << "i[" << i << "] = " << hostbuf[i] << ", expected " << i + 1 << endl;
+      simple_res_OK = false;
+    }
   }
-
+  cout << "Simple result write test passed? " << simple_res_OK << endl;
   all_OK &= simple_res_OK;
-  // Print table with current output and expected output
-  if (!simple_res_OK)
+  delete[] hostbuf;
+  p->deallocAccelBuffer(accelbuf);
+
+  // write throughput vs dram_skip: each tile is DPA_RHS rows of DPA_LHS
+  // results, rows are dram_skip bytes apart and tiles follow each other
+  const size_t row_bytes = sizeof(ResultType) * DPA_LHS;
+  const uint64_t skips[] = {row_bytes, 64, 512, 4096};
+  cout << "dram_skip,bytes,issue_cycles,issue_bytes_per_cycle,";
+  cout << "write_cycles,write_bytes_per_cycle,ok" << endl;
+  for (uint64_t skip : skips)
   {
-    cout << left << setw(37) << setfill('-') << "" << endl;
-    cout << left << setw(16) << setfill(' ') << "Your result:";
-    cout << left << setw(5) << setfill(' ') << "|";
-    cout << left << setw(17) << setfill(' ') << "Expected result:" << endl;
-    cout << left << setw(37) << setfill('-') << "" << endl;
+    size_t tile_span = DPA_RHS * skip;
+    size_t bufsize = NUM_TILES * tile_span;
+    uint8_t *buf = new uint8_t[bufsize];
+    accelbuf = p->allocAccelBuffer(bufsize);
+    uint32_t issue_cycles = 0;
+    dut->set_perf_clear(1);
+    dut->set_perf_clear(0);
+    for (int t = 0; t < NUM_TILES; t++)
+    {
+      for (int lhs = 0; lhs < DPA_LHS; lhs++)
+        for (int rhs = 0; rhs < DPA_RHS; rhs++)
+          write_resmem(lhs, rhs, tile_value(t, lhs, rhs));
+      issue_cycles += do_result_write((uint64_t)accelbuf + t * tile_span, skip);
+    }
+    do_result_waitcomplete();
+    uint32_t write_cycles = dut->get_wr_busy_cycles();
 
-    for (int i = 0; i < nrhs * nlhs; i++)
+    p->copyBufferAccelToHost(accelbuf, buf, bufsize);
+    bool ok = true;
+    for (int t = 0; t < NUM_TILES; t++)
     {
-      cout << "i[" << i << "] = " << left << setw(9) << setfill(' ') << hostbuf[i];
-      cout << left << setw(5) << setfill(' ') << "|";
-      cout << left << setw(0) << setfill(' ') << ""
-           << "i[" << i << "] = " << i + 1 << endl;
+      for (int rhs = 0; rhs < DPA_RHS; rhs++)
+      {
+        ResultType *row = (ResultType *)&buf[t * tile_span + rhs * skip];
+        for (int lhs = 0; lhs < DPA_LHS; lhs++)
+        {
+          if (ok && row[lhs] != tile_value(t, lhs, rhs))
+          {
+            cout << "tile " << t << " (" << lhs << ", " << rhs << ") = ";
+            cout << row[lhs] << ", expected " << tile_value(t, lhs, rhs) << endl;
+            ok = false;
+          }
+        }
+      }
     }
-    cout << left << setw(37) << setfill('-') << "" << endl;
+    all_OK &= ok;
+    size_t bytes = NUM_TILES * DPA_LHS * DPA_RHS * sizeof(ResultType);
+    cout << skip << "," << bytes << "," << issue_cycles << ",";
+    cout << fixed << setprecision(3);
+    cout << (issue_cycles ? (double)bytes / issue_cycles : 0.0) << ",";
+    cout << write_cycles << ",";
+    cout << (write_cycles ? (double)bytes / write_cycles : 0.0) << "," << ok << endl;
+    delete[] buf;
+    p->deallocAccelBuffer(accelbuf);
   }
 
   if (all_OK)
@@ -145,9 +193,7 @@ int main()
     cout << "Test failed" << endl;
   }
 
-  delete[] hostbuf;
-
   delete dut;
   deinitPlatform(p);
   return all_OK ? 0 : -1;
-}
\ No newline at end of file
+}